@@ -46,20 +46,37 @@ ldap_get_attribute(struct ber_element *entry, const char *attr)
 	return NULL;
 }
 
+/* Returns the schema type of the attribute description desc.  It is
+ * looked up once and cached on the element, so entries that stay decoded
+ * are not looked up again.
+ */
+struct attr_type *
+ldap_attribute_type(struct ber_element *desc)
+{
+	char			*s;
+
+	if (desc->be_udata == NULL && ber_get_string(desc, &s) == 0)
+		desc->be_udata = lookup_attribute(conf->schema, s);
+	return desc->be_udata;
+}
+
 struct ber_element *
 ldap_find_attribute(struct ber_element *entry, struct attr_type *at)
 {
-	struct ber_element	*elm = NULL;
-	struct name		*an;
+	struct ber_element	*elm, *a;
+
+	assert(entry);
+	assert(at);
+	if (entry->be_encoding != BER_TYPE_SEQUENCE)
+		return NULL;
 
-	SLIST_FOREACH(an, at->names, next) {
-		if ((elm = ldap_get_attribute(entry, an->name)) != NULL)
-			return elm;
+	for (elm = entry->be_sub; elm != NULL; elm = elm->be_next) {
+		a = elm->be_sub;
+		if (a && ldap_attribute_type(a) == at)
+			return a;
 	}
-	if (an == NULL)
-		elm = ldap_get_attribute(entry, at->oid);
 
-	return elm;
+	return NULL;
 }
 
 struct ber_element *
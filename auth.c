@@ -31,6 +31,48 @@
 #include "ldapd.h"
 #include "log.h"
 
+#define ACL_CACHE_SIZE		 256	/* cached decisions */
+
+/* An access control rule, numbered in evaluation order. The last matching
+ * rule decides.
+ */
+struct acl_rule {
+	struct aci		*aci;
+	unsigned int		 seq;
+};
+
+/* Node of a trie of the reversed rule targets. The rules of a node have
+ * the target spelled by the path from the root, so the rules that may
+ * match a DN are found by walking the DN backwards.
+ */
+struct acl_node {
+	char			 c;
+	struct acl_node		*child;
+	struct acl_node		*next;		/* sibling */
+	struct acl_rule		*rules;
+	unsigned int		 nrules;
+};
+
+struct acl_index {
+	struct acl_rule		*any;		/* rules without a target */
+	unsigned int		 nany;
+	struct acl_node		 root;
+	struct aci		**order;	/* all rules, in order */
+	unsigned int		 nrules;
+};
+
+struct acl_cached {
+	unsigned int		 hash;
+	struct namespace	*ns;
+	int			 rights;
+	int			 scope;
+	char			*binddn;	/* NULL if anonymous */
+	char			*dn;
+	int			 allowed;
+};
+
+static struct acl_cached	 acl_cache[ACL_CACHE_SIZE];
+
 static int
 aci_matches(struct aci *aci, struct conn *conn, struct namespace *ns,
     char *dn, int rights, enum scope scope)
@@ -101,24 +143,247 @@ aci_matches(struct aci *aci, struct conn *conn, struct namespace *ns,
 	return 1;
 }
 
+static int
+acl_add_rule(struct acl_rule **rules, unsigned int *nrules, struct aci *aci,
+    unsigned int seq)
+{
+	struct acl_rule		*r;
+
+	if ((r = reallocarray(*rules, *nrules + 1, sizeof(*r))) == NULL)
+		return -1;
+	r[*nrules].aci = aci;
+	r[*nrules].seq = seq;
+	*rules = r;
+	(*nrules)++;
+	return 0;
+}
+
+static int
+acl_index_add(struct acl_index *idx, struct aci *aci)
+{
+	struct acl_node		*node, *child;
+	struct aci		**order;
+	const char		*p;
+	unsigned int		 seq;
+
+	if ((order = reallocarray(idx->order, idx->nrules + 1,
+	    sizeof(*order))) == NULL)
+		return -1;
+	idx->order = order;
+	seq = idx->nrules++;
+	order[seq] = aci;
+
+	if (aci->target == NULL)
+		return acl_add_rule(&idx->any, &idx->nany, aci, seq);
+
+	node = &idx->root;
+	for (p = aci->target + strlen(aci->target); p > aci->target; ) {
+		p--;
+		for (child = node->child; child != NULL; child = child->next)
+			if (child->c == *p)
+				break;
+		if (child == NULL) {
+			if ((child = calloc(1, sizeof(*child))) == NULL)
+				return -1;
+			child->c = *p;
+			child->next = node->child;
+			node->child = child;
+		}
+		node = child;
+	}
+
+	return acl_add_rule(&node->rules, &node->nrules, aci, seq);
+}
+
+static void
+acl_node_free(struct acl_node *node)
+{
+	struct acl_node		*child;
+
+	while ((child = node->child) != NULL) {
+		node->child = child->next;
+		acl_node_free(child);
+		free(child);
+	}
+	free(node->rules);
+}
+
+/* Compiles the global rules, followed by those of the namespace, if any.
+ */
+static struct acl_index *
+acl_compile(struct namespace *ns)
+{
+	struct acl_index	*idx;
+	struct aci		*aci;
+
+	if ((idx = calloc(1, sizeof(*idx))) == NULL)
+		return NULL;
+
+	SIMPLEQ_FOREACH(aci, &conf->acl, entry)
+		if (acl_index_add(idx, aci) != 0)
+			goto fail;
+	if (ns != NULL) {
+		SIMPLEQ_FOREACH(aci, &ns->acl, entry)
+			if (acl_index_add(idx, aci) != 0)
+				goto fail;
+	}
+
+	log_debug("compiled %u access control rules for %s", idx->nrules,
+	    ns ? ns->suffix : "global");
+	return idx;
+
+fail:
+	log_warn("acl_compile");
+	acl_node_free(&idx->root);
+	free(idx->any);
+	free(idx->order);
+	free(idx);
+	return NULL;
+}
+
+static struct acl_index *
+acl_index_for(struct namespace *ns)
+{
+	struct acl_index	**idxp;
+
+	idxp = ns != NULL ? &ns->acl_index : &conf->acl_index;
+	if (*idxp == NULL)
+		*idxp = acl_compile(ns);
+	return *idxp;
+}
+
+/* Finds the last of the rules that matches.
+ */
+static void
+acl_match_rules(struct acl_rule *rules, unsigned int nrules,
+    struct conn *conn, struct namespace *ns, char *dn, int rights,
+    enum scope scope, struct acl_rule **best)
+{
+	unsigned int		 i;
+
+	for (i = 0; i < nrules; i++) {
+		if ((*best == NULL || rules[i].seq > (*best)->seq) &&
+		    aci_matches(rules[i].aci, conn, ns, dn, rights, scope))
+			*best = &rules[i];
+	}
+}
+
+static struct acl_rule *
+acl_lookup(struct acl_index *idx, struct conn *conn, struct namespace *ns,
+    char *dn, int rights, enum scope scope)
+{
+	struct acl_rule		*best = NULL;
+	struct acl_node		*node, *child;
+	const char		*p;
+
+	acl_match_rules(idx->any, idx->nany, conn, ns, dn, rights, scope,
+	    &best);
+
+	/* Only rules targeting a suffix of the DN can match it. */
+	node = &idx->root;
+	acl_match_rules(node->rules, node->nrules, conn, ns, dn, rights,
+	    scope, &best);
+	for (p = dn + strlen(dn); p > dn; ) {
+		p--;
+		for (child = node->child; child != NULL; child = child->next)
+			if (child->c == *p)
+				break;
+		if ((node = child) == NULL)
+			break;
+		acl_match_rules(node->rules, node->nrules, conn, ns, dn,
+		    rights, scope, &best);
+	}
+
+	return best;
+}
+
+static unsigned int
+acl_cache_hash(struct namespace *ns, int rights, int scope,
+    const char *binddn, const char *dn)
+{
+	unsigned int		 h = 2166136261U;	/* FNV-1a */
+	const char		*p;
+
+	h = (h ^ (unsigned int)(uintptr_t)ns) * 16777619U;
+	h = (h ^ (rights << 4 | scope)) * 16777619U;
+	for (p = binddn ? binddn : ""; *p != '\0'; p++)
+		h = (h ^ (unsigned char)*p) * 16777619U;
+	h = (h ^ ',') * 16777619U;
+	for (p = dn; *p != '\0'; p++)
+		h = (h ^ (unsigned char)*p) * 16777619U;
+	return h;
+}
+
+static struct acl_cached *
+acl_cache_find(unsigned int hash, struct namespace *ns, int rights,
+    int scope, const char *binddn, const char *dn)
+{
+	struct acl_cached	*ac;
+
+	ac = &acl_cache[hash % ACL_CACHE_SIZE];
+	if (ac->dn == NULL || ac->hash != hash || ac->ns != ns ||
+	    ac->rights != rights || ac->scope != scope ||
+	    strcmp(ac->dn, dn) != 0)
+		return NULL;
+	if (binddn == NULL || ac->binddn == NULL)
+		return binddn == ac->binddn ? ac : NULL;
+	return strcmp(ac->binddn, binddn) == 0 ? ac : NULL;
+}
+
+static void
+acl_cache_put(unsigned int hash, struct namespace *ns, int rights,
+    int scope, const char *binddn, const char *dn, int allowed)
+{
+	struct acl_cached	*ac;
+
+	ac = &acl_cache[hash % ACL_CACHE_SIZE];
+	free(ac->binddn);
+	free(ac->dn);
+	memset(ac, 0, sizeof(*ac));
+
+	if ((ac->dn = strdup(dn)) == NULL)
+		return;
+	if (binddn != NULL && (ac->binddn = strdup(binddn)) == NULL) {
+		free(ac->dn);
+		ac->dn = NULL;
+		return;
+	}
+	ac->hash = hash;
+	ac->ns = ns;
+	ac->rights = rights;
+	ac->scope = scope;
+	ac->allowed = allowed;
+}
+
+static int
+is_rootdn(struct conn *conn, struct namespace *ns)
+{
+	if (conn->binddn == NULL)
+		return 0;
+	if (conf->rootdn != NULL &&
+	    strcasecmp(conn->binddn, conf->rootdn) == 0)
+		return 1;
+	if (ns != NULL && ns->rootdn != NULL &&
+	    strcasecmp(conn->binddn, ns->rootdn) == 0)
+		return 1;
+	return 0;
+}
+
 /* Returns true (1) if conn is authorized for op on dn in namespace.
  */
 int
 authorized(struct conn *conn, struct namespace *ns, int rights, char *dn,
     int scope)
 {
-	struct aci	*aci;
-	int		 type = ACI_ALLOW;
+	struct acl_index	*idx;
+	struct acl_rule		*rule;
+	struct acl_cached	*ac;
+	unsigned int		 hash;
+	int			 type = ACI_ALLOW;
 
 	/* Root DN is always allowed. */
-	if (conn->binddn != NULL) {
-		if (conf->rootdn != NULL &&
-		    strcasecmp(conn->binddn, conf->rootdn) == 0)
-			return 1;
-		if (ns != NULL && ns->rootdn != NULL &&
-		    strcasecmp(conn->binddn, ns->rootdn) == 0)
-			return 1;
-	}
+	if (is_rootdn(conn, ns))
+		return 1;
 
 	/* Default to deny for write access. */
 	if ((rights & (ACI_WRITE | ACI_CREATE)) != 0)
@@ -130,32 +395,99 @@ authorized(struct conn *conn, struct namespace *ns, int rights, char *dn,
 	    conn->binddn ? conn->binddn : "any",
 	    ns ? ns->suffix : "global");
 
-	SIMPLEQ_FOREACH(aci, &conf->acl, entry) {
-		if (aci_matches(aci, conn, ns, dn, rights, scope)) {
-			type = aci->type;
-			log_debug("%s by: %s %02X access to %s by %s",
-			    type == ACI_ALLOW ? "allowed" : "denied",
-			    aci->type == ACI_ALLOW ? "allow" : "deny",
-			    aci->rights,
-			    aci->target ? aci->target : "any",
-			    aci->subject ? aci->subject : "any");
-		}
+	if (dn == NULL)
+		return type == ACI_ALLOW ? 1 : 0;	/* no rule matches */
+
+	hash = acl_cache_hash(ns, rights, scope, conn->binddn, dn);
+	if ((ac = acl_cache_find(hash, ns, rights, scope, conn->binddn,
+	    dn)) != NULL)
+		return ac->allowed;
+
+	if ((idx = acl_index_for(ns)) == NULL)
+		return 0;
+
+	if ((rule = acl_lookup(idx, conn, ns, dn, rights, scope)) != NULL) {
+		type = rule->aci->type;
+		log_debug("%s by: %s %02X access to %s by %s",
+		    type == ACI_ALLOW ? "allowed" : "denied",
+		    rule->aci->type == ACI_ALLOW ? "allow" : "deny",
+		    rule->aci->rights,
+		    rule->aci->target ? rule->aci->target : "any",
+		    rule->aci->subject ? rule->aci->subject : "any");
 	}
 
-	if (ns != NULL) {
-		SIMPLEQ_FOREACH(aci, &ns->acl, entry) {
-			if (aci_matches(aci, conn, ns, dn, rights, scope)) {
-				type = aci->type;
-				log_debug("%s by: %s %02X access to %s by %s",
-				    type == ACI_ALLOW ? "allowed" : "denied",
-				    aci->type == ACI_ALLOW ? "allow" : "deny",
-				    aci->rights,
-				    aci->target ? aci->target : "any",
-				    aci->subject ? aci->subject : "any");
+	acl_cache_put(hash, ns, rights, scope, conn->binddn, dn,
+	    type == ACI_ALLOW);
+	return type == ACI_ALLOW ? 1 : 0;
+}
+
+/* Decides the access to all entries of a search at once, where the rules
+ * don't depend on the entry. Returns 1 if access is allowed to all entries
+ * below basedn, 0 if it is denied to all, and -1 if each entry must be
+ * checked with authorized().
+ */
+int
+authorized_search(struct conn *conn, struct namespace *ns, int rights,
+    char *basedn)
+{
+	struct acl_index	*idx;
+	struct aci		*aci;
+	struct btval		 base, target;
+	unsigned int		 seq;
+	int			 type = ACI_ALLOW, per_entry = 0;
+
+	if (is_rootdn(conn, ns))
+		return 1;
+	if ((rights & (ACI_WRITE | ACI_CREATE)) != 0)
+		type = ACI_DENY;
+	if ((idx = acl_index_for(ns)) == NULL)
+		return -1;
+
+	memset(&base, 0, sizeof(base));
+	base.data = basedn;
+	base.size = strlen(basedn);
+
+	for (seq = 0; seq < idx->nrules; seq++) {
+		aci = idx->order[seq];
+		if ((rights & aci->rights) != rights)
+			continue;
+
+		if (aci->subject != NULL) {
+			if (conn->binddn == NULL)
+				continue;
+			if (strcmp(aci->subject, "@") == 0) {
+				per_entry = 1;
+				continue;
+			}
+			if (strcmp(aci->subject, conn->binddn) != 0)
+				continue;
+		}
+
+		/* Entries are checked with base scope, so a subtree rule
+		 * targeting a suffix of the base matches all of them. Other
+		 * rules targeting the base, or a DN below it, match only some.
+		 */
+		if (aci->target != NULL) {
+			memset(&target, 0, sizeof(target));
+			target.data = aci->target;
+			target.size = strlen(aci->target);
+			if (aci->scope != LDAP_SCOPE_SUBTREE ||
+			    !has_suffix(&base, aci->target)) {
+				if (has_suffix(&base, aci->target) ||
+				    has_suffix(&target, basedn))
+					per_entry = 1;
+				continue;
 			}
 		}
+
+		type = aci->type;
+		per_entry = 0;
 	}
 
+	if (per_entry)
+		return -1;
+	log_debug("%s %02X access to all entries below %s",
+	    type == ACI_ALLOW ? "allowed" : "denied", rights, basedn);
 	return type == ACI_ALLOW ? 1 : 0;
 }
 
@@ -192,8 +524,8 @@ fail:
  * is in progress, 0 on mismatch and -1 on error.
  */
 static int
-check_password(struct request *req, const char *stored_passwd,
-    const char *passwd)
+check_password(struct request *req, const char *binddn,
+    const char *stored_passwd, const char *passwd)
 {
 	unsigned char	 tmp[128];
 	unsigned char	 md[SHA_DIGEST_LENGTH];
@@ -224,10 +556,17 @@ check_password(struct request *req, const char *stored_passwd,
 		SHA1_Final(md, &ctx);
 		return (bcmp(md, tmp, SHA_DIGEST_LENGTH) == 0 ? 1 : 0);
 	} else if (strncmp(stored_passwd, "{CRYPT}", 7) == 0) {
+		if (passwd_cached(binddn, stored_passwd + 7, passwd))
+			return 1;
+		if (passwd_check(req, binddn, stored_passwd + 7, passwd) == 0)
+			return 2;	/* Operation in progress. */
 		encpw = crypt(passwd, stored_passwd + 7);
 		if (encpw == NULL)
 			return (-1);
-		return (strcmp(encpw, stored_passwd + 7) == 0 ? 1 : 0);
+		if (strcmp(encpw, stored_passwd + 7) != 0)
+			return 0;
+		passwd_cache(binddn, stored_passwd + 7, passwd);
+		return 1;
 	} else if (strncmp(stored_passwd, "{BSDAUTH}", 9) == 0) {
 		if (send_auth_request(req, stored_passwd + 9, passwd) == -1)
 			return (-1);
@@ -282,7 +621,7 @@ ldap_auth_sasl(struct request *req, char *binddn, struct ber_element *params)
 static int
 ldap_auth_simple(struct request *req, char *binddn, struct ber_element *auth)
 {
-	int			 pwret = 0;
+	int			 pwret = 0, pass, pending = 0;
 	char			*password;
 	char			*user_password;
 	struct namespace	*ns;
@@ -310,11 +649,11 @@ ldap_auth_simple(struct request *req, char *binddn, struct ber_element *auth)
 	}
 
 	if (conf->rootdn != NULL && strcmp(conf->rootdn, binddn) == 0) {
-		pwret = check_password(req, conf->rootpw, password);
+		pwret = check_password(req, binddn, conf->rootpw, password);
 	} else if ((ns = namespace_lookup_base(binddn, 1)) == NULL) {
 		return LDAP_INVALID_CREDENTIALS;
 	} else if (ns->rootdn != NULL && strcmp(ns->rootdn, binddn) == 0) {
-		pwret = check_password(req, ns->rootpw, password);
+		pwret = check_password(req, binddn, ns->rootpw, password);
 	} else if (namespace_has_referrals(ns)) {
 		return LDAP_INVALID_CREDENTIALS;
 	} else {
@@ -331,16 +670,30 @@ ldap_auth_simple(struct request *req, char *binddn, struct ber_element *auth)
 
 		if (elm != NULL)
 			pw = ldap_get_attribute(elm, "userPassword");
-		if (pw != NULL) {
+		/* Other schemes are tried first, then all crypt(3) hashes
+		 * are sent to the helpers, and the bind succeeds if any of
+		 * them matches.
+		 */
+		for (pass = 0; pw != NULL && pass < 2 && pwret < 1; pass++) {
 			for (elm = pw->be_next->be_sub; elm;
 			    elm = elm->be_next) {
-				if (ber_get_string(elm, &user_password) != 0)
+				if (ber_get_string(elm, &user_password) != 0 ||
+				    pass != (strncmp(user_password, "{CRYPT}",
+				    7) == 0))
 					continue;
-				pwret = check_password(req, user_password, password);
-				if (pwret >= 1)
+				pwret = check_password(req, binddn,
+				    user_password, password);
+				if (pwret == 1 || (pwret == 2 && pass == 0))
 					break;
+				if (pwret == 2)
+					pending = 1;
 			}
 		}
+		if (pending && pwret == 1) {
+			passwd_cancel(req);
+			req->conn->bind_req = NULL;
+		} else if (pending)
+			pwret = 2;
 	}
 
 	free(req->conn->binddn);
@@ -388,6 +741,7 @@ ldap_bind(struct request *req)
 	long long		 ver;
 	char			*binddn;
 	struct ber_element	*auth;
+	struct search		*search;
 
 	++stats.req_bind;
 
@@ -396,9 +750,16 @@ ldap_bind(struct request *req)
 		goto done;
 	}
 
+	/* Access decided for the searches in progress was for the old
+	 * bind DN.
+	 */
+	TAILQ_FOREACH(search, &req->conn->searches, next)
+		search->acl = -1;
+
 	if (req->conn->bind_req) {
 		log_debug("aborting bind in progress with msgid %lld",
 		    req->conn->bind_req->msgid);
+		passwd_cancel(req->conn->bind_req);
 		request_free(req->conn->bind_req);
 		req->conn->bind_req = NULL;
 	}
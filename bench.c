@@ -0,0 +1,1132 @@
+/*	$OpenBSD$ */
+
+/*
+ * Copyright (c) 2026 agent <agent@local>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/* ldapbench, an offline benchmark of the btree engine and the request
+ * pipeline of ldapd, built from the same sources without ldapd.c.
+ *
+ * A synthetic directory is generated from a seed, so runs with the same
+ * options can be compared across builds. The btree tests put, get and
+ * scan its entries in a scratch file next to the databases. The request
+ * tests then add the entries to an empty namespace, and search and
+ * modify them, over a connection to this process, so requests run
+ * through the same code as in ldape. Each test prints its operations per
+ * second, latency percentiles, and the pages it read and bytes it wrote.
+ */
+
+#include <sys/types.h>
+#include <sys/queue.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+
+#include <err.h>
+#include <errno.h>
+#include <event.h>
+#include <limits.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "ldapd.h"
+#include "log.h"
+
+#define BENCH_SCAN	 100		/* keys read per btree scan */
+
+struct ldapd_stats	 stats;
+struct imsgev		*iev_ldape[MAX_WORKERS];
+const char		*datadir = DATADIR;
+
+struct bench_opts {
+	unsigned int		 entries;	/* person entries */
+	unsigned int		 depth;		/* levels of ou below suffix */
+	unsigned int		 branch;	/* ou entries per parent */
+	unsigned int		 fanout;	/* values of mail, description */
+	unsigned int		 ops;		/* operations per test */
+	unsigned int		 window;	/* outstanding requests */
+	unsigned int		 txn;		/* btree puts per commit */
+	uint64_t		 seed;
+	char			*suffix;
+};
+
+enum bench_kind {
+	BENCH_ADD,
+	BENCH_UID,
+	BENCH_CN,
+	BENCH_OR,
+	BENCH_NUMBER,
+	BENCH_ONELEVEL,
+	BENCH_MODIFY
+};
+
+struct bench_test {
+	const char		*name;
+	enum bench_kind		 kind;
+	unsigned int		 ops;
+	unsigned int		 sent, done;
+	unsigned int		 errors;
+	unsigned long long	 results;	/* entries returned */
+	long long		*lat;		/* nsec of each operation */
+	struct timespec		*started;	/* by message id */
+	struct timespec		 start;
+	unsigned long long	 reads, writes;	/* btree counters at start */
+};
+
+struct bench {
+	struct bench_opts	 o;
+	struct namespace	*ns;
+	unsigned int		 nous;		/* ou entries */
+	unsigned int		 nleaves;	/* ou entries at the last level */
+	unsigned int		 nodes;		/* all entries */
+	uint64_t		 rnd;
+
+	/* The client end of the loopback connection. */
+	struct listener		 l;
+	int			 fd;
+	struct bufferevent	*bev;
+	struct ber		 ber;
+	size_t			 pdu_len;
+	int			 failed;
+	struct bench_test	*test;
+};
+
+static uint64_t		 bench_random(struct bench *b);
+static int		 bench_dn(struct bench *b, unsigned int node, char *buf,
+			    size_t size);
+static struct ber_element *bench_entry(struct bench *b, unsigned int node);
+static struct ber_element *bench_suffix_entry(struct bench *b);
+static int		 bench_test_init(struct bench_test *t, const char *name,
+			    unsigned int ops);
+static void		 bench_test_stats(struct bench_test *t,
+			    struct btree *bt, struct btree *bt2);
+static int		 bench_cmp(const void *a, const void *b);
+static void		 bench_report(struct bench_test *t, struct btree *bt,
+			    struct btree *bt2);
+static long long	 bench_lap(struct timespec *start);
+static void		 bench_test_free(struct bench_test *t);
+static int		 bench_btree(struct bench *b);
+static struct ber_element *bench_filter_eq(const char *attr,
+			    const char *value);
+static int		 bench_send(struct bench *b);
+static void		 bench_response(struct bench *b,
+			    struct ber_element *root);
+static void		 bench_read(struct bufferevent *bev, void *data);
+static void		 bench_write(struct bufferevent *bev, void *data);
+static void		 bench_err(struct bufferevent *bev, short why,
+			    void *data);
+static int		 bench_requests(struct bench *b, const char *name,
+			    enum bench_kind kind, unsigned int ops);
+static int		 bench_parse(struct bench_opts *o, char *spec);
+static int		 bench_run(char *spec);
+__dead void		 usage(void);
+
+/* A xorshift64* generator, so the directory doesn't depend on the libc.
+ */
+static uint64_t
+bench_random(struct bench *b)
+{
+	b->rnd ^= b->rnd >> 12;
+	b->rnd ^= b->rnd << 25;
+	b->rnd ^= b->rnd >> 27;
+	return b->rnd * 2685821657736338717ULL;
+}
+
+/* Formats the DN of a node of the directory. The ou entries come first,
+ * level by level, followed by the person entries spread over the ou
+ * entries of the last level.
+ */
+static int
+bench_dn(struct bench *b, unsigned int node, char *buf, size_t size)
+{
+	unsigned int	 level, pos, first, width;
+	char		*parent;
+	int		 n;
+
+	if (node >= b->nous) {
+		pos = node - b->nous;
+		if (b->nleaves == 0)
+			n = snprintf(buf, size, "uid=u%u,%s", pos,
+			    b->ns->suffix);
+		else {
+			n = snprintf(buf, size, "uid=u%u,", pos);
+			if (n < 0 || (size_t)n >= size)
+				return -1;
+			return bench_dn(b, b->nous - b->nleaves +
+			    pos % b->nleaves, buf + n, size - n);
+		}
+		return n < 0 || (size_t)n >= size ? -1 : 0;
+	}
+
+	/* Find the level of the ou entry and its position in the level. */
+	for (level = 1, first = 0, width = b->o.branch;
+	    node >= first + width; level++) {
+		first += width;
+		width *= b->o.branch;
+	}
+	pos = node - first;
+
+	n = snprintf(buf, size, "ou=g%u,", pos);
+	if (n < 0 || (size_t)n >= size)
+		return -1;
+	if (level == 1) {
+		parent = b->ns->suffix;
+		if (strlcpy(buf + n, parent, size - n) >= size - n)
+			return -1;
+		return 0;
+	}
+	return bench_dn(b, first - width / b->o.branch + pos / b->o.branch,
+	    buf + n, size - n);
+}
+
+/* Returns the attributes of a node of the directory.
+ */
+static struct ber_element *
+bench_entry(struct bench *b, unsigned int node)
+{
+	struct ber_element	*entry, *set, *elm;
+	char			 buf[512];
+	unsigned int		 i, n;
+
+	if ((entry = ber_add_sequence(NULL)) == NULL)
+		return NULL;
+
+	if (node < b->nous) {
+		if ((set = ber_add_set(NULL)) == NULL ||
+		    ber_add_string(ber_add_string(set, "top"),
+		    "organizationalUnit") == NULL ||
+		    ldap_add_attribute(entry, "objectClass", set) == NULL)
+			goto fail;
+		if (bench_dn(b, node, buf, sizeof(buf)) != 0)
+			goto fail;
+		*strchr(buf, ',') = '\0';
+		if ((set = ber_add_set(NULL)) == NULL ||
+		    ber_add_string(set, buf + 3) == NULL ||
+		    ldap_add_attribute(entry, "ou", set) == NULL)
+			goto fail;
+		return entry;
+	}
+
+	n = node - b->nous;
+	if ((set = ber_add_set(NULL)) == NULL ||
+	    (elm = ber_add_string(set, "top")) == NULL ||
+	    (elm = ber_add_string(elm, "person")) == NULL ||
+	    (elm = ber_add_string(elm, "organizationalPerson")) == NULL ||
+	    ber_add_string(elm, "inetOrgPerson") == NULL ||
+	    ldap_add_attribute(entry, "objectClass", set) == NULL)
+		goto fail;
+
+	snprintf(buf, sizeof(buf), "u%u", n);
+	if ((set = ber_add_set(NULL)) == NULL ||
+	    ber_add_string(set, buf) == NULL ||
+	    ldap_add_attribute(entry, "uid", set) == NULL)
+		goto fail;
+
+	snprintf(buf, sizeof(buf), "User %u", n);
+	if ((set = ber_add_set(NULL)) == NULL ||
+	    ber_add_string(set, buf) == NULL ||
+	    ldap_add_attribute(entry, "cn", set) == NULL)
+		goto fail;
+
+	snprintf(buf, sizeof(buf), "S%u", n % 1000);
+	if ((set = ber_add_set(NULL)) == NULL ||
+	    ber_add_string(set, buf) == NULL ||
+	    ldap_add_attribute(entry, "sn", set) == NULL)
+		goto fail;
+
+	snprintf(buf, sizeof(buf), "%u", n);
+	if ((set = ber_add_set(NULL)) == NULL ||
+	    ber_add_string(set, buf) == NULL ||
+	    ldap_add_attribute(entry, "employeeNumber", set) == NULL)
+		goto fail;
+
+	snprintf(buf, sizeof(buf), "+1 555 %07llu",
+	    (unsigned long long)(bench_random(b) % 10000000));
+	if ((set = ber_add_set(NULL)) == NULL ||
+	    ber_add_string(set, buf) == NULL ||
+	    ldap_add_attribute(entry, "telephoneNumber", set) == NULL)
+		goto fail;
+
+	if ((elm = set = ber_add_set(NULL)) == NULL)
+		goto fail;
+	for (i = 0; i < b->o.fanout; i++) {
+		snprintf(buf, sizeof(buf), "u%u.%u@example.com", n, i);
+		if ((elm = ber_add_string(elm, buf)) == NULL)
+			goto fail;
+	}
+	if (b->o.fanout > 0 &&
+	    ldap_add_attribute(entry, "mail", set) == NULL)
+		goto fail;
+
+	if ((elm = set = ber_add_set(NULL)) == NULL)
+		goto fail;
+	for (i = 0; i < b->o.fanout; i++) {
+		snprintf(buf, sizeof(buf), "note %u of user %u, %016llx", i, n,
+		    (unsigned long long)bench_random(b));
+		if ((elm = ber_add_string(elm, buf)) == NULL)
+			goto fail;
+	}
+	if (b->o.fanout > 0 &&
+	    ldap_add_attribute(entry, "description", set) == NULL)
+		goto fail;
+
+	return entry;
+
+fail:
+	ber_free_elements(entry);
+	return NULL;
+}
+
+/* Returns the attributes of the suffix entry, which the other entries
+ * need as a parent. The extensibleObject class allows any attribute in
+ * its RDN.
+ */
+static struct ber_element *
+bench_suffix_entry(struct bench *b)
+{
+	struct ber_element	*entry, *set, *elm;
+	char			 rdn[256], *value;
+
+	strlcpy(rdn, b->ns->suffix, sizeof(rdn));
+	rdn[strcspn(rdn, ",")] = '\0';
+	if ((value = strchr(rdn, '=')) == NULL) {
+		log_warnx("%s: invalid suffix", b->ns->suffix);
+		return NULL;
+	}
+	*value++ = '\0';
+
+	if ((entry = ber_add_sequence(NULL)) == NULL)
+		return NULL;
+	if ((set = ber_add_set(NULL)) == NULL ||
+	    (elm = ber_add_string(set, "top")) == NULL ||
+	    (elm = ber_add_string(elm, "organizationalUnit")) == NULL ||
+	    ber_add_string(elm, "extensibleObject") == NULL ||
+	    ldap_add_attribute(entry, "objectClass", set) == NULL)
+		goto fail;
+	if (strcasecmp(rdn, "ou") != 0 &&
+	    ((set = ber_add_set(NULL)) == NULL ||
+	    ber_add_string(set, "bench") == NULL ||
+	    ldap_add_attribute(entry, "ou", set) == NULL))
+		goto fail;
+	if ((set = ber_add_set(NULL)) == NULL ||
+	    ber_add_string(set, value) == NULL ||
+	    ldap_add_attribute(entry, rdn, set) == NULL)
+		goto fail;
+	return entry;
+
+fail:
+	ber_free_elements(entry);
+	return NULL;
+}
+
+static int
+bench_test_init(struct bench_test *t, const char *name, unsigned int ops)
+{
+	memset(t, 0, sizeof(*t));
+	t->name = name;
+	t->ops = ops;
+	if ((t->lat = calloc(ops, sizeof(*t->lat))) == NULL)
+		return -1;
+	return 0;
+}
+
+/* Remembers the btree counters at the start of a test.
+ */
+static void
+bench_test_stats(struct bench_test *t, struct btree *bt, struct btree *bt2)
+{
+	const struct btree_stat	*st;
+
+	t->reads = t->writes = 0;
+	if ((st = btree_stat(bt)) != NULL) {
+		t->reads += st->reads;
+		t->writes += st->writes * st->psize;
+	}
+	if (bt2 != NULL && (st = btree_stat(bt2)) != NULL) {
+		t->reads += st->reads;
+		t->writes += st->writes * st->psize;
+	}
+	clock_gettime(CLOCK_MONOTONIC, &t->start);
+}
+
+static int
+bench_cmp(const void *a, const void *b)
+{
+	long long	 x = *(const long long *)a, y = *(const long long *)b;
+
+	return x < y ? -1 : x > y;
+}
+
+static void
+bench_report(struct bench_test *t, struct btree *bt, struct btree *bt2)
+{
+	struct bench_test	 end;
+	struct timespec		 now;
+	double			 secs;
+	unsigned int		 n;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	bench_test_stats(&end, bt, bt2);
+	secs = (now.tv_sec - t->start.tv_sec) +
+	    (now.tv_nsec - t->start.tv_nsec) / 1e9;
+
+	n = t->done;
+	qsort(t->lat, n, sizeof(*t->lat), bench_cmp);
+#define PCT(p)	(n == 0 ? 0 : t->lat[(n - 1) * (p) / 1000ULL] / 1000.0)
+	printf("%-16s %8u %10.0f %9.1f %9.1f %9.1f %9.1f %8llu %10llu"
+	    " %8llu %6u\n", t->name, n, secs > 0 ? n / secs : 0,
+	    PCT(500), PCT(900), PCT(990), PCT(1000),
+	    end.reads - t->reads, (end.writes - t->writes) / 1024,
+	    t->results, t->errors);
+#undef PCT
+	fflush(stdout);
+}
+
+static void
+bench_test_free(struct bench_test *t)
+{
+	free(t->lat);
+	free(t->started);
+}
+
+static long long
+bench_lap(struct timespec *start)
+{
+	struct timespec		 now;
+	long long		 nsec;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	nsec = (now.tv_sec - start->tv_sec) * 1000000000LL +
+	    (now.tv_nsec - start->tv_nsec);
+	*start = now;
+	return nsec;
+}
+
+/* Runs the btree tests on a scratch file with the entries of the
+ * directory, in the format and with the flags of the namespace.
+ */
+static int
+bench_btree(struct bench *b)
+{
+	struct bench_test	 t;
+	const struct btree_stat	*st;
+	struct btree		*bt = NULL;
+	struct btree_txn	*txn = NULL;
+	struct cursor		*cursor;
+	struct ber_element	*entry;
+	struct btval		 key, val;
+	struct timespec		 lap;
+	unsigned int		*order = NULL, i, j, n, flags;
+	char			 path[PATH_MAX], dn[512];
+	int			 fd, ret, rc = -1;
+
+	if ((unsigned int)snprintf(path, sizeof(path), "%s/bench.XXXXXXXXXX",
+	    datadir) >= sizeof(path)) {
+		log_warnx("%s: path too long", datadir);
+		return -1;
+	}
+	if ((fd = mkstemp(path)) == -1) {
+		log_warn("%s", path);
+		return -1;
+	}
+	close(fd);
+
+	flags = BT_REVERSEKEY;
+	if (b->ns->sync == 0)
+		flags |= BT_NOSYNC;
+	if (b->ns->mmap)
+		flags |= BT_MMAP;
+	if ((bt = btree_open(path, flags, 0600)) == NULL) {
+		log_warn("%s", path);
+		goto done;
+	}
+	if ((st = btree_stat(b->ns->data_db)) != NULL)
+		btree_set_cache_size(bt, st->max_cache);
+
+	/* Put the entries in random order. */
+	if ((order = calloc(b->nodes, sizeof(*order))) == NULL)
+		goto done;
+	for (i = 0; i < b->nodes; i++)
+		order[i] = i;
+	for (i = b->nodes - 1; i > 0; i--) {
+		j = bench_random(b) % (i + 1);
+		n = order[i];
+		order[i] = order[j];
+		order[j] = n;
+	}
+
+	if (bench_test_init(&t, "btree put", b->nodes) != 0)
+		goto done;
+	bench_test_stats(&t, bt, NULL);
+	for (i = 0; i < b->nodes; i++) {
+		if (bench_dn(b, order[i], dn, sizeof(dn)) != 0 ||
+		    (entry = bench_entry(b, order[i])) == NULL)
+			goto fail;
+		ret = ber2db(entry, &val, b->ns->compression_level,
+		    &b->ns->dict);
+		ber_free_elements(entry);
+		if (ret != 0)
+			goto fail;
+
+		clock_gettime(CLOCK_MONOTONIC, &lap);
+		if (txn == NULL && (txn = btree_txn_begin(bt, 0)) == NULL)
+			goto fail;
+		key.data = dn;
+		key.size = strlen(dn);
+		ret = btree_txn_put(bt, txn, &key, &val, 0);
+		btval_reset(&val);
+		if (ret != BT_SUCCESS)
+			goto fail;
+		if ((i + 1) % b->o.txn == 0 || i + 1 == b->nodes) {
+			ret = btree_txn_commit(txn);
+			txn = NULL;
+			if (ret != BT_SUCCESS)
+				goto fail;
+		}
+		t.lat[t.done++] = bench_lap(&lap);
+	}
+	bench_report(&t, bt, NULL);
+	bench_test_free(&t);
+
+	/* Get entries at random. */
+	if (bench_test_init(&t, "btree get", b->o.ops) != 0)
+		goto done;
+	bench_test_stats(&t, bt, NULL);
+	for (i = 0; i < b->o.ops; i++) {
+		if (bench_dn(b, bench_random(b) % b->nodes, dn,
+		    sizeof(dn)) != 0)
+			goto fail;
+		key.data = dn;
+		key.size = strlen(dn);
+		clock_gettime(CLOCK_MONOTONIC, &lap);
+		if (btree_get(bt, &key, &val) != BT_SUCCESS)
+			t.errors++;
+		else {
+			t.results++;
+			btval_reset(&val);
+		}
+		t.lat[t.done++] = bench_lap(&lap);
+	}
+	bench_report(&t, bt, NULL);
+	bench_test_free(&t);
+
+	/* Read runs of keys from a random key on. */
+	if (bench_test_init(&t, "btree scan", b->o.ops) != 0)
+		goto done;
+	bench_test_stats(&t, bt, NULL);
+	for (i = 0; i < b->o.ops; i++) {
+		if (bench_dn(b, bench_random(b) % b->nodes, dn,
+		    sizeof(dn)) != 0)
+			goto fail;
+		clock_gettime(CLOCK_MONOTONIC, &lap);
+		if ((cursor = btree_cursor_open(bt)) == NULL)
+			goto fail;
+		btree_cursor_sequential(cursor);
+		key.data = dn;
+		key.size = strlen(dn);
+		key.free_data = 0;
+		key.mp = NULL;
+		for (j = 0; j < BENCH_SCAN; j++) {
+			if (btree_cursor_get(cursor, &key, &val,
+			    j == 0 ? BT_CURSOR : BT_NEXT) != BT_SUCCESS)
+				break;
+			t.results++;
+			btval_reset(&key);
+			btval_reset(&val);
+		}
+		btree_cursor_close(cursor);
+		t.lat[t.done++] = bench_lap(&lap);
+	}
+	bench_report(&t, bt, NULL);
+	bench_test_free(&t);
+
+	/* Compact the file in one go. */
+	if (bench_test_init(&t, "btree compact", 1) != 0)
+		goto done;
+	bench_test_stats(&t, bt, NULL);
+	clock_gettime(CLOCK_MONOTONIC, &lap);
+	if (btree_compact(bt) != BT_SUCCESS)
+		t.errors++;
+	t.lat[t.done++] = bench_lap(&lap);
+	bench_report(&t, bt, NULL);
+
+	rc = 0;
+fail:
+	if (rc != 0)
+		log_warn("%s", t.name);
+	bench_test_free(&t);
+done:
+	if (txn != NULL)
+		btree_txn_abort(txn);
+	if (bt != NULL)
+		btree_close(bt);
+	free(order);
+	unlink(path);
+	return rc;
+}
+
+static struct ber_element *
+bench_filter_eq(const char *attr, const char *value)
+{
+	struct ber_element	*filter;
+
+	if ((filter = ber_add_sequence(NULL)) == NULL)
+		return NULL;
+	if (ber_add_string(ber_add_string(filter, attr), value) == NULL) {
+		ber_free_elements(filter);
+		return NULL;
+	}
+	ber_set_header(filter, BER_CLASS_CONTEXT, LDAP_FILT_EQ);
+	return filter;
+}
+
+/* Sends the next request of the test.
+ */
+static int
+bench_send(struct bench *b)
+{
+	struct bench_test	*t = b->test;
+	struct ber_element	*root, *elm, *filter = NULL, *sub;
+	char			 dn[512], value[64];
+	unsigned int		 node, i;
+	long long		 scope = LDAP_SCOPE_SUBTREE;
+	const char		*base;
+	void			*buf;
+	int			 msgid, rc;
+
+	msgid = ++t->sent;
+	if ((root = ber_add_sequence(NULL)) == NULL)
+		return -1;
+
+	switch (t->kind) {
+	case BENCH_ADD:
+		/* The suffix entry is added first. */
+		if (msgid == 1) {
+			if (strlcpy(dn, b->ns->suffix, sizeof(dn)) >=
+			    sizeof(dn) || (sub = bench_suffix_entry(b)) == NULL)
+				goto fail;
+		} else {
+			node = msgid - 2;
+			if (bench_dn(b, node, dn, sizeof(dn)) != 0 ||
+			    (sub = bench_entry(b, node)) == NULL)
+				goto fail;
+		}
+		if ((elm = ber_printf_elements(root, "d{ts", msgid,
+		    BER_CLASS_APP, (unsigned long)LDAP_REQ_ADD, dn)) == NULL) {
+			ber_free_elements(sub);
+			goto fail;
+		}
+		ber_link_elements(elm, sub);
+		break;
+	case BENCH_MODIFY:
+		node = b->nous + bench_random(b) % b->o.entries;
+		if (bench_dn(b, node, dn, sizeof(dn)) != 0)
+			goto fail;
+		snprintf(value, sizeof(value), "modified %u", msgid);
+		if (ber_printf_elements(root, "d{ts{{E{s(s", msgid,
+		    BER_CLASS_APP, (unsigned long)LDAP_REQ_MODIFY, dn,
+		    (long long)LDAP_MOD_REPLACE, "description", value) == NULL)
+			goto fail;
+		break;
+	default:
+		base = b->ns->suffix;
+		switch (t->kind) {
+		case BENCH_UID:
+			snprintf(value, sizeof(value), "u%llu",
+			    (unsigned long long)(bench_random(b) %
+			    b->o.entries));
+			filter = bench_filter_eq("uid", value);
+			break;
+		case BENCH_CN:
+			/* (cn=User N*) */
+			snprintf(value, sizeof(value), "User %llu",
+			    (unsigned long long)(bench_random(b) %
+			    b->o.entries));
+			if ((filter = ber_add_sequence(NULL)) == NULL)
+				goto fail;
+			ber_set_header(filter, BER_CLASS_CONTEXT,
+			    LDAP_FILT_SUBS);
+			if ((sub = ber_add_sequence(ber_add_string(filter,
+			    "cn"))) == NULL ||
+			    (elm = ber_add_string(sub, value)) == NULL)
+				goto fail;
+			ber_set_header(elm, BER_CLASS_CONTEXT,
+			    LDAP_FILT_SUBS_INIT);
+			break;
+		case BENCH_OR:
+			if ((filter = ber_add_set(NULL)) == NULL)
+				goto fail;
+			ber_set_header(filter, BER_CLASS_CONTEXT, LDAP_FILT_OR);
+			for (elm = filter, i = 0; i < 4; i++) {
+				snprintf(value, sizeof(value), "u%llu",
+				    (unsigned long long)(bench_random(b) %
+				    b->o.entries));
+				if ((sub = bench_filter_eq("uid", value)) ==
+				    NULL)
+					goto fail;
+				ber_link_elements(elm, sub);
+				elm = sub;
+			}
+			break;
+		case BENCH_NUMBER:
+			snprintf(value, sizeof(value), "%llu",
+			    (unsigned long long)(bench_random(b) %
+			    b->o.entries));
+			filter = bench_filter_eq("employeeNumber", value);
+			break;
+		case BENCH_ONELEVEL:
+			if (b->nleaves > 0) {
+				node = b->nous - b->nleaves +
+				    bench_random(b) % b->nleaves;
+				if (bench_dn(b, node, dn, sizeof(dn)) != 0)
+					goto fail;
+				base = dn;
+			}
+			scope = LDAP_SCOPE_ONELEVEL;
+			if ((filter = ber_add_string(NULL,
+			    "objectClass")) == NULL)
+				goto fail;
+			ber_set_header(filter, BER_CLASS_CONTEXT,
+			    LDAP_FILT_PRES);
+			break;
+		default:
+			goto fail;
+		}
+		if (filter == NULL ||
+		    (elm = ber_printf_elements(root, "d{tsEEiib", msgid,
+		    BER_CLASS_APP, (unsigned long)LDAP_REQ_SEARCH, base, scope,
+		    (long long)LDAP_DEREF_NEVER, 0LL, 0LL, 0)) == NULL)
+			goto fail;
+		ber_link_elements(elm, filter);
+		elm = filter;
+		filter = NULL;
+		if (ber_add_sequence(elm) == NULL)
+			goto fail;
+		break;
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &t->started[msgid]);
+	rc = ber_write_elements(&b->ber, root);
+	ber_free_elements(root);
+	if (rc < 0)
+		return -1;
+	ber_get_writebuf(&b->ber, &buf);
+	return bufferevent_write(b->bev, buf, rc);
+
+fail:
+	if (filter != NULL)
+		ber_free_elements(filter);
+	ber_free_elements(root);
+	return -1;
+}
+
+/* Counts a response, and sends the next request when one is done.
+ */
+static void
+bench_response(struct bench *b, struct ber_element *root)
+{
+	struct bench_test	*t = b->test;
+	struct ber_element	*op;
+	long long		 msgid, code;
+	struct timespec		 start;
+
+	if (ber_scanf_elements(root, "{ie", &msgid, &op) != 0 ||
+	    msgid < 1 || msgid > t->sent) {
+		log_warnx("%s: invalid response", t->name);
+		b->failed = 1;
+		return;
+	}
+
+	if (op->be_type == LDAP_RES_SEARCH_ENTRY) {
+		t->results++;
+		return;
+	}
+	if (ber_scanf_elements(op, "{E", &code) != 0 || code != LDAP_SUCCESS)
+		t->errors++;
+
+	start = t->started[msgid];
+	t->lat[t->done++] = bench_lap(&start);
+	if (t->sent < t->ops && bench_send(b) != 0) {
+		log_warn("%s", t->name);
+		b->failed = 1;
+	}
+}
+
+static void
+bench_read(struct bufferevent *bev, void *data)
+{
+	struct bench		*b = data;
+	struct ber_element	*root;
+	struct evbuffer		*input;
+	size_t			 nused = 0, avail, len;
+	ssize_t			 hlen;
+	unsigned long		 type;
+	int			 class, cstruct;
+	u_char			*p;
+
+	/* The server unsets the arena of a request before returning to the
+	 * event loop, so responses are parsed with malloc.
+	 */
+	if (ber_set_arena(NULL) != NULL)
+		fatalx("bench_read: arena left set");
+
+	input = EVBUFFER_INPUT(bev);
+	p = EVBUFFER_DATA(input);
+	avail = EVBUFFER_LENGTH(input);
+	while (avail > 0 && !b->failed) {
+		if (b->pdu_len == 0) {
+			if ((hlen = ber_read_header(p, avail, &class, &type,
+			    &cstruct, &len)) == -1) {
+				if (errno != ECANCELED)
+					b->failed = 1;
+				break;
+			}
+			b->pdu_len = hlen + len;
+		}
+		if (b->pdu_len > avail)
+			break;
+
+		ber_set_readbuf(&b->ber, p, b->pdu_len);
+		if ((root = ber_read_elements(&b->ber, NULL)) == NULL) {
+			log_warnx("%s: failed to parse response", b->test->name);
+			b->failed = 1;
+			break;
+		}
+		bench_response(b, root);
+		ber_free_elements(root);
+
+		p += b->pdu_len;
+		avail -= b->pdu_len;
+		nused += b->pdu_len;
+		b->pdu_len = 0;
+	}
+	evbuffer_drain(input, nused);
+}
+
+static void
+bench_write(struct bufferevent *bev, void *data)
+{
+}
+
+static void
+bench_err(struct bufferevent *bev, short why, void *data)
+{
+	struct bench		*b = data;
+
+	log_warnx("connection closed by the server");
+	b->failed = 1;
+}
+
+/* Runs a test with up to window requests outstanding on the loopback
+ * connection at a time.
+ */
+static int
+bench_requests(struct bench *b, const char *name, enum bench_kind kind,
+    unsigned int ops)
+{
+	struct bench_test	 t;
+	unsigned int		 i;
+	int			 rc = -1;
+
+	if (bench_test_init(&t, name, ops) != 0)
+		return -1;
+	t.kind = kind;
+	if ((t.started = calloc(ops + 1, sizeof(*t.started))) == NULL)
+		goto done;
+	b->test = &t;
+
+	bench_test_stats(&t, b->ns->data_db, b->ns->indx_db);
+	for (i = 0; i < b->o.window && t.sent < t.ops; i++)
+		if (bench_send(b) != 0) {
+			log_warn("%s", name);
+			goto done;
+		}
+	while (t.done < t.ops && !b->failed)
+		if (event_loop(EVLOOP_ONCE) == -1) {
+			log_warn("event_loop");
+			goto done;
+		}
+	if (b->failed)
+		goto done;
+	bench_report(&t, b->ns->data_db, b->ns->indx_db);
+	rc = 0;
+done:
+	b->test = NULL;
+	bench_test_free(&t);
+	return rc;
+}
+
+static int
+bench_parse(struct bench_opts *o, char *spec)
+{
+	enum { ENTRIES, DEPTH, BRANCH, FANOUT, OPS, WINDOW, TXN, SEED,
+	    SUFFIX };
+	char *const	 tokens[] = { "entries", "depth", "branch", "fanout",
+	    "ops", "window", "txn", "seed", "suffix", NULL };
+	char		*name, *value;
+	const char	*errstr = NULL;
+	long long	 n;
+	int		 opt;
+
+	o->entries = 10000;
+	o->depth = 2;
+	o->branch = 10;
+	o->fanout = 2;
+	o->ops = 10000;
+	o->window = 16;
+	o->txn = 1;
+	o->seed = 1;
+	o->suffix = NULL;
+
+	while (*spec != '\0') {
+		name = spec;
+		if ((opt = getsubopt(&spec, tokens, &value)) == -1 ||
+		    value == NULL) {
+			log_warnx("invalid benchmark option %s", name);
+			return -1;
+		}
+		if (opt == SUFFIX) {
+			o->suffix = value;
+			continue;
+		}
+		n = strtonum(value, opt == DEPTH || opt == FANOUT ? 0 : 1,
+		    opt == DEPTH ? 8 : UINT_MAX, &errstr);
+		if (errstr != NULL) {
+			log_warnx("%s is %s: %s", tokens[opt], errstr, value);
+			return -1;
+		}
+		switch (opt) {
+		case ENTRIES:
+			o->entries = n;
+			break;
+		case DEPTH:
+			o->depth = n;
+			break;
+		case BRANCH:
+			o->branch = n;
+			break;
+		case FANOUT:
+			o->fanout = n;
+			break;
+		case OPS:
+			o->ops = n;
+			break;
+		case WINDOW:
+			o->window = n;
+			break;
+		case TXN:
+			o->txn = n;
+			break;
+		case SEED:
+			o->seed = n;
+			break;
+		}
+	}
+	return 0;
+}
+
+/* Runs the benchmark on an empty namespace, the first one unless a
+ * suffix is given in spec.
+ */
+static int
+bench_run(char *spec)
+{
+	struct bench		 b;
+	const struct btree_stat	*st;
+	struct conn		*conn;
+	unsigned long long	 width;
+	unsigned int		 i;
+	int			 pair[2], rc = -1;
+	char			*rootdn;
+
+	memset(&b, 0, sizeof(b));
+	b.fd = -1;
+	if (bench_parse(&b.o, spec) != 0)
+		return -1;
+	b.rnd = b.o.seed * 0x9e3779b97f4a7c15ULL + 1;
+
+	TAILQ_FOREACH(b.ns, &conf->namespaces, next) {
+		if (namespace_has_referrals(b.ns))
+			continue;
+		if (b.o.suffix == NULL ||
+		    strcasecmp(b.ns->suffix, b.o.suffix) == 0)
+			break;
+	}
+	if (b.ns == NULL) {
+		log_warnx("no namespace %s", b.o.suffix ? b.o.suffix : "");
+		return -1;
+	}
+	rootdn = b.ns->rootdn != NULL ? b.ns->rootdn : conf->rootdn;
+	if (rootdn == NULL) {
+		log_warnx("%s: a rootdn is needed to add entries",
+		    b.ns->suffix);
+		return -1;
+	}
+
+	for (i = 0, width = 1; i < b.o.depth; i++) {
+		width *= b.o.branch;
+		b.nous += width;
+		if (b.nous + (unsigned long long)b.o.entries > UINT_MAX / 2) {
+			log_warnx("too many entries");
+			return -1;
+		}
+	}
+	b.nleaves = b.o.depth > 0 ? width : 0;
+	b.nodes = b.nous + b.o.entries;
+
+	/* namespace_open() sets up timers. */
+	event_init();
+	TAILQ_INIT(&conn_list);
+	signal(SIGPIPE, SIG_IGN);
+
+	if (namespace_open(b.ns) != 0) {
+		log_warn("%s", b.ns->suffix);
+		return -1;
+	}
+	if ((st = btree_stat(b.ns->data_db)) == NULL || st->entries > 0) {
+		log_warnx("namespace %s is not empty", b.ns->suffix);
+		goto done;
+	}
+
+	printf("%u entries in %u ou entries, depth %u, fanout %u, seed %llu\n",
+	    b.o.entries, b.nous, b.o.depth, b.o.fanout,
+	    (unsigned long long)b.o.seed);
+	printf("%-16s %8s %10s %9s %9s %9s %9s %8s %10s %8s %6s\n", "test",
+	    "ops", "ops/s", "p50 us", "p90 us", "p99 us", "max us", "reads",
+	    "written K", "results", "errors");
+
+	if (bench_btree(&b) != 0)
+		goto done;
+
+	/* Connect to ourselves as the root user. */
+	if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK, 0, pair) != 0) {
+		log_warn("socketpair");
+		goto done;
+	}
+	b.l.flags = F_SECURE;
+	b.l.ss.ss_family = AF_UNIX;
+	b.l.fd = -1;
+	evtimer_set(&b.l.evt, conn_accept, &b.l);
+	if ((conn = conn_new(pair[0], &b.l)) == NULL) {
+		close(pair[0]);
+		close(pair[1]);
+		goto done;
+	}
+	if ((conn->binddn = strdup(rootdn)) == NULL) {
+		conn_close(conn);
+		close(pair[1]);
+		goto done;
+	}
+
+	b.fd = pair[1];
+	b.ber.fd = -1;
+	ber_set_application(&b.ber, ldap_application);
+	if ((b.bev = bufferevent_new(b.fd, bench_read, bench_write,
+	    bench_err, &b)) == NULL) {
+		log_warn("bufferevent_new");
+		goto done;
+	}
+	bufferevent_enable(b.bev, EV_READ);
+
+	if (bench_requests(&b, "add", BENCH_ADD, b.nodes + 1) != 0 ||
+	    bench_requests(&b, "search uid", BENCH_UID, b.o.ops) != 0 ||
+	    bench_requests(&b, "search cn", BENCH_CN, b.o.ops) != 0 ||
+	    bench_requests(&b, "search or", BENCH_OR, b.o.ops) != 0 ||
+	    bench_requests(&b, "search number", BENCH_NUMBER,
+	    b.o.ops) != 0 ||
+	    bench_requests(&b, "search onelevel", BENCH_ONELEVEL,
+	    b.o.ops) != 0 ||
+	    bench_requests(&b, "modify", BENCH_MODIFY, b.o.ops) != 0)
+		goto done;
+
+	rc = 0;
+done:
+	if (b.bev != NULL)
+		bufferevent_free(b.bev);
+	if (b.fd != -1)
+		close(b.fd);
+	ber_free(&b.ber);
+	while ((conn = TAILQ_FIRST(&conn_list)) != NULL)
+		conn_close(conn);
+	namespace_remove(b.ns);
+	return rc;
+}
+
+void
+usage(void)
+{
+	extern char	*__progname;
+
+	fprintf(stderr, "usage: %s [-v] [-D macro=value] [-f file] "
+	    "[-r directory] [options]\n", __progname);
+	exit(1);
+}
+
+int
+main(int argc, char *argv[])
+{
+	char			*conffile = CONFFILE;
+	char			 nospec[] = "";
+	struct stat		 sb;
+	int			 c, verbose = 0;
+
+	log_init(1);
+
+	while ((c = getopt(argc, argv, "D:f:r:v")) != -1) {
+		switch (c) {
+		case 'D':
+			if (cmdline_symset(optarg) < 0) {
+				warnx("could not parse macro definition %s",
+				    optarg);
+			}
+			break;
+		case 'f':
+			conffile = optarg;
+			break;
+		case 'r':
+			datadir = optarg;
+			break;
+		case 'v':
+			verbose++;
+			break;
+		default:
+			usage();
+			/* NOTREACHED */
+		}
+	}
+
+	argc -= optind;
+	argv += optind;
+	if (argc > 1)
+		usage();
+
+	log_verbose(verbose);
+	tls_init();
+
+	if (parse_config(conffile) != 0)
+		exit(2);
+
+	if (stat(datadir, &sb) == -1)
+		err(1, "%s", datadir);
+	if (!S_ISDIR(sb.st_mode))
+		errx(1, "%s is not a directory", datadir);
+
+	exit(bench_run(argc > 0 ? argv[0] : nospec) == 0 ? 0 : 1);
+}
@@ -40,6 +40,12 @@
 #define BER_TAG_TYPE_MASK	0x7f
 #define BER_CLASS_SHIFT		6
 
+#define BER_CHUNK_SIZE		8192
+#define BER_POOL_MAX		8	/* chunks kept for reuse per pool */
+#define BER_ALIGN		sizeof(long long)
+
+static struct ber_arena	*ber_arena;	/* current arena, or NULL */
+
 static int	ber_dump_element(struct ber *ber, struct ber_element *root);
 static void	ber_dump_header(struct ber *ber, struct ber_element *root);
 static void	ber_putc(struct ber *ber, u_char c);
@@ -51,6 +57,8 @@ static ssize_t	ber_read_element(struct ber *ber, struct ber_element *elm);
 static ssize_t	ber_readbuf(struct ber *b, void *buf, size_t nbytes);
 static ssize_t	ber_getc(struct ber *b, u_char *c);
 static ssize_t	ber_read(struct ber *ber, void *buf, size_t len);
+static void	*ber_malloc(size_t len, int *arena);
+static void	 ber_release(void *p, int arena);
 
 #ifdef DEBUG
 #define DPRINTF(...)	printf(__VA_ARGS__)
@@ -62,10 +70,13 @@ struct ber_element *
 ber_get_element(unsigned long encoding)
 {
 	struct ber_element *elm;
+	int arena;
 
-	if ((elm = calloc(1, sizeof(*elm))) == NULL)
+	if ((elm = ber_malloc(sizeof(*elm), &arena)) == NULL)
 		return NULL;
 
+	memset(elm, 0, sizeof(*elm));
+	elm->be_arena = arena;
 	elm->be_encoding = encoding;
 	ber_set_header(elm, BER_CLASS_UNIVERSAL, BER_TYPE_DEFAULT);
 
@@ -268,18 +279,20 @@ ber_add_nstring(struct ber_element *prev, const char *string0, size_t len)
 {
 	struct ber_element *elm;
 	char *string;
+	int arena;
 
-	if ((string = calloc(1, len + 1)) == NULL)
+	if ((string = ber_malloc(len + 1, &arena)) == NULL)
 		return NULL;
 	if ((elm = ber_get_element(BER_TYPE_OCTETSTRING)) == NULL) {
-		free(string);
+		ber_release(string, arena);
 		return NULL;
 	}
 
 	bcopy(string0, string, len);
+	string[len] = '\0';
 	elm->be_val = string;
 	elm->be_len = len;
-	elm->be_free = 1;		/* free string on cleanup */
+	elm->be_free = !arena;		/* free string on cleanup */
 
 	ber_link_elements(prev, elm);
 
@@ -312,18 +325,19 @@ ber_add_bitstring(struct ber_element *prev, const void *v0, size_t len)
 {
 	struct ber_element *elm;
 	void *v;
+	int arena;
 
-	if ((v = calloc(1, len)) == NULL)
+	if ((v = ber_malloc(len, &arena)) == NULL)
 		return NULL;
 	if ((elm = ber_get_element(BER_TYPE_BITSTRING)) == NULL) {
-		free(v);
+		ber_release(v, arena);
 		return NULL;
 	}
 
 	bcopy(v0, v, len);
 	elm->be_val = v;
 	elm->be_len = len;
-	elm->be_free = 1;		/* free string on cleanup */
+	elm->be_free = !arena;		/* free string on cleanup */
 
 	ber_link_elements(prev, elm);
 
@@ -385,6 +399,26 @@ ber_get_eoc(struct ber_element *elm)
 	return 0;
 }
 
+/*
+ * Adds an element holding len bytes of already encoded BER at buf, which
+ * are written out verbatim.  The bytes are not copied and must remain
+ * valid until the element has been written or freed.
+ */
+struct ber_element *
+ber_add_raw(struct ber_element *prev, void *buf, size_t len)
+{
+	struct ber_element *elm;
+
+	if ((elm = ber_get_element(BER_TYPE_RAW)) == NULL)
+		return NULL;
+
+	elm->be_val = buf;
+	elm->be_len = len;
+	ber_link_elements(prev, elm);
+
+	return elm;
+}
+
 size_t
 ber_oid2ber(struct ber_oid *o, u_int8_t *buf, size_t len)
 {
@@ -440,6 +474,7 @@ ber_add_oid(struct ber_element *prev, struct ber_oid *o)
 	struct ber_element	*elm;
 	u_int8_t		*buf;
 	size_t			 len;
+	int			 arena;
 
 	if ((elm = ber_get_element(BER_TYPE_OBJECT)) == NULL)
 		return (NULL);
@@ -447,12 +482,12 @@ ber_add_oid(struct ber_element *prev, struct ber_oid *o)
 	if ((len = ber_oid2ber(o, NULL, 0)) == 0)
 		goto fail;
 
-	if ((buf = calloc(1, len)) == NULL)
+	if ((buf = ber_malloc(len, &arena)) == NULL)
 		goto fail;
 
 	elm->be_val = buf;
 	elm->be_len = len;
-	elm->be_free = 1;
+	elm->be_free = !arena;
 
 	if (ber_oid2ber(o, buf, len) != len)
 		goto fail;
@@ -835,7 +870,8 @@ ber_free_element(struct ber_element *root)
 	    root->be_encoding == BER_TYPE_BITSTRING ||
 	    root->be_encoding == BER_TYPE_OBJECT))
 		free(root->be_val);
-	free(root);
+	if (!root->be_arena)
+		free(root);
 }
 
 void
@@ -850,7 +886,8 @@ ber_free_elements(struct ber_element *root)
 	    root->be_encoding == BER_TYPE_BITSTRING ||
 	    root->be_encoding == BER_TYPE_OBJECT))
 		free(root->be_val);
-	free(root);
+	if (!root->be_arena)
+		free(root);
 }
 
 size_t
@@ -860,6 +897,14 @@ ber_calc_len(struct ber_element *root)
 	size_t s;
 	size_t size = 2;	/* minimum 1 byte head and 1 byte size */
 
+	/* raw elements carry their own header */
+	if (root->be_encoding == BER_TYPE_RAW) {
+		size = root->be_len;
+		if (root->be_next)
+			size += ber_calc_len(root->be_next);
+		return (size);
+	}
+
 	/* calculate the real length of a sequence or set */
 	if (root->be_sub && (root->be_encoding == BER_TYPE_SEQUENCE ||
 	    root->be_encoding == BER_TYPE_SET))
@@ -895,9 +940,13 @@ ber_dump_element(struct ber *ber, struct ber_element *root)
 	int i;
 	uint8_t u;
 
-	ber_dump_header(ber, root);
+	if (root->be_encoding != BER_TYPE_RAW)
+		ber_dump_header(ber, root);
 
 	switch (root->be_encoding) {
+	case BER_TYPE_RAW:
+		ber_write(ber, root->be_val, root->be_len);
+		break;
 	case BER_TYPE_BOOLEAN:
 	case BER_TYPE_INTEGER:
 	case BER_TYPE_ENUMERATED:
@@ -1081,7 +1130,7 @@ ber_read_element(struct ber *ber, struct ber_element *elm)
 	long long val = 0;
 	struct ber_element *next;
 	unsigned long type;
-	int i, class, cstruct;
+	int i, class, cstruct, arena;
 	ssize_t len, r, totlen = 0;
 	u_char c;
 
@@ -1145,19 +1194,19 @@ ber_read_element(struct ber *ber, struct ber_element *elm)
 		elm->be_numeric = val;
 		break;
 	case BER_TYPE_BITSTRING:
-		elm->be_val = malloc(len);
+		elm->be_val = ber_malloc(len, &arena);
 		if (elm->be_val == NULL)
 			return -1;
-		elm->be_free = 1;
+		elm->be_free = !arena;
 		elm->be_len = len;
 		ber_read(ber, elm->be_val, len);
 		break;
 	case BER_TYPE_OCTETSTRING:
 	case BER_TYPE_OBJECT:
-		elm->be_val = malloc(len + 1);
+		elm->be_val = ber_malloc(len + 1, &arena);
 		if (elm->be_val == NULL)
 			return -1;
-		elm->be_free = 1;
+		elm->be_free = !arena;
 		elm->be_len = len;
 		ber_read(ber, elm->be_val, len);
 		((u_char *)elm->be_val)[len] = '\0';
@@ -1219,6 +1268,32 @@ ber_set_readbuf(struct ber *b, void *buf, size_t len)
 	b->br_rend = (u_int8_t *)buf + len;
 }
 
+/*
+ * Decodes the identifier and length octets of the element at the start of
+ * the size bytes at buf without reading its contents, which need not be
+ * buffered yet.  Returns the length of the header, or -1 if it is invalid
+ * or truncated (errno set to ECANCELED).
+ */
+ssize_t
+ber_read_header(void *buf, size_t size, int *class, unsigned long *type,
+    int *cstruct, size_t *len)
+{
+	struct ber	 b;
+	ssize_t		 r, s, l;
+
+	memset(&b, 0, sizeof(b));
+	b.fd = -1;
+	ber_set_readbuf(&b, buf, size);
+
+	if ((r = get_id(&b, type, class, cstruct)) == -1)
+		return -1;
+	if ((s = get_len(&b, &l)) == -1)
+		return -1;
+
+	*len = l;
+	return r + s;
+}
+
 ssize_t
 ber_get_writebuf(struct ber *b, void **buf)
 {
@@ -1285,3 +1360,125 @@ ber_read(struct ber *ber, void *buf, size_t len)
 	}
 	return (b - (u_char *)buf);
 }
+
+static void *
+ber_malloc(size_t len, int *arena)
+{
+	struct ber_chunk	*c;
+	size_t			 size;
+	void			*p;
+
+	if ((*arena = ber_arena != NULL) == 0)
+		return malloc(len);
+
+	len = (len + BER_ALIGN - 1) & ~(BER_ALIGN - 1);
+	c = ber_arena->ba_chunk;
+	if (c == NULL || c->bc_size - c->bc_used < len) {
+		/* large values get a chunk of their own */
+		size = len > BER_CHUNK_SIZE / 4 ? len : BER_CHUNK_SIZE;
+		if (size == BER_CHUNK_SIZE && ber_arena->ba_pool != NULL &&
+		    (c = ber_arena->ba_pool->bp_free) != NULL) {
+			ber_arena->ba_pool->bp_free = c->bc_next;
+			ber_arena->ba_pool->bp_count--;
+		} else if ((c = malloc(sizeof(*c) + size)) == NULL)
+			return NULL;
+		c->bc_size = size;
+		c->bc_used = 0;
+		c->bc_next = ber_arena->ba_chunk;
+		ber_arena->ba_chunk = c;
+	}
+
+	p = (u_char *)(c + 1) + c->bc_used;
+	c->bc_used += len;
+	return p;
+}
+
+static void
+ber_release(void *p, int arena)
+{
+	if (!arena)
+		free(p);
+}
+
+static void
+ber_chunk_release(struct ber_pool *pool, struct ber_chunk *c)
+{
+	if (pool != NULL && c->bc_size == BER_CHUNK_SIZE &&
+	    pool->bp_count < BER_POOL_MAX) {
+		c->bc_next = pool->bp_free;
+		pool->bp_free = c;
+		pool->bp_count++;
+	} else
+		free(c);
+}
+
+void
+ber_arena_init(struct ber_arena *arena, struct ber_pool *pool)
+{
+	arena->ba_chunk = NULL;
+	arena->ba_pool = pool;
+}
+
+/*
+ * Makes arena the current arena, or switches back to malloc if it is NULL.
+ * Returns the previous arena. An arena must be unset before returning to
+ * the event loop, or elements built for anything else would be released
+ * with it.
+ */
+struct ber_arena *
+ber_set_arena(struct ber_arena *arena)
+{
+	struct ber_arena *prev = ber_arena;
+
+	ber_arena = arena;
+	return prev;
+}
+
+/*
+ * Records the fill level of arena, so that everything allocated after it
+ * can be reclaimed with ber_arena_rewind.
+ */
+void
+ber_arena_mark(struct ber_arena *arena, struct ber_mark *mark)
+{
+	mark->bm_chunk = arena->ba_chunk;
+	mark->bm_used = mark->bm_chunk ? mark->bm_chunk->bc_used : 0;
+}
+
+void
+ber_arena_rewind(struct ber_arena *arena, struct ber_mark *mark)
+{
+	struct ber_chunk *c;
+
+	while ((c = arena->ba_chunk) != mark->bm_chunk) {
+		arena->ba_chunk = c->bc_next;
+		ber_chunk_release(arena->ba_pool, c);
+	}
+	if (c != NULL)
+		c->bc_used = mark->bm_used;
+}
+
+void
+ber_arena_free(struct ber_arena *arena)
+{
+	struct ber_chunk *c;
+
+	while ((c = arena->ba_chunk) != NULL) {
+		arena->ba_chunk = c->bc_next;
+		ber_chunk_release(arena->ba_pool, c);
+	}
+	if (ber_arena == arena)
+		ber_arena = NULL;
+}
+
+void
+ber_pool_free(struct ber_pool *pool)
+{
+	struct ber_chunk *c;
+
+	while ((c = pool->bp_free) != NULL) {
+		pool->bp_free = c->bc_next;
+		free(c);
+	}
+	pool->bp_count = 0;
+}
@@ -24,6 +24,8 @@ struct ber_element {
 	size_t			 be_len;
 	int			 be_free;
 	u_int8_t		 be_class;
+	u_int8_t		 be_arena;	/* allocated from an arena */
+	void			*be_udata;	/* for the caller, not encoded */
 	union {
 		struct ber_element	*bv_sub;
 		void			*bv_val;
@@ -46,6 +48,32 @@ struct ber {
 	unsigned long	(*br_application)(struct ber_element *);
 };
 
+/* While an arena is set with ber_set_arena, elements and their values are
+ * carved out of its chunks and ber_free_elements leaves them alone.  They
+ * are all released at once by ber_arena_free, which hands the chunks back
+ * to the pool for reuse by the next arena.
+ */
+struct ber_chunk {
+	struct ber_chunk	*bc_next;
+	size_t			 bc_size;
+	size_t			 bc_used;
+};
+
+struct ber_pool {
+	struct ber_chunk	*bp_free;
+	u_int			 bp_count;
+};
+
+struct ber_arena {
+	struct ber_chunk	*ba_chunk;	/* chunk being filled */
+	struct ber_pool		*ba_pool;
+};
+
+struct ber_mark {
+	struct ber_chunk	*bm_chunk;
+	size_t			 bm_used;
+};
+
 /* well-known ber_element types */
 #define BER_TYPE_DEFAULT	((unsigned long)-1)
 #define BER_TYPE_EOC		0
@@ -58,6 +86,7 @@ struct ber {
 #define BER_TYPE_ENUMERATED	10
 #define BER_TYPE_SEQUENCE	16
 #define BER_TYPE_SET		17
+#define BER_TYPE_RAW		((unsigned long)-2)	/* pre-encoded */
 
 /* ber classes */
 #define BER_CLASS_UNIVERSAL	0x0
@@ -108,6 +137,7 @@ struct ber_element	*ber_add_null(struct ber_element *);
 int			 ber_get_null(struct ber_element *);
 struct ber_element	*ber_add_eoc(struct ber_element *);
 int			 ber_get_eoc(struct ber_element *);
+struct ber_element	*ber_add_raw(struct ber_element *, void *, size_t);
 struct ber_element	*ber_add_oid(struct ber_element *, struct ber_oid *);
 struct ber_element	*ber_add_noid(struct ber_element *, struct ber_oid *, int);
 struct ber_element	*ber_add_oidstring(struct ber_element *, const char *);
@@ -119,6 +149,8 @@ int			 ber_scanf_elements(struct ber_element *, char *, ...);
 ssize_t			 ber_get_writebuf(struct ber *, void **);
 int			 ber_write_elements(struct ber *, struct ber_element *);
 void			 ber_set_readbuf(struct ber *, void *, size_t);
+ssize_t			 ber_read_header(void *, size_t, int *,
+			    unsigned long *, int *, size_t *);
 struct ber_element	*ber_read_elements(struct ber *, struct ber_element *);
 void			 ber_free_element(struct ber_element *);
 void			 ber_free_elements(struct ber_element *);
@@ -126,4 +158,11 @@ size_t			 ber_calc_len(struct ber_element *);
 void			 ber_set_application(struct ber *,
 			    unsigned long (*)(struct ber_element *));
 void			 ber_free(struct ber *);
+void			 ber_arena_init(struct ber_arena *, struct ber_pool *);
+struct ber_arena	*ber_set_arena(struct ber_arena *);
+void			 ber_arena_mark(struct ber_arena *, struct ber_mark *);
+void			 ber_arena_rewind(struct ber_arena *,
+			    struct ber_mark *);
+void			 ber_arena_free(struct ber_arena *);
+void			 ber_pool_free(struct ber_pool *);
 __END_DECLS
@@ -36,8 +36,11 @@ main(int argc, char **argv)
 	const char	*filename = "test.db";
 	struct btval	 key, data, maxkey;
 
-	while ((c = getopt(argc, argv, "rf:")) != -1) {
+	while ((c = getopt(argc, argv, "mrf:")) != -1) {
 		switch (c) {
+		case 'm':
+			flags |= BT_MMAP;
+			break;
 		case 'r':
 			flags |= BT_REVERSEKEY;
 			break;
@@ -18,6 +18,7 @@
 
 #include <sys/types.h>
 #include <sys/tree.h>
+#include <sys/mman.h>
 #include <sys/stat.h>
 #include <sys/queue.h>
 #include <sys/uio.h>
@@ -25,6 +26,7 @@
 #include <assert.h>
 #include <err.h>
 #include <errno.h>
+#include <limits.h>
 #include <fcntl.h>
 #include <stddef.h>
 #include <stdint.h>
@@ -103,6 +105,7 @@ struct bt_head {				/* header page content */
 
 struct bt_meta {				/* meta (footer) page content */
 #define BT_TOMBSTONE	 0x01			/* file is replaced */
+#define BT_USERMETA	 0x02			/* followed by bt_usermeta */
 	uint32_t	 flags;
 	pgno_t		 root;			/* page number of root page */
 	pgno_t		 prev_meta;		/* previous meta page number */
@@ -116,6 +119,12 @@ struct bt_meta {				/* meta (footer) page content */
 	unsigned char	 hash[SHA_DIGEST_LENGTH];
 } __packed;
 
+struct bt_usermeta {				/* application data on meta page */
+	uint32_t	 size;
+	unsigned char	 hash[SHA_DIGEST_LENGTH];
+	char		 data[1];
+} __packed;
+
 struct btkey {
 	size_t			 len;
 	char			 str[MAXKEYSIZE];
@@ -124,7 +133,7 @@ struct btkey {
 struct mpage {					/* an in-memory cached page */
 	RB_ENTRY(mpage)		 entry;		/* page cache entry */
 	SIMPLEQ_ENTRY(mpage)	 next;		/* queue of dirty pages */
-	TAILQ_ENTRY(mpage)	 lru_next;	/* LRU queue */
+	TAILQ_ENTRY(mpage)	 clock_next;	/* CLOCK replacement ring */
 	struct mpage		*parent;	/* NULL if root */
 	unsigned int		 parent_index;	/* keep track of node index */
 	struct btkey		 prefix;
@@ -132,10 +141,21 @@ struct mpage {					/* an in-memory cached page */
 	pgno_t			 pgno;		/* copy of page->pgno */
 	short			 ref;		/* increased by cursors */
 	short			 dirty;		/* 1 if on dirty queue */
+	short			 mapped;	/* 1 if page is in file mapping */
+	short			 usage;		/* CLOCK usage count */
+	short			 readahead;	/* 1 if read ahead, not yet used */
+	uint32_t		*heads;		/* key heads, see mpage_heads */
 };
 RB_HEAD(page_cache, mpage);
 SIMPLEQ_HEAD(dirty_queue, mpage);
-TAILQ_HEAD(lru_queue, mpage);
+TAILQ_HEAD(clock_queue, mpage);
+
+struct bt_map {					/* a mapping of the file */
+	SLIST_ENTRY(bt_map)	 entry;
+	char			*addr;
+	size_t			 size;
+};
+SLIST_HEAD(map_list, bt_map);
 
 static int		 mpage_cmp(struct mpage *a, struct mpage *b);
 static struct mpage	*mpage_lookup(struct btree *bt, pgno_t pgno);
@@ -145,8 +165,10 @@ static void		 mpage_del(struct btree *bt, struct mpage *mp);
 static void		 mpage_flush(struct btree *bt);
 static struct mpage	*mpage_copy(struct btree *bt, struct mpage *mp);
 static void		 mpage_prune(struct btree *bt);
+static void		 mpage_clock_advance(struct btree *bt);
 static void		 mpage_dirty(struct btree *bt, struct mpage *mp);
 static struct mpage	*mpage_touch(struct btree *bt, struct mpage *mp);
+static int		 mpage_unmap(struct btree *bt, struct mpage *mp);
 
 RB_PROTOTYPE(page_cache, mpage, entry, mpage_cmp);
 RB_GENERATE(page_cache, mpage, entry, mpage_cmp);
@@ -169,10 +191,16 @@ struct cursor {
 	struct page_stack	 stack;		/* stack of parent pages */
 	short			 initialized;	/* 1 if initialized */
 	short			 eof;		/* 1 if end is reached */
+	short			 sequential;	/* 1 if leaves are read ahead */
 };
 
 #define METAHASHLEN	 offsetof(struct bt_meta, hash)
 #define METADATA(p)	 ((void *)((char *)p + PAGEHDRSZ))
+#define USERMETA(p)	 ((struct bt_usermeta *)((char *)METADATA(p) + \
+			    sizeof(struct bt_meta)))
+#define USERMETASZ	 offsetof(struct bt_usermeta, data)
+#define USERMETAMAX(bt)	 ((bt)->head.psize - PAGEHDRSZ - \
+			    sizeof(struct bt_meta) - USERMETASZ)
 
 struct node {
 #define n_pgno		 p.np_pgno
@@ -194,7 +222,11 @@ struct btree_txn {
 	struct dirty_queue	*dirty_queue;	/* modified pages */
 #define BT_TXN_RDONLY		 0x01		/* read-only transaction */
 #define BT_TXN_ERROR		 0x02		/* an error has occurred */
+#define BT_TXN_APPEND		 0x04		/* split leaves at the end */
+#define BT_TXN_USERMETA		 0x08		/* user meta data replaced */
 	unsigned int		 flags;
+	void			*usermeta;	/* replacing user meta data */
+	size_t			 usermeta_size;
 };
 
 struct btree {
@@ -205,12 +237,16 @@ struct btree {
 	bt_cmp_func		 cmp;		/* user compare function */
 	struct bt_head		 head;
 	struct bt_meta		 meta;
+	void			*usermeta;	/* of the current meta page */
+	size_t			 usermeta_size;
 	struct page_cache	*page_cache;
-	struct lru_queue	*lru_queue;
+	struct clock_queue	*clock_queue;
+	struct mpage		*clock_hand;	/* next page to consider */
 	struct btree_txn	*txn;		/* current write transaction */
 	int			 ref;		/* increased by cursors & txn */
 	struct btree_stat	 stat;
 	off_t			 size;		/* current file size */
+	struct map_list		 maps;		/* file mappings if BT_MMAP */
 };
 
 #define NODESIZE	 offsetof(struct node, data)
@@ -226,9 +262,18 @@ struct btree {
 
 #define BT_COMMIT_PAGES	 64	/* max number of pages to write in one commit */
 #define BT_MAXCACHE_DEF	 1024	/* max number of pages to keep in cache  */
+#define BT_CLOCK_MAX	 3	/* max usage count of a cached page */
+#define BT_MAPSIZE_MIN	 (16 * 1024 * 1024)	/* smallest file mapping */
+#define BT_READAHEAD	 16	/* max number of leaf pages to read ahead */
 
 static int		 btree_read_page(struct btree *bt, pgno_t pgno,
 			    struct page *page);
+static int		 btree_read_run(struct btree *bt, pgno_t pgno,
+			    unsigned int n);
+static void		 btree_readahead(struct btree *bt,
+			    struct mpage *parent, unsigned int ki);
+static int		 btree_map(struct btree *bt);
+static struct page	*btree_map_page(struct btree *bt, pgno_t pgno);
 static struct mpage	*btree_get_mpage(struct btree *bt, pgno_t pgno);
 static int		 btree_search_page_root(struct btree *bt,
 			    struct mpage *root, struct btval *key,
@@ -243,8 +288,10 @@ static int		 btree_write_header(struct btree *bt, int fd);
 static int		 btree_read_header(struct btree *bt);
 static int		 btree_is_meta_page(struct page *p);
 static int		 btree_read_meta(struct btree *bt, pgno_t *p_next);
+static int		 btree_read_snapshot(struct btree *bt);
 static int		 btree_write_meta(struct btree *bt, pgno_t root,
 			    unsigned int flags);
+static int		 btree_write_tombstone(struct btree *bt);
 static void		 btree_ref(struct btree *bt);
 
 static struct node	*btree_search_node(struct btree *bt, struct mpage *mp,
@@ -261,11 +308,14 @@ static int		 btree_rebalance(struct btree *bt, struct mpage *mp);
 static int		 btree_update_key(struct btree *bt, struct mpage *mp,
 			    indx_t indx, struct btval *key);
 static int		 btree_adjust_prefix(struct btree *bt,
-			    struct mpage *src, int delta);
+			    struct mpage *src, struct btkey *pfx, int delta);
 static int		 btree_move_node(struct btree *bt, struct mpage *src,
 			    indx_t srcindx, struct mpage *dst, indx_t dstindx);
+static int		 btree_merge_fits(struct btree *bt, struct mpage *src,
+			    struct mpage *dst);
 static int		 btree_merge(struct btree *bt, struct mpage *src,
 			    struct mpage *dst);
+static int		 btree_is_last_page(struct mpage *mp);
 static int		 btree_split(struct btree *bt, struct mpage **mpp,
 			    unsigned int *newindxp, struct btval *newkey,
 			    struct btval *newdata, pgno_t newpgno);
@@ -314,15 +364,11 @@ static int		 memnrcmp(const void *s1, size_t n1,
 static int
 memncmp(const void *s1, size_t n1, const void *s2, size_t n2)
 {
-	if (n1 < n2) {
-		if (memcmp(s1, s2, n1) == 0)
-			return -1;
-	}
-	else if (n1 > n2) {
-		if (memcmp(s1, s2, n2) == 0)
-			return 1;
-	}
-	return memcmp(s1, s2, n1);
+	int	 rc;
+
+	if ((rc = memcmp(s1, s2, n1 < n2 ? n1 : n2)) != 0)
+		return rc;
+	return n1 < n2 ? -1 : n1 > n2;
 }
 
 static int
@@ -354,7 +400,11 @@ memnrcmp(const void *s1, size_t n1, const void *s2, size_t n2)
 int
 btree_cmp(struct btree *bt, const struct btval *a, const struct btval *b)
 {
-	return bt->cmp(a, b);
+	if (bt->cmp != NULL)
+		return bt->cmp(a, b);
+	if (F_ISSET(bt->flags, BT_REVERSEKEY))
+		return memnrcmp(a->data, a->size, b->data, b->size);
+	return memncmp(a->data, a->size, b->data, b->size);
 }
 
 static void
@@ -470,28 +520,49 @@ mpage_lookup(struct btree *bt, pgno_t pgno)
 
 	find.pgno = pgno;
 	mp = RB_FIND(page_cache, bt->page_cache, &find);
-	if (mp) {
+	if (mp && mp->readahead) {
+		/* The first use of a page read ahead was counted as the read. */
+		mp->readahead = 0;
+	} else if (mp) {
 		bt->stat.hits++;
-		/* Update LRU queue. Move page to the end. */
-		TAILQ_REMOVE(bt->lru_queue, mp, lru_next);
-		TAILQ_INSERT_TAIL(bt->lru_queue, mp, lru_next);
+		if (mp->usage < BT_CLOCK_MAX)
+			mp->usage++;
 	}
 	return mp;
 }
 
+/* Insert a page in the cache. New pages are put just behind the clock
+ * hand, so they are the last to be considered for eviction.
+ */
 static void
 mpage_add(struct btree *bt, struct mpage *mp)
 {
 	assert(RB_INSERT(page_cache, bt->page_cache, mp) == NULL);
 	bt->stat.cache_size++;
-	TAILQ_INSERT_TAIL(bt->lru_queue, mp, lru_next);
+	mp->usage = 0;
+	if (bt->clock_hand != NULL)
+		TAILQ_INSERT_BEFORE(bt->clock_hand, mp, clock_next);
+	else {
+		TAILQ_INSERT_TAIL(bt->clock_queue, mp, clock_next);
+		bt->clock_hand = mp;
+	}
+}
+
+static void
+mpage_clock_advance(struct btree *bt)
+{
+	bt->clock_hand = TAILQ_NEXT(bt->clock_hand, clock_next);
+	if (bt->clock_hand == NULL)
+		bt->clock_hand = TAILQ_FIRST(bt->clock_queue);
 }
 
 static void
 mpage_free(struct mpage *mp)
 {
 	if (mp != NULL) {
-		free(mp->page);
+		if (!mp->mapped)
+			free(mp->page);
+		free(mp->heads);
 		free(mp);
 	}
 }
@@ -502,7 +573,12 @@ mpage_del(struct btree *bt, struct mpage *mp)
 	assert(RB_REMOVE(page_cache, bt->page_cache, mp) == mp);
 	assert(bt->stat.cache_size > 0);
 	bt->stat.cache_size--;
-	TAILQ_REMOVE(bt->lru_queue, mp, lru_next);
+	if (bt->clock_hand == mp) {
+		mpage_clock_advance(bt);
+		if (bt->clock_hand == mp)
+			bt->clock_hand = NULL;
+	}
+	TAILQ_REMOVE(bt->clock_queue, mp, clock_next);
 }
 
 static void
@@ -536,23 +612,37 @@ mpage_copy(struct btree *bt, struct mpage *mp)
 	return copy;
 }
 
-/* Remove the least recently used memory pages until the cache size is
- * within the configured bounds. Pages referenced by cursors or returned
- * key/data are not pruned.
+/* Evict memory pages until the cache size is within the configured
+ * bounds, using a generalized CLOCK algorithm. Each cache hit increments
+ * the usage count of a page, and the clock hand decrements it while
+ * sweeping past, evicting pages that have reached zero. Frequently used
+ * pages, like the upper branch pages, thus survive a full scan that
+ * touches each leaf page only once. Pages referenced by cursors or
+ * returned key/data are not pruned.
  */
 static void
 mpage_prune(struct btree *bt)
 {
-	struct mpage	*mp, *next;
+	struct mpage	*mp;
+	unsigned int	 n;
 
-	for (mp = TAILQ_FIRST(bt->lru_queue); mp; mp = next) {
-		if (bt->stat.cache_size <= bt->stat.max_cache)
-			break;
-		next = TAILQ_NEXT(mp, lru_next);
-		if (!mp->dirty && mp->ref <= 0) {
-			mpage_del(bt, mp);
-			mpage_free(mp);
+	/* Each page can be passed at most BT_CLOCK_MAX times before its
+	 * usage count is zero, which bounds the sweep if all remaining
+	 * pages are referenced.
+	 */
+	n = (BT_CLOCK_MAX + 1) * bt->stat.cache_size;
+	while (bt->stat.cache_size > bt->stat.max_cache && n-- > 0) {
+		mp = bt->clock_hand;
+		mpage_clock_advance(bt);
+		if (mp->dirty || mp->ref > 0)
+			continue;
+		if (mp->usage > 0) {
+			mp->usage--;
+			continue;
 		}
+		mpage_del(bt, mp);
+		mpage_free(mp);
+		bt->stat.evictions++;
 	}
 }
 
@@ -581,15 +671,20 @@ mpage_touch(struct btree *bt, struct mpage *mp)
 
 	if (!mp->dirty) {
 		DPRINTF("touching page %u -> %u", mp->pgno, bt->txn->next_pgno);
-		if (mp->ref == 0)
+		if (mp->ref == 0) {
+			if (mp->mapped && mpage_unmap(bt, mp) != BT_SUCCESS)
+				return NULL;
 			mpage_del(bt, mp);
-		else {
+			free(mp->heads);
+			mp->heads = NULL;
+		} else {
 			if ((mp = mpage_copy(bt, mp)) == NULL)
 				return NULL;
 		}
 		mp->pgno = mp->page->pgno = bt->txn->next_pgno++;
 		mpage_dirty(bt, mp);
 		mpage_add(bt, mp);
+		bt->stat.touched++;
 
 		/* Update the page number to new touched page. */
 		if (mp->parent != NULL)
@@ -600,6 +695,92 @@ mpage_touch(struct btree *bt, struct mpage *mp)
 	return mp;
 }
 
+/* Give a page that points into the file mapping its own copy of the
+ * page data, so it can be modified.
+ */
+static int
+mpage_unmap(struct btree *bt, struct mpage *mp)
+{
+	struct page	*p;
+
+	assert(mp->mapped);
+
+	if ((p = malloc(bt->head.psize)) == NULL)
+		return BT_FAIL;
+	bcopy(mp->page, p, bt->head.psize);
+	mp->page = p;
+	mp->mapped = 0;
+
+	return BT_SUCCESS;
+}
+
+/* Extend the file mapping to cover the current file size. The mapping is
+ * made larger than the file so it doesn't have to be replaced on every
+ * commit, but only pages within the known file size are ever accessed.
+ * Old mappings are kept until the btree is closed, as cached pages and
+ * returned keys and data may still point into them. Pages are never
+ * modified once written, so all mappings show the same content.
+ */
+static int
+btree_map(struct btree *bt)
+{
+	struct bt_map	*map;
+	size_t		 size;
+
+	if ((uint64_t)bt->size * 2 > SIZE_MAX) {
+		errno = EFBIG;
+		return BT_FAIL;
+	}
+	size = bt->size * 2;
+	if (size < BT_MAPSIZE_MIN)
+		size = BT_MAPSIZE_MIN;
+	size -= size % bt->head.psize;
+
+	if ((map = calloc(1, sizeof(*map))) == NULL)
+		return BT_FAIL;
+
+	DPRINTF("mapping %zu bytes of file size %lld", size,
+	    (long long)bt->size);
+	map->addr = mmap(NULL, size, PROT_READ, MAP_SHARED, bt->fd, 0);
+	if (map->addr == MAP_FAILED) {
+		DPRINTF("mmap: %s", strerror(errno));
+		free(map);
+		return BT_FAIL;
+	}
+	map->size = size;
+	SLIST_INSERT_HEAD(&bt->maps, map, entry);
+
+	return BT_SUCCESS;
+}
+
+/* Returns a pointer to page pgno in the file mapping, or NULL if the
+ * page isn't mapped.
+ */
+static struct page *
+btree_map_page(struct btree *bt, pgno_t pgno)
+{
+	struct bt_map	*map;
+	struct page	*p;
+	off_t		 end;
+
+	end = ((off_t)pgno + 1) * bt->head.psize;
+	if (end > bt->size)
+		return NULL;
+	if ((map = SLIST_FIRST(&bt->maps)) == NULL || (size_t)end > map->size) {
+		if (btree_map(bt) != BT_SUCCESS)
+			return NULL;
+		map = SLIST_FIRST(&bt->maps);
+	}
+
+	p = (struct page *)(map->addr + (off_t)pgno * bt->head.psize);
+	if (p->pgno != pgno) {
+		DPRINTF("page numbers don't match: %u != %u", pgno, p->pgno);
+		return NULL;
+	}
+
+	return p;
+}
+
 static int
 btree_read_page(struct btree *bt, pgno_t pgno, struct page *page)
 {
@@ -632,9 +813,24 @@ btree_read_page(struct btree *bt, pgno_t pgno, struct page *page)
 int
 btree_sync(struct btree *bt)
 {
-	if (!F_ISSET(bt->flags, BT_NOSYNC))
-		return fsync(bt->fd);
-	return 0;
+	struct timespec	 start, end;
+	unsigned long long usec;
+	int		 rc;
+
+	if (F_ISSET(bt->flags, BT_NOSYNC))
+		return 0;
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	rc = fsync(bt->fd);
+	clock_gettime(CLOCK_MONOTONIC, &end);
+
+	usec = (end.tv_sec - start.tv_sec) * 1000000ULL +
+	    (end.tv_nsec - start.tv_nsec) / 1000;
+	bt->stat.fsyncs++;
+	bt->stat.fsync_usec += usec;
+	if (usec > bt->stat.fsync_max_usec)
+		bt->stat.fsync_max_usec = usec;
+	return rc;
 }
 
 struct btree_txn *
@@ -677,7 +873,12 @@ btree_txn_begin(struct btree *bt, int rdonly)
 	txn->bt = bt;
 	btree_ref(bt);
 
-	if (btree_read_meta(bt, &txn->next_pgno) != BT_SUCCESS) {
+	if (rdonly) {
+		if (btree_read_snapshot(bt) != BT_SUCCESS) {
+			btree_txn_abort(txn);
+			return NULL;
+		}
+	} else if (btree_read_meta(bt, &txn->next_pgno) != BT_SUCCESS) {
 		btree_txn_abort(txn);
 		return NULL;
 	}
@@ -718,6 +919,7 @@ btree_txn_abort(struct btree_txn *txn)
 			    txn->bt->fd, strerror(errno));
 		}
 		free(txn->dirty_queue);
+		free(txn->usermeta);
 	}
 
 	btree_close(txn->bt);
@@ -727,9 +929,12 @@ btree_txn_abort(struct btree_txn *txn)
 int
 btree_txn_commit(struct btree_txn *txn)
 {
-	int		 n, done;
+	int		 n, done, b;
+	unsigned int	 pages = 0;
 	ssize_t		 rc;
 	off_t		 size;
+	void		*usermeta;
+	size_t		 usermeta_size;
 	struct mpage	*mp;
 	struct btree	*bt;
 	struct iovec	 iov[BT_COMMIT_PAGES];
@@ -760,7 +965,8 @@ btree_txn_commit(struct btree_txn *txn)
 		return BT_FAIL;
 	}
 
-	if (SIMPLEQ_EMPTY(txn->dirty_queue))
+	if (SIMPLEQ_EMPTY(txn->dirty_queue) &&
+	    !F_ISSET(txn->flags, BT_TXN_USERMETA))
 		goto done;
 
 	if (F_ISSET(bt->flags, BT_FIXPADDING)) {
@@ -807,6 +1013,8 @@ btree_txn_commit(struct btree_txn *txn)
 			return BT_FAIL;
 		}
 
+		pages += n;
+
 		/* Remove the dirty flag from the written pages.
 		 */
 		while (!SIMPLEQ_EMPTY(txn->dirty_queue)) {
@@ -818,13 +1026,38 @@ btree_txn_commit(struct btree_txn *txn)
 		}
 	} while (!done);
 
+	/* The replaced user meta data is freed with the transaction,
+	 * or put back if the meta page can't be written.
+	 */
+	if (F_ISSET(txn->flags, BT_TXN_USERMETA)) {
+		usermeta = bt->usermeta;
+		usermeta_size = bt->usermeta_size;
+		bt->usermeta = txn->usermeta;
+		bt->usermeta_size = txn->usermeta_size;
+		txn->usermeta = usermeta;
+		txn->usermeta_size = usermeta_size;
+	}
+
 	if (btree_sync(bt) != 0 ||
 	    btree_write_meta(bt, txn->root, 0) != BT_SUCCESS ||
 	    btree_sync(bt) != 0) {
+		if (F_ISSET(txn->flags, BT_TXN_USERMETA)) {
+			free(bt->usermeta);
+			bt->usermeta = txn->usermeta;
+			bt->usermeta_size = txn->usermeta_size;
+			txn->usermeta = NULL;
+		}
 		btree_txn_abort(txn);
 		return BT_FAIL;
 	}
 
+	/* Count the commit by its dirty pages, not counting the meta page. */
+	bt->stat.commits++;
+	bt->stat.writes += pages;
+	for (b = 0; b < BT_DIRTY_BUCKETS - 1 && pages >> (b + 1) != 0; b++)
+		;
+	bt->stat.dirty[b]++;
+
 done:
 	mpage_prune(bt);
 	btree_txn_abort(txn);
@@ -924,9 +1157,10 @@ btree_read_header(struct btree *bt)
 static int
 btree_write_meta(struct btree *bt, pgno_t root, unsigned int flags)
 {
-	struct mpage	*mp;
-	struct bt_meta	*meta;
-	ssize_t		 rc;
+	struct mpage		*mp;
+	struct bt_meta		*meta;
+	struct bt_usermeta	*um;
+	ssize_t			 rc;
 
 	DPRINTF("writing meta page for root page %u", root);
 
@@ -939,6 +1173,8 @@ btree_write_meta(struct btree *bt, pgno_t root, unsigned int flags)
 	bt->meta.prev_meta = bt->meta.root;
 	bt->meta.root = root;
 	bt->meta.flags = flags;
+	if (bt->usermeta != NULL)
+		bt->meta.flags |= BT_USERMETA;
 	bt->meta.created_at = time(0);
 	bt->meta.revisions++;
 	SHA1((unsigned char *)&bt->meta, METAHASHLEN, bt->meta.hash);
@@ -946,6 +1182,12 @@ btree_write_meta(struct btree *bt, pgno_t root, unsigned int flags)
 	/* Copy the meta data changes to the new meta page. */
 	meta = METADATA(mp->page);
 	bcopy(&bt->meta, meta, sizeof(*meta));
+	if (bt->usermeta != NULL) {
+		um = USERMETA(mp->page);
+		um->size = bt->usermeta_size;
+		SHA1(bt->usermeta, bt->usermeta_size, um->hash);
+		bcopy(bt->usermeta, um->data, bt->usermeta_size);
+	}
 
 	rc = write(bt->fd, mp->page, bt->head.psize);
 	mp->dirty = 0;
@@ -955,6 +1197,8 @@ btree_write_meta(struct btree *bt, pgno_t root, unsigned int flags)
 			DPRINTF("short write, filesystem full?");
 		return BT_FAIL;
 	}
+	bt->stat.writes++;
+	bt->stat.meta_writes++;
 
 	if ((bt->size = lseek(bt->fd, 0, SEEK_END)) == -1) {
 		DPRINTF("failed to update file size: %s", strerror(errno));
@@ -964,6 +1208,25 @@ btree_write_meta(struct btree *bt, pgno_t root, unsigned int flags)
 	return BT_SUCCESS;
 }
 
+/* Writes a tombstone meta page, so other processes re-open the file. The
+ * last live meta page is kept in memory and the btree flagged BT_STALE:
+ * read-only transactions keep using that revision until the file is
+ * re-opened here too.
+ */
+static int
+btree_write_tombstone(struct btree *bt)
+{
+	struct bt_meta		 meta;
+	int			 rc;
+
+	bcopy(&bt->meta, &meta, sizeof(meta));
+	rc = btree_write_meta(bt, P_INVALID, BT_TOMBSTONE);
+	bcopy(&meta, &bt->meta, sizeof(bt->meta));
+	if (rc == BT_SUCCESS)
+		bt->flags |= BT_STALE;
+	return rc;
+}
+
 /* Returns true if page p is a valid meta page, false otherwise.
  */
 static int
@@ -995,6 +1258,61 @@ btree_is_meta_page(struct page *p)
 	return 1;
 }
 
+/* Keeps a copy of the user meta data of the valid meta page p.
+ */
+static int
+btree_read_usermeta(struct btree *bt, struct page *p)
+{
+	struct bt_meta		*meta;
+	struct bt_usermeta	*um;
+	unsigned char		 hash[SHA_DIGEST_LENGTH];
+	void			*data = NULL;
+
+	meta = METADATA(p);
+	um = USERMETA(p);
+	if (F_ISSET(meta->flags, BT_USERMETA)) {
+		if (um->size > USERMETAMAX(bt)) {
+			DPRINTF("page %d has invalid user meta data", p->pgno);
+			errno = EIO;
+			return -1;
+		}
+		SHA1(um->data, um->size, hash);
+		if (bcmp(hash, um->hash, SHA_DIGEST_LENGTH) != 0) {
+			DPRINTF("page %d has an invalid user meta digest",
+			    p->pgno);
+			errno = EIO;
+			return -1;
+		}
+		if ((data = malloc(um->size + 1)) == NULL)
+			return -1;
+		bcopy(um->data, data, um->size);
+	}
+
+	free(bt->usermeta);
+	bt->usermeta = data;
+	bt->usermeta_size = data == NULL ? 0 : um->size;
+	return 0;
+}
+
+/* Copies the user meta data of src to a compacted file.
+ */
+static int
+btree_copy_usermeta(struct btree *dst, struct btree *src)
+{
+	void		*data = NULL;
+
+	if (src->usermeta != NULL) {
+		if ((data = malloc(src->usermeta_size + 1)) == NULL)
+			return -1;
+		bcopy(src->usermeta, data, src->usermeta_size);
+	}
+
+	free(dst->usermeta);
+	dst->usermeta = data;
+	dst->usermeta_size = src->usermeta_size;
+	return 0;
+}
+
 static int
 btree_read_meta(struct btree *bt, pgno_t *p_next)
 {
@@ -1042,7 +1360,8 @@ btree_read_meta(struct btree *bt, pgno_t *p_next)
 
 	if (size == bt->size) {
 		DPRINTF("size unchanged, keeping current meta page");
-		if (F_ISSET(bt->meta.flags, BT_TOMBSTONE)) {
+		if (F_ISSET(bt->flags, BT_STALE) ||
+		    F_ISSET(bt->meta.flags, BT_TOMBSTONE)) {
 			DPRINTF("file is dead");
 			errno = ESTALE;
 			return BT_FAIL;
@@ -1058,18 +1377,30 @@ btree_read_meta(struct btree *bt, pgno_t *p_next)
 			meta = METADATA(mp->page);
 			DPRINTF("flags = 0x%x", meta->flags);
 			if (F_ISSET(meta->flags, BT_TOMBSTONE)) {
+				/* Keep scanning for the last live revision,
+				 * read-only transactions may still use it.
+				 */
 				DPRINTF("file is dead");
-				errno = ESTALE;
-				return BT_FAIL;
+				bt->flags |= BT_STALE;
 			} else {
 				/* Make copy of last meta page. */
+				if (btree_read_usermeta(bt, mp->page) != 0)
+					goto fail;
 				bcopy(meta, &bt->meta, sizeof(bt->meta));
+				if (F_ISSET(bt->flags, BT_STALE)) {
+					errno = ESTALE;
+					return BT_FAIL;
+				}
 				return BT_SUCCESS;
 			}
 		}
 		--meta_pgno;	/* scan backwards to first valid meta page */
 	}
 
+	if (F_ISSET(bt->flags, BT_STALE)) {
+		errno = ESTALE;
+		return BT_FAIL;
+	}
 	errno = EIO;
 fail:
 	if (p_next != NULL)
@@ -1077,6 +1408,25 @@ fail:
 	return BT_FAIL;
 }
 
+/* Read the meta page for a read-only transaction. Unlike writers, readers
+ * can continue on a file that has been replaced by compaction: the old
+ * file stays intact, so the last revision before the tombstone is still a
+ * consistent snapshot. The btree is then flagged with BT_STALE, so the
+ * caller knows it should re-open the file.
+ */
+static int
+btree_read_snapshot(struct btree *bt)
+{
+	if (btree_read_meta(bt, NULL) == BT_SUCCESS)
+		return BT_SUCCESS;
+
+	if (errno != ESTALE || F_ISSET(bt->meta.flags, BT_TOMBSTONE))
+		return BT_FAIL;
+
+	DPRINTF("file is stale, reading revision %u", bt->meta.revisions);
+	return BT_SUCCESS;
+}
+
 struct btree *
 btree_open_fd(int fd, unsigned int flags)
 {
@@ -1091,7 +1441,7 @@ btree_open_fd(int fd, unsigned int flags)
 		return NULL;
 	bt->fd = fd;
 	bt->flags = flags;
-	bt->flags &= ~BT_FIXPADDING;
+	bt->flags &= ~(BT_FIXPADDING | BT_STALE);
 	bt->ref = 1;
 	bt->meta.root = P_INVALID;
 
@@ -1100,9 +1450,11 @@ btree_open_fd(int fd, unsigned int flags)
 	bt->stat.max_cache = BT_MAXCACHE_DEF;
 	RB_INIT(bt->page_cache);
 
-	if ((bt->lru_queue = calloc(1, sizeof(*bt->lru_queue))) == NULL)
+	if ((bt->clock_queue = calloc(1, sizeof(*bt->clock_queue))) == NULL)
 		goto fail;
-	TAILQ_INIT(bt->lru_queue);
+	TAILQ_INIT(bt->clock_queue);
+
+	SLIST_INIT(&bt->maps);
 
 	if (btree_read_header(bt) != 0) {
 		if (errno != ENOENT)
@@ -1129,7 +1481,7 @@ btree_open_fd(int fd, unsigned int flags)
 	return bt;
 
 fail:
-	free(bt->lru_queue);
+	free(bt->clock_queue);
 	free(bt->page_cache);
 	free(bt);
 	return NULL;
@@ -1169,14 +1521,22 @@ btree_ref(struct btree *bt)
 void
 btree_close(struct btree *bt)
 {
+	struct bt_map	*map;
+
 	if (bt == NULL)
 		return;
 
 	if (--bt->ref == 0) {
 		DPRINTF("ref is zero, closing btree %p", bt);
-		close(bt->fd);
 		mpage_flush(bt);
-		free(bt->lru_queue);
+		while ((map = SLIST_FIRST(&bt->maps)) != NULL) {
+			SLIST_REMOVE_HEAD(&bt->maps, entry);
+			munmap(map->addr, map->size);
+			free(map);
+		}
+		close(bt->fd);
+		free(bt->clock_queue);
+		free(bt->usermeta);
 		free(bt->path);
 		free(bt->page_cache);
 		free(bt);
@@ -1184,6 +1544,55 @@ btree_close(struct btree *bt)
 		DPRINTF("ref is now %d on btree %p", bt->ref, bt);
 }
 
+/* Returns the first four bytes of a key as a number, zero padded, or the
+ * last four bytes in reverse order for BT_REVERSEKEY. If the heads of two
+ * keys differ they compare as the keys do, only equal heads need the full
+ * keys to be compared.
+ */
+static uint32_t
+bt_key_head(struct btree *bt, const void *data, size_t size)
+{
+	const unsigned char	*p = data;
+	uint32_t		 head = 0;
+	size_t			 i;
+
+	for (i = 0; i < sizeof(head); i++) {
+		head <<= 8;
+		if (i < size)
+			head |= F_ISSET(bt->flags, BT_REVERSEKEY) ?
+			    p[size - 1 - i] : p[i];
+	}
+	return head;
+}
+
+/* Returns an array with the head of each node key on a page, so a search
+ * can compare fixed-width numbers in one place instead of chasing each
+ * node pointer into the page. The array is built the second time a page
+ * is used, so pages read once in a scan don't pay for it, and only for
+ * clean pages, which are never modified. Returns NULL if the array can't
+ * be used and the keys must be compared in full.
+ */
+static uint32_t *
+mpage_heads(struct btree *bt, struct mpage *mp)
+{
+	struct node	*node;
+	unsigned int	 i;
+
+	if (bt->cmp != NULL || mp->dirty)
+		return NULL;
+	if (mp->heads == NULL && mp->usage > 0) {
+		mp->heads = reallocarray(NULL, NUMKEYS(mp), sizeof(*mp->heads));
+		if (mp->heads == NULL)
+			return NULL;
+		for (i = 0; i < NUMKEYS(mp); i++) {
+			node = NODEPTR(mp, i);
+			mp->heads[i] = bt_key_head(bt, NODEKEY(node),
+			    node->ksize);
+		}
+	}
+	return mp->heads;
+}
+
 /* Search for key within a leaf page, using binary search.
  * Returns the smallest entry larger or equal to the key.
  * If exactp is non-null, stores whether the found entry was an exact match
@@ -1200,6 +1609,7 @@ btree_search_node(struct btree *bt, struct mpage *mp, struct btval *key,
 	int		 rc = 0;
 	struct node	*node;
 	struct btval	 nodekey;
+	uint32_t	*heads, head = 0;
 
 	DPRINTF("searching %lu keys in %s page %u with prefix [%.*s]",
 	    NUMKEYS(mp),
@@ -1210,6 +1620,16 @@ btree_search_node(struct btree *bt, struct mpage *mp, struct btval *key,
 
 	memset(&nodekey, 0, sizeof(nodekey));
 
+	if ((heads = mpage_heads(bt, mp)) != NULL) {
+		if (F_ISSET(bt->flags, BT_REVERSEKEY))
+			head = bt_key_head(bt, key->data,
+			    key->size - mp->prefix.len);
+		else
+			head = bt_key_head(bt,
+			    (char *)key->data + mp->prefix.len,
+			    key->size - mp->prefix.len);
+	}
+
 	low = IS_LEAF(mp) ? 0 : 1;
 	high = NUMKEYS(mp) - 1;
 	while (low <= high) {
@@ -1219,9 +1639,12 @@ btree_search_node(struct btree *bt, struct mpage *mp, struct btval *key,
 		nodekey.size = node->ksize;
 		nodekey.data = NODEKEY(node);
 
-		if (bt->cmp)
+		rc = 0;
+		if (heads != NULL)
+			rc = (head > heads[i]) - (head < heads[i]);
+		if (rc == 0 && bt->cmp)
 			rc = bt->cmp(key, &nodekey);
-		else
+		else if (rc == 0)
 			rc = bt_cmp(bt, key, &nodekey, &mp->prefix);
 
 		if (IS_LEAF(mp))
@@ -1292,13 +1715,20 @@ btree_get_mpage(struct btree *bt, pgno_t pgno)
 	if (mp == NULL) {
 		if ((mp = calloc(1, sizeof(*mp))) == NULL)
 			return NULL;
-		if ((mp->page = malloc(bt->head.psize)) == NULL) {
-			free(mp);
-			return NULL;
-		}
-		if (btree_read_page(bt, pgno, mp->page) != BT_SUCCESS) {
-			mpage_free(mp);
-			return NULL;
+		if (F_ISSET(bt->flags, BT_MMAP) &&
+		    (mp->page = btree_map_page(bt, pgno)) != NULL) {
+			DPRINTF("returning page %u from file mapping", pgno);
+			bt->stat.reads++;
+			mp->mapped = 1;
+		} else {
+			if ((mp->page = malloc(bt->head.psize)) == NULL) {
+				free(mp);
+				return NULL;
+			}
+			if (btree_read_page(bt, pgno, mp->page) != BT_SUCCESS) {
+				mpage_free(mp);
+				return NULL;
+			}
 		}
 		mp->pgno = pgno;
 		mpage_add(bt, mp);
@@ -1308,6 +1738,104 @@ btree_get_mpage(struct btree *bt, pgno_t pgno)
 	return mp;
 }
 
+/* Read the run of consecutive pages starting at pgno with one preadv and
+ * put them in the cache.
+ */
+static int
+btree_read_run(struct btree *bt, pgno_t pgno, unsigned int n)
+{
+	struct iovec	 iov[BT_READAHEAD];
+	struct mpage	*mp[BT_READAHEAD];
+	unsigned int	 i;
+	ssize_t		 rc;
+	int		 ret = BT_FAIL;
+
+	assert(n <= BT_READAHEAD);
+
+	DPRINTF("reading ahead %u pages from page %u", n, pgno);
+	memset(mp, 0, sizeof(mp));
+	for (i = 0; i < n; i++) {
+		if ((mp[i] = calloc(1, sizeof(*mp[i]))) == NULL ||
+		    (mp[i]->page = malloc(bt->head.psize)) == NULL)
+			goto done;
+		iov[i].iov_base = mp[i]->page;
+		iov[i].iov_len = bt->head.psize;
+	}
+
+	rc = preadv(bt->fd, iov, n, (off_t)pgno * bt->head.psize);
+	if (rc != (ssize_t)n * bt->head.psize) {
+		DPRINTF("readahead of page %u failed", pgno);
+		goto done;
+	}
+	for (i = 0; i < n; i++)
+		if (mp[i]->page->pgno != pgno + i) {
+			DPRINTF("page numbers don't match: %u != %u",
+			    pgno + i, mp[i]->page->pgno);
+			goto done;
+		}
+
+	for (i = 0; i < n; i++) {
+		mp[i]->pgno = pgno + i;
+		mpage_add(bt, mp[i]);
+		mp[i]->readahead = 1;
+		mp[i] = NULL;
+	}
+	bt->stat.reads += n;
+	bt->stat.readahead += n;
+	ret = BT_SUCCESS;
+
+done:
+	for (i = 0; i < n; i++)
+		mpage_free(mp[i]);
+	return ret;
+}
+
+/* Read ahead the leaf pages a sequential cursor is about to visit: the
+ * children of parent from index ki on, if the first of them isn't cached.
+ * Runs of consecutive pages, as written by compaction and bulk loads, are
+ * read into the cache at once. Their first use isn't counted as a cache
+ * hit, so a long scan ages out of the cache like it does without
+ * readahead instead of pushing out the pages used by other requests.
+ * Pages that aren't next to each other, and all pages with BT_MMAP, are
+ * only advised to the kernel. Errors are ignored, as the pages are read
+ * again when the cursor gets to them.
+ */
+static void
+btree_readahead(struct btree *bt, struct mpage *parent, unsigned int ki)
+{
+	struct mpage	 find;
+	struct bt_map	*map;
+	pgno_t		 pgno[BT_READAHEAD];
+	unsigned int	 i, n, max, run;
+	off_t		 off, len;
+
+	max = bt->stat.max_cache / 4;
+	if (max > BT_READAHEAD)
+		max = BT_READAHEAD;
+
+	for (n = 0; n < max && ki + n < NUMKEYS(parent); n++) {
+		find.pgno = NODEPGNO(NODEPTR(parent, ki + n));
+		if (((off_t)find.pgno + 1) * bt->head.psize > bt->size ||
+		    RB_FIND(page_cache, bt->page_cache, &find) != NULL)
+			break;
+		pgno[n] = find.pgno;
+	}
+
+	for (i = 0; i < n; i += run) {
+		for (run = 1; i + run < n && pgno[i + run] == pgno[i] + run;
+		    run++)
+			;
+		off = (off_t)pgno[i] * bt->head.psize;
+		len = (off_t)run * bt->head.psize;
+		if (F_ISSET(bt->flags, BT_MMAP)) {
+			map = SLIST_FIRST(&bt->maps);
+			if (map != NULL && off + len <= (off_t)map->size)
+				madvise(map->addr + off, len, MADV_WILLNEED);
+		} else if (run == 1 || btree_read_run(bt, pgno[i], run) != 0)
+			posix_fadvise(bt->fd, off, len, POSIX_FADV_WILLNEED);
+	}
+}
+
 static void
 concat_prefix(struct btree *bt, char *s1, size_t n1, char *s2, size_t n2,
     char *cs, size_t *cn)
@@ -1456,7 +1984,7 @@ btree_search_page(struct btree *bt, struct btree_txn *txn, struct btval *key,
          * committed root page.
 	 */
 	if (txn == NULL) {
-		if ((rc = btree_read_meta(bt, NULL)) != BT_SUCCESS)
+		if ((rc = btree_read_snapshot(bt)) != BT_SUCCESS)
 			return rc;
 		root = bt->meta.root;
 	} else if (F_ISSET(txn->flags, BT_TXN_ERROR)) {
@@ -1498,6 +2026,7 @@ btree_read_data(struct btree *bt, struct mpage *mp, struct node *leaf,
 	size_t		 max;
 	size_t		 sz = 0;
 	pgno_t		 pgno;
+	unsigned long long int reads;
 
 	memset(data, 0, sizeof(*data));
 	max = bt->head.psize - PAGEHDRSZ;
@@ -1531,8 +2060,11 @@ btree_read_data(struct btree *bt, struct mpage *mp, struct node *leaf,
 	data->mp = NULL;
 	bcopy(NODEDATA(leaf), &pgno, sizeof(pgno));
 	for (sz = 0; sz < data->size; ) {
-		if ((omp = btree_get_mpage(bt, pgno)) == NULL ||
-		    !F_ISSET(omp->page->flags, P_OVERFLOW)) {
+		reads = bt->stat.reads;
+		omp = btree_get_mpage(bt, pgno);
+		if (bt->stat.reads != reads)
+			bt->stat.overflow_reads++;
+		if (omp == NULL || !F_ISSET(omp->page->flags, P_OVERFLOW)) {
 			DPRINTF("read overflow page %u failed", pgno);
 			free(data->data);
 			mpage_free(omp);
@@ -1561,7 +2093,188 @@ btree_txn_get(struct btree *bt, struct btree_txn *txn,
 	assert(data);
 	DPRINTF("===> get key [%.*s]", (int)key->size, (char *)key->data);
 
-	if (bt != NULL && txn != NULL && bt != txn->bt) {
+	if (bt != NULL && txn != NULL && bt != txn->bt) {
+		errno = EINVAL;
+		return BT_FAIL;
+	}
+
+	if (bt == NULL) {
+		if (txn == NULL) {
+			errno = EINVAL;
+			return BT_FAIL;
+		}
+		bt = txn->bt;
+	}
+
+	if (key->size == 0 || key->size > MAXKEYSIZE) {
+		errno = EINVAL;
+		return BT_FAIL;
+	}
+
+	if ((rc = btree_search_page(bt, txn, key, NULL, 0, &mp)) != BT_SUCCESS)
+		return rc;
+
+	leaf = btree_search_node(bt, mp, key, &exact, NULL);
+	if (leaf && exact)
+		rc = btree_read_data(bt, mp, leaf, data);
+	else {
+		errno = ENOENT;
+		rc = BT_FAIL;
+	}
+
+	mpage_prune(bt);
+	return rc;
+}
+
+/* Returns the position of the smallest key larger or equal to key as a
+ * fraction of the keys of the tree, taking each subtree of a branch page
+ * to hold as many keys. Only the pages on the path to the key are read.
+ */
+static int
+btree_key_position(struct btree *bt, struct btree_txn *txn,
+    struct btval *key, double *pos)
+{
+	int		 rc;
+	unsigned int	 ki;
+	struct cursor	 cursor;
+	struct ppage	*ppage;
+	struct mpage	*mp;
+
+	memset(&cursor, 0, sizeof(cursor));
+	SLIST_INIT(&cursor.stack);
+	cursor.bt = bt;
+	cursor.txn = txn;
+
+	if ((rc = btree_search_page(bt, txn, key, &cursor, 0,
+	    &mp)) == BT_SUCCESS) {
+		if (btree_search_node(bt, mp, key, NULL, &ki) == NULL)
+			ki = NUMKEYS(mp);
+		CURSOR_TOP(&cursor)->ki = ki;
+
+		/* from the leaf up to the root */
+		*pos = 0;
+		SLIST_FOREACH(ppage, &cursor.stack, entry)
+			*pos = (ppage->ki + *pos) / NUMKEYS(ppage->mpage);
+	}
+
+	while (!CURSOR_EMPTY(&cursor))
+		cursor_pop_page(&cursor);
+	return rc;
+}
+
+/* Estimates the number of keys from the key from up to, but not
+ * including, the key to, from the positions of the two keys in the tree.
+ * The estimate is rough outside the leaf pages of the keys, but costs
+ * no more than two lookups.
+ */
+int
+btree_txn_estimate(struct btree *bt, struct btree_txn *txn,
+    struct btval *from, struct btval *to, unsigned long long *count)
+{
+	int		 rc;
+	double		 a, b;
+
+	assert(from);
+	assert(to);
+	assert(count);
+
+	if (bt != NULL && txn != NULL && bt != txn->bt) {
+		errno = EINVAL;
+		return BT_FAIL;
+	}
+
+	if (bt == NULL) {
+		if (txn == NULL) {
+			errno = EINVAL;
+			return BT_FAIL;
+		}
+		bt = txn->bt;
+	}
+
+	if (from->size == 0 || from->size > MAXKEYSIZE ||
+	    to->size == 0 || to->size > MAXKEYSIZE) {
+		errno = EINVAL;
+		return BT_FAIL;
+	}
+
+	*count = 0;
+	if ((rc = btree_key_position(bt, txn, from, &a)) == BT_SUCCESS)
+		rc = btree_key_position(bt, txn, to, &b);
+	mpage_prune(bt);
+	if (rc != BT_SUCCESS)
+		return errno == ENOENT ? BT_SUCCESS : BT_FAIL;	/* empty */
+
+	if (b > a)
+		*count = (b - a) * bt->meta.entries + 0.5;
+	return BT_SUCCESS;
+}
+
+/* Returns a copy of the user meta data stored with the last commit, or
+ * the data set in the write transaction txn.  The caller must release it
+ * with btval_reset.
+ */
+int
+btree_txn_get_meta(struct btree *bt, struct btree_txn *txn,
+    struct btval *data)
+{
+	void		*meta;
+	size_t		 size;
+
+	assert(data);
+
+	if (bt != NULL && txn != NULL && bt != txn->bt) {
+		errno = EINVAL;
+		return BT_FAIL;
+	}
+
+	if (bt == NULL) {
+		if (txn == NULL) {
+			errno = EINVAL;
+			return BT_FAIL;
+		}
+		bt = txn->bt;
+	}
+
+	if (txn != NULL && F_ISSET(txn->flags, BT_TXN_USERMETA)) {
+		meta = txn->usermeta;
+		size = txn->usermeta_size;
+	} else {
+		if (txn == NULL && btree_read_meta(bt, NULL) != BT_SUCCESS)
+			return BT_FAIL;
+		meta = bt->usermeta;
+		size = bt->usermeta_size;
+	}
+
+	memset(data, 0, sizeof(*data));
+	if (meta == NULL) {
+		errno = ENOENT;
+		return BT_FAIL;
+	}
+	if ((data->data = malloc(size + 1)) == NULL)
+		return BT_FAIL;
+	bcopy(meta, data->data, size);
+	data->size = size;
+	data->free_data = 1;
+
+	return BT_SUCCESS;
+}
+
+/* Replaces the user meta data, which is written on the meta page with
+ * the next commit.  A NULL data removes it.
+ */
+int
+btree_txn_put_meta(struct btree *bt, struct btree_txn *txn,
+    struct btval *data)
+{
+	void		*meta = NULL;
+	int		 close_txn = 0;
+
+	if (bt != NULL && txn != NULL && bt != txn->bt) {
+		errno = EINVAL;
+		return BT_FAIL;
+	}
+
+	if (txn != NULL && F_ISSET(txn->flags, BT_TXN_RDONLY)) {
 		errno = EINVAL;
 		return BT_FAIL;
 	}
@@ -1574,24 +2287,34 @@ btree_txn_get(struct btree *bt, struct btree_txn *txn,
 		bt = txn->bt;
 	}
 
-	if (key->size == 0 || key->size > MAXKEYSIZE) {
+	if (data != NULL && data->size > USERMETAMAX(bt)) {
 		errno = EINVAL;
 		return BT_FAIL;
 	}
 
-	if ((rc = btree_search_page(bt, txn, key, NULL, 0, &mp)) != BT_SUCCESS)
-		return rc;
+	if (txn == NULL) {
+		close_txn = 1;
+		if ((txn = btree_txn_begin(bt, 0)) == NULL)
+			return BT_FAIL;
+	}
 
-	leaf = btree_search_node(bt, mp, key, &exact, NULL);
-	if (leaf && exact)
-		rc = btree_read_data(bt, mp, leaf, data);
-	else {
-		errno = ENOENT;
-		rc = BT_FAIL;
+	if (data != NULL) {
+		if ((meta = malloc(data->size + 1)) == NULL) {
+			if (close_txn)
+				btree_txn_abort(txn);
+			return BT_FAIL;
+		}
+		bcopy(data->data, meta, data->size);
 	}
 
-	mpage_prune(bt);
-	return rc;
+	free(txn->usermeta);
+	txn->usermeta = meta;
+	txn->usermeta_size = data == NULL ? 0 : data->size;
+	txn->flags |= BT_TXN_USERMETA;
+
+	if (close_txn)
+		return btree_txn_commit(txn);
+	return BT_SUCCESS;
 }
 
 static int
@@ -1601,12 +2324,14 @@ btree_sibling(struct cursor *cursor, int move_right)
 	struct node	*indx;
 	struct ppage	*parent, *top;
 	struct mpage	*mp;
+	int		 leaf;
 
 	top = CURSOR_TOP(cursor);
 	if ((parent = SLIST_NEXT(top, entry)) == NULL) {
 		errno = ENOENT;
 		return BT_FAIL;			/* root has no siblings */
 	}
+	leaf = IS_LEAF(top->mpage);
 
 	DPRINTF("parent page is page %u, index %u",
 	    parent->mpage->pgno, parent->ki);
@@ -1629,6 +2354,9 @@ btree_sibling(struct cursor *cursor, int move_right)
 	}
 	assert(IS_BRANCH(parent->mpage));
 
+	if (cursor->sequential && move_right && leaf)
+		btree_readahead(cursor->bt, parent->mpage, parent->ki);
+
 	indx = NODEPTR(parent->mpage, parent->ki);
 	if ((mp = btree_get_mpage(cursor->bt, indx->n_pgno)) == NULL)
 		return BT_FAIL;
@@ -2094,6 +2822,15 @@ btree_txn_cursor_open(struct btree *bt, struct btree_txn *txn)
 	return cursor;
 }
 
+/* Hint that the cursor will be moved over many keys with BT_NEXT, so
+ * the following leaf pages are read ahead.
+ */
+void
+btree_cursor_sequential(struct cursor *cursor)
+{
+	cursor->sequential = 1;
+}
+
 void
 btree_cursor_close(struct cursor *cursor)
 {
@@ -2151,8 +2888,13 @@ btree_update_key(struct btree *bt, struct mpage *mp, indx_t indx,
 	return BT_SUCCESS;
 }
 
+/* Change the prefix length of all keys on src by delta. The keys are
+ * stored without pfx, which provides the bytes a shorter prefix gives
+ * back to them.
+ */
 static int
-btree_adjust_prefix(struct btree *bt, struct mpage *src, int delta)
+btree_adjust_prefix(struct btree *bt, struct mpage *src, struct btkey *pfx,
+    int delta)
 {
 	indx_t		 i;
 	struct node	*node;
@@ -2163,7 +2905,8 @@ btree_adjust_prefix(struct btree *bt, struct mpage *src, int delta)
 	    src->pgno, delta);
 	assert(delta != 0);
 
-	for (i = 0; i < NUMKEYS(src); i++) {
+	/* The first key of a branch page is implicit and stays empty. */
+	for (i = IS_BRANCH(src) ? 1 : 0; i < NUMKEYS(src); i++) {
 		node = NODEPTR(src, i);
 		tmpkey.len = node->ksize - delta;
 		if (delta > 0) {
@@ -2175,10 +2918,10 @@ btree_adjust_prefix(struct btree *bt, struct mpage *src, int delta)
 		} else {
 			if (F_ISSET(bt->flags, BT_REVERSEKEY)) {
 				bcopy(NODEKEY(node), tmpkey.str, node->ksize);
-				bcopy(src->prefix.str, tmpkey.str + node->ksize,
+				bcopy(pfx->str, tmpkey.str + node->ksize,
 				    -delta);
 			} else {
-				bcopy(src->prefix.str + src->prefix.len + delta,
+				bcopy(pfx->str + pfx->len + delta,
 				    tmpkey.str, -delta);
 				bcopy(NODEKEY(node), tmpkey.str - delta,
 				    node->ksize);
@@ -2200,10 +2943,9 @@ btree_move_node(struct btree *bt, struct mpage *src, indx_t srcindx,
     struct mpage *dst, indx_t dstindx)
 {
 	int			 rc;
-	unsigned int		 pfxlen, mp_pfxlen = 0;
 	struct node		*srcnode;
 	struct mpage		*mp = NULL;
-	struct btkey		 tmpkey, srckey;
+	struct btkey		 tmpkey, srckey, pfx, mp_pfx;
 	struct btval		 key, data;
 
 	assert(src->parent);
@@ -2228,7 +2970,7 @@ btree_move_node(struct btree *bt, struct mpage *src, indx_t srcindx,
 		mp->parent = src;
 		mp->parent_index = srcindx;
 		find_common_prefix(bt, mp);
-		mp_pfxlen = mp->prefix.len;
+		bcopy(&mp->prefix, &mp_pfx, sizeof(mp_pfx));
 	}
 
 	/* Mark src and dst as dirty. */
@@ -2237,40 +2979,45 @@ btree_move_node(struct btree *bt, struct mpage *src, indx_t srcindx,
 		return BT_FAIL;
 
 	find_common_prefix(bt, dst);
+	find_common_prefix(bt, src);
+
+	/* expand the prefix */
+	if (srcindx == 0 && IS_BRANCH(src)) {
+		/* The implicit key is the separator of src, so the pages
+		 * below keep their bounds and prefixes.
+		 */
+		assert(src->parent_index > 0);
+		expand_prefix(bt, src->parent, src->parent_index, &tmpkey);
+		DPRINTF("using separator [%.*s] of page %u",
+		    (int)tmpkey.len, tmpkey.str, src->pgno);
+	} else
+		expand_prefix(bt, src, srcindx, &tmpkey);
 
 	/* Check if src node has destination page prefix. Otherwise the
-	 * destination page must expand its prefix on all its nodes.
+	 * destination page must expand its prefix on all its nodes. The
+	 * whole key is compared, as the node is stored without the prefix
+	 * of src.
 	 */
-	srckey.len = srcnode->ksize;
-	bcopy(NODEKEY(srcnode), srckey.str, srckey.len);
-	common_prefix(bt, &srckey, &dst->prefix, &tmpkey);
-	if (tmpkey.len != dst->prefix.len) {
-		if (btree_adjust_prefix(bt, dst,
-		    tmpkey.len - dst->prefix.len) != BT_SUCCESS)
+	common_prefix(bt, &tmpkey, &dst->prefix, &srckey);
+	if (srckey.len != dst->prefix.len) {
+		if (btree_adjust_prefix(bt, dst, &dst->prefix,
+		    srckey.len - dst->prefix.len) != BT_SUCCESS)
 			return BT_FAIL;
-		bcopy(&tmpkey, &dst->prefix, sizeof(tmpkey));
+		bcopy(&srckey, &dst->prefix, sizeof(srckey));
 	}
 
-	if (srcindx == 0 && IS_BRANCH(src)) {
-		struct mpage	*low;
-
-		/* must find the lowest key below src
-		 */
-		assert(btree_search_page_root(bt, src, NULL, NULL, 0,
-		    &low) == BT_SUCCESS);
-		expand_prefix(bt, low, 0, &srckey);
-		DPRINTF("found lowest key [%.*s] on leaf page %u",
-		    (int)srckey.len, srckey.str, low->pgno);
-	} else {
-		srckey.len = srcnode->ksize;
-		bcopy(NODEKEY(srcnode), srckey.str, srcnode->ksize);
+	/* The implicit key of the first node of a branch page becomes the
+	 * separator of dst when the node is moved in front of it.
+	 */
+	if (dstindx == 0 && IS_BRANCH(dst)) {
+		assert(dst->parent_index > 0);
+		expand_prefix(bt, dst->parent, dst->parent_index, &srckey);
+		key.size = srckey.len;
+		key.data = srckey.str;
+		remove_prefix(bt, &key, dst->prefix.len);
+		if (btree_update_key(bt, dst, 0, &key) != BT_SUCCESS)
+			return BT_FAIL;
 	}
-	find_common_prefix(bt, src);
-
-	/* expand the prefix */
-	tmpkey.len = sizeof(tmpkey.str);
-	concat_prefix(bt, src->prefix.str, src->prefix.len,
-	    srckey.str, srckey.len, tmpkey.str, &tmpkey.len);
 
 	/* Add the node to the destination page. Adjust prefix for
 	 * destination page.
@@ -2331,20 +3078,21 @@ btree_move_node(struct btree *bt, struct mpage *src, indx_t srcindx,
 
 	/* We can get a new page prefix here!
 	 * Must update keys in all nodes of this page!
+	 * The keys are still stored without the old prefix.
 	 */
-	pfxlen = src->prefix.len;
+	bcopy(&src->prefix, &pfx, sizeof(pfx));
 	find_common_prefix(bt, src);
-	if (src->prefix.len != pfxlen) {
-		if (btree_adjust_prefix(bt, src,
-		    src->prefix.len - pfxlen) != BT_SUCCESS)
+	if (src->prefix.len != pfx.len) {
+		if (btree_adjust_prefix(bt, src, &pfx,
+		    src->prefix.len - pfx.len) != BT_SUCCESS)
 			return BT_FAIL;
 	}
 
-	pfxlen = dst->prefix.len;
+	bcopy(&dst->prefix, &pfx, sizeof(pfx));
 	find_common_prefix(bt, dst);
-	if (dst->prefix.len != pfxlen) {
-		if (btree_adjust_prefix(bt, dst,
-		    dst->prefix.len - pfxlen) != BT_SUCCESS)
+	if (dst->prefix.len != pfx.len) {
+		if (btree_adjust_prefix(bt, dst, &pfx,
+		    dst->prefix.len - pfx.len) != BT_SUCCESS)
 			return BT_FAIL;
 	}
 
@@ -2353,12 +3101,12 @@ btree_move_node(struct btree *bt, struct mpage *src, indx_t srcindx,
 		mp->parent = dst;
 		mp->parent_index = dstindx;
 		find_common_prefix(bt, mp);
-		if (mp->prefix.len != mp_pfxlen) {
+		if (mp->prefix.len != mp_pfx.len) {
 			DPRINTF("moved branch node has changed prefix");
 			if ((mp = mpage_touch(bt, mp)) == NULL)
 				return BT_FAIL;
-			if (btree_adjust_prefix(bt, mp,
-			    mp->prefix.len - mp_pfxlen) != BT_SUCCESS)
+			if (btree_adjust_prefix(bt, mp, &mp_pfx,
+			    mp->prefix.len - mp_pfx.len) != BT_SUCCESS)
 				return BT_FAIL;
 		}
 	}
@@ -2366,6 +3114,29 @@ btree_move_node(struct btree *bt, struct mpage *src, indx_t srcindx,
 	return BT_SUCCESS;
 }
 
+/* Returns 1 if the nodes of src fit in dst once the prefix of dst is
+ * shortened to the one common with src. The implicit key of a branch
+ * page is counted at the largest key size.
+ */
+static int
+btree_merge_fits(struct btree *bt, struct mpage *src, struct mpage *dst)
+{
+	struct btkey		 pfx;
+	size_t			 used;
+
+	find_common_prefix(bt, src);
+	find_common_prefix(bt, dst);
+	common_prefix(bt, &src->prefix, &dst->prefix, &pfx);
+
+	used = 2 * (bt->head.psize - PAGEHDRSZ) - SIZELEFT(src) -
+	    SIZELEFT(dst);
+	used += NUMKEYS(src) * (src->prefix.len - pfx.len);
+	used += NUMKEYS(dst) * (dst->prefix.len - pfx.len);
+	if (IS_BRANCH(src))
+		used += MAXKEYSIZE;
+	return used <= bt->head.psize - PAGEHDRSZ;
+}
+
 static int
 btree_merge(struct btree *bt, struct mpage *src, struct mpage *dst)
 {
@@ -2395,7 +3166,7 @@ btree_merge(struct btree *bt, struct mpage *src, struct mpage *dst)
 	 */
 	common_prefix(bt, &src->prefix, &dst->prefix, &dstpfx);
 	if (dstpfx.len != dst->prefix.len) {
-		if (btree_adjust_prefix(bt, dst,
+		if (btree_adjust_prefix(bt, dst, &dst->prefix,
 		    dstpfx.len - dst->prefix.len) != BT_SUCCESS)
 			return BT_FAIL;
 		bcopy(&dstpfx, &dst->prefix, sizeof(dstpfx));
@@ -2406,18 +3177,15 @@ btree_merge(struct btree *bt, struct mpage *src, struct mpage *dst)
 	for (i = 0; i < NUMKEYS(src); i++) {
 		srcnode = NODEPTR(src, i);
 
-		/* If branch node 0 (implicit key), find the real key.
+		/* If branch node 0 (implicit key), use the separator of
+		 * src, so the pages below keep their bounds and prefixes.
 		 */
 		if (i == 0 && IS_BRANCH(src)) {
-			struct mpage	*low;
-
-			/* must find the lowest key below src
-			 */
-			assert(btree_search_page_root(bt, src, NULL, NULL, 0,
-			    &low) == BT_SUCCESS);
-			expand_prefix(bt, low, 0, &tmpkey);
-			DPRINTF("found lowest key [%.*s] on leaf page %u",
-			    (int)tmpkey.len, tmpkey.str, low->pgno);
+			assert(src->parent_index > 0);
+			expand_prefix(bt, src->parent, src->parent_index,
+			    &tmpkey);
+			DPRINTF("using separator [%.*s] of page %u",
+			    (int)tmpkey.len, tmpkey.str, src->pgno);
 		} else {
 			expand_prefix(bt, src, i, &tmpkey);
 		}
@@ -2545,18 +3313,31 @@ btree_rebalance(struct btree *bt, struct mpage *mp)
 	/* If the neighbor page is above threshold and has at least two
 	 * keys, move one key from it.
 	 *
-	 * Otherwise we should try to merge them, but that might not be
-	 * possible, even if both are below threshold, as prefix expansion
-	 * might make keys larger. FIXME: detect this
+	 * Otherwise merge them, unless prefix expansion makes the keys too
+	 * large for one page, even if both are below threshold. A key is
+	 * then moved if the neighbor keeps enough of them, or the page is
+	 * left below threshold.
 	 */
 	if (PAGEFILL(bt, neighbor) >= FILL_THRESHOLD && NUMKEYS(neighbor) >= 2)
 		return btree_move_node(bt, neighbor, si, mp, di);
-	else { /* FIXME: if (has_enough_room()) */
-		if (mp->parent_index == 0)
+
+	if (mp->parent_index == 0) {
+		if (btree_merge_fits(bt, neighbor, mp))
 			return btree_merge(bt, neighbor, mp);
-		else
-			return btree_merge(bt, mp, neighbor);
+	} else if (btree_merge_fits(bt, mp, neighbor))
+		return btree_merge(bt, mp, neighbor);
+
+	if (NUMKEYS(neighbor) > (IS_BRANCH(neighbor) ? 2 : 1))
+		return btree_move_node(bt, neighbor, si, mp, di);
+	if (NUMKEYS(mp) > (IS_BRANCH(mp) ? 1 : 0)) {
+		DPRINTF("page %u left below threshold", mp->pgno);
+		return BT_SUCCESS;
 	}
+
+	if (mp->parent_index == 0)
+		return btree_merge(bt, neighbor, mp);
+	else
+		return btree_merge(bt, mp, neighbor);
 }
 
 int
@@ -2751,7 +3532,14 @@ btree_split(struct btree *bt, struct mpage **mpp, unsigned int *newindxp,
 	mp->page->lower = PAGEHDRSZ;
 	mp->page->upper = bt->head.psize;
 
-	split_indx = NUMKEYSP(copy) / 2 + 1;
+	/* When appending sorted keys, the left page is full and won't see
+	 * any more inserts, so leave all keys there.
+	 */
+	if (IS_LEAF(mp) && F_ISSET(bt->txn->flags, BT_TXN_APPEND) &&
+	    newindx == NUMKEYSP(copy))
+		split_indx = newindx;
+	else
+		split_indx = NUMKEYSP(copy) / 2 + 1;
 
 	/* First find the separating key between the split pages.
 	 */
@@ -2878,6 +3666,17 @@ btree_split(struct btree *bt, struct mpage **mpp, unsigned int *newindxp,
 	return rc;
 }
 
+/* Returns true if mp is the rightmost page on its level.
+ */
+static int
+btree_is_last_page(struct mpage *mp)
+{
+	for (; mp->parent != NULL; mp = mp->parent)
+		if (mp->parent_index + 1 < (indx_t)NUMKEYS(mp->parent))
+			return 0;
+	return 1;
+}
+
 int
 btree_txn_put(struct btree *bt, struct btree_txn *txn,
     struct btval *key, struct btval *data, unsigned int flags)
@@ -2926,16 +3725,26 @@ btree_txn_put(struct btree *bt, struct btree_txn *txn,
 	rc = btree_search_page(bt, txn, key, NULL, 1, &mp);
 	if (rc == BT_SUCCESS) {
 		leaf = btree_search_node(bt, mp, key, &exact, &ki);
-		if (leaf && exact) {
-			if (F_ISSET(flags, BT_NOOVERWRITE)) {
-				DPRINTF("duplicate key %.*s",
-				    (int)key->size, (char *)key->data);
-				errno = EEXIST;
-				rc = BT_FAIL;
-				goto done;
-			}
-			btree_del_node(bt, mp, ki);
+		if (leaf && exact && F_ISSET(flags, BT_NOOVERWRITE)) {
+			DPRINTF("duplicate key %.*s",
+			    (int)key->size, (char *)key->data);
+			errno = EEXIST;
+			rc = BT_FAIL;
+			goto done;
+		}
+		/* Checked before an existing key is replaced, so a failed
+		 * append leaves the page as it was.
+		 */
+		if (F_ISSET(flags, BT_APPEND) &&
+		    (leaf != NULL || !btree_is_last_page(mp))) {
+			DPRINTF("key %.*s is out of order",
+			    (int)key->size, (char *)key->data);
+			errno = EINVAL;
+			rc = BT_FAIL;
+			goto done;
 		}
+		if (leaf && exact)
+			btree_del_node(bt, mp, ki);
 		if (leaf == NULL) {		/* append if not found */
 			ki = NUMKEYS(mp);
 			DPRINTF("appending key at index %d", ki);
@@ -2965,7 +3774,10 @@ btree_txn_put(struct btree *bt, struct btree_txn *txn,
 	xkey.size = key->size;
 
 	if (SIZELEFT(mp) < bt_leaf_size(bt, key, data)) {
+		if (F_ISSET(flags, BT_APPEND))
+			txn->flags |= BT_TXN_APPEND;
 		rc = btree_split(bt, &mp, &ki, &xkey, data, P_INVALID);
+		txn->flags &= ~BT_TXN_APPEND;
 	} else {
 		/* There is room already in this leaf page. */
 		remove_prefix(bt, &xkey, mp->prefix.len);
@@ -2974,8 +3786,10 @@ btree_txn_put(struct btree *bt, struct btree_txn *txn,
 
 	if (rc != BT_SUCCESS)
 		txn->flags |= BT_TXN_ERROR;
-	else
+	else {
 		bt->meta.entries++;
+		bt->stat.put_bytes += key->size + data->size;
+	}
 
 done:
 	if (close_txn) {
@@ -3088,6 +3902,8 @@ btree_compact(struct btree *bt)
 		goto failed;
 	bcopy(&bt->meta, &btc->meta, sizeof(bt->meta));
 	btc->meta.revisions = 0;
+	if (btree_copy_usermeta(btc, bt) != 0)
+		goto failed;
 
 	if ((txnc = btree_txn_begin(btc, 0)) == NULL)
 		goto failed;
@@ -3109,7 +3925,7 @@ btree_compact(struct btree *bt)
 	/* Write a "tombstone" meta page so other processes can pick up
 	 * the change and re-open the file.
 	 */
-	if (btree_write_meta(bt, P_INVALID, BT_TOMBSTONE) != BT_SUCCESS)
+	if (btree_write_tombstone(bt) != BT_SUCCESS)
 		goto failed;
 
 	btree_txn_abort(txn);
@@ -3129,6 +3945,383 @@ failed:
 	return BT_FAIL;
 }
 
+/* Incremental compaction.
+ *
+ * Pages are copied to the new file in post-order, a bounded number at a
+ * time, from the last committed revision. Since pages are never modified,
+ * a page that is still in the tree after later commits has the same page
+ * number, and so does its whole subtree. A later pass over a newer
+ * revision only copies the pages that aren't in the map of already copied
+ * pages. The last pass is done under the write lock, followed by a meta
+ * page in the new file.
+ */
+struct bt_pgmap {
+	pgno_t			 old;
+	pgno_t			 new;
+};
+
+struct bt_cframe {
+	struct page		*p;		/* copy of the source page */
+	pgno_t			 pgno;		/* source page number */
+	indx_t			 i;		/* next child to copy */
+};
+
+struct btree_compact {
+	struct btree		*bt;		/* source */
+	struct btree		*btc;		/* destination */
+	struct btree_txn	*txn;		/* write lock on source */
+	struct btree_txn	*txnc;
+	pgno_t			 root;		/* root of the current pass */
+	pgno_t			 new_root;	/* copy of root when done */
+	off_t			 size;		/* source size at pass start */
+	int			 done;		/* pass is complete */
+	struct bt_pgmap		*map;		/* copied pages */
+	size_t			 nmap;
+	size_t			 nsorted;	/* map[0..nsorted) is sorted */
+	size_t			 maxmap;
+	struct bt_cframe	*stack;		/* pages being copied */
+	unsigned int		 depth;
+	unsigned int		 maxdepth;
+	struct btree_compact_stat stat;
+};
+
+static int
+btree_pgmap_cmp(const void *a, const void *b)
+{
+	const struct bt_pgmap	*ma = a, *mb = b;
+
+	if (ma->old < mb->old)
+		return -1;
+	return ma->old > mb->old;
+}
+
+static pgno_t
+btree_compact_lookup(struct btree_compact *bc, pgno_t pgno)
+{
+	struct bt_pgmap		 key, *m;
+
+	key.old = pgno;
+	m = bsearch(&key, bc->map, bc->nsorted, sizeof(*bc->map),
+	    btree_pgmap_cmp);
+	return m == NULL ? P_INVALID : m->new;
+}
+
+/* Merges the pages copied in the last pass into the sorted map.
+ */
+static int
+btree_compact_sort_map(struct btree_compact *bc)
+{
+	struct bt_pgmap		*m, *a, *b, *ae, *be;
+
+	qsort(bc->map + bc->nsorted, bc->nmap - bc->nsorted,
+	    sizeof(*bc->map), btree_pgmap_cmp);
+
+	if (bc->nsorted > 0 && bc->nmap > bc->nsorted) {
+		if ((m = reallocarray(NULL, bc->nmap, sizeof(*m))) == NULL)
+			return BT_FAIL;
+		a = bc->map;
+		ae = b = bc->map + bc->nsorted;
+		be = bc->map + bc->nmap;
+		bc->nmap = 0;
+		while (a < ae || b < be) {
+			if (b == be || (a < ae && a->old < b->old))
+				m[bc->nmap++] = *a++;
+			else
+				m[bc->nmap++] = *b++;
+		}
+		free(bc->map);
+		bc->map = m;
+		bc->maxmap = bc->nmap;
+	}
+
+	bc->nsorted = bc->nmap;
+	return BT_SUCCESS;
+}
+
+static int
+btree_compact_push(struct btree_compact *bc, pgno_t pgno)
+{
+	struct bt_cframe	*stack;
+	struct mpage		*mp;
+	struct page		*p;
+	unsigned int		 n;
+
+	if (bc->depth == bc->maxdepth) {
+		n = bc->maxdepth == 0 ? 16 : bc->maxdepth * 2;
+		if ((stack = reallocarray(bc->stack, n, sizeof(*stack))) ==
+		    NULL)
+			return BT_FAIL;
+		bc->stack = stack;
+		bc->maxdepth = n;
+	}
+
+	if ((mp = btree_get_mpage(bc->bt, pgno)) == NULL)
+		return BT_FAIL;
+	if ((p = malloc(bc->bt->head.psize)) == NULL)
+		return BT_FAIL;
+	bcopy(mp->page, p, bc->bt->head.psize);
+	mpage_prune(bc->bt);
+
+	bc->stack[bc->depth].p = p;
+	bc->stack[bc->depth].pgno = pgno;
+	bc->stack[bc->depth].i = 0;
+	bc->depth++;
+	return BT_SUCCESS;
+}
+
+/* Finds the next page referenced from p, starting at index *ip.
+ */
+static int
+btree_compact_child(struct page *p, indx_t *ip, pgno_t *pgno)
+{
+	struct node	*node;
+
+	if (F_ISSET(p->flags, P_BRANCH)) {
+		if (*ip < NUMKEYSP(p)) {
+			*pgno = NODEPTRP(p, *ip)->n_pgno;
+			return 1;
+		}
+	} else if (F_ISSET(p->flags, P_LEAF)) {
+		for (; *ip < NUMKEYSP(p); (*ip)++) {
+			node = NODEPTRP(p, *ip);
+			if (F_ISSET(node->flags, F_BIGDATA)) {
+				bcopy(NODEDATA(node), pgno, sizeof(*pgno));
+				return 1;
+			}
+		}
+	} else if (F_ISSET(p->flags, P_OVERFLOW)) {
+		if (*ip == 0 && p->p_next_pgno > 0) {
+			*pgno = p->p_next_pgno;
+			return 1;
+		}
+	}
+	return 0;
+}
+
+static void
+btree_compact_set_child(struct page *p, indx_t i, pgno_t pgno)
+{
+	if (F_ISSET(p->flags, P_BRANCH))
+		NODEPTRP(p, i)->n_pgno = pgno;
+	else if (F_ISSET(p->flags, P_LEAF))
+		bcopy(&pgno, NODEDATA(NODEPTRP(p, i)), sizeof(pgno));
+	else
+		p->p_next_pgno = pgno;
+}
+
+static int
+btree_compact_pass(struct btree_compact *bc)
+{
+	struct btree	*bt = bc->bt;
+	pgno_t		 pgno;
+
+	if (btree_read_snapshot(bt) != BT_SUCCESS)
+		return BT_FAIL;
+	if (F_ISSET(bt->flags, BT_STALE) || bt->size < bc->size) {
+		/* Compacted or reverted by someone else. */
+		errno = ESTALE;
+		return BT_FAIL;
+	}
+
+	bc->done = (bt->meta.root == bc->root);
+	if (bc->done)
+		return BT_SUCCESS;
+
+	DPRINTF("starting compaction pass at root %u", bt->meta.root);
+	bc->root = bt->meta.root;
+	bc->size = bt->size;
+	bc->stat.passes++;
+	bc->stat.file_pages = bt->size / bt->head.psize;
+
+	if (bc->root == P_INVALID) {
+		bc->new_root = P_INVALID;
+		bc->done = 1;
+	} else if ((pgno = btree_compact_lookup(bc, bc->root)) != P_INVALID) {
+		bc->new_root = pgno;
+		bc->done = 1;
+	} else
+		return btree_compact_push(bc, bc->root);
+
+	return BT_SUCCESS;
+}
+
+/* Starts compacting bt into the empty file fd. The file descriptor is
+ * owned by the compaction, and closed on failure.
+ */
+struct btree_compact *
+btree_compact_begin(struct btree *bt, int fd)
+{
+	struct btree_compact	*bc;
+
+	assert(bt != NULL);
+
+	DPRINTF("compacting btree %p to fd %d", bt, fd);
+
+	if ((bc = calloc(1, sizeof(*bc))) == NULL) {
+		close(fd);
+		return NULL;
+	}
+	bc->bt = bt;
+	bc->root = P_INVALID;
+	bc->new_root = P_INVALID;
+
+	if ((bc->btc = btree_open_fd(fd, bt->flags & BT_REVERSEKEY)) == NULL) {
+		close(fd);
+		free(bc);
+		return NULL;
+	}
+	if ((bc->txnc = btree_txn_begin(bc->btc, 0)) == NULL) {
+		btree_close(bc->btc);
+		free(bc);
+		return NULL;
+	}
+
+	btree_ref(bt);
+	return bc;
+}
+
+/* Copies at most npages pages. Returns 1 when the copy is at the last
+ * committed revision, 0 if there is more to do.
+ */
+int
+btree_compact_step(struct btree_compact *bc, unsigned int npages)
+{
+	struct bt_cframe	*f;
+	pgno_t			 pgno, child;
+	ssize_t			 rc;
+	struct bt_pgmap		*map;
+	size_t			 n;
+
+	assert(bc != NULL);
+
+	if (bc->depth == 0 && btree_compact_pass(bc) != BT_SUCCESS)
+		return BT_FAIL;
+
+	while (!bc->done) {
+		f = &bc->stack[bc->depth - 1];
+		if (btree_compact_child(f->p, &f->i, &child)) {
+			if ((pgno = btree_compact_lookup(bc, child)) == P_INVALID) {
+				if (npages == 0)
+					return 0;
+				if (btree_compact_push(bc, child) != BT_SUCCESS)
+					return BT_FAIL;
+			} else {
+				btree_compact_set_child(f->p, f->i, pgno);
+				f->i++;
+			}
+			continue;
+		}
+
+		/* All pages below are copied, write this one. */
+		if (bc->nmap == bc->maxmap) {
+			n = bc->maxmap == 0 ? 1024 : bc->maxmap * 2;
+			if ((map = reallocarray(bc->map, n, sizeof(*map))) ==
+			    NULL)
+				return BT_FAIL;
+			bc->map = map;
+			bc->maxmap = n;
+		}
+		pgno = f->p->pgno = bc->txnc->next_pgno++;
+		rc = write(bc->btc->fd, f->p, bc->bt->head.psize);
+		free(f->p);
+		bc->depth--;
+		if (rc != (ssize_t)bc->bt->head.psize)
+			return BT_FAIL;
+		bc->map[bc->nmap].old = f->pgno;
+		bc->map[bc->nmap].new = pgno;
+		bc->nmap++;
+		bc->stat.copied++;
+		if (npages > 0)
+			npages--;
+
+		if (bc->depth > 0) {
+			f = &bc->stack[bc->depth - 1];
+			btree_compact_set_child(f->p, f->i, pgno);
+			f->i++;
+			continue;
+		}
+
+		/* Pass is complete, catch up on later commits. */
+		bc->new_root = pgno;
+		if (btree_compact_sort_map(bc) != BT_SUCCESS ||
+		    btree_compact_pass(bc) != BT_SUCCESS)
+			return BT_FAIL;
+	}
+
+	return 1;
+}
+
+/* Takes the write lock, copies the pages of the last commits and writes
+ * the meta page of the new file. The write lock is held until
+ * btree_compact_end() is called.
+ */
+int
+btree_compact_commit(struct btree_compact *bc)
+{
+	struct btree	*bt = bc->bt;
+
+	assert(bc->txn == NULL);
+
+	if ((bc->txn = btree_txn_begin(bt, 0)) == NULL)
+		return BT_FAIL;
+
+	if (btree_compact_step(bc, UINT_MAX) != 1)
+		goto fail;
+
+	bcopy(&bt->meta, &bc->btc->meta, sizeof(bt->meta));
+	bc->btc->meta.revisions = 0;
+	if (btree_copy_usermeta(bc->btc, bt) != 0)
+		goto fail;
+	if (bc->new_root != P_INVALID &&
+	    btree_write_meta(bc->btc, bc->new_root, 0) != BT_SUCCESS)
+		goto fail;
+	if (fsync(bc->btc->fd) != 0)
+		goto fail;
+
+	return BT_SUCCESS;
+
+fail:
+	btree_txn_abort(bc->txn);
+	bc->txn = NULL;
+	return BT_FAIL;
+}
+
+/* Ends a compaction. If commit is true, the new file must have replaced
+ * the old one after btree_compact_commit(). A tombstone is then written to
+ * the old file so it is reopened by its users.
+ */
+int
+btree_compact_end(struct btree_compact *bc, int commit)
+{
+	int		 rc = BT_SUCCESS;
+
+	if (bc == NULL)
+		return BT_SUCCESS;
+
+	if (commit) {
+		assert(bc->txn != NULL);
+		rc = btree_write_tombstone(bc->bt);
+	}
+
+	btree_txn_abort(bc->txn);
+	btree_txn_abort(bc->txnc);
+	btree_close(bc->btc);
+	while (bc->depth > 0)
+		free(bc->stack[--bc->depth].p);
+	free(bc->stack);
+	free(bc->map);
+	mpage_prune(bc->bt);
+	btree_close(bc->bt);
+	free(bc);
+	return rc;
+}
+
+const struct btree_compact_stat *
+btree_compact_stat(struct btree_compact *bc)
+{
+	return &bc->stat;
+}
+
 /* Reverts the last change. Truncates the file at the last root page.
  */
 int
@@ -3159,6 +4352,24 @@ btree_get_path(struct btree *bt)
 	return bt->path;
 }
 
+/* Returns the revision of the last commit, re-reading the meta page if
+ * another process has committed since.
+ */
+int
+btree_revision(struct btree *bt, unsigned int *revision)
+{
+	if (bt == NULL) {
+		errno = EINVAL;
+		return BT_FAIL;
+	}
+
+	if (btree_read_meta(bt, NULL) != BT_SUCCESS)
+		return BT_FAIL;
+
+	*revision = bt->meta.revisions;
+	return BT_SUCCESS;
+}
+
 const struct btree_stat *
 btree_stat(struct btree *bt)
 {
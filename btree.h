@@ -24,6 +24,7 @@
 struct mpage;
 struct cursor;
 struct btree_txn;
+struct btree_compact;
 
 struct btval {
 	void		*data;
@@ -39,6 +40,7 @@ typedef void		 (*bt_prefix_func)(const struct btval *a,
 					   struct btval *sep);
 
 #define BT_NOOVERWRITE	 1
+#define BT_APPEND	 2
 
 enum cursor_op {				/* cursor operations */
 	BT_CURSOR,				/* position at given key */
@@ -57,10 +59,26 @@ enum cursor_op {				/* cursor operations */
 #define BT_NOSYNC		 0x02		/* don't fsync after commit */
 #define BT_RDONLY		 0x04		/* read only */
 #define BT_REVERSEKEY		 0x08		/* use reverse string keys */
+#define BT_MMAP			 0x10		/* read pages from a file mapping */
+#define BT_STALE		 0x20		/* file replaced by compaction */
+
+#define BT_DIRTY_BUCKETS	 16		/* powers of 2 of dirty pages */
 
 struct btree_stat {
 	unsigned long long int	 hits;		/* cache hits */
-	unsigned long long int	 reads;		/* page reads */
+	unsigned long long int	 reads;		/* page reads (cache misses) */
+	unsigned long long int	 evictions;	/* pages evicted from cache */
+	unsigned long long int	 readahead;	/* pages read ahead */
+	unsigned long long int	 overflow_reads; /* overflow pages read */
+	unsigned long long int	 commits;	/* write transactions committed */
+	unsigned long long int	 writes;	/* pages written, incl. meta */
+	unsigned long long int	 meta_writes;	/* meta pages written */
+	unsigned long long int	 touched;	/* pages copied on write */
+	unsigned long long int	 put_bytes;	/* key and data bytes put */
+	unsigned long long int	 fsyncs;
+	unsigned long long int	 fsync_usec;	/* time spent in fsync */
+	unsigned long long int	 fsync_max_usec;
+	unsigned long long int	 dirty[BT_DIRTY_BUCKETS]; /* log2 pages */
 	unsigned int		 max_cache;	/* max cached pages */
 	unsigned int		 cache_size;	/* current cache size */
 	unsigned int		 branch_pages;
@@ -73,11 +91,19 @@ struct btree_stat {
 	time_t			 created_at;
 };
 
+struct btree_compact_stat {
+	unsigned long long int	 copied;	/* pages written */
+	unsigned long long int	 file_pages;	/* source pages at last pass */
+	unsigned int		 passes;	/* revisions copied */
+};
+
 struct btree		*btree_open_fd(int fd, unsigned int flags);
 struct btree		*btree_open(const char *path, unsigned int flags,
 			    mode_t mode);
 void			 btree_close(struct btree *bt);
 const struct btree_stat	*btree_stat(struct btree *bt);
+int			 btree_revision(struct btree *bt,
+			    unsigned int *revision);
 
 struct btree_txn	*btree_txn_begin(struct btree *bt, int rdonly);
 int			 btree_txn_commit(struct btree_txn *txn);
@@ -90,6 +116,13 @@ int			 btree_txn_put(struct btree *bt, struct btree_txn *txn,
 			    unsigned int flags);
 int			 btree_txn_del(struct btree *bt, struct btree_txn *txn,
 			    struct btval *key, struct btval *data);
+int			 btree_txn_estimate(struct btree *bt,
+			    struct btree_txn *txn, struct btval *from,
+			    struct btval *to, unsigned long long *count);
+int			 btree_txn_get_meta(struct btree *bt,
+			    struct btree_txn *txn, struct btval *data);
+int			 btree_txn_put_meta(struct btree *bt,
+			    struct btree_txn *txn, struct btval *data);
 
 #define btree_get(bt, key, data)	 \
 			 btree_txn_get(bt, NULL, key, data)
@@ -107,6 +140,7 @@ const char		*btree_get_path(struct btree *bt);
 			 btree_txn_cursor_open(bt, NULL)
 struct cursor		*btree_txn_cursor_open(struct btree *bt,
 			    struct btree_txn *txn);
+void			 btree_cursor_sequential(struct cursor *cursor);
 void			 btree_cursor_close(struct cursor *cursor);
 int			 btree_cursor_get(struct cursor *cursor,
 			    struct btval *key, struct btval *data,
@@ -116,6 +150,14 @@ int			 btree_sync(struct btree *bt);
 int			 btree_compact(struct btree *bt);
 int			 btree_revert(struct btree *bt);
 
+struct btree_compact	*btree_compact_begin(struct btree *bt, int fd);
+int			 btree_compact_step(struct btree_compact *bc,
+			    unsigned int npages);
+int			 btree_compact_commit(struct btree_compact *bc);
+int			 btree_compact_end(struct btree_compact *bc, int commit);
+const struct btree_compact_stat
+			*btree_compact_stat(struct btree_compact *bc);
+
 int			 btree_cmp(struct btree *bt, const struct btval *a,
 			     const struct btval *b);
 void			 btval_reset(struct btval *btv);
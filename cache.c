@@ -0,0 +1,182 @@
+/*	$OpenBSD$ */
+
+/*
+ * Copyright (c) 2026 agent <agent@local>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/* Entries looked up by DN, kept uncompressed in their stored encoding,
+ * along with DNs found not to exist.
+ */
+
+#include <sys/types.h>
+#include <sys/queue.h>
+#include <sys/tree.h>
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "ldapd.h"
+#include "log.h"
+
+/* Entries larger than this part of the cache are not cached. */
+#define ENTRY_CACHE_MAX_PART	 4
+
+static int	 cached_entry_cmp(struct cached_entry *a, struct cached_entry *b);
+
+RB_GENERATE(cached_entry_tree, cached_entry, link, cached_entry_cmp);
+
+static int
+cached_entry_cmp(struct cached_entry *a, struct cached_entry *b)
+{
+	return strcmp(a->dn, b->dn);
+}
+
+/* Finds dn in the tree by hand, as RB_FIND would need a non-const key.
+ */
+static struct cached_entry *
+entry_cache_find(struct entry_cache *cache, const char *dn)
+{
+	struct cached_entry	*ce;
+	int			 cmp;
+
+	ce = RB_ROOT(&cache->tree);
+	while (ce != NULL && (cmp = strcmp(dn, ce->dn)) != 0)
+		ce = cmp < 0 ? RB_LEFT(ce, link) : RB_RIGHT(ce, link);
+	return ce;
+}
+
+static size_t
+cached_entry_bytes(struct cached_entry *ce)
+{
+	return sizeof(*ce) + strlen(ce->dn) + 1 + ce->size;
+}
+
+void
+entry_cache_init(struct entry_cache *cache, size_t max_bytes)
+{
+	memset(cache, 0, sizeof(*cache));
+	RB_INIT(&cache->tree);
+	TAILQ_INIT(&cache->lru);
+	cache->max_bytes = max_bytes;
+}
+
+static void
+entry_cache_evict(struct entry_cache *cache, struct cached_entry *ce)
+{
+	RB_REMOVE(cached_entry_tree, &cache->tree, ce);
+	TAILQ_REMOVE(&cache->lru, ce, lru);
+	cache->bytes -= cached_entry_bytes(ce);
+	cache->stat.entries--;
+	free(ce->dn);
+	free(ce->data);
+	free(ce);
+}
+
+/* Looks up the dn. Returns 1 and the stored entry in val if it is cached,
+ * 0 if the dn is known not to exist and -1 if it isn't cached.  The entry
+ * stays owned by the cache, and is only valid until it is changed.
+ */
+int
+entry_cache_get(struct entry_cache *cache, const char *dn, struct btval *val)
+{
+	struct cached_entry	*ce;
+
+	if ((ce = entry_cache_find(cache, dn)) == NULL) {
+		cache->stat.misses++;
+		return -1;
+	}
+
+	cache->stat.hits++;
+	TAILQ_REMOVE(&cache->lru, ce, lru);
+	TAILQ_INSERT_HEAD(&cache->lru, ce, lru);
+
+	if (ce->data == NULL)
+		return 0;
+
+	memset(val, 0, sizeof(*val));
+	val->data = ce->data;
+	val->size = ce->size;
+	return 1;
+}
+
+/* Caches the stored entry of dn, or that dn doesn't exist if val is NULL.
+ */
+void
+entry_cache_put(struct entry_cache *cache, const char *dn, struct btval *val)
+{
+	struct cached_entry	*ce, *old;
+
+	if (cache->max_bytes == 0)
+		return;
+	if (val != NULL &&
+	    val->size > cache->max_bytes / ENTRY_CACHE_MAX_PART)
+		return;
+
+	if ((ce = calloc(1, sizeof(*ce))) == NULL)
+		return;
+	if ((ce->dn = strdup(dn)) == NULL)
+		goto fail;
+	if (val != NULL) {
+		if ((ce->data = malloc(val->size)) == NULL)
+			goto fail;
+		memcpy(ce->data, val->data, val->size);
+		ce->size = val->size;
+	}
+
+	if ((old = RB_INSERT(cached_entry_tree, &cache->tree, ce)) != NULL) {
+		entry_cache_evict(cache, old);
+		RB_INSERT(cached_entry_tree, &cache->tree, ce);
+	}
+	TAILQ_INSERT_HEAD(&cache->lru, ce, lru);
+	cache->bytes += cached_entry_bytes(ce);
+	cache->stat.entries++;
+
+	while (cache->bytes > cache->max_bytes &&
+	    (old = TAILQ_LAST(&cache->lru, cached_entry_lru)) != NULL) {
+		entry_cache_evict(cache, old);
+		cache->stat.evictions++;
+	}
+	return;
+
+fail:
+	free(ce->dn);
+	free(ce);
+}
+
+/* Forgets the dn, which is being changed.
+ */
+void
+entry_cache_remove(struct entry_cache *cache, const char *dn)
+{
+	struct cached_entry	*ce;
+
+	if ((ce = entry_cache_find(cache, dn)) != NULL)
+		entry_cache_evict(cache, ce);
+}
+
+/* Forgets all entries, when the database has been changed elsewhere.
+ */
+void
+entry_cache_flush(struct entry_cache *cache)
+{
+	struct cached_entry	*ce;
+
+	if (cache->stat.entries > 0)
+		log_debug("flushing %llu cached entries",
+		    cache->stat.entries);
+	while ((ce = TAILQ_FIRST(&cache->lru)) != NULL)
+		entry_cache_evict(cache, ce);
+	cache->stat.flushes++;
+}
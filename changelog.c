@@ -0,0 +1,484 @@
+/*	$OpenBSD$ */
+
+/*
+ * Copyright (c) 2026 agent <agent@local>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/* The change log of a namespace lists its committed changes in order, so
+ * a replica can catch up by applying the changes after the last one it
+ * has seen, instead of copying the database files.
+ *
+ * Changes are numbered from 1 and stored in the index btree, so they are
+ * written in the transaction of the change. The key "%" holds the number
+ * of the next change, and each change is stored under "%" followed by its
+ * number in 8 bytes, most significant byte first:
+ *
+ * %<41> -> { 41, modify, 1286985600, "cn=chunky bacon,dc=example,dc=com",
+ *	      { { "cn", { "chunky bacon" } }, ... } }
+ *
+ * ie, a sequence of the change number, the LDAP request type (add, modify
+ * or delete), the time of the change, the DN and the full entry after the
+ * change, or before it for a deleted entry. Only the last ns->changelog
+ * changes are kept.
+ *
+ * The changes are read with the changelog extended operation, whose
+ * request value is { suffix, after, limit } and whose response value is
+ * { next, { change, ... } }, with at most limit changes following after.
+ */
+
+#include <sys/types.h>
+#include <sys/queue.h>
+
+#include <errno.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "ldapd.h"
+#include "log.h"
+
+#define CHANGELOG_KEYSIZE	 (1 + 8)
+#define CHANGELOG_MAX_CHANGES	 1000	/* max changes in one response */
+#define CHANGELOG_MAX_BYTES	 (4 * 1024 * 1024)
+#define CHANGELOG_TRIM		 4	/* max changes dropped per change */
+
+static void		 changelog_key(char *buf, uint64_t seq);
+static uint64_t		 changelog_seq(struct btval *key);
+static int		 changelog_trim(struct namespace *ns, uint64_t seq);
+
+static void
+changelog_key(char *buf, uint64_t seq)
+{
+	int	 i;
+
+	buf[0] = '%';
+	for (i = 0; i < 8; i++)
+		buf[1 + i] = seq >> (56 - 8 * i);
+}
+
+/* Returns the number of the change stored under key, or 0 if key is not
+ * a change.
+ */
+static uint64_t
+changelog_seq(struct btval *key)
+{
+	const unsigned char	*p = key->data;
+	uint64_t		 seq = 0;
+	int			 i;
+
+	if (key->size != CHANGELOG_KEYSIZE || p[0] != '%')
+		return 0;
+	for (i = 0; i < 8; i++)
+		seq = seq << 8 | p[1 + i];
+	return seq;
+}
+
+/* Reads the number of the next change to be logged.
+ */
+int
+changelog_next(struct btree_txn *txn, uint64_t *next)
+{
+	struct btval	 key, val;
+	char		 buf[CHANGELOG_KEYSIZE];
+
+	memset(&key, 0, sizeof(key));
+	memset(&val, 0, sizeof(val));
+	key.data = "%";
+	key.size = 1;
+	if (btree_txn_get(NULL, txn, &key, &val) != BT_SUCCESS) {
+		if (errno != ENOENT)
+			return -1;
+		*next = 1;
+		return 0;
+	}
+
+	if (val.size != CHANGELOG_KEYSIZE - 1) {
+		btval_reset(&val);
+		errno = EINVAL;
+		return -1;
+	}
+	buf[0] = '%';
+	memcpy(buf + 1, val.data, val.size);
+	btval_reset(&val);
+	key.data = buf;
+	key.size = sizeof(buf);
+	*next = changelog_seq(&key);
+	return 0;
+}
+
+/* Drops the oldest changes that are no longer kept once change seq is
+ * written. Only a few are dropped at a time, so decreasing the size of
+ * the log doesn't delay a single change.
+ */
+static int
+changelog_trim(struct namespace *ns, uint64_t seq)
+{
+	struct cursor	*cursor;
+	struct btval	 key;
+	uint64_t	 oldest;
+	char		 buf[CHANGELOG_KEYSIZE];
+	int		 i, rc;
+
+	for (i = 0; i < CHANGELOG_TRIM; i++) {
+		if ((cursor = btree_txn_cursor_open(NULL,
+		    ns->indx_txn)) == NULL)
+			return -1;
+		changelog_key(buf, 0);
+		memset(&key, 0, sizeof(key));
+		key.data = buf;
+		key.size = sizeof(buf);
+		rc = btree_cursor_get(cursor, &key, NULL, BT_CURSOR);
+		btree_cursor_close(cursor);
+		if (rc != BT_SUCCESS)
+			return errno == ENOENT ? 0 : -1;
+
+		oldest = changelog_seq(&key);
+		btval_reset(&key);
+		if (oldest == 0 || seq - oldest < ns->changelog)
+			return 0;
+
+		changelog_key(buf, oldest);
+		key.data = buf;
+		key.size = sizeof(buf);
+		if (btree_txn_del(NULL, ns->indx_txn, &key, NULL) != BT_SUCCESS)
+			return -1;
+	}
+	return 0;
+}
+
+/* Adds a change of the entry dn to the change log, in the current write
+ * transaction. The entry of a deleted entry is the one that was deleted.
+ */
+int
+changelog_append(struct namespace *ns, unsigned long op, char *dn,
+    struct ber_element *entry)
+{
+	struct ber_element	*root, *elm;
+	struct btval		 key, val;
+	uint64_t		 seq;
+	char			 buf[CHANGELOG_KEYSIZE];
+	int			 rc;
+
+	if (ns->changelog == 0)
+		return BT_SUCCESS;
+
+	if (changelog_next(ns->indx_txn, &seq) != 0) {
+		log_warn("%s: failed to read change log", ns->suffix);
+		return BT_FAIL;
+	}
+
+	if ((root = ber_add_sequence(NULL)) == NULL)
+		return BT_FAIL;
+	if ((elm = ber_printf_elements(root, "iEis", (long long)seq,
+	    (long long)op, (long long)time(NULL), dn)) == NULL) {
+		ber_free_elements(root);
+		return BT_FAIL;
+	}
+
+	/* The entry is only borrowed for encoding the change. */
+	elm->be_next = entry;
+	rc = ber2db(root, &val, ns->compression_level, NULL);
+	elm->be_next = NULL;
+	ber_free_elements(root);
+	if (rc != 0)
+		return BT_FAIL;
+
+	changelog_key(buf, seq);
+	memset(&key, 0, sizeof(key));
+	key.data = buf;
+	key.size = sizeof(buf);
+	rc = btree_txn_put(NULL, ns->indx_txn, &key, &val, 0);
+	btval_reset(&val);
+	if (rc != BT_SUCCESS)
+		return BT_FAIL;
+
+	changelog_key(buf, seq + 1);
+	key.data = "%";
+	key.size = 1;
+	val.data = buf + 1;
+	val.size = sizeof(buf) - 1;
+	if (btree_txn_put(NULL, ns->indx_txn, &key, &val, 0) != BT_SUCCESS)
+		return BT_FAIL;
+
+	log_debug("%s: logged change %llu of %s", ns->suffix,
+	    (unsigned long long)seq, dn);
+	return changelog_trim(ns, seq) == 0 ? BT_SUCCESS : BT_FAIL;
+}
+
+/* Reads an unsigned integer of at most 8 bytes.
+ */
+static int
+changelog_uint(const u_char *p, size_t len, uint64_t *v)
+{
+	size_t	 i;
+
+	if (len == 0 || len > 8 + (p[0] == 0) || (p[0] & 0x80))
+		return -1;
+	for (*v = 0, i = 0; i < len; i++)
+		*v = *v << 8 | p[i];
+	return 0;
+}
+
+/* Reads change seq from the change log. The change is decoded in place:
+ * only the fields needed for matching it are located in the record.
+ * Fails with ENOENT if the change is not logged.
+ */
+int
+changelog_get(struct namespace *ns, struct btree_txn *txn, uint64_t seq,
+    struct change *change)
+{
+	struct btval		 key, val;
+	struct btval		 fields[4];
+	ssize_t			 hlen;
+	size_t			 len;
+	u_char			*p, *end;
+	unsigned long		 type;
+	uint64_t		 op;
+	char			 buf[CHANGELOG_KEYSIZE];
+	int			 class, cstruct, i;
+
+	memset(change, 0, sizeof(*change));
+	memset(&val, 0, sizeof(val));
+	changelog_key(buf, seq);
+	memset(&key, 0, sizeof(key));
+	key.data = buf;
+	key.size = sizeof(buf);
+	if (btree_txn_get(NULL, txn, &key, &val) != BT_SUCCESS)
+		return -1;
+
+	if (db2raw(&val, ns->compression_level, NULL, &change->raw) != 0) {
+		btval_reset(&val);
+		return -1;
+	}
+	if (change->raw.free_data)
+		btval_reset(&val);
+	else
+		change->raw = val;	/* raw points into val */
+
+	/* { seq, op, time, dn [, entry] } */
+	p = change->raw.data;
+	if ((hlen = ber_read_header(p, change->raw.size, &class, &type,
+	    &cstruct, &len)) == -1 || !cstruct ||
+	    len > change->raw.size - hlen)
+		goto invalid;
+	p += hlen;
+	end = p + len;
+	for (i = 0; i < 4; i++) {
+		if ((hlen = ber_read_header(p, end - p, &class, &type,
+		    &cstruct, &len)) == -1 || cstruct ||
+		    len > (size_t)(end - p) - hlen)
+			goto invalid;
+		fields[i].data = p + hlen;
+		fields[i].size = len;
+		p += hlen + len;
+	}
+	if (changelog_uint(fields[0].data, fields[0].size,
+	    &change->seq) != 0 || change->seq != seq ||
+	    changelog_uint(fields[1].data, fields[1].size, &op) != 0)
+		goto invalid;
+	change->op = op;
+	change->dn.data = fields[3].data;
+	change->dn.size = fields[3].size;
+	if (p < end) {
+		change->entry.data = p;
+		change->entry.size = end - p;
+	}
+	return 0;
+
+invalid:
+	log_warnx("%s: invalid change %llu", ns->suffix,
+	    (unsigned long long)seq);
+	btval_reset(&change->raw);
+	errno = EINVAL;
+	return -1;
+}
+
+/* Collects the changes following after into the response value, as raw
+ * elements pointing into raws, which must be released after encoding.
+ * Returns an LDAP result code.
+ */
+static int
+changelog_read(struct namespace *ns, struct btree_txn *txn, uint64_t after,
+    unsigned int limit, struct ber_element *changes, struct btval *raws,
+    unsigned int *nraws)
+{
+	struct cursor		*cursor;
+	struct btval		 key, val, raw;
+	struct ber_element	*elm = changes;
+	uint64_t		 seq, next;
+	size_t			 bytes = 0;
+	char			 buf[CHANGELOG_KEYSIZE];
+	int			 op, rc = LDAP_SUCCESS;
+
+	if (changelog_next(txn, &next) != 0)
+		return LDAP_OTHER;
+	if (after >= next) {
+		log_debug("%s: change %llu is not logged yet", ns->suffix,
+		    (unsigned long long)after);
+		return LDAP_UNWILLING_TO_PERFORM;
+	}
+
+	if ((cursor = btree_txn_cursor_open(NULL, txn)) == NULL)
+		return LDAP_OTHER;
+
+	changelog_key(buf, after + 1);
+	memset(&key, 0, sizeof(key));
+	memset(&val, 0, sizeof(val));
+	key.data = buf;
+	key.size = sizeof(buf);
+	op = BT_CURSOR;
+	for (*nraws = 0; *nraws < limit && bytes < CHANGELOG_MAX_BYTES; ) {
+		if (btree_cursor_get(cursor, &key, &val, op) != BT_SUCCESS) {
+			if (errno != ENOENT)
+				rc = LDAP_OTHER;
+			break;
+		}
+		op = BT_NEXT;
+		seq = changelog_seq(&key);
+		btval_reset(&key);
+		if (seq == 0) {
+			btval_reset(&val);
+			break;
+		}
+
+		/* The next change may have been dropped from the log. */
+		if (seq != after + 1 + *nraws) {
+			log_debug("%s: change %llu is no longer logged",
+			    ns->suffix, (unsigned long long)after + 1);
+			rc = LDAP_UNWILLING_TO_PERFORM;
+			btval_reset(&val);
+			break;
+		}
+
+		if (db2raw(&val, ns->compression_level, NULL, &raw) != 0) {
+			btval_reset(&val);
+			rc = LDAP_OTHER;
+			break;
+		}
+		if (raw.free_data) {
+			btval_reset(&val);
+			raws[*nraws] = raw;
+		} else
+			raws[*nraws] = val;	/* raw points into val */
+		elm = ber_add_raw(elm, raw.data, raw.size);
+		bytes += raws[(*nraws)++].size;
+		if (elm == NULL) {
+			rc = LDAP_OTHER;
+			break;
+		}
+	}
+	btree_cursor_close(cursor);
+
+	/* All changes up to next must still be there. */
+	if (rc == LDAP_SUCCESS && *nraws == 0 && after + 1 < next)
+		rc = LDAP_UNWILLING_TO_PERFORM;
+	return rc;
+}
+
+/* The changelog extended operation. Only clients that can read all
+ * entries of the namespace may read its changes.
+ */
+int
+ldap_changelog(struct request *req, struct ber_element **value)
+{
+	struct namespace	*ns;
+	struct btree_txn	*data_txn, *indx_txn;
+	struct ber_element	*root = NULL, *elm, *changes;
+	struct btval		*raws = NULL;
+	struct ber		 ber;
+	unsigned int		 nraws = 0, i;
+	long long		 after, limit;
+	uint64_t		 next;
+	char			*suffix;
+	void			*buf;
+	size_t			 len;
+	ssize_t			 n;
+	int			 rc;
+
+	if (req->op == NULL || ber_get_nstring(req->op, &buf, &len) != 0)
+		return LDAP_PROTOCOL_ERROR;
+
+	memset(&ber, 0, sizeof(ber));
+	ber.fd = -1;
+	ber_set_readbuf(&ber, buf, len);
+	if ((root = ber_read_elements(&ber, NULL)) == NULL ||
+	    ber_scanf_elements(root, "{sii", &suffix, &after, &limit) != 0 ||
+	    after < 0 || limit <= 0) {
+		rc = LDAP_PROTOCOL_ERROR;
+		goto done;
+	}
+	if (limit > CHANGELOG_MAX_CHANGES)
+		limit = CHANGELOG_MAX_CHANGES;
+
+	normalize_dn(suffix);
+	if ((ns = namespace_for_base(suffix)) == NULL ||
+	    strcmp(ns->suffix, suffix) != 0 || ns->changelog == 0) {
+		rc = LDAP_NO_SUCH_OBJECT;
+		goto done;
+	}
+	req->ns = ns;
+	if (authorized_search(req->conn, ns, ACI_READ, ns->suffix) != 1) {
+		rc = LDAP_INSUFFICIENT_ACCESS;
+		goto done;
+	}
+
+	if (namespace_begin_txn(ns, &data_txn, &indx_txn, 1) != 0) {
+		rc = errno == EBUSY ? LDAP_BUSY : LDAP_OTHER;
+		goto done;
+	}
+
+	if ((raws = calloc(limit, sizeof(*raws))) == NULL ||
+	    (elm = ber_add_sequence(NULL)) == NULL) {
+		rc = LDAP_OTHER;
+		goto abort;
+	}
+	ber_free_elements(root);
+	root = elm;
+	if (changelog_next(indx_txn, &next) != 0 ||
+	    (elm = ber_add_integer(root, next)) == NULL ||
+	    (changes = ber_add_sequence(elm)) == NULL) {
+		rc = LDAP_OTHER;
+		goto abort;
+	}
+
+	rc = changelog_read(ns, indx_txn, after, limit, changes, raws, &nraws);
+	if (rc != LDAP_SUCCESS)
+		goto abort;
+
+	/* The raw changes must be encoded before they are released. */
+	memset(&ber, 0, sizeof(ber));
+	ber.fd = -1;
+	if (ber_write_elements(&ber, root) == -1 ||
+	    (n = ber_get_writebuf(&ber, &buf)) == -1 ||
+	    (*value = ber_add_nstring(NULL, buf, n)) == NULL)
+		rc = LDAP_OTHER;
+	else
+		ber_set_header(*value, BER_CLASS_CONTEXT, 11);
+	ber_free(&ber);
+	log_debug("%s: sending %u changes after %lld", ns->suffix, nraws,
+	    after);
+
+abort:
+	for (i = 0; i < nraws; i++)
+		btval_reset(&raws[i]);
+	btree_txn_abort(data_txn);
+	btree_txn_abort(indx_txn);
+done:
+	free(raws);
+	if (root != NULL)
+		ber_free_elements(root);
+	return rc;
+}
@@ -21,6 +21,7 @@
 
 #include <stdlib.h>
 #include <errno.h>
+#include <time.h>
 #include <unistd.h>
 
 #include "ldapd.h"
@@ -28,7 +29,6 @@
 
 int			 conn_dispatch(struct conn *conn);
 int			 conn_tls_init(struct conn *);
-unsigned long		 ldap_application(struct ber_element *elm);
 
 struct conn_list	 conn_list;
 
@@ -41,8 +41,10 @@ ldap_application(struct ber_element *elm)
 void
 request_free(struct request *req)
 {
+	latency_request(req);
 	if (req->root != NULL)
 		ber_free_elements(req->root);
+	ber_arena_free(&req->arena);
 	free(req);
 }
 
@@ -59,10 +61,17 @@ conn_close(struct conn *conn)
 		next = TAILQ_NEXT(search, next);
 		search_close(search);
 	}
+	sort_free(conn->sorted);
 
 	/* Cancel any queued requests on this connection. */
 	namespace_cancel_conn(conn);
 
+	if (conn->bind_req != NULL) {
+		passwd_cancel(conn->bind_req);
+		request_free(conn->bind_req);
+	}
+	ber_pool_free(&conn->pool);
+
 	tls_free(conn->tls);
 
 	TAILQ_REMOVE(&conn_list, conn, next);
@@ -153,17 +162,27 @@ conn_dispatch(struct conn *conn)
 	}
 
 	req->conn = conn;
+	clock_gettime(CLOCK_MONOTONIC, &req->started);
 	rptr = conn->ber.br_rptr;	/* save where we start reading */
 
+	/* Everything decoded or built for the request is released by
+	 * request_free, which may already happen in request_dispatch. The
+	 * arena is only set while dispatching, so no other request may
+	 * have left one set.
+	 */
+	ber_arena_init(&req->arena, &conn->pool);
+	if (ber_set_arena(&req->arena) != NULL)
+		fatalx("conn_dispatch: arena left set");
+
+	/* The read buffer holds exactly one complete PDU. */
 	if ((req->root = ber_read_elements(&conn->ber, NULL)) == NULL) {
-		if (errno != ECANCELED) {
-			log_warnx("protocol error");
-			hexdump(rptr, conn->ber.br_rend - rptr,
-			    "failed to parse request from %zi bytes:",
-			    conn->ber.br_rend - rptr);
-			conn_disconnect(conn);
-		}
+		log_warnx("protocol error");
+		hexdump(rptr, conn->ber.br_rend - rptr,
+		    "failed to parse request from %zi bytes:",
+		    conn->ber.br_rend - rptr);
+		conn_disconnect(conn);
 		request_free(req);
+		ber_set_arena(NULL);
 		return -1;
 	}
 	log_debug("consumed %d bytes", conn->ber.br_rptr - rptr);
@@ -177,33 +196,65 @@ conn_dispatch(struct conn *conn)
 		    "received invalid request on fd %d", conn->fd);
 		conn_disconnect(conn);
 		request_free(req);
+		ber_set_arena(NULL);
 		return -1;
 	}
+	if (req->op->be_next != NULL &&
+	    req->op->be_next->be_class == BER_CLASS_CONTEXT &&
+	    req->op->be_next->be_type == 0)
+		req->controls = req->op->be_next;
 
 	ldap_debug_elements(req->root, req->type,
 	    "received request on fd %d", conn->fd);
 
 	log_debug("got request type %d, id %lld", req->type, req->msgid);
 	request_dispatch(req);
+	ber_set_arena(NULL);
 	return 0;
 }
 
 void
 conn_read(struct bufferevent *bev, void *data)
 {
-	size_t			 nused = 0;
+	size_t			 nused = 0, avail, len;
+	ssize_t			 hlen;
+	unsigned long		 type;
+	int			 class, cstruct;
+	u_char			*p;
 	struct conn		*conn = data;
 	struct evbuffer		*input;
 
 	input = EVBUFFER_INPUT(bev);
-	ber_set_readbuf(&conn->ber,
-	    EVBUFFER_DATA(input), EVBUFFER_LENGTH(input));
+	p = EVBUFFER_DATA(input);
+	avail = EVBUFFER_LENGTH(input);
 
-	while (conn->ber.br_rend - conn->ber.br_rptr > 0) {
-		if (conn_dispatch(conn) == 0)
-			nused = conn->ber.br_rptr - conn->ber.br_rbuf;
-		else
+	/* Dispatch every complete PDU in the buffer.  The length of a
+	 * partially received PDU is remembered from its header, so it is
+	 * only parsed once all of it has arrived.
+	 */
+	while (avail > 0) {
+		if (conn->pdu_len == 0) {
+			if ((hlen = ber_read_header(p, avail, &class, &type,
+			    &cstruct, &len)) == -1) {
+				if (errno != ECANCELED) {
+					log_warnx("protocol error");
+					conn_disconnect(conn);
+				}
+				break;
+			}
+			conn->pdu_len = hlen + len;
+		}
+		if (conn->pdu_len > avail)
+			break;		/* wait for the rest of the PDU */
+
+		ber_set_readbuf(&conn->ber, p, conn->pdu_len);
+		if (conn_dispatch(conn) != 0)
 			break;
+
+		p += conn->pdu_len;
+		avail -= conn->pdu_len;
+		nused += conn->pdu_len;
+		conn->pdu_len = 0;
 	}
 
 	evbuffer_drain(input, nused);
@@ -212,16 +263,19 @@ conn_read(struct bufferevent *bev, void *data)
 void
 conn_write(struct bufferevent *bev, void *data)
 {
-	struct search	*search, *next;
+	struct search	*search;
 	struct conn	*conn = data;
 
-	/* Continue any ongoing searches.
-	 * Note that the search may be unlinked and freed by conn_search.
+	/* Continue any ongoing searches now that the output buffer has
+	 * drained below the low watermark.
 	 */
-	for (search = TAILQ_FIRST(&conn->searches); search; search = next) {
-		next = TAILQ_NEXT(search, next);
-		conn_search(search);
-	}
+	TAILQ_FOREACH(search, &conn->searches, next)
+		search_schedule(search);
+
+	/* Wait until all output is flushed before closing the connection
+	 * or switching to TLS. */
+	if (EVBUFFER_LENGTH(EVBUFFER_OUTPUT(bev)) != 0)
+		return;
 
 	if (conn->disconnect)
 		conn_close(conn);
@@ -252,7 +306,6 @@ conn_accept(int fd, short event, void *data)
 {
 	int			 afd;
 	socklen_t		 addrlen;
-	struct conn		*conn;
 	struct listener		*l = data;
 	struct sockaddr_storage	 remote_addr;
 	char			 host[128];
@@ -292,27 +345,46 @@ conn_accept(int fd, short event, void *data)
 		log_debug("accepted connection from %s on fd %d", host, afd);
 	}
 
+	if (conn_new(afd, l) == NULL && errno != 0)
+		goto giveup;
+	return;
+giveup:
+	close(afd);
+	/* Some file descriptors are available again. */
+	if (evtimer_pending(&l->evt, NULL)) {
+		evtimer_del(&l->evt);
+		event_add(&l->ev, NULL);
+	}
+}
+
+/* Sets up a connection on the socket fd, accepted on listener l.
+ * Returns NULL with errno set if the connection could not be set up, or
+ * with errno 0 if it failed to start TLS and has been closed.
+ */
+struct conn *
+conn_new(int fd, struct listener *l)
+{
+	struct conn		*conn;
+
 	if ((conn = calloc(1, sizeof(*conn))) == NULL) {
 		log_warn("malloc");
-		goto giveup;
+		return NULL;
 	}
 	conn->ber.fd = -1;
 	ber_set_application(&conn->ber, ldap_application);
-	conn->fd = afd;
+	conn->fd = fd;
 	conn->listener = l;
 
-	conn->bev = bufferevent_new(afd, conn_read, conn_write,
+	conn->bev = bufferevent_new(fd, conn_read, conn_write,
 	    conn_err, conn);
 	if (conn->bev == NULL) {
-		log_warn("conn_accept: bufferevent_new");
+		log_warn("conn_new: bufferevent_new");
 		free(conn);
-		goto giveup;
+		return NULL;
 	}
 	bufferevent_enable(conn->bev, EV_READ);
 	bufferevent_settimeout(conn->bev, 0, 60);
-	if (l->flags & F_LDAPS)
-		if (conn_tls_init(conn) == -1)
-			conn_close(conn);
+	bufferevent_setwatermark(conn->bev, EV_WRITE, SEARCH_LOWAT, 0);
 
 	TAILQ_INIT(&conn->searches);
 	TAILQ_INSERT_HEAD(&conn_list, conn, next);
@@ -321,14 +393,13 @@ conn_accept(int fd, short event, void *data)
 		conn->s_flags |= F_SECURE;
 
 	++stats.conns;
-	return;
-giveup:
-	close(afd);
-	/* Some file descriptors are available again. */
-	if (evtimer_pending(&l->evt, NULL)) {
-		evtimer_del(&l->evt);
-		event_add(&l->ev, NULL);
+
+	if (l->flags & F_LDAPS && conn_tls_init(conn) == -1) {
+		conn_close(conn);
+		errno = 0;
+		return NULL;
 	}
+	return conn;
 }
 
 struct conn *
@@ -41,6 +41,9 @@
 
 struct ctl_connlist ctl_conns;
 
+/* Statistics last reported by the other ldape workers. */
+static struct ldapd_stats worker_stats[MAX_WORKERS];
+
 struct ctl_conn	*control_connbyfd(int);
 void		 control_close(int, struct control_sock *);
 static void	 control_imsgev(struct imsgev *iev, int code, struct imsg *imsg);
@@ -195,15 +198,106 @@ control_close(int fd, struct control_sock *cs)
 	free(c);
 }
 
+/* Saves the statistics sent by another worker.
+ */
+void
+control_worker_stats(int worker, struct ldapd_stats *st)
+{
+	if (worker <= 0 || worker >= MAX_WORKERS) {
+		log_warnx("statistics from invalid worker %d", worker);
+		return;
+	}
+	worker_stats[worker] = *st;
+}
+
+/* Keeps the database statistics last reported by another worker for
+ * the namespace with the same suffix.
+ */
+void
+control_worker_nsstats(int worker, struct ns_stat *nss)
+{
+	struct namespace	*ns;
+
+	if (worker <= 0 || worker >= conf->workers) {
+		log_warnx("statistics from invalid worker %d", worker);
+		return;
+	}
+
+	nss->suffix[sizeof(nss->suffix) - 1] = '\0';
+	TAILQ_FOREACH(ns, &conf->namespaces, next) {
+		if (strcmp(ns->suffix, nss->suffix) == 0)
+			break;
+	}
+	if (ns == NULL || namespace_has_referrals(ns))
+		return;
+
+	if (ns->worker_data_stat == NULL &&
+	    (ns->worker_data_stat = calloc(conf->workers,
+	    sizeof(*ns->worker_data_stat))) == NULL) {
+		log_warn("%s", __func__);
+		return;
+	}
+	if (ns->worker_indx_stat == NULL &&
+	    (ns->worker_indx_stat = calloc(conf->workers,
+	    sizeof(*ns->worker_indx_stat))) == NULL) {
+		log_warn("%s", __func__);
+		return;
+	}
+	ns->worker_data_stat[worker] = nss->data_stat;
+	ns->worker_indx_stat[worker] = nss->indx_stat;
+}
+
+/* Adds the counters of another worker to those of the first. The cache
+ * sizes and the shape of the tree are kept as the first worker sees
+ * them.
+ */
+static void
+add_btree_stat(struct btree_stat *sum, const struct btree_stat *st)
+{
+	int	 i;
+
+	sum->hits += st->hits;
+	sum->reads += st->reads;
+	sum->evictions += st->evictions;
+	sum->readahead += st->readahead;
+	sum->overflow_reads += st->overflow_reads;
+	sum->commits += st->commits;
+	sum->writes += st->writes;
+	sum->meta_writes += st->meta_writes;
+	sum->touched += st->touched;
+	sum->put_bytes += st->put_bytes;
+	sum->fsyncs += st->fsyncs;
+	sum->fsync_usec += st->fsync_usec;
+	if (sum->fsync_max_usec < st->fsync_max_usec)
+		sum->fsync_max_usec = st->fsync_max_usec;
+	for (i = 0; i < BT_DIRTY_BUCKETS; i++)
+		sum->dirty[i] += st->dirty[i];
+}
+
 static int
 send_stats(struct imsgev *iev)
 {
 	struct namespace	*ns;
 	const struct btree_stat	*st;
 	struct ns_stat		 nss;
+	struct ldapd_stats	 sum;
+	int			 i;
+
+	/* Requests and connections are counted over all workers. */
+	sum = stats;
+	for (i = 1; i < conf->workers; i++) {
+		sum.requests += worker_stats[i].requests;
+		sum.req_search += worker_stats[i].req_search;
+		sum.req_bind += worker_stats[i].req_bind;
+		sum.req_mod += worker_stats[i].req_mod;
+		sum.timeouts += worker_stats[i].timeouts;
+		sum.unindexed += worker_stats[i].unindexed;
+		sum.conns += worker_stats[i].conns;
+		sum.searches += worker_stats[i].searches;
+	}
 
 	imsgev_compose(iev, IMSG_CTL_STATS, 0, iev->ibuf.pid, -1,
-	    &stats, sizeof(stats));
+	    &sum, sizeof(sum));
 
 	TAILQ_FOREACH(ns, &conf->namespaces, next) {
 		if (namespace_has_referrals(ns))
@@ -216,6 +310,24 @@ send_stats(struct imsgev *iev)
 		if ((st = btree_stat(ns->indx_db)) != NULL)
 			bcopy(st, &nss.indx_stat, sizeof(nss.indx_stat));
 
+		/* The database counters are summed over all workers too. */
+		for (i = 1; i < conf->workers; i++) {
+			if (ns->worker_data_stat != NULL)
+				add_btree_stat(&nss.data_stat,
+				    &ns->worker_data_stat[i]);
+			if (ns->worker_indx_stat != NULL)
+				add_btree_stat(&nss.indx_stat,
+				    &ns->worker_indx_stat[i]);
+		}
+
+		nss.compact_phase = ns->compact_phase;
+		if (ns->compact != NULL)
+			bcopy(btree_compact_stat(ns->compact),
+			    &nss.compact_stat, sizeof(nss.compact_stat));
+		nss.entry_cache_stat = ns->entry_cache.stat;
+		nss.compress_stat = ns->compress_stat;
+		nss.index_build_stat = ns->index_build_stat;
+
 		imsgev_compose(iev, IMSG_CTL_NSSTATS, 0, iev->ibuf.pid, -1,
 		    &nss, sizeof(nss));
 	}
@@ -225,6 +337,41 @@ send_stats(struct imsgev *iev)
 	return 0;
 }
 
+/* Starts online compaction of the namespace named in the message, or of
+ * all namespaces if no suffix is given.
+ */
+static void
+control_compact(struct imsgev *iev, struct imsg *imsg)
+{
+	struct namespace	*ns;
+	char			 suffix[256];
+	size_t			 len;
+	int			 started = 0;
+
+	len = imsg->hdr.len - IMSG_HEADER_SIZE;
+	if (len >= sizeof(suffix)) {
+		imsgev_compose(iev, IMSG_CTL_FAIL, 0, iev->ibuf.pid, -1,
+		    NULL, 0);
+		return;
+	}
+	memcpy(suffix, imsg->data, len);
+	suffix[len] = '\0';
+
+	TAILQ_FOREACH(ns, &conf->namespaces, next) {
+		if (namespace_has_referrals(ns))
+			continue;
+		if (*suffix != '\0' && strcasecmp(suffix, ns->suffix) != 0)
+			continue;
+		if (namespace_compact(ns) == 0)
+			started++;
+		else
+			log_warn("%s: compaction not started", ns->suffix);
+	}
+
+	imsgev_compose(iev, started ? IMSG_CTL_OK : IMSG_CTL_FAIL, 0,
+	    iev->ibuf.pid, -1, NULL, 0);
+}
+
 static void
 control_imsgev(struct imsgev *iev, int code, struct imsg *imsg)
 {
@@ -263,6 +410,32 @@ control_imsgev(struct imsgev *iev, int code, struct imsg *imsg)
 
 		log_verbose(verbose);
 		break;
+	case IMSG_CTL_LATENCY:
+		if (latency_send(iev) == -1) {
+			log_debug("%s: failed to send latencies", __func__);
+			control_close(fd, cs);
+		}
+		break;
+	case IMSG_CTL_SLOWLOG:
+		/* The filters may contain values of entries. */
+		if (cs->cs_restricted) {
+			imsgev_compose(iev, IMSG_CTL_FAIL, 0, iev->ibuf.pid,
+			    -1, NULL, 0);
+			break;
+		}
+		if (slowlog_send(iev) == -1) {
+			log_debug("%s: failed to send slow queries", __func__);
+			control_close(fd, cs);
+		}
+		break;
+	case IMSG_CTL_COMPACT:
+		if (cs->cs_restricted) {
+			imsgev_compose(iev, IMSG_CTL_FAIL, 0, iev->ibuf.pid,
+			    -1, NULL, 0);
+			break;
+		}
+		control_compact(iev, imsg);
+		break;
 	default:
 		log_warnx("%s: unexpected imsg %d", __func__, imsg->hdr.type);
 		break;
@@ -0,0 +1,219 @@
+/*	$OpenBSD$ */
+
+/*
+ * Copyright (c) 2026 agent <agent@local>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/* Preset dictionaries for the zlib compression of stored entries.
+ *
+ * Entries are small, and compressed one at a time, most of them contain
+ * the same attribute descriptions and many of the same values.  The
+ * strings that occur most often in a sample of entries are laid out as a
+ * dictionary, most frequent last where deflate finds them at the
+ * shortest distance.
+ */
+
+#include <sys/types.h>
+#include <sys/queue.h>
+#include <sys/tree.h>
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "ldapd.h"
+#include "log.h"
+
+#define DICT_MAX_FRAGMENT	 64	/* longest string considered */
+
+struct dict_fragment {
+	RB_ENTRY(dict_fragment)	 link;
+	u_char			*data;		/* BER encoded string */
+	size_t			 len;
+	unsigned long		 count;
+};
+RB_HEAD(dict_fragment_tree, dict_fragment);
+
+static int	 dict_fragment_cmp(struct dict_fragment *a,
+		    struct dict_fragment *b);
+
+RB_PROTOTYPE(dict_fragment_tree, dict_fragment, link, dict_fragment_cmp);
+RB_GENERATE(dict_fragment_tree, dict_fragment, link, dict_fragment_cmp);
+
+static int
+dict_fragment_cmp(struct dict_fragment *a, struct dict_fragment *b)
+{
+	if (a->len != b->len)
+		return a->len < b->len ? -1 : 1;
+	return memcmp(a->data, b->data, a->len);
+}
+
+static int
+dict_fragment_score_cmp(const void *a, const void *b)
+{
+	const struct dict_fragment	*fa = *(struct dict_fragment * const *)a;
+	const struct dict_fragment	*fb = *(struct dict_fragment * const *)b;
+	unsigned long long		 sa, sb;
+
+	sa = (unsigned long long)fa->count * fa->len;
+	sb = (unsigned long long)fb->count * fb->len;
+	if (sa != sb)
+		return sa > sb ? -1 : 1;
+	return 0;
+}
+
+static int
+dict_count(struct dict_fragment_tree *tree, u_char *p, size_t len,
+    unsigned int *nfrags)
+{
+	struct dict_fragment	 find, *frag;
+
+	if (len > DICT_MAX_FRAGMENT)
+		return 0;
+
+	find.data = p;
+	find.len = len;
+	if ((frag = RB_FIND(dict_fragment_tree, tree, &find)) != NULL) {
+		frag->count++;
+		return 0;
+	}
+
+	if ((frag = calloc(1, sizeof(*frag))) == NULL)
+		return -1;
+	if ((frag->data = malloc(len)) == NULL) {
+		free(frag);
+		return -1;
+	}
+	memcpy(frag->data, p, len);
+	frag->len = len;
+	frag->count = 1;
+	RB_INSERT(dict_fragment_tree, tree, frag);
+	(*nfrags)++;
+	return 0;
+}
+
+/* Counts the encoded attribute descriptions and values of the entry.
+ */
+static int
+dict_count_entry(struct dict_fragment_tree *tree, struct btval *raw,
+    unsigned int *nfrags)
+{
+	int			 class, cstruct;
+	unsigned long		 type;
+	ssize_t			 hlen, dlen;
+	size_t			 len, alen, vlen;
+	u_char			*p, *end, *v, *vend;
+
+	if ((hlen = ber_read_header(raw->data, raw->size, &class, &type,
+	    &cstruct, &len)) == -1 || !cstruct || len > raw->size - hlen)
+		return 0;
+
+	p = (u_char *)raw->data + hlen;
+	end = p + len;
+	while (p < end) {
+		/* attribute SEQUENCE { description, SET OF values } */
+		if ((hlen = ber_read_header(p, end - p, &class, &type,
+		    &cstruct, &alen)) == -1 || !cstruct ||
+		    alen > (size_t)(end - p) - hlen)
+			return 0;
+		v = p + hlen;
+		vend = v + alen;
+		p = vend;
+
+		if ((dlen = ber_read_header(v, vend - v, &class, &type,
+		    &cstruct, &len)) == -1 || len > (size_t)(vend - v) - dlen)
+			return 0;
+		if (dict_count(tree, v, dlen + len, nfrags) != 0)
+			return -1;
+		v += dlen + len;
+
+		/* values */
+		if ((hlen = ber_read_header(v, vend - v, &class, &type,
+		    &cstruct, &len)) == -1 || !cstruct ||
+		    len > (size_t)(vend - v) - hlen)
+			return 0;
+		v += hlen;
+		while (v < vend) {
+			if ((dlen = ber_read_header(v, vend - v, &class, &type,
+			    &cstruct, &vlen)) == -1 ||
+			    vlen > (size_t)(vend - v) - dlen)
+				return 0;
+			if (dict_count(tree, v, dlen + vlen, nfrags) != 0)
+				return -1;
+			v += dlen + vlen;
+		}
+	}
+
+	return 0;
+}
+
+/* Trains a dictionary of at most max_size bytes from the uncompressed
+ * encodings of nsamples entries.  Only strings seen more than once are
+ * used.  Returns -1 if there is nothing worth a dictionary.
+ */
+int
+dict_train(struct btval *samples, unsigned int nsamples, size_t max_size,
+    struct btval *dict)
+{
+	struct dict_fragment_tree	 tree;
+	struct dict_fragment		*frag, *next, **frags = NULL;
+	unsigned int			 i, nfrags = 0, n = 0;
+	size_t				 size = 0, used;
+	u_char				*p;
+	int				 rc = -1;
+
+	memset(dict, 0, sizeof(*dict));
+	RB_INIT(&tree);
+
+	for (i = 0; i < nsamples; i++)
+		if (dict_count_entry(&tree, &samples[i], &nfrags) != 0)
+			goto done;
+
+	if (nfrags == 0 ||
+	    (frags = calloc(nfrags, sizeof(*frags))) == NULL)
+		goto done;
+	RB_FOREACH(frag, dict_fragment_tree, &tree)
+		if (frag->count > 1)
+			frags[n++] = frag;
+	qsort(frags, n, sizeof(*frags), dict_fragment_score_cmp);
+
+	for (i = 0; i < n && size + frags[i]->len <= max_size; i++)
+		size += frags[i]->len;
+	n = i;
+	if (size == 0 || (p = malloc(size)) == NULL)
+		goto done;
+
+	/* the most frequent strings go last */
+	for (i = 0, used = 0; i < n; i++) {
+		used += frags[i]->len;
+		memcpy(p + size - used, frags[i]->data, frags[i]->len);
+	}
+
+	dict->data = p;
+	dict->size = size;
+	dict->free_data = 1;
+	log_debug("trained %zu byte dictionary of %u strings"
+	    " from %u entries", size, n, nsamples);
+	rc = 0;
+
+done:
+	free(frags);
+	for (frag = RB_MIN(dict_fragment_tree, &tree); frag; frag = next) {
+		next = RB_NEXT(dict_fragment_tree, &tree, frag);
+		RB_REMOVE(dict_fragment_tree, &tree, frag);
+		free(frag->data);
+		free(frag);
+	}
+	return rc;
+}
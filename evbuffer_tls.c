@@ -336,15 +336,23 @@ evtls_read(struct evbuffer *buf, int fd, int howmuch, struct tls *ctx)
 	return (n);
 }
 
+/*
+ * Writes the buffer as full TLS records until it is empty or the socket
+ * would block.  A partial write returns after each record, so writing
+ * only once per callback would cost an event loop round trip per record.
+ */
 int
 evtls_write(struct evbuffer *buffer, int fd, struct tls *ctx)
 {
-	int n;
-
-	n = tls_write(ctx, buffer->buffer, buffer->off);
-	if (n <= 0)
-		return (n);
-	evbuffer_drain(buffer, n);
+	int n, total = 0;
+
+	while (buffer->off > 0) {
+		n = tls_write(ctx, buffer->buffer, buffer->off);
+		if (n <= 0)
+			return (total > 0 ? total : n);
+		evbuffer_drain(buffer, n);
+		total += n;
+	}
 
-	return (n);
+	return (total);
 }
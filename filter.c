@@ -15,212 +15,444 @@
  * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
  * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
  */
-
 #include <sys/queue.h>
 #include <sys/types.h>
 
+#include <ctype.h>
+#include <stdlib.h>
 #include <string.h>
 #include <stdint.h>
 
 #include "ldapd.h"
 #include "log.h"
 
-static int	 ldap_filt_eq(struct ber_element *root, struct plan *plan);
-static int	 ldap_filt_subs(struct ber_element *root, struct plan *plan);
-static int	 ldap_filt_and(struct ber_element *root, struct plan *plan);
-static int	 ldap_filt_or(struct ber_element *root, struct plan *plan);
-static int	 ldap_filt_not(struct ber_element *root, struct plan *plan);
+/* The filter plan of a search is compiled once into a flat program,
+ * which is run against each candidate entry.
+ *
+ * Instructions are laid out in prefix order, and each one records where
+ * its subtree ends, so AND and OR can skip the rest of their arguments
+ * once decided.  Assertions are lowercased and substring components
+ * decoded at compile time, and the attributes tested are bound to slots
+ * once per entry, while its attributes are read.
+ */
+
+enum filter_opcode {
+	FILTER_FALSE,			/* undefined, or never matches */
+	FILTER_EQ,
+	FILTER_GE,
+	FILTER_LE,
+	FILTER_SUBS,
+	FILTER_PRES,
+	FILTER_AND,
+	FILTER_OR,
+	FILTER_NOT
+};
+
+struct filter_sub {
+	unsigned long		 type;
+	char			*value;		/* lowercased */
+	size_t			 len;
+};
+
+struct filter_insn {
+	enum filter_opcode	 op;
+	unsigned int		 end;		/* first insn after subtree */
+	unsigned int		 slot;
+	const struct match_rule	*ordering;
+	char			*value;		/* lowercased, except GE/LE */
+	size_t			 len;
+	struct filter_sub	*subs;
+	unsigned int		 nsubs;
+};
+
+struct filter_slot {
+	struct attr_type	*at;
+	const char		*adesc;		/* if at is not known */
+	struct ber_element	*attr;		/* description in the entry */
+};
+
+struct filter_prog {
+	struct filter_insn	*insns;
+	unsigned int		 ninsns;
+	struct filter_slot	*slots;
+	unsigned int		 nslots;
+};
+
+static unsigned int
+filter_count(struct plan *plan)
+{
+	struct plan	*arg;
+	unsigned int	 n = 1;
+
+	if (plan->undefined)
+		return 1;
+	TAILQ_FOREACH(arg, &plan->args, next)
+		n += filter_count(arg);
+	return n;
+}
+
+static char *
+filter_lowercase(const char *s, size_t len)
+{
+	char		*p;
+	size_t		 i;
+
+	if ((p = malloc(len + 1)) == NULL)
+		return NULL;
+	for (i = 0; i < len; i++)
+		p[i] = tolower((unsigned char)s[i]);
+	p[len] = '\0';
+	return p;
+}
 
 static int
-ldap_filt_eq(struct ber_element *root, struct plan *plan)
+filter_slot(struct filter_prog *prog, struct plan *plan)
 {
-	char			*vs;
-	struct ber_element	*a, *vals, *v;
-
-	if (plan->adesc != NULL)
-		a = ldap_get_attribute(root, plan->adesc);
-	else
-		a = ldap_find_attribute(root, plan->at);
-	if (a == NULL) {
-		log_debug("no attribute [%s] found", plan->adesc ? plan->adesc : ATTR_NAME(plan->at));
-		return -1;
+	unsigned int	 i;
+
+	for (i = 0; i < prog->nslots; i++) {
+		if (plan->adesc != NULL) {
+			if (prog->slots[i].adesc != NULL &&
+			    strcasecmp(prog->slots[i].adesc, plan->adesc) == 0)
+				return i;
+		} else if (prog->slots[i].at == plan->at)
+			return i;
 	}
 
-	vals = a->be_next;
-	if (vals == NULL)
+	/* allocated for one slot per instruction */
+	prog->slots[i].at = plan->at;
+	prog->slots[i].adesc = plan->adesc;
+	return prog->nslots++;
+}
+
+/* Decodes the substring components, which must all be valid for the
+ * assertion to ever match.  Returns 1 if one is invalid.
+ */
+static int
+filter_compile_subs(struct filter_insn *insn, struct ber_element *sub)
+{
+	int			 class;
+	unsigned long		 type;
+	struct ber_element	*elm;
+	char			*cmpval;
+	unsigned int		 n = 0;
+
+	for (elm = sub; elm != NULL; elm = elm->be_next)
+		n++;
+	if ((insn->subs = calloc(n, sizeof(*insn->subs))) == NULL)
 		return -1;
 
-	for (v = vals->be_sub; v; v = v->be_next) {
-		if (ber_get_string(v, &vs) != 0)
-			continue;
-		if (strcasecmp(plan->assert.value, vs) == 0)
-			return 0;
+	for (elm = sub; elm != NULL; elm = elm->be_next) {
+		if (ber_scanf_elements(elm, "ts", &class, &type, &cmpval) != 0 ||
+		    class != BER_CLASS_CONTEXT)
+			return 1;
+		if (type != LDAP_FILT_SUBS_INIT &&
+		    type != LDAP_FILT_SUBS_ANY &&
+		    type != LDAP_FILT_SUBS_FIN) {
+			log_warnx("invalid subfilter type %lu", type);
+			return 1;
+		}
+		insn->subs[insn->nsubs].type = type;
+		insn->subs[insn->nsubs].len = strlen(cmpval);
+		if ((insn->subs[insn->nsubs].value = filter_lowercase(cmpval,
+		    insn->subs[insn->nsubs].len)) == NULL)
+			return -1;
+		insn->nsubs++;
 	}
 
-	return -1;
+	return 0;
 }
 
 static int
-ldap_filt_subs_value(struct ber_element *v, struct ber_element *sub)
+filter_compile_plan(struct filter_prog *prog, struct plan *plan)
 {
-	int		 class;
-	unsigned long	 type;
-	const char	*cmpval;
-	char		*vs, *p, *end;
-
-	if (ber_get_string(v, &vs) != 0)
-		return -1;
+	struct filter_insn	*insn;
+	struct plan		*arg;
+	int			 rc;
 
-	for (; sub; sub = sub->be_next) {
-		if (ber_scanf_elements(sub, "ts", &class, &type, &cmpval) != 0)
-			return -1;
+	insn = &prog->insns[prog->ninsns++];
+	insn->op = FILTER_FALSE;
 
-		if (class != BER_CLASS_CONTEXT)
-			return -1;
+	if (plan->undefined)
+		goto leaf;
 
-		switch (type) {
-		case LDAP_FILT_SUBS_INIT:
-			if (strncasecmp(cmpval, vs, strlen(cmpval)) == 0)
-				vs += strlen(cmpval);
-			else
-				return 1; /* no match */
-			break;
-		case LDAP_FILT_SUBS_ANY:
-			if ((p = strcasestr(vs, cmpval)) != NULL)
-				vs = p + strlen(cmpval);
-			else
-				return 1; /* no match */
+	switch (plan->op) {
+	case LDAP_FILT_AND:
+	case LDAP_FILT_OR:
+	case LDAP_FILT_NOT:
+		insn->op = plan->op == LDAP_FILT_AND ? FILTER_AND :
+		    plan->op == LDAP_FILT_OR ? FILTER_OR : FILTER_NOT;
+		TAILQ_FOREACH(arg, &plan->args, next)
+			if (filter_compile_plan(prog, arg) != 0)
+				return -1;
+		insn->end = prog->ninsns;
+		return 0;
+	case LDAP_FILT_EQ:
+	case LDAP_FILT_APPR:
+		if (plan->assert.value == NULL)
 			break;
-		case LDAP_FILT_SUBS_FIN:
-			if (strlen(vs) < strlen(cmpval))
-				return 1; /* no match */
-			end = vs + strlen(vs) - strlen(cmpval);
-			if (strcasecmp(end, cmpval) == 0)
-				vs = end + strlen(cmpval);
-			else
-				return 1; /* no match */
+		insn->len = strlen(plan->assert.value);
+		if ((insn->value = filter_lowercase(plan->assert.value,
+		    insn->len)) == NULL)
+			return -1;
+		insn->op = FILTER_EQ;
+		break;
+	case LDAP_FILT_GE:
+	case LDAP_FILT_LE:
+		if (plan->ordering == NULL || plan->assert.value == NULL)
 			break;
-		default:
-			log_warnx("invalid subfilter type %d", type);
+		if ((insn->value = strdup(plan->assert.value)) == NULL)
 			return -1;
-		}
+		insn->ordering = plan->ordering;
+		insn->op = plan->op == LDAP_FILT_GE ? FILTER_GE : FILTER_LE;
+		break;
+	case LDAP_FILT_SUBS:
+		if ((rc = filter_compile_subs(insn, plan->assert.substring)) == -1)
+			return -1;
+		if (rc == 0)
+			insn->op = FILTER_SUBS;
+		break;
+	case LDAP_FILT_PRES:
+		insn->op = FILTER_PRES;
+		break;
+	default:
+		log_warnx("filter type %d not implemented", plan->op);
+		break;
 	}
 
-	return 0; /* match */
+	if (insn->op != FILTER_FALSE) {
+		if (plan->at == NULL && plan->adesc == NULL)
+			insn->op = FILTER_FALSE;
+		else
+			insn->slot = filter_slot(prog, plan);
+	}
+
+leaf:
+	insn->end = prog->ninsns;
+	return 0;
 }
 
-static int
-ldap_filt_subs(struct ber_element *root, struct plan *plan)
+/* Compiles the filter plan of a search.  Returns NULL on failure.
+ */
+struct filter_prog *
+filter_compile(struct plan *plan)
 {
-	const char		*attr;
-	struct ber_element	*a, *v;
+	struct filter_prog	*prog;
+	unsigned int		 n;
+
+	if ((prog = calloc(1, sizeof(*prog))) == NULL)
+		return NULL;
+
+	n = filter_count(plan);
+	if ((prog->insns = calloc(n, sizeof(*prog->insns))) == NULL ||
+	    (prog->slots = calloc(n, sizeof(*prog->slots))) == NULL ||
+	    filter_compile_plan(prog, plan) != 0) {
+		filter_prog_free(prog);
+		return NULL;
+	}
 
-	if (plan->adesc != NULL)
-		a = ldap_get_attribute(root, plan->adesc);
-	else
-		a = ldap_find_attribute(root, plan->at);
-	if (a == NULL) {
-		log_debug("no attribute [%s] found", plan->adesc ? plan->adesc : ATTR_NAME(plan->at));
-		return -1;
+	return prog;
+}
+
+void
+filter_prog_free(struct filter_prog *prog)
+{
+	unsigned int	 i, j;
+
+	if (prog == NULL)
+		return;
+
+	for (i = 0; prog->insns != NULL && i < prog->ninsns; i++) {
+		free(prog->insns[i].value);
+		for (j = 0; j < prog->insns[i].nsubs; j++)
+			free(prog->insns[i].subs[j].value);
+		free(prog->insns[i].subs);
 	}
+	free(prog->insns);
+	free(prog->slots);
+	free(prog);
+}
 
-	if (ber_scanf_elements(a, "s(e", &attr, &v) != 0)
-		return -1; /* internal failure, false or undefined? */
+/* Returns the slot of the attribute adesc, of type at, if the filter
+ * tests it, or -1.
+ */
+int
+filter_uses_attribute(struct filter_prog *prog, const char *adesc,
+    struct attr_type *at)
+{
+	unsigned int	 i;
 
-	/* Loop through all values, stop if any matches.
-	 */
-	for (; v; v = v->be_next) {
-		/* All substrings must match. */
-		switch (ldap_filt_subs_value(v, plan->assert.substring)) {
-		case 0:
-			return 0;
-		case -1:
-			return -1;
-		default:
-			break;
-		}
+	if (prog == NULL)
+		return -1;
+	for (i = 0; i < prog->nslots; i++) {
+		if (prog->slots[i].adesc != NULL) {
+			if (strcasecmp(prog->slots[i].adesc, adesc) == 0)
+				return i;
+		} else if (at != NULL && prog->slots[i].at == at)
+			return i;
 	}
 
-	/* All values checked, no match. */
 	return -1;
 }
 
-static int
-ldap_filt_and(struct ber_element *root, struct plan *plan)
+/* Forgets the attributes of the previous entry.
+ */
+void
+filter_reset(struct filter_prog *prog)
 {
-	struct plan	*arg;
+	unsigned int	 i;
 
-	TAILQ_FOREACH(arg, &plan->args, next)
-		if (ldap_matches_filter(root, arg) != 0)
-			return -1;
+	for (i = 0; prog != NULL && i < prog->nslots; i++)
+		prog->slots[i].attr = NULL;
+}
 
-	return 0;
+/* Binds the attribute element, a SEQUENCE of description and values, to
+ * its slot.  The first attribute of the entry with the type wins.
+ */
+void
+filter_bind(struct filter_prog *prog, int slot, struct ber_element *elm)
+{
+	if (prog->slots[slot].attr == NULL)
+		prog->slots[slot].attr = elm->be_sub;
 }
 
 static int
-ldap_filt_or(struct ber_element *root, struct plan *plan)
+filter_equals(const char *lower, const char *s)
 {
-	struct plan	*arg;
-
-	TAILQ_FOREACH(arg, &plan->args, next)
-		if (ldap_matches_filter(root, arg) == 0)
+	for (; *lower != '\0'; lower++, s++)
+		if (*lower != tolower((unsigned char)*s))
 			return 0;
-
-	return -1;
+	return *s == '\0';
 }
 
 static int
-ldap_filt_not(struct ber_element *root, struct plan *plan)
+filter_prefix(const char *lower, size_t len, const char *s)
 {
-	struct plan	*arg;
+	size_t		 i;
 
-	TAILQ_FOREACH(arg, &plan->args, next)
-		if (ldap_matches_filter(root, arg) != 0)
+	for (i = 0; i < len; i++)
+		if (lower[i] != tolower((unsigned char)s[i]))
 			return 0;
+	return 1;
+}
 
-	return -1;
+static int
+filter_subs_value(struct filter_insn *insn, const char *vs, size_t vlen)
+{
+	struct filter_sub	*sub;
+	const char		*end = vs + vlen;
+	unsigned int		 i;
+
+	for (i = 0; i < insn->nsubs; i++) {
+		sub = &insn->subs[i];
+		switch (sub->type) {
+		case LDAP_FILT_SUBS_INIT:
+			if ((size_t)(end - vs) < sub->len ||
+			    !filter_prefix(sub->value, sub->len, vs))
+				return 0;
+			vs += sub->len;
+			break;
+		case LDAP_FILT_SUBS_ANY:
+			for (;; vs++) {
+				if ((size_t)(end - vs) < sub->len)
+					return 0;
+				if (filter_prefix(sub->value, sub->len, vs))
+					break;
+			}
+			vs += sub->len;
+			break;
+		case LDAP_FILT_SUBS_FIN:
+			if ((size_t)(end - vs) < sub->len ||
+			    !filter_prefix(sub->value, sub->len,
+			    end - sub->len))
+				return 0;
+			vs = end;
+			break;
+		}
+	}
+
+	return 1;
 }
 
 static int
-ldap_filt_presence(struct ber_element *root, struct plan *plan)
+filter_test(struct filter_insn *insn, struct ber_element *a)
 {
-	struct ber_element	*a;
+	struct ber_element	*v;
+	char			*vs;
+	size_t			 vlen;
+	int			 cmp;
 
-	if (plan->adesc != NULL)
-		a = ldap_get_attribute(root, plan->adesc);
-	else
-		a = ldap_find_attribute(root, plan->at);
-	if (a == NULL) {
-		log_debug("no attribute [%s] found", plan->adesc ? plan->adesc : ATTR_NAME(plan->at));
-		return -1;
+	if (a == NULL || a->be_next == NULL)
+		return insn->op == FILTER_PRES && a != NULL;
+	if (insn->op == FILTER_PRES)
+		return 1;
+
+	for (v = a->be_next->be_sub; v != NULL; v = v->be_next) {
+		if (ber_get_string(v, &vs) != 0)
+			continue;
+		switch (insn->op) {
+		case FILTER_EQ:
+			if (v->be_len == insn->len &&
+			    filter_equals(insn->value, vs))
+				return 1;
+			break;
+		case FILTER_GE:
+		case FILTER_LE:
+			if (insn->ordering->compare(vs, insn->value, &cmp) != 0)
+				break;
+			if (insn->op == FILTER_GE ? cmp >= 0 : cmp <= 0)
+				return 1;
+			break;
+		case FILTER_SUBS:
+			vlen = strnlen(vs, v->be_len);
+			if (filter_subs_value(insn, vs, vlen))
+				return 1;
+			break;
+		default:
+			return 0;
+		}
 	}
 
 	return 0;
 }
 
-int
-ldap_matches_filter(struct ber_element *root, struct plan *plan)
+static int
+filter_run(struct filter_prog *prog, unsigned int pc)
 {
-	if (plan == NULL)
+	struct filter_insn	*insn = &prog->insns[pc];
+	unsigned int		 arg;
+
+	switch (insn->op) {
+	case FILTER_AND:
+		for (arg = pc + 1; arg < insn->end; arg = prog->insns[arg].end)
+			if (!filter_run(prog, arg))
+				return 0;
+		return 1;
+	case FILTER_OR:
+		for (arg = pc + 1; arg < insn->end; arg = prog->insns[arg].end)
+			if (filter_run(prog, arg))
+				return 1;
+		return 0;
+	case FILTER_NOT:
+		for (arg = pc + 1; arg < insn->end; arg = prog->insns[arg].end)
+			if (!filter_run(prog, arg))
+				return 1;
+		return 0;
+	case FILTER_FALSE:
 		return 0;
-
-	switch (plan->op) {
-	case LDAP_FILT_EQ:
-	case LDAP_FILT_APPR:
-		return ldap_filt_eq(root, plan);
-	case LDAP_FILT_SUBS:
-		return ldap_filt_subs(root, plan);
-	case LDAP_FILT_AND:
-		return ldap_filt_and(root, plan);
-	case LDAP_FILT_OR:
-		return ldap_filt_or(root, plan);
-	case LDAP_FILT_NOT:
-		return ldap_filt_not(root, plan);
-	case LDAP_FILT_PRES:
-		return ldap_filt_presence(root, plan);
 	default:
-		log_warnx("filter type %d not implemented", plan->op);
-		return -1;
+		return filter_test(insn, prog->slots[insn->slot].attr);
 	}
 }
 
+/* Runs the program against the attributes bound for the entry.  Returns
+ * 0 if the entry matches, otherwise -1.  Without a program, as for base
+ * searches, all entries match.
+ */
+int
+filter_matches(struct filter_prog *prog)
+{
+	if (prog == NULL)
+		return 0;
+	return filter_run(prog, 0) ? 0 : -1;
+}
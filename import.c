@@ -0,0 +1,862 @@
+/*	$OpenBSD$ */
+
+/*
+ * Copyright (c) 2026 agent <agent@local>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/* Offline bulk loading of LDIF files into empty namespaces.
+ *
+ * Entries are read and encoded, then sorted by DN in the sort order of
+ * the data btree. An external merge sort spills sorted runs to temporary
+ * files, so the input doesn't have to fit in memory. The sorted entries
+ * are appended to the data btree, which splits leaf pages at the end
+ * instead of in the middle, so leaf pages are written full and in order.
+ *
+ * Since a parent DN always sorts before its children, entries can be
+ * validated against the schema when appended. Entries are given IDs in
+ * the order they are appended. Index keys are collected in a second sort
+ * and appended to the index btree last.
+ */
+
+#include <sys/types.h>
+#include <sys/queue.h>
+
+#include <assert.h>
+#include <errno.h>
+#include <event.h>
+#include <resolv.h>		/* for b64_pton */
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "ldapd.h"
+#include "log.h"
+#include "uuid.h"
+
+#define IMPORT_SORT_MEM		(64 * 1024 * 1024)	/* bytes per run */
+#define IMPORT_TXN_SIZE		10000			/* puts per commit */
+
+struct import_rec {
+	struct btval		 key;
+	struct btval		 val;
+};
+
+/* A sorted run spilled to a temporary file.
+ */
+struct import_run {
+	FILE			*fp;
+	struct import_rec	 rec;		/* current record */
+	size_t			 bufsz;
+	int			 eof;
+};
+
+struct import_sort {
+	struct btree		*bt;		/* defines the sort order */
+	struct import_rec	*recs;		/* in-memory run */
+	size_t			 nrecs;
+	size_t			 maxrecs;
+	size_t			 pos;		/* merge position in recs */
+	size_t			 mem;
+	struct import_run	*runs;
+	unsigned int		 nruns;
+	int			 last;		/* source read last */
+};
+
+struct import_ns {
+	SLIST_ENTRY(import_ns)	 next;
+	struct namespace	*ns;
+	struct import_sort	 data;
+	struct import_sort	 indx;
+	unsigned long		 entries;
+	unsigned long		 skipped;
+	uint32_t		 next_id;	/* of the next entry loaded */
+	struct btval		*samples;	/* to train a dictionary */
+	unsigned int		 nsamples;
+};
+SLIST_HEAD(import_ns_list, import_ns);
+
+struct ldif {
+	FILE			*fp;
+	const char		*path;
+	unsigned long		 lineno;
+	char			*line;		/* look-ahead line */
+	size_t			 linesz;
+	ssize_t			 linelen;
+	char			*buf;		/* unfolded line */
+	size_t			 bufsz;
+};
+
+static int		 import_sort_add(struct import_sort *sort,
+			    struct btval *key, struct btval *val);
+static int		 import_sort_spill(struct import_sort *sort);
+static int		 import_sort_finish(struct import_sort *sort);
+static int		 import_sort_next(struct import_sort *sort,
+			    struct btval *key, struct btval *val);
+static void		 import_sort_free(struct import_sort *sort);
+static int		 import_run_read(struct import_run *run);
+static int		 import_rec_cmp(const void *a, const void *b);
+static ssize_t		 ldif_getline(struct ldif *ldif);
+static int		 ldif_read_entry(struct ldif *ldif, char **dnp,
+			    struct ber_element **entryp);
+static int		 ldif_add_value(struct ber_element *entry,
+			    const char *attr, const char *val, size_t len);
+static int		 import_add_operational(struct namespace *ns,
+			    struct ber_element *entry);
+static struct import_ns	*import_ns_get(struct import_ns_list *list,
+			    struct namespace *ns);
+static int		 import_index_key(struct namespace *ns,
+			    struct btval *key, struct btval *val, void *arg);
+static int		 import_sample(struct import_ns *ins,
+			    struct ber_element *entry);
+static void		 import_sample_free(struct import_ns *ins);
+static int		 import_load_data(struct import_ns *ins);
+static int		 import_load_indx(struct import_ns *ins);
+
+static struct btree	*sort_bt;	/* for qsort */
+
+static int
+import_rec_cmp(const void *a, const void *b)
+{
+	const struct import_rec	*ra = a, *rb = b;
+
+	return btree_cmp(sort_bt, &ra->key, &rb->key);
+}
+
+/* Adds a copy of a record to the sort, spilling the in-memory run to a
+ * temporary file when it grows too large.
+ */
+static int
+import_sort_add(struct import_sort *sort, struct btval *key,
+    struct btval *val)
+{
+	struct import_rec	*rec, *recs;
+	size_t			 n;
+
+	if (sort->nrecs == sort->maxrecs) {
+		n = sort->maxrecs == 0 ? 1024 : sort->maxrecs * 2;
+		if ((recs = reallocarray(sort->recs, n, sizeof(*recs))) ==
+		    NULL)
+			return -1;
+		sort->recs = recs;
+		sort->maxrecs = n;
+	}
+
+	rec = &sort->recs[sort->nrecs];
+	memset(rec, 0, sizeof(*rec));
+	if ((rec->key.data = malloc(key->size + val->size)) == NULL)
+		return -1;
+	rec->key.size = key->size;
+	rec->key.free_data = 1;
+	bcopy(key->data, rec->key.data, key->size);
+	rec->val.data = (char *)rec->key.data + key->size;
+	rec->val.size = val->size;
+	if (val->size > 0)
+		bcopy(val->data, rec->val.data, val->size);
+	sort->nrecs++;
+
+	sort->mem += sizeof(*rec) + key->size + val->size;
+	if (sort->mem >= IMPORT_SORT_MEM)
+		return import_sort_spill(sort);
+	return 0;
+}
+
+static int
+import_sort_spill(struct import_sort *sort)
+{
+	struct import_run	*runs, *run;
+	struct import_rec	*rec;
+	uint32_t		 hdr[2];
+	size_t			 i;
+
+	if ((runs = reallocarray(sort->runs, sort->nruns + 1,
+	    sizeof(*runs))) == NULL)
+		return -1;
+	sort->runs = runs;
+	run = &sort->runs[sort->nruns];
+	memset(run, 0, sizeof(*run));
+	if ((run->fp = tmpfile()) == NULL) {
+		log_warn("tmpfile");
+		return -1;
+	}
+	sort->nruns++;
+
+	log_debug("spilling sort run %u with %zu records",
+	    sort->nruns, sort->nrecs);
+
+	sort_bt = sort->bt;
+	qsort(sort->recs, sort->nrecs, sizeof(*sort->recs), import_rec_cmp);
+
+	for (i = 0; i < sort->nrecs; i++) {
+		rec = &sort->recs[i];
+		hdr[0] = rec->key.size;
+		hdr[1] = rec->val.size;
+		if (fwrite(hdr, sizeof(hdr), 1, run->fp) != 1 ||
+		    fwrite(rec->key.data, rec->key.size + rec->val.size, 1,
+		    run->fp) != 1) {
+			log_warn("sort run");
+			return -1;
+		}
+		btval_reset(&rec->key);
+	}
+
+	if (fflush(run->fp) != 0) {
+		log_warn("sort run");
+		return -1;
+	}
+
+	sort->nrecs = 0;
+	sort->mem = 0;
+	return 0;
+}
+
+static int
+import_run_read(struct import_run *run)
+{
+	uint32_t		 hdr[2];
+	size_t			 sz;
+	char			*buf;
+
+	if (fread(hdr, sizeof(hdr), 1, run->fp) != 1) {
+		if (ferror(run->fp)) {
+			log_warn("sort run");
+			return -1;
+		}
+		run->eof = 1;
+		return 0;
+	}
+
+	sz = (size_t)hdr[0] + hdr[1];
+	if (sz > run->bufsz) {
+		if ((buf = realloc(run->rec.key.data, sz)) == NULL)
+			return -1;
+		run->rec.key.data = buf;
+		run->bufsz = sz;
+	}
+	if (sz > 0 && fread(run->rec.key.data, sz, 1, run->fp) != 1) {
+		log_warnx("sort run: short read");
+		return -1;
+	}
+	run->rec.key.size = hdr[0];
+	run->rec.val.data = (char *)run->rec.key.data + hdr[0];
+	run->rec.val.size = hdr[1];
+	return 0;
+}
+
+/* Prepares the sort for merging. Must be called once after the last
+ * record has been added.
+ */
+static int
+import_sort_finish(struct import_sort *sort)
+{
+	unsigned int		 i;
+
+	sort_bt = sort->bt;
+	qsort(sort->recs, sort->nrecs, sizeof(*sort->recs), import_rec_cmp);
+	sort->pos = 0;
+	sort->last = -1;
+
+	for (i = 0; i < sort->nruns; i++) {
+		rewind(sort->runs[i].fp);
+		if (import_run_read(&sort->runs[i]) != 0)
+			return -1;
+	}
+
+	return 0;
+}
+
+/* Returns the next record in sort order. The record is only valid until
+ * the next call. Returns 0 at the end of the sort.
+ */
+static int
+import_sort_next(struct import_sort *sort, struct btval *key,
+    struct btval *val)
+{
+	struct import_rec	*rec = NULL;
+	struct import_run	*run;
+	unsigned int		 i;
+	int			 src = -1;
+
+	/* Advance the source the previous record came from. */
+	if (sort->last == (int)sort->nruns)
+		sort->pos++;
+	else if (sort->last >= 0 &&
+	    import_run_read(&sort->runs[sort->last]) != 0)
+		return -1;
+
+	for (i = 0; i < sort->nruns; i++) {
+		run = &sort->runs[i];
+		if (run->eof)
+			continue;
+		if (rec == NULL || btree_cmp(sort->bt, &run->rec.key,
+		    &rec->key) < 0) {
+			rec = &run->rec;
+			src = i;
+		}
+	}
+	if (sort->pos < sort->nrecs && (rec == NULL ||
+	    btree_cmp(sort->bt, &sort->recs[sort->pos].key, &rec->key) < 0)) {
+		rec = &sort->recs[sort->pos];
+		src = sort->nruns;
+	}
+
+	sort->last = src;
+	if (rec == NULL)
+		return 0;
+
+	key->data = rec->key.data;
+	key->size = rec->key.size;
+	val->data = rec->val.data;
+	val->size = rec->val.size;
+	return 1;
+}
+
+static void
+import_sort_free(struct import_sort *sort)
+{
+	size_t			 i;
+
+	for (i = 0; i < sort->nrecs; i++)
+		btval_reset(&sort->recs[i].key);
+	free(sort->recs);
+	sort->recs = NULL;
+	sort->nrecs = sort->maxrecs = 0;
+
+	for (i = 0; i < sort->nruns; i++) {
+		fclose(sort->runs[i].fp);
+		free(sort->runs[i].rec.key.data);
+	}
+	free(sort->runs);
+	sort->runs = NULL;
+	sort->nruns = 0;
+}
+
+/* Reads the next logical line, with continuation lines unfolded, into
+ * ldif->buf. Comments are skipped. Returns the length of the line, 0 for
+ * an empty line and -1 at end of file.
+ */
+static ssize_t
+ldif_getline(struct ldif *ldif)
+{
+	size_t			 len, n;
+	char			*s, *buf;
+	int			 first;
+
+	do {
+		len = 0;
+		for (first = 1;; first = 0) {
+			if (ldif->linelen == -1)
+				ldif->linelen = getline(&ldif->line,
+				    &ldif->linesz, ldif->fp);
+			if (ldif->linelen == -1) {
+				if (first)
+					return -1;
+				break;
+			}
+
+			s = ldif->line;
+			n = ldif->linelen;
+			while (n > 0 && (s[n - 1] == '\n' || s[n - 1] == '\r'))
+				n--;
+
+			/* Keep anything but a continuation line for later. */
+			if (!first) {
+				if (len == 0 || n == 0 || *s != ' ')
+					break;
+				s++;
+				n--;
+			}
+
+			if (len + n + 1 > ldif->bufsz) {
+				if ((buf = realloc(ldif->buf, len + n + 1)) ==
+				    NULL)
+					return -1;
+				ldif->buf = buf;
+				ldif->bufsz = len + n + 1;
+			}
+			bcopy(s, ldif->buf + len, n);
+			len += n;
+			ldif->buf[len] = '\0';
+			ldif->linelen = -1;
+			ldif->lineno++;
+		}
+	} while (len > 0 && ldif->buf[0] == '#');
+
+	return len;
+}
+
+static int
+ldif_add_value(struct ber_element *entry, const char *attr, const char *val,
+    size_t len)
+{
+	struct ber_element	*a, *set, *last;
+
+	if ((a = ldap_get_attribute(entry, attr)) != NULL) {
+		set = a->be_next;
+		for (last = set->be_sub; last && last->be_next; )
+			last = last->be_next;
+		if (ber_add_nstring(last ? last : set, val, len) == NULL)
+			return -1;
+		return 0;
+	}
+
+	if ((set = ber_add_set(NULL)) == NULL)
+		return -1;
+	if (ber_add_nstring(set, val, len) == NULL ||
+	    ldap_add_attribute(entry, attr, set) == NULL) {
+		ber_free_elements(set);
+		return -1;
+	}
+	return 0;
+}
+
+/* Reads the next entry. Returns 1 if an entry was read, 0 at end of file
+ * and -1 on error.
+ */
+static int
+ldif_read_entry(struct ldif *ldif, char **dnp, struct ber_element **entryp)
+{
+	ssize_t			 len;
+	size_t			 vlen;
+	char			*attr, *val, *p, *dec = NULL;
+	struct ber_element	*entry = NULL;
+	char			*dn = NULL;
+	int			 b64, n;
+
+	*dnp = NULL;
+	*entryp = NULL;
+
+	/* Skip empty lines and the version line. */
+	while ((len = ldif_getline(ldif)) == 0 ||
+	    (len > 0 && strncasecmp(ldif->buf, "version:", 8) == 0))
+		;
+	if (len == -1)
+		return ferror(ldif->fp) ? -1 : 0;
+
+	if ((entry = ber_add_sequence(NULL)) == NULL)
+		return -1;
+
+	for (; len > 0; len = ldif_getline(ldif)) {
+		attr = ldif->buf;
+		if ((p = strchr(attr, ':')) == NULL) {
+			log_warnx("%s:%lu: missing ':'", ldif->path,
+			    ldif->lineno);
+			goto fail;
+		}
+		*p++ = '\0';
+		b64 = (*p == ':');
+		if (b64)
+			p++;
+		else if (*p == '<') {
+			log_warnx("%s:%lu: URL values not supported",
+			    ldif->path, ldif->lineno);
+			goto fail;
+		}
+		while (*p == ' ')
+			p++;
+		val = p;
+		vlen = strlen(val);
+
+		if (b64) {
+			free(dec);
+			if ((dec = malloc(vlen + 1)) == NULL)
+				goto fail;
+			if ((n = b64_pton(val, dec, vlen + 1)) == -1) {
+				log_warnx("%s:%lu: invalid base64 value",
+				    ldif->path, ldif->lineno);
+				goto fail;
+			}
+			dec[n] = '\0';
+			val = dec;
+			vlen = n;
+		}
+
+		if (dn == NULL) {
+			if (strcasecmp(attr, "dn") != 0) {
+				log_warnx("%s:%lu: expected dn", ldif->path,
+				    ldif->lineno);
+				goto fail;
+			}
+			if ((dn = strndup(val, vlen)) == NULL)
+				goto fail;
+			continue;
+		}
+
+		if (strcasecmp(attr, "changetype") == 0) {
+			if (vlen == 3 && strncasecmp(val, "add", 3) == 0)
+				continue;
+			log_warnx("%s:%lu: changetype %.*s not supported",
+			    ldif->path, ldif->lineno, (int)vlen, val);
+			goto fail;
+		}
+
+		if (ldif_add_value(entry, attr, val, vlen) != 0)
+			goto fail;
+	}
+
+	free(dec);
+	if (len == -1 && ferror(ldif->fp))
+		goto fail;
+
+	*dnp = dn;
+	*entryp = entry;
+	return 1;
+
+fail:
+	free(dec);
+	free(dn);
+	ber_free_elements(entry);
+	return -1;
+}
+
+/* Adds the operational attributes an LDAP add would, unless the entry
+ * already has them, as when restoring a dump.
+ */
+static int
+import_add_operational(struct namespace *ns, struct ber_element *entry)
+{
+	char			 uuid_str[64];
+	struct uuid		 uuid;
+	char			*s;
+
+	if (ldap_get_attribute(entry, "creatorsName") == NULL) {
+		s = ns->rootdn ? ns->rootdn : "";
+		if (ldif_add_value(entry, "creatorsName", s, strlen(s)) != 0)
+			return -1;
+	}
+
+	if (ldap_get_attribute(entry, "createTimestamp") == NULL) {
+		s = ldap_now();
+		if (ldif_add_value(entry, "createTimestamp", s, strlen(s)) != 0)
+			return -1;
+	}
+
+	if (ldap_get_attribute(entry, "entryUUID") == NULL) {
+		uuid_create(&uuid);
+		uuid_to_string(&uuid, uuid_str, sizeof(uuid_str));
+		if (ldif_add_value(entry, "entryUUID", uuid_str,
+		    strlen(uuid_str)) != 0)
+			return -1;
+	}
+
+	return 0;
+}
+
+static struct import_ns *
+import_ns_get(struct import_ns_list *list, struct namespace *ns)
+{
+	struct import_ns	*ins;
+	const struct btree_stat	*st;
+
+	SLIST_FOREACH(ins, list, next)
+		if (ins->ns == ns)
+			return ins;
+
+	if (namespace_open(ns) != 0) {
+		log_warn("%s", ns->suffix);
+		return NULL;
+	}
+
+	if ((st = btree_stat(ns->data_db)) == NULL || st->entries > 0) {
+		log_warnx("namespace %s is not empty", ns->suffix);
+		return NULL;
+	}
+
+	if ((ins = calloc(1, sizeof(*ins))) == NULL)
+		return NULL;
+	ins->ns = ns;
+	ins->next_id = 1;
+	ins->data.bt = ns->data_db;
+	ins->indx.bt = ns->indx_db;
+	SLIST_INSERT_HEAD(list, ins, next);
+	return ins;
+}
+
+static int
+import_index_key(struct namespace *ns, struct btval *key, struct btval *val,
+    void *arg)
+{
+	struct import_ns	*ins = arg;
+
+	return import_sort_add(&ins->indx, key, val);
+}
+
+/* Keeps the encoding of the first entries of a namespace compressed with
+ * a dictionary, and trains it from them.  The entries read after are
+ * compressed with the dictionary.
+ */
+static int
+import_sample(struct import_ns *ins, struct ber_element *entry)
+{
+	struct namespace	*ns = ins->ns;
+	struct btval		 dict;
+
+	if (!ns->compression_dict || ns->compression_level == 0 ||
+	    ns->dict.data != NULL)
+		return 0;
+
+	if (ins->samples == NULL &&
+	    (ins->samples = calloc(DICT_SAMPLE, sizeof(*ins->samples))) == NULL)
+		return -1;
+	if (ber2db(entry, &ins->samples[ins->nsamples], 0, NULL) != 0)
+		return -1;
+	if (++ins->nsamples < DICT_SAMPLE)
+		return 0;
+
+	if (dict_train(ins->samples, ins->nsamples, DICT_MAX_SIZE,
+	    &dict) == 0) {
+		log_info("%s: trained %zu byte compression dictionary",
+		    ns->suffix, dict.size);
+		ns->dict = dict;
+	}
+	import_sample_free(ins);
+	return 0;
+}
+
+static void
+import_sample_free(struct import_ns *ins)
+{
+	unsigned int		 i;
+
+	for (i = 0; i < ins->nsamples; i++)
+		btval_reset(&ins->samples[i]);
+	free(ins->samples);
+	ins->samples = NULL;
+	ins->nsamples = 0;
+}
+
+/* Appends the sorted entries to the data btree, and collects their index
+ * keys under the IDs given to them.  The compression dictionary is stored
+ * with the first commit.
+ */
+static int
+import_load_data(struct import_ns *ins)
+{
+	struct namespace	*ns = ins->ns;
+	struct ber_element	*elm;
+	struct btval		 key, val;
+	unsigned long		 n = 0;
+	char			*dn;
+	int			 rc;
+
+	if (import_sort_finish(&ins->data) != 0)
+		return -1;
+
+	while ((rc = import_sort_next(&ins->data, &key, &val)) == 1) {
+		if (ns->data_txn == NULL &&
+		    (ns->data_txn = btree_txn_begin(ns->data_db, 0)) == NULL)
+			return -1;
+		if (n == 0 && ns->dict.data != NULL &&
+		    btree_txn_put_meta(NULL, ns->data_txn,
+		    &ns->dict) != BT_SUCCESS) {
+			log_warn("%s: dictionary", ns->suffix);
+			return -1;
+		}
+
+		if ((dn = strndup(key.data, key.size)) == NULL)
+			return -1;
+		if ((elm = namespace_db2ber(ns, &val)) == NULL) {
+			free(dn);
+			return -1;
+		}
+
+		if ((rc = validate_entry(dn, elm, ns->relax)) != LDAP_SUCCESS) {
+			log_warnx("%s: entry failed validation (error %d)",
+			    dn, rc);
+			ins->skipped++;
+		} else if (btree_txn_put(NULL, ns->data_txn, &key, &val,
+		    BT_NOOVERWRITE | BT_APPEND) != BT_SUCCESS) {
+			if (errno != EEXIST) {
+				log_warn("%s", dn);
+				goto fail;
+			}
+			log_warnx("%s: duplicate entry", dn);
+			ins->skipped++;
+		} else if (index_entry_keys(ns, &key, ins->next_id, elm,
+		    import_index_key, ins) != 0) {
+			log_warn("%s: failed to index", dn);
+			goto fail;
+		} else {
+			ins->next_id++;
+			ins->entries++;
+		}
+
+		free(dn);
+		ber_free_elements(elm);
+
+		if (++n % IMPORT_TXN_SIZE == 0) {
+			log_debug("%s: loaded %lu entries", ns->suffix, n);
+			rc = btree_txn_commit(ns->data_txn);
+			ns->data_txn = NULL;
+			if (rc != BT_SUCCESS)
+				return -1;
+		}
+	}
+
+	if (rc == -1 || (ns->data_txn != NULL &&
+	    btree_txn_commit(ns->data_txn) != BT_SUCCESS)) {
+		ns->data_txn = NULL;
+		return -1;
+	}
+	ns->data_txn = NULL;
+	import_sort_free(&ins->data);
+	return 0;
+
+fail:
+	free(dn);
+	ber_free_elements(elm);
+	return -1;
+}
+
+static int
+import_load_indx(struct import_ns *ins)
+{
+	struct namespace	*ns = ins->ns;
+	struct btval		 key, val;
+	unsigned long		 n = 0;
+	int			 rc;
+
+	/* All configured indices are written. */
+	if (index_built_keys(ns, import_index_key, ins) != 0 ||
+	    import_sort_finish(&ins->indx) != 0)
+		return -1;
+
+	while ((rc = import_sort_next(&ins->indx, &key, &val)) == 1) {
+		if (ns->indx_txn == NULL &&
+		    (ns->indx_txn = btree_txn_begin(ns->indx_db, 0)) == NULL)
+			return -1;
+		if (n == 0 &&
+		    index_put_meta(ns->indx_txn, ins->next_id) != BT_SUCCESS) {
+			log_warn("%s: index", ns->suffix);
+			return -1;
+		}
+
+		/* Repeated values give duplicate keys, keep the first. */
+		if (btree_txn_put(NULL, ns->indx_txn, &key, &val,
+		    BT_NOOVERWRITE | BT_APPEND) != BT_SUCCESS) {
+			if (errno == EEXIST)
+				continue;
+			log_warn("%s: index", ns->suffix);
+			return -1;
+		}
+
+		if (++n % IMPORT_TXN_SIZE == 0) {
+			rc = btree_txn_commit(ns->indx_txn);
+			ns->indx_txn = NULL;
+			if (rc != BT_SUCCESS)
+				return -1;
+		}
+	}
+
+	if (rc == -1 || (ns->indx_txn != NULL &&
+	    btree_txn_commit(ns->indx_txn) != BT_SUCCESS)) {
+		ns->indx_txn = NULL;
+		return -1;
+	}
+	ns->indx_txn = NULL;
+	import_sort_free(&ins->indx);
+	return 0;
+}
+
+/* Loads an LDIF file into the configured namespaces, which must be empty.
+ * Reads from standard input if path is "-".
+ */
+int
+import_ldif(const char *path)
+{
+	struct import_ns_list	 list;
+	struct import_ns	*ins;
+	struct namespace	*ns;
+	struct ber_element	*entry;
+	struct btval		 key, val;
+	struct ldif		 ldif;
+	char			*dn;
+	int			 rc = -1;
+
+	SLIST_INIT(&list);
+	memset(&ldif, 0, sizeof(ldif));
+	ldif.linelen = -1;
+	ldif.path = path;
+	if (strcmp(path, "-") == 0)
+		ldif.fp = stdin;
+	else if ((ldif.fp = fopen(path, "r")) == NULL) {
+		log_warn("%s", path);
+		return -1;
+	}
+
+	/* namespace_open() sets up timers. */
+	event_init();
+
+	while ((rc = ldif_read_entry(&ldif, &dn, &entry)) == 1) {
+		normalize_dn(dn);
+		rc = -1;
+		if ((ns = namespace_for_base(dn)) == NULL) {
+			log_warnx("%s: no namespace for entry", dn);
+			goto next;
+		}
+		if ((ins = import_ns_get(&list, ns)) == NULL)
+			goto done;
+		if (import_add_operational(ns, entry) != 0 ||
+		    import_sample(ins, entry) != 0)
+			goto done;
+
+		memset(&key, 0, sizeof(key));
+		key.data = dn;
+		key.size = strlen(dn);
+		if (namespace_ber2db(ns, entry, &val) != 0)
+			goto done;
+		rc = import_sort_add(&ins->data, &key, &val);
+		btval_reset(&val);
+		if (rc != 0)
+			goto done;
+next:
+		free(dn);
+		ber_free_elements(entry);
+	}
+	dn = NULL;
+	entry = NULL;
+	if (rc == -1)
+		goto done;
+
+	SLIST_FOREACH(ins, &list, next) {
+		log_info("loading namespace %s", ins->ns->suffix);
+		if ((rc = import_load_data(ins)) != 0 ||
+		    (rc = import_load_indx(ins)) != 0) {
+			log_warnx("failed to load namespace %s",
+			    ins->ns->suffix);
+			break;
+		}
+		log_info("loaded %lu entries into namespace %s,"
+		    " skipped %lu", ins->entries, ins->ns->suffix,
+		    ins->skipped);
+	}
+
+done:
+	free(dn);
+	if (entry != NULL)
+		ber_free_elements(entry);
+	while ((ins = SLIST_FIRST(&list)) != NULL) {
+		SLIST_REMOVE_HEAD(&list, next);
+		import_sort_free(&ins->data);
+		import_sort_free(&ins->indx);
+		import_sample_free(ins);
+		free(ins);
+	}
+	free(ldif.line);
+	free(ldif.buf);
+	if (ldif.fp != stdin)
+		fclose(ldif.fp);
+	return rc;
+}
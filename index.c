@@ -16,58 +16,74 @@
  * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
  */
 
-/* Indices are stored as unique keys in a btree. No data is stored.
- * The keys are made up of the attribute being indexed, concatenated
- * with the distinguished name of the entry. The namespace suffix is
- * stripped, however.
+/* Indices are stored as unique keys in a btree. Each entry is given an
+ * ID when it is added, which it keeps until it is deleted and which is
+ * never given out again. Index keys are made up of the attribute being
+ * indexed, followed by the ID of the entry in 4 bytes, most significant
+ * byte first. The keys of a value thus list the IDs of its entries in
+ * ascending order, and stay short however long the DNs are.
  *
- * Below, the namespace suffix dc=example,dc=com is stripped.
- *
- * Index b-tree sorts with plain strcmp:
+ * Index b-tree sorts bytewise, IDs are shown as <n>:
  * ...
- * cn=Chunky Bacon,cn=chunky bacon,ou=people,
- * cn=Chunky Bacon,uid=cbacon,ou=accounts,
- * cn=Chunky Beans,cn=chunky beans,ou=people,
- * cn=Chunky Beans,uid=cbeans,ou=accounts,
- * cn=Crispy Bacon,cn=crispy bacon,ou=people,
+ * cn=chunky bacon,<3>
+ * cn=chunky bacon,<17>
+ * cn=chunky beans,<4>
+ * cn=crispy bacon,<5>
  * ...
- * sn=Bacon,cn=chunky bacon,ou=people,
- * sn=Bacon,cn=crispy bacon,ou=people,
- * sn=Beans,cn=chunky beans,ou=people,
+ * sn=bacon,<3>
+ * sn=bacon,<5>
+ * sn=beans,<4>
  * ...
- * This index can be used for equality, prefix and range searches.
+ * This index can be used for equality, prefix and case-insensitive
+ * range searches.
  *
- * If an indexed attribute sorts numerically (integer), we might be able
- * to just pad it with zeros... otherwise this needs to be refined.
+ * If the ordering matching rule of the attribute sorts differently, e.g.
+ * numerically, and can encode its values as keys sorting in the same
+ * order, they are also stored for range searches. For an integer:
+ * uidnumber<p0510000,<3>
+ * uidnumber<p0510001,<4>
  *
  * Multiple attributes can be indexed in the same database.
  *
  * Presence index can be stored as:
- * !mail,cn=chunky bacon,ou=people,
- * !mail,cn=chunky beans,ou=people,
- * !mail,cn=crispy bacon,ou=people,
+ * !mail,<3>
+ * !mail,<4>
+ * !mail,<5>
  *
- * Substring index could probably be stored like a suffix tree:
- * sn>Bacon,cn=chunky bacon,ou=people,
- * sn>acon,cn=chunky bacon,ou=people,
- * sn>con,cn=chunky bacon,ou=people,
- * sn>on,cn=chunky bacon,ou=people,
- * sn>n,cn=chunky bacon,ou=people,
+ * Substring index is stored as trigrams of the value, with ^ and $
+ * marking the start and end:
+ * sn>^ba,<3>
+ * sn>bac,<3>
+ * sn>aco,<3>
+ * sn>con,<3>
+ * sn>on$,<3>
  *
- * This facilitates both substring and suffix search.
+ * An entry can only match a substring if it has all trigrams of the
+ * substring. Trigrams containing a comma are not indexed.
  *
  * Approximate index:
- * sn~[soundex(bacon)],cn=chunky bacon,ou=people,
+ * sn~[soundex(bacon)],<3>
+ *
+ * One level searches are indexed by the parent of the entry, with the
+ * namespace suffix stripped:
+ * @,<2>
+ * @ou=people,<3>
+ * @ou=people,<4>
+ * @ou=people,<5>
+ *
+ * The DN of an entry, with the namespace suffix stripped, is stored
+ * under its ID, and the ID under the DN:
+ * #<3> -> cn=chunky bacon,ou=people,
+ * $cn=chunky bacon,ou=people, -> <3>
+ *
+ * The next ID to give out is kept in the meta data of the btree, along
+ * with the version of this layout.
  *
- * One level searches can be indexed as follows:
- * @<parent-rdn>,<rdn>
- * example:
- * @ou=accounts,uid=cbacon
- * @ou=accounts,uid=cbeans
- * @ou=people,cn=chunky bacon
- * @ou=people,cn=chunky beans
- * @ou=people,cn=crispy bacon
+ * The change log of the namespace, if enabled, is kept under keys
+ * starting with %, see changelog.c.
  *
+ * The indices whose entries have all been indexed are recorded under
+ * keys starting with &, see the background index builds below.
  */
 
 #include <sys/types.h>
@@ -75,150 +91,474 @@
 
 #include <assert.h>
 #include <errno.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 
 #include "ldapd.h"
 #include "log.h"
 
+#define INDEX_VERSION		 2	/* keys end with an entry ID */
+
+/* Meta data of the index btree, in network byte order.
+ */
+struct index_meta {
+	uint32_t		 version;
+	uint32_t		 next_id;
+};
+
+static int	 index_build_mark(struct namespace *ns, struct btree_txn *txn);
+
+static void
+index_set_id(char *p, uint32_t id)
+{
+	p[0] = id >> 24;
+	p[1] = id >> 16;
+	p[2] = id >> 8;
+	p[3] = id;
+}
+
+static uint32_t
+index_get_id(const char *p)
+{
+	const unsigned char	*u = (const unsigned char *)p;
+
+	return (uint32_t)u[0] << 24 | (uint32_t)u[1] << 16 |
+	    (uint32_t)u[2] << 8 | u[3];
+}
+
+/* Returns the entry ID ending an index key.
+ */
+uint32_t
+index_key_id(struct btval *key)
+{
+	assert(key->size >= ENTRY_ID_SIZE);
+	return index_get_id((char *)key->data + key->size - ENTRY_ID_SIZE);
+}
+
+/* Decodes the meta data of the index btree. Returns -1, with errno set
+ * to EINVAL if it isn't of this version.
+ */
 static int
-index_attribute(struct namespace *ns, char *attr, struct btval *dn,
-    struct ber_element *a)
+index_parse_meta(struct btval *val, struct index_meta *meta)
 {
-	int			 dnsz, rc;
-	char			*s, *t;
-	struct ber_element	*v;
-	struct btval		 key, val;
+	if (val->size != sizeof(*meta)) {
+		errno = EINVAL;
+		return -1;
+	}
+	meta->version = index_get_id(val->data);
+	meta->next_id = index_get_id((char *)val->data + 4);
+	if (meta->version != INDEX_VERSION) {
+		errno = EINVAL;
+		return -1;
+	}
+	return 0;
+}
 
-	assert(ns);
-	assert(ns->indx_txn);
-	assert(attr);
-	assert(dn);
-	assert(a);
-	assert(a->be_next);
+/* Sets the next ID to give out in the index transaction.
+ */
+int
+index_put_meta(struct btree_txn *txn, uint32_t next_id)
+{
+	char			 buf[sizeof(struct index_meta)];
+	struct btval		 val;
+
+	index_set_id(buf, INDEX_VERSION);
+	index_set_id(buf + 4, next_id);
 	memset(&val, 0, sizeof(val));
+	val.data = buf;
+	val.size = sizeof(buf);
+	return btree_txn_put_meta(NULL, txn, &val);
+}
 
-	log_debug("indexing %.*s on %s", (int)dn->size, (char *)dn->data, attr);
+/* Reads the meta data of the index btree, in txn if not NULL. Returns -1,
+ * with errno set to ENOENT if there is none.
+ */
+static int
+index_get_meta(struct namespace *ns, struct btree_txn *txn,
+    struct index_meta *meta)
+{
+	struct btval		 val;
+	int			 rc;
 
-	dnsz = dn->size - strlen(ns->suffix);
+	if (btree_txn_get_meta(txn ? NULL : ns->indx_db, txn, &val) !=
+	    BT_SUCCESS)
+		return -1;
+	rc = index_parse_meta(&val, meta);
+	btval_reset(&val);
+	return rc;
+}
 
-	for (v = a->be_next->be_sub; v; v = v->be_next) {
-		if (ber_get_string(v, &s) != 0)
-			continue;
-		memset(&key, 0, sizeof(key));
-		key.size = asprintf(&t, "%s=%s,%.*s", attr, s, dnsz,
-		    (char *)dn->data);
-		if (key.size == (size_t)-1)
+/* Returns 1 if the index btree of the namespace can be used, 0 if it was
+ * written with the DNs of the entries in the keys, before entries had IDs,
+ * or -1 on failure. Such an index is removed and built again by the first
+ * worker.
+ */
+int
+index_usable(struct namespace *ns, struct btree_txn *txn)
+{
+	struct index_meta	 meta;
+	const struct btree_stat	*st;
+
+	if (index_get_meta(ns, txn, &meta) == 0)
+		return 1;
+	if (errno == EINVAL)
+		return 0;
+	if (errno != ENOENT)
+		return -1;
+
+	/* The meta data is written with the first ID given out. */
+	if ((st = btree_stat(ns->data_db)) == NULL)
+		return -1;
+	return st->entries == 0;
+}
+
+/* Gives out the next entry ID in the index transaction.
+ */
+int
+index_new_id(struct namespace *ns, uint32_t *id)
+{
+	struct index_meta	 meta;
+	struct attr_index	*ai;
+
+	assert(ns->indx_txn);
+
+	if (index_get_meta(ns, ns->indx_txn, &meta) != 0) {
+		if (errno != ENOENT)
 			return -1;
-		key.data = t;
-		normalize_dn(key.data);
-		rc = btree_txn_put(NULL, ns->indx_txn, &key, &val,
-		    BT_NOOVERWRITE);
-		free(t);
-		if (rc == -1 && errno != EEXIST)
+		/* The first entry of the namespace, so all indices are
+		 * built. */
+		TAILQ_FOREACH(ai, &ns->indices, next)
+			ai->ready = 1;
+		ns->indx_ids = 1;
+		if (index_build_mark(ns, ns->indx_txn) != BT_SUCCESS)
 			return -1;
+		meta.next_id = 1;
+	}
+
+	if (meta.next_id == 0) {
+		log_warnx("%s: out of entry IDs", ns->suffix);
+		errno = ENOSPC;
+		return -1;
 	}
+	*id = meta.next_id;
+	return index_put_meta(ns->indx_txn, meta.next_id + 1);
+}
+
+/* Looks up the ID of an entry by its DN. Returns -1, with errno set to
+ * ENOENT if the entry has no ID.
+ */
+int
+index_dn2id(struct namespace *ns, struct btree_txn *txn, struct btval *dn,
+    uint32_t *id)
+{
+	struct btval		 key, val;
+	char			*t;
+	int			 dnsz, rc;
 
+	dnsz = dn->size - strlen(ns->suffix);
+	if (asprintf(&t, "$%.*s", dnsz, (char *)dn->data) == -1)
+		return -1;
+	normalize_dn(t);
+
+	memset(&key, 0, sizeof(key));
+	memset(&val, 0, sizeof(val));
+	key.data = t;
+	key.size = strlen(t);
+	rc = btree_txn_get(NULL, txn, &key, &val);
+	free(t);
+	if (rc != BT_SUCCESS)
+		return -1;
+	if (val.size != ENTRY_ID_SIZE) {
+		btval_reset(&val);
+		errno = EINVAL;
+		return -1;
+	}
+	*id = index_key_id(&val);
+	btval_reset(&val);
 	return 0;
 }
 
-static int
-index_rdn_key(struct namespace *ns, struct btval *dn, struct btval *key)
+/* Looks up the full DN of an entry by its ID. Returns -1, with errno set
+ * to ENOENT if no entry has the ID.
+ *
+ * Filled in dn must be freed with btval_reset().
+ */
+int
+index_id2dn(struct namespace *ns, struct btree_txn *txn, uint32_t id,
+    struct btval *dn)
 {
-	int		 dnsz, rdnsz, pdnsz;
-	char		*t, *parent_dn;
+	struct btval		 key, val;
+	char			 idkey[1 + ENTRY_ID_SIZE];
+	size_t			 len;
 
-	memset(key, 0, sizeof(*key));
+	idkey[0] = '#';
+	index_set_id(idkey + 1, id);
 
-	dnsz = dn->size - strlen(ns->suffix);
-	if (dnsz-- == 0)
+	memset(&key, 0, sizeof(key));
+	memset(&val, 0, sizeof(val));
+	key.data = idkey;
+	key.size = sizeof(idkey);
+	if (btree_txn_get(NULL, txn, &key, &val) != BT_SUCCESS)
 		return -1;
 
-	parent_dn = memchr(dn->data, ',', dnsz);
-	if (parent_dn == NULL) {
-		rdnsz = dnsz;
-		pdnsz = 0;
-	} else {
-		rdnsz = parent_dn - (char *)dn->data;
-		pdnsz = dnsz - rdnsz - 1;
-		++parent_dn;
+	len = strlen(ns->suffix);
+	memset(dn, 0, sizeof(*dn));
+	if ((dn->data = malloc(val.size + len)) == NULL) {
+		log_warn("index_id2dn: malloc");
+		btval_reset(&val);
+		return -1;
 	}
+	bcopy(val.data, dn->data, val.size);
+	bcopy(ns->suffix, (char *)dn->data + val.size, len);
+	dn->size = val.size + len;
+	dn->free_data = 1;
+	btval_reset(&val);
+	return 0;
+}
+
+static int
+index_put(struct namespace *ns, struct btval *key, struct btval *val,
+    void *arg)
+{
+	int			 rc;
 
-	if (asprintf(&t, "@%.*s,%.*s", pdnsz, parent_dn, rdnsz,
-	    (char *)dn->data) == -1)
+	assert(ns->indx_txn);
+
+	rc = btree_txn_put(NULL, ns->indx_txn, key, val, BT_NOOVERWRITE);
+	if (rc == -1 && errno != EEXIST)
+		return -1;
+	return 0;
+}
+
+static int
+index_del(struct namespace *ns, struct btval *key, struct btval *val,
+    void *arg)
+{
+	if (btree_txn_del(NULL, ns->indx_txn, key, NULL) == BT_FAIL &&
+	    errno != ENOENT)
+		return -1;
+	return 0;
+}
+
+/* Calls fn for the index key made of the normalized prefix formatted
+ * from fmt, followed by the entry ID.
+ */
+static int
+index_key(struct namespace *ns, uint32_t id, index_func fn, void *arg,
+    const char *fmt, ...)
+{
+	va_list			 ap;
+	struct btval		 key, val;
+	char			*t, *p;
+	size_t			 len;
+	int			 rc;
+
+	va_start(ap, fmt);
+	rc = vasprintf(&t, fmt, ap);
+	va_end(ap);
+	if (rc == -1)
 		return -1;
 
 	normalize_dn(t);
-	key->data = t;
-	key->size = strlen(t);
-	key->free_data = 1;
+	len = strlen(t);
+	if ((p = realloc(t, len + ENTRY_ID_SIZE)) == NULL) {
+		free(t);
+		return -1;
+	}
+	index_set_id(p + len, id);
 
-	return 0;
+	memset(&key, 0, sizeof(key));
+	memset(&val, 0, sizeof(val));
+	key.data = p;
+	key.size = len + ENTRY_ID_SIZE;
+	rc = fn(ns, &key, &val, arg);
+	free(p);
+	return rc;
 }
 
+/* Calls fn for the keys mapping the ID of an entry to its DN and back.
+ */
 static int
-index_rdn(struct namespace *ns, struct btval *dn)
+index_id_keys(struct namespace *ns, struct btval *dn, uint32_t id,
+    index_func fn, void *arg)
 {
-	struct btval	 key, val;
-	int		 rc;
+	struct btval		 key, val;
+	char			 idkey[1 + ENTRY_ID_SIZE], *t;
+	int			 dnsz, rc;
 
+	dnsz = dn->size - strlen(ns->suffix);
+	if (asprintf(&t, "$%.*s", dnsz, (char *)dn->data) == -1)
+		return -1;
+	normalize_dn(t);
+
+	idkey[0] = '#';
+	index_set_id(idkey + 1, id);
+
+	memset(&key, 0, sizeof(key));
 	memset(&val, 0, sizeof(val));
+	key.data = idkey;
+	key.size = sizeof(idkey);
+	val.data = t + 1;
+	val.size = strlen(t + 1);
+	if ((rc = fn(ns, &key, &val, arg)) == 0) {
+		key.data = t;
+		key.size = strlen(t);
+		val.data = idkey + 1;
+		val.size = ENTRY_ID_SIZE;
+		rc = fn(ns, &key, &val, arg);
+	}
+	free(t);
+	return rc;
+}
 
-	assert(ns);
-	assert(ns->indx_txn);
-	assert(dn);
+/* Calls fn for each n-gram of s. The start and end of s are included
+ * if anchors has INDEX_GRAM_INIT or INDEX_GRAM_FINAL set.
+ */
+int
+index_grams(const char *s, int anchors, gram_func fn, void *arg)
+{
+	char		*v, *p;
+	char		 gram[INDEX_GRAM + 1];
+	int		 rc = 0;
+
+	if (asprintf(&v, "%s%s%s", (anchors & INDEX_GRAM_INIT) ? "^" : "",
+	    s, (anchors & INDEX_GRAM_FINAL) ? "$" : "") == -1)
+		return -1;
 
-	if (index_rdn_key(ns, dn, &key) < 0)
+	for (p = v; strlen(p) >= INDEX_GRAM; p++) {
+		strlcpy(gram, p, sizeof(gram));
+		if (strchr(gram, ',') != NULL)
+			continue;
+		if ((rc = fn(gram, arg)) != 0)
+			break;
+	}
+
+	free(v);
+	return rc;
+}
+
+struct index_gram_arg {
+	struct namespace	*ns;
+	const char		*attr;
+	uint32_t		 id;
+	index_func		 fn;
+	void			*arg;
+};
+
+static int
+index_gram(const char *gram, void *arg)
+{
+	struct index_gram_arg	*ga = arg;
+
+	return index_key(ga->ns, ga->id, ga->fn, ga->arg, "%s>%s,",
+	    ga->attr, gram);
+}
+
+/* Calls fn for the ordering key of value.
+ */
+static int
+index_order(struct namespace *ns, const struct match_rule *mr, char *attr,
+    uint32_t id, const char *value, index_func fn, void *arg)
+{
+	int			 rc;
+	char			*k;
+
+	if ((k = mr->index_key(value)) == NULL)
+		return 0;	/* not valid for the syntax */
+	if (strchr(k, ',') != NULL) {
+		free(k);
 		return 0;
+	}
 
-	log_debug("indexing rdn on %.*s", (int)key.size, (char *)key.data);
-	rc = btree_txn_put(NULL, ns->indx_txn, &key, &val, BT_NOOVERWRITE);
-	btval_reset(&key);
-	if (rc == -1 && errno != EEXIST)
-		return -1;
-	return 0;
+	rc = index_key(ns, id, fn, arg, "%s<%s,", attr, k);
+	free(k);
+	return rc;
 }
 
 static int
-unindex_attribute(struct namespace *ns, char *attr, struct btval *dn,
-    struct ber_element *a)
+index_attribute(struct namespace *ns, char *attr, enum index_type type,
+    uint32_t id, struct ber_element *a, index_func fn, void *arg)
 {
-	int			 dnsz, rc;
-	char			*s, *t;
+	char			*s;
 	struct ber_element	*v;
-	struct btval		 key;
+	struct index_gram_arg	 ga;
+	const struct match_rule	*mr = NULL;
 
 	assert(ns);
-	assert(ns->indx_txn);
 	assert(attr);
-	assert(dn);
 	assert(a);
 	assert(a->be_next);
 
-	log_debug("unindexing %.*s on %s",
-	    (int)dn->size, (char *)dn->data, attr);
-
-	dnsz = dn->size - strlen(ns->suffix);
+	ga.ns = ns;
+	ga.attr = attr;
+	ga.id = id;
+	ga.fn = fn;
+	ga.arg = arg;
+	if (type == INDEX_EQUAL &&
+	    (mr = namespace_ordering(ns, attr)) != NULL &&
+	    mr->index_key == NULL)
+		mr = NULL;
 
 	for (v = a->be_next->be_sub; v; v = v->be_next) {
 		if (ber_get_string(v, &s) != 0)
 			continue;
-		memset(&key, 0, sizeof(key));
-		key.size = asprintf(&t, "%s=%s,%.*s", attr, s, dnsz,
-		    (char *)dn->data);
-		key.data = t;
-		normalize_dn(key.data);
-		rc = btree_txn_del(NULL, ns->indx_txn, &key, NULL);
-		free(t);
-		if (rc == BT_FAIL && errno != ENOENT)
+		if (type == INDEX_SUBSTR) {
+			if (index_grams(s, INDEX_GRAM_INIT | INDEX_GRAM_FINAL,
+			    index_gram, &ga) != 0)
+				return -1;
+			continue;
+		}
+		if (index_key(ns, id, fn, arg, "%s=%s,", attr, s) != 0)
+			return -1;
+		if (mr != NULL &&
+		    index_order(ns, mr, attr, id, s, fn, arg) != 0)
 			return -1;
 	}
 
 	return 0;
 }
 
+/* Calls fn for the one level key of the entry, under its parent. The
+ * entry at the namespace suffix has none.
+ */
+static int
+index_rdn(struct namespace *ns, struct btval *dn, uint32_t id,
+    index_func fn, void *arg)
+{
+	int		 dnsz, rdnsz, pdnsz;
+	char		*parent_dn;
+
+	assert(ns);
+	assert(dn);
+
+	dnsz = dn->size - strlen(ns->suffix);
+	if (dnsz-- == 0)
+		return 0;
+
+	parent_dn = memchr(dn->data, ',', dnsz);
+	if (parent_dn == NULL)
+		pdnsz = 0;
+	else {
+		rdnsz = parent_dn - (char *)dn->data;
+		pdnsz = dnsz - rdnsz - 1;
+		++parent_dn;
+	}
+
+	log_debug("indexing rdn on %.*s", (int)dn->size, (char *)dn->data);
+	return index_key(ns, id, fn, arg, "@%.*s,", pdnsz,
+	    pdnsz > 0 ? parent_dn : "");
+}
+
+/* Calls fn for each index key of an entry, with the keys mapping its ID
+ * to its DN and back.
+ */
 int
-index_entry(struct namespace *ns, struct btval *dn, struct ber_element *elm)
+index_entry_keys(struct namespace *ns, struct btval *dn, uint32_t id,
+    struct ber_element *elm, index_func fn, void *arg)
 {
 	struct ber_element	*a;
 	struct attr_index	*ai;
@@ -226,136 +566,791 @@ index_entry(struct namespace *ns, struct btval *dn, struct ber_element *elm)
 	assert(ns);
 	assert(dn);
 	assert(elm);
+
+	if (index_id_keys(ns, dn, id, fn, arg) != 0)
+		return -1;
+
 	TAILQ_FOREACH(ai, &ns->indices, next) {
-		a = ldap_get_attribute(elm, ai->attr);
-		if (a && index_attribute(ns, ai->attr, dn, a) < 0)
+		if ((a = ldap_get_attribute(elm, ai->attr)) == NULL)
+			continue;
+		log_debug("indexing %.*s on %s", (int)dn->size,
+		    (char *)dn->data, ai->attr);
+		if (index_attribute(ns, ai->attr, ai->type, id, a, fn,
+		    arg) < 0)
 			return -1;
 	}
 
-	return index_rdn(ns, dn);
+	return index_rdn(ns, dn, id, fn, arg);
 }
 
-static int
-unindex_rdn(struct namespace *ns, struct btval *dn)
+int
+index_entry(struct namespace *ns, struct btval *dn, uint32_t id,
+    struct ber_element *elm)
 {
-	int		 rc;
-	struct btval	 key;
+	return index_entry_keys(ns, dn, id, elm, index_put, NULL);
+}
 
+/* Removes the index keys of an entry. Its ID may be indexed again for
+ * the same DN, but is never given out to another entry.
+ */
+int
+unindex_entry(struct namespace *ns, struct btval *dn, uint32_t id,
+    struct ber_element *elm)
+{
 	assert(ns);
 	assert(ns->indx_txn);
-	assert(dn);
 
-	if (index_rdn_key(ns, dn, &key) < 0)
-		return 0;
+	log_debug("unindexing %.*s", (int)dn->size, (char *)dn->data);
+	return index_entry_keys(ns, dn, id, elm, index_del, NULL);
+}
 
-	log_debug("unindexing rdn on %.*s", (int)key.size, (char *)key.data);
-	rc = btree_txn_del(NULL, ns->indx_txn, &key, NULL);
-	btval_reset(&key);
-	if (rc == BT_FAIL && errno != ENOENT)
+/* Indices added to the configuration of a namespace that already has
+ * entries are built in the background by the first worker, while the
+ * namespace stays available. Since changes update all configured
+ * indices, only the entries that existed when the build started need
+ * to be indexed. They are read a few at a time with a read transaction,
+ * and their keys are sorted in memory and written in one index
+ * transaction. If entries were written in between, the keys are made
+ * again while holding the write lock.
+ *
+ * An index is not used until it is built. The indices built are
+ * recorded in the index btree, so the other workers notice when a build
+ * has finished:
+ * &		-> (all entries have IDs, the indices built are recorded)
+ * &cn=		-> (equality index on cn)
+ * &cn>		-> (substring index on cn)
+ * The records are written with the first entry of a namespace and by
+ * ldapd -I. Without the first key, the index was written by an earlier
+ * version, and no index is taken as built until all are built again.
+ * Entries found without an ID are then given one, with the keys of all
+ * indices, and the one level keys are not used until all have one.
+ *
+ * An index written with the DNs of the entries in the keys is removed
+ * first, a batch of keys at a time. Changes are not indexed until the
+ * meta data is written with the last batch.
+ */
+#define INDEX_BUILD_ENTRIES	 256		/* read per step */
+#define INDEX_BUILD_KEYS	 4096		/* removed per step */
+#define INDEX_BUILD_BYTES	 (1024 * 1024)	/* max keys in a run */
+#define INDEX_BUILD_RETRY	 100000		/* usec, if write locked */
+
+struct index_build_key {
+	struct btval		 key;
+	struct btval		 val;		/* empty but for ID keys */
+};
+
+struct index_build {
+	struct namespace	*ns;
+	struct event		 ev;
+	int			 marked;	/* recorded built indices */
+	struct btval		 last;		/* key of last entry indexed */
+	uint32_t		 first_id;	/* given out by the scan */
+	uint32_t		 next_id;
+	struct index_build_key	*run;		/* keys of the current step */
+	size_t			 nrun;
+	size_t			 maxrun;
+	size_t			 run_bytes;
+};
+
+static void	 index_build_step(int fd, short event, void *data);
+
+/* Makes the key recording that ai is built, or that built indices are
+ * recorded if ai is NULL. The key must be freed with btval_reset().
+ */
+static int
+index_mark_key(struct attr_index *ai, struct btval *key)
+{
+	char		*t;
+	int		 rc;
+
+	if (ai == NULL)
+		rc = asprintf(&t, "&");
+	else
+		rc = asprintf(&t, "&%s%c", ai->attr,
+		    ai->type == INDEX_SUBSTR ? '>' : '=');
+	if (rc == -1)
 		return -1;
+	normalize_dn(t);
+
+	memset(key, 0, sizeof(*key));
+	key->data = t;
+	key->size = strlen(t);
+	key->free_data = 1;
 	return 0;
 }
 
+/* Makes the keys recording that all configured indices are built, for
+ * a load that writes the keys of all of them.
+ */
 int
-unindex_entry(struct namespace *ns, struct btval *dn, struct ber_element *elm)
+index_built_keys(struct namespace *ns, index_func fn, void *arg)
 {
-	struct ber_element	*a;
 	struct attr_index	*ai;
+	struct btval		 key, val;
+	int			 rc;
+
+	memset(&val, 0, sizeof(val));
+	if (index_mark_key(NULL, &key) != 0)
+		return -1;
+	rc = fn(ns, &key, &val, arg);
+	btval_reset(&key);
 
-	assert(ns);
-	assert(dn);
-	assert(elm);
 	TAILQ_FOREACH(ai, &ns->indices, next) {
-		a = ldap_get_attribute(elm, ai->attr);
-		if (a && unindex_attribute(ns, ai->attr, dn, a) < 0)
+		if (rc != 0)
+			break;
+		if (index_mark_key(ai, &key) != 0)
 			return -1;
+		rc = fn(ns, &key, &val, arg);
+		btval_reset(&key);
 	}
+	return rc;
+}
+
+/* Returns 1 if the key recording ai is in the index btree, 0 if not, or
+ * -1 on failure.
+ */
+static int
+index_is_marked(struct namespace *ns, struct btree_txn *txn,
+    struct attr_index *ai)
+{
+	struct btval		 key, val;
+	int			 rc;
 
-	return unindex_rdn(ns, dn);
+	if (index_mark_key(ai, &key) != 0)
+		return -1;
+	memset(&val, 0, sizeof(val));
+	rc = btree_txn_get(txn ? NULL : ns->indx_db, txn, &key, &val);
+	btval_reset(&key);
+	if (rc == BT_SUCCESS) {
+		btval_reset(&val);
+		return 1;
+	}
+	return errno == ENOENT ? 0 : -1;
 }
 
-/* Reconstruct the full dn from the index key and the namespace suffix.
- *
- * Examples:
- *
- * index key:
- *   sn=Bacon,cn=chunky bacon,ou=people,
- * full dn:
- *   cn=chunky bacon,ou=people,dc=example,dc=com
- *
- * index key:
- *   @ou=people,cn=chunky bacon
- * full dn:
- *   cn=chunky bacon,ou=people,dc=example,dc=com
- *
- * index key:
- *   @,ou=people
- * full dn:
- *   ou=people,dc=example,dc=com
- *
- * index key:
- *   @ou=staff,ou=people,cn=chunky bacon
- * full dn:
- *   cn=chunky bacon,ou=staff,ou=people,dc=example,dc=com
- *
- * Filled in dn must be freed with btval_reset().
+/* Reads which indices of the namespace are built, or only ai if not
+ * NULL.
  */
-int
-index_to_dn(struct namespace *ns, struct btval *indx, struct btval *dn)
+static int
+index_read_ready(struct namespace *ns, struct btree_txn *txn,
+    struct attr_index *ai)
 {
-	char		*rdn, *parent_rdn, indxtype, *dst;
-	int		 rdn_sz, prdn_sz;
+	struct attr_index	*aj;
+	int			 recorded, rc;
 
-	/* Skip past first index part to get the RDN.
-	 */
+	/* An index of an earlier version is being removed. */
+	if (ns->indx_unusable) {
+		if ((rc = index_usable(ns, txn)) != 1) {
+			TAILQ_FOREACH(aj, &ns->indices, next)
+				aj->ready = 0;
+			ns->indx_ids = 0;
+			return rc;
+		}
+		log_debug("%s: index of an earlier version removed",
+		    ns->suffix);
+		ns->indx_unusable = 0;
+	}
 
-	indxtype = ((char *)indx->data)[0];
-	if (indxtype == '@') {
-		/* One-level index.
-		 * Full DN is made up of rdn + parent rdn + namespace suffix.
-		 */
-		rdn = memrchr(indx->data, ',', indx->size);
-		if (rdn++ == NULL)
-			return -1;
-		rdn_sz = indx->size - (rdn - (char *)indx->data);
-
-		parent_rdn = (char *)indx->data + 1;
-		prdn_sz = rdn - parent_rdn - 1;
-		dn->size = indx->size + strlen(ns->suffix);
-		if (prdn_sz == 0)
-			dn->size--;
-		if ((dn->data = malloc(dn->size)) == NULL) {
-			log_warn("conn_search: malloc");
+	if ((recorded = index_is_marked(ns, txn, NULL)) == -1)
+		return -1;
+	ns->indx_ids = recorded;
+
+	TAILQ_FOREACH(aj, &ns->indices, next) {
+		if (ai != NULL && aj != ai)
+			continue;
+		if (!recorded)
+			aj->ready = 0;
+		else if ((rc = index_is_marked(ns, txn, aj)) == -1)
 			return -1;
+		else
+			aj->ready = rc;
+	}
+	return 0;
+}
+
+/* Checks if the index ai is built, or all indices of the namespace if ai
+ * is NULL. An index not yet built is checked at most once a second.
+ */
+void
+index_check_ready(struct namespace *ns, struct attr_index *ai)
+{
+	time_t			 now;
+
+	if (ns->indx_db == NULL)
+		return;		/* being reopened */
+
+	if (ai != NULL) {
+		now = time(NULL);
+		if (ai->ready || ai->checked == now)
+			return;
+		ai->checked = now;
+	}
+
+	if (index_read_ready(ns, NULL, ai) != 0)
+		log_warn("%s: failed to read built indices", ns->suffix);
+}
+
+/* Returns 1 if all entries of the namespace have IDs, so that the one
+ * level keys can be used. Until then, it is checked at most once a
+ * second.
+ */
+int
+index_has_ids(struct namespace *ns)
+{
+	time_t			 now;
+
+	if (ns->indx_ids || ns->indx_db == NULL)
+		return ns->indx_ids;
+
+	now = time(NULL);
+	if (ns->indx_checked != now) {
+		ns->indx_checked = now;
+		index_check_ready(ns, NULL);
+	}
+	return ns->indx_ids;
+}
+
+/* Returns 1 if the btval a holds the same bytes as b.
+ */
+static int
+index_key_equal(struct btval *a, struct btval *b)
+{
+	return a->size == b->size && memcmp(a->data, b->data, a->size) == 0;
+}
+
+/* Updates the recorded indices to those configured and built, in the
+ * index write transaction. Records of indices no longer configured are
+ * removed, since they are not kept up to date. The first record is only
+ * written once all entries have IDs.
+ */
+static int
+index_build_mark(struct namespace *ns, struct btree_txn *txn)
+{
+	struct attr_index	*ai;
+	struct cursor		*cursor;
+	struct btval		 key, mark, val, *stale = NULL, *p;
+	size_t			 i, nstale = 0;
+	enum cursor_op		 op;
+	int			 match, rc = -1;
+
+	if (index_mark_key(NULL, &mark) != 0)
+		return -1;
+	if ((cursor = btree_txn_cursor_open(NULL, txn)) == NULL)
+		goto done;
+
+	memset(&key, 0, sizeof(key));
+	key.data = mark.data;
+	key.size = mark.size;
+	for (op = BT_CURSOR; btree_cursor_get(cursor, &key, NULL, op) ==
+	    BT_SUCCESS; op = BT_NEXT) {
+		if (key.size == 0 || *(char *)key.data != '&') {
+			btval_reset(&key);
+			break;
 		}
-		dst = dn->data;
-		bcopy(rdn, dst, rdn_sz);
-		dst += rdn_sz;
-		*dst++ = ',';
-		bcopy(parent_rdn, dst, prdn_sz);
-		dst += prdn_sz;
-		if (prdn_sz > 0)
-			*dst++ = ',';
-		bcopy(ns->suffix, dst, strlen(ns->suffix));
-	} else {
-		/* Construct the full DN by appending namespace suffix.
-		 */
-		rdn = memchr(indx->data, ',', indx->size);
-		if (rdn++ == NULL)
-			return -1;
-		rdn_sz = indx->size - (rdn - (char *)indx->data);
-		dn->size = rdn_sz + strlen(ns->suffix);
-		if ((dn->data = malloc(dn->size)) == NULL) {
-			log_warn("index_to_dn: malloc");
+		TAILQ_FOREACH(ai, &ns->indices, next) {
+			if (!ai->ready || index_mark_key(ai, &val) != 0)
+				continue;
+			match = index_key_equal(&key, &val);
+			btval_reset(&val);
+			if (match)
+				break;
+		}
+		if (ai == NULL && !index_key_equal(&key, &mark)) {
+			log_debug("%s: dropping record of index %.*s",
+			    ns->suffix, (int)key.size - 1,
+			    (char *)key.data + 1);
+			p = reallocarray(stale, nstale + 1, sizeof(*stale));
+			if (p == NULL) {
+				btval_reset(&key);
+				btree_cursor_close(cursor);
+				goto done;
+			}
+			stale = p;
+			memset(&stale[nstale], 0, sizeof(*stale));
+			if ((stale[nstale].data = malloc(key.size)) == NULL) {
+				btval_reset(&key);
+				btree_cursor_close(cursor);
+				goto done;
+			}
+			memcpy(stale[nstale].data, key.data, key.size);
+			stale[nstale].size = key.size;
+			stale[nstale++].free_data = 1;
+		}
+		btval_reset(&key);
+	}
+	btree_cursor_close(cursor);
+
+	/* The cursor is closed before the records are changed. */
+	rc = BT_SUCCESS;
+	for (i = 0; i < nstale && rc == BT_SUCCESS; i++)
+		rc = btree_txn_del(NULL, txn, &stale[i], NULL);
+
+	memset(&val, 0, sizeof(val));
+	if (rc == BT_SUCCESS && ns->indx_ids)
+		rc = btree_txn_put(NULL, txn, &mark, &val, 0);
+	TAILQ_FOREACH(ai, &ns->indices, next) {
+		if (rc != BT_SUCCESS)
+			break;
+		if (!ai->ready)
+			continue;
+		if ((rc = index_mark_key(ai, &key)) != 0)
+			break;
+		rc = btree_txn_put(NULL, txn, &key, &val, 0);
+		btval_reset(&key);
+	}
+
+done:
+	for (i = 0; i < nstale; i++)
+		btval_reset(&stale[i]);
+	free(stale);
+	btval_reset(&mark);
+	return rc;
+}
+
+static void
+index_build_schedule(struct index_build *ib, unsigned int usec)
+{
+	struct timeval	 tv;
+
+	tv.tv_sec = 0;
+	tv.tv_usec = usec;
+	evtimer_add(&ib->ev, &tv);
+}
+
+static void
+index_build_reset_run(struct index_build *ib)
+{
+	size_t		 i;
+
+	for (i = 0; i < ib->nrun; i++) {
+		btval_reset(&ib->run[i].key);
+		btval_reset(&ib->run[i].val);
+	}
+	ib->nrun = 0;
+	ib->run_bytes = 0;
+}
+
+/* Copies the bytes of src to dst, which must be freed with btval_reset().
+ */
+static int
+index_build_copy(struct btval *dst, struct btval *src)
+{
+	memset(dst, 0, sizeof(*dst));
+	if (src == NULL || src->size == 0)
+		return 0;
+	if ((dst->data = malloc(src->size)) == NULL)
+		return -1;
+	memcpy(dst->data, src->data, src->size);
+	dst->size = src->size;
+	dst->free_data = 1;
+	return 0;
+}
+
+/* Collects a key of an index being built in the run of the step, with its
+ * value if any.
+ */
+static int
+index_build_collect(struct namespace *ns, struct btval *key,
+    struct btval *val, void *arg)
+{
+	struct index_build	*ib = arg;
+	struct index_build_key	*p;
+	size_t			 n;
+
+	if (ib->nrun == ib->maxrun) {
+		n = ib->maxrun ? 2 * ib->maxrun : 1024;
+		if ((p = reallocarray(ib->run, n, sizeof(*p))) == NULL)
 			return -1;
+		ib->run = p;
+		ib->maxrun = n;
+	}
+
+	p = &ib->run[ib->nrun];
+	if (index_build_copy(&p->key, key) != 0)
+		return -1;
+	if (index_build_copy(&p->val, val) != 0) {
+		btval_reset(&p->key);
+		return -1;
+	}
+	ib->nrun++;
+	ib->run_bytes += key->size + p->val.size;
+	return 0;
+}
+
+/* Sorts keys as the index btree does, bytewise.
+ */
+static int
+index_build_cmp(const void *a, const void *b)
+{
+	const struct btval	*ka = &((const struct index_build_key *)a)->key;
+	const struct btval	*kb = &((const struct index_build_key *)b)->key;
+	int			 rc;
+
+	rc = memcmp(ka->data, kb->data,
+	    ka->size < kb->size ? ka->size : kb->size);
+	if (rc != 0)
+		return rc;
+	if (ka->size != kb->size)
+		return ka->size < kb->size ? -1 : 1;
+	return 0;
+}
+
+/* Removes a batch of keys of an index written by an earlier version, in
+ * the index write transaction, and writes the meta data once none is
+ * left but those of the change log. Returns 1 if the index is removed, 0
+ * if not, or -1 on failure.
+ */
+static int
+index_build_clear(struct index_build *ib, struct btree_txn *txn)
+{
+	struct cursor		*cursor;
+	struct btval		 key;
+	enum cursor_op		 op;
+	size_t			 i;
+	int			 rc = 0;
+
+	if ((cursor = btree_txn_cursor_open(NULL, txn)) == NULL)
+		return -1;
+	memset(&key, 0, sizeof(key));
+	op = BT_FIRST;
+	while (ib->nrun < INDEX_BUILD_KEYS) {
+		if (btree_cursor_get(cursor, &key, NULL, op) != BT_SUCCESS) {
+			rc = errno == ENOENT ? 1 : -1;
+			break;
+		}
+		op = BT_NEXT;
+		if (key.size > 0 && *(char *)key.data == '%') {
+			/* The change log is kept, so skip past it. */
+			btval_reset(&key);
+			key.data = "&";
+			key.size = 1;
+			op = BT_CURSOR;
+			continue;
 		}
-		bcopy(rdn, dn->data, rdn_sz);
-		bcopy(ns->suffix, (char *)dn->data + rdn_sz,
-		    strlen(ns->suffix));
+		rc = index_build_collect(ib->ns, &key, NULL, ib);
+		btval_reset(&key);
+		if (rc != 0)
+			break;
 	}
+	btree_cursor_close(cursor);
 
-	dn->free_data = 1;
+	/* The cursor is closed before the keys are removed. */
+	for (i = 0; i < ib->nrun && rc != -1; i++) {
+		if (btree_txn_del(NULL, txn, &ib->run[i].key, NULL) !=
+		    BT_SUCCESS)
+			rc = -1;
+	}
+	if (rc == 1 && index_put_meta(txn, 1) != BT_SUCCESS)
+		rc = -1;
+	return rc;
+}
 
+/* Reads the entries following the last one indexed, up to the limits of
+ * a step, and collects the keys of the indices being built. Entries
+ * without an ID are given one from next_id, with the keys of all indices.
+ * The key of the last entry read is copied to next, and their number to
+ * nread. Returns 1 if all entries have been read, 0 if not, or -1 on
+ * failure.
+ */
+static int
+index_build_scan(struct index_build *ib, struct btree_txn *data_txn,
+    struct btree_txn *indx_txn, struct btval *next, unsigned int *nread)
+{
+	struct namespace	*ns = ib->ns;
+	struct attr_index	*ai;
+	struct ber_element	*elm, *a;
+	struct cursor		*cursor;
+	struct btval		 key, val;
+	struct index_meta	 meta;
+	enum cursor_op		 op = BT_FIRST;
+	uint32_t		 id;
+	int			 numbered, rc = 0;
+
+	memset(next, 0, sizeof(*next));
+	*nread = 0;
+	if (index_get_meta(ns, indx_txn, &meta) == 0)
+		ib->first_id = meta.next_id;
+	else if (errno == ENOENT)
+		ib->first_id = 1;
+	else
+		return -1;
+	ib->next_id = ib->first_id;
+	if ((cursor = btree_txn_cursor_open(NULL, data_txn)) == NULL)
+		return -1;
+	btree_cursor_sequential(cursor);
+
+	memset(&key, 0, sizeof(key));
+	memset(&val, 0, sizeof(val));
+	if (ib->last.size > 0) {
+		key.data = ib->last.data;
+		key.size = ib->last.size;
+		op = BT_CURSOR;
+	}
+
+	while (*nread < INDEX_BUILD_ENTRIES &&
+	    ib->run_bytes < INDEX_BUILD_BYTES) {
+		if (btree_cursor_get(cursor, &key, &val, op) != BT_SUCCESS) {
+			rc = errno == ENOENT ? 1 : -1;
+			break;
+		}
+		op = BT_NEXT;
+		if (ib->last.size > 0 && index_key_equal(&key, &ib->last)) {
+			btval_reset(&key);
+			btval_reset(&val);
+			continue;
+		}
+
+		numbered = index_dn2id(ns, indx_txn, &key, &id) == 0;
+		if (!numbered && errno != ENOENT)
+			rc = -1;
+		else if ((elm = namespace_db2ber(ns, &val)) == NULL) {
+			log_warnx("%s: failed to parse entry [%.*s]",
+			    ns->suffix, (int)key.size, (char *)key.data);
+		} else if (!numbered) {
+			if (ib->next_id == 0) {
+				log_warnx("%s: out of entry IDs", ns->suffix);
+				errno = ENOSPC;
+				rc = -1;
+			} else if (index_entry_keys(ns, &key, ib->next_id++,
+			    elm, index_build_collect, ib) != 0)
+				rc = -1;
+			ber_free_elements(elm);
+		} else {
+			TAILQ_FOREACH(ai, &ns->indices, next) {
+				if (ai->ready || (a = ldap_get_attribute(elm,
+				    ai->attr)) == NULL)
+					continue;
+				if (index_attribute(ns, ai->attr, ai->type, id,
+				    a, index_build_collect, ib) != 0) {
+					rc = -1;
+					break;
+				}
+			}
+			ber_free_elements(elm);
+		}
+
+		btval_reset(next);
+		if (rc == 0 && (next->data = malloc(key.size)) == NULL)
+			rc = -1;
+		else if (rc == 0) {
+			memcpy(next->data, key.data, key.size);
+			next->size = key.size;
+			next->free_data = 1;
+			(*nread)++;
+		}
+		btval_reset(&key);
+		btval_reset(&val);
+		if (rc != 0)
+			break;
+	}
+
+	btree_cursor_close(cursor);
+	if (rc == -1)
+		btval_reset(next);
+	return rc;
+}
+
+/* Removes an index of an earlier version, records the indices built and
+ * those configured, then indexes the entries that existed before the
+ * indices not built were configured.
+ */
+static void
+index_build_step(int fd, short event, void *data)
+{
+	struct index_build	*ib = data;
+	struct namespace	*ns = ib->ns;
+	struct index_build_stat	*st = &ns->index_build_stat;
+	struct attr_index	*ai;
+	struct btree_txn	*data_txn, *indx_txn;
+	const struct btree_stat	*bst;
+	struct btval		 next;
+	unsigned int		 rev, rev2, nread;
+	size_t			 i;
+	int			 done = 0;
+
+	memset(&next, 0, sizeof(next));
+
+	/* A batch of this worker holds the write lock. */
+	if (ns->group_data_txn != NULL) {
+		index_build_schedule(ib, INDEX_BUILD_RETRY);
+		return;
+	}
+
+	if (ns->indx_unusable) {
+		if (namespace_begin_txn(ns, &data_txn, &indx_txn, 0) != 0)
+			goto retry;
+		btree_txn_abort(data_txn);
+		if ((done = index_build_clear(ib, indx_txn)) == -1) {
+			btree_txn_abort(indx_txn);
+			goto fail;
+		}
+		if (btree_txn_commit(indx_txn) != BT_SUCCESS)
+			goto fail;
+		st->keys += ib->nrun;
+		index_build_reset_run(ib);
+		if (done) {
+			log_info("%s: removed %llu keys of the index of an"
+			    " earlier version", ns->suffix, st->keys);
+			ns->indx_unusable = 0;
+		}
+		index_build_schedule(ib, 0);
+		return;
+	}
+
+	if (!ib->marked) {
+		if (namespace_begin_txn(ns, &data_txn, &indx_txn, 0) != 0)
+			goto retry;
+		if (index_read_ready(ns, indx_txn, NULL) != 0 ||
+		    index_build_mark(ns, indx_txn) != BT_SUCCESS) {
+			btree_txn_abort(data_txn);
+			btree_txn_abort(indx_txn);
+			goto fail;
+		}
+		btree_txn_abort(data_txn);
+		if (btree_txn_commit(indx_txn) != BT_SUCCESS)
+			goto fail;
+		ib->marked = 1;
+
+		memset(st, 0, sizeof(*st));
+		TAILQ_FOREACH(ai, &ns->indices, next) {
+			if (!ai->ready) {
+				log_info("%s: building %s index on %s",
+				    ns->suffix, ai->type == INDEX_SUBSTR ?
+				    "substring" : "equality", ai->attr);
+				st->indices++;
+			}
+		}
+		if (st->indices == 0 && ns->indx_ids) {
+			index_build_stop(ns);
+			return;
+		}
+		if ((bst = btree_stat(ns->data_db)) != NULL)
+			st->entries = bst->entries;
+		st->started = time(NULL);
+		index_build_schedule(ib, 0);
+		return;
+	}
+
+	/* The keys are made without holding the write lock. */
+	if (ns->data_db == NULL)
+		goto retry;	/* being reopened */
+	if (btree_revision(ns->data_db, &rev) != BT_SUCCESS)
+		goto fail;
+	if (namespace_begin_txn(ns, &data_txn, &indx_txn, 1) != 0)
+		goto retry;
+	done = index_build_scan(ib, data_txn, indx_txn, &next, &nread);
+	btree_txn_abort(data_txn);
+	btree_txn_abort(indx_txn);
+	if (done == -1)
+		goto fail;
+
+	if (namespace_begin_txn(ns, &data_txn, &indx_txn, 0) != 0)
+		goto retry;
+
+	/* Entries were written in between, so the keys are made again. */
+	if (btree_revision(ns->data_db, &rev2) != BT_SUCCESS || rev2 != rev) {
+		index_build_reset_run(ib);
+		btval_reset(&next);
+		st->rescans++;
+		done = index_build_scan(ib, data_txn, indx_txn, &next, &nread);
+		if (done == -1)
+			goto abort;
+	}
+
+	qsort(ib->run, ib->nrun, sizeof(*ib->run), index_build_cmp);
+	for (i = 0; i < ib->nrun; i++) {
+		if (btree_txn_put(NULL, indx_txn, &ib->run[i].key,
+		    &ib->run[i].val, BT_NOOVERWRITE) != BT_SUCCESS &&
+		    errno != EEXIST)
+			goto abort;
+	}
+	if (ib->next_id != ib->first_id &&
+	    index_put_meta(indx_txn, ib->next_id) != BT_SUCCESS)
+		goto abort;
+
+	if (done) {
+		TAILQ_FOREACH(ai, &ns->indices, next)
+			ai->ready = 1;
+		ns->indx_ids = 1;
+		if (index_build_mark(ns, indx_txn) != BT_SUCCESS) {
+			index_read_ready(ns, NULL, NULL);
+			goto abort;
+		}
+	}
+
+	btree_txn_abort(data_txn);
+	if (btree_txn_commit(indx_txn) != BT_SUCCESS) {
+		if (done)
+			index_read_ready(ns, NULL, NULL);
+		goto fail;
+	}
+
+	st->scanned += nread;
+	st->keys += ib->nrun;
+	index_build_reset_run(ib);
+	btval_reset(&ib->last);
+	ib->last = next;
+
+	if (done) {
+		log_info("%s: indexed %llu entries with %llu keys in %lld"
+		    " seconds", ns->suffix, st->scanned, st->keys,
+		    (long long)(time(NULL) - st->started));
+		index_build_stop(ns);
+		return;
+	}
+	index_build_schedule(ib, 0);
+	return;
+
+abort:
+	btree_txn_abort(data_txn);
+	btree_txn_abort(indx_txn);
+fail:
+	log_warn("%s: index build failed", ns->suffix);
+	btval_reset(&next);
+	index_build_stop(ns);
+	return;
+
+retry:
+	/* Another worker is writing, or the namespace is being reopened. */
+	btval_reset(&next);
+	index_build_reset_run(ib);
+	index_build_schedule(ib, INDEX_BUILD_RETRY);
+}
+
+/* Starts building the indices of the namespace that are not yet built,
+ * in the first worker.
+ */
+int
+index_build_start(struct namespace *ns)
+{
+	struct index_build	*ib;
+
+	if (ns->index_build != NULL)
+		return 0;
+
+	if ((ib = calloc(1, sizeof(*ib))) == NULL)
+		return -1;
+	ib->ns = ns;
+	evtimer_set(&ib->ev, index_build_step, ib);
+	ns->index_build = ib;
+	index_build_schedule(ib, 0);
 	return 0;
 }
 
+void
+index_build_stop(struct namespace *ns)
+{
+	struct index_build	*ib = ns->index_build;
+
+	if (ib == NULL)
+		return;
+
+	if (evtimer_pending(&ib->ev, NULL))
+		evtimer_del(&ib->ev);
+	index_build_reset_run(ib);
+	free(ib->run);
+	btval_reset(&ib->last);
+	free(ib);
+	ns->index_build = NULL;
+	ns->index_build_stat.indices = 0;
+}
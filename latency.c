@@ -0,0 +1,412 @@
+/*	$OpenBSD$ */
+
+/*
+ * Copyright (c) 2026 agent <agent@local>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/* Latency histograms and the slow query log.
+ *
+ * Each request is timed from when it is read until it is freed, and
+ * counted in the histogram of its operation, both for its namespace and
+ * for all namespaces. A search also counts the time spent in each phase
+ * of its walk. The other workers report their counts to the first one,
+ * which answers the control requests, and start over.
+ */
+
+#include <sys/types.h>
+#include <sys/queue.h>
+#include <sys/time.h>
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "ldapd.h"
+#include "log.h"
+
+#define SLOWLOG_SIZE	 64	/* slow queries kept */
+
+static struct latency	 latency_all[LATENCY_KINDS];
+static struct slow_query slowlog[SLOWLOG_SIZE];
+static unsigned int	 slowlog_next, slowlog_count;
+
+static const char	*latency_walks[] = {
+	"full scan", "index scan", "index ids", "sorted"
+};
+
+static unsigned int
+latency_bucket(long long usec)
+{
+	unsigned int	 e;
+
+	if (usec < (1 << LATENCY_SUB_BITS))
+		return usec < 0 ? 0 : usec;
+	if (usec > UINT32_MAX)
+		usec = UINT32_MAX;
+
+	for (e = LATENCY_SUB_BITS; usec >> (e + 1) != 0; e++)
+		;
+	return ((e - LATENCY_SUB_BITS + 1) << LATENCY_SUB_BITS) +
+	    (usec >> (e - LATENCY_SUB_BITS)) - (1 << LATENCY_SUB_BITS);
+}
+
+/* Returns the nanoseconds since lap, which is moved to now.
+ */
+long long
+latency_lap(struct timespec *lap)
+{
+	struct timespec		 now;
+	long long		 nsec;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	nsec = (now.tv_sec - lap->tv_sec) * 1000000000LL +
+	    (now.tv_nsec - lap->tv_nsec);
+	*lap = now;
+	return nsec;
+}
+
+void
+latency_add(struct namespace *ns, enum latency_kind kind, long long usec)
+{
+	unsigned int	 b;
+
+	b = latency_bucket(usec);
+	latency_all[kind].count[b]++;
+	latency_all[kind].total++;
+	if (ns != NULL) {
+		ns->latency[kind].count[b]++;
+		ns->latency[kind].total++;
+	}
+}
+
+/* Counts the latency of a request that is being freed.
+ */
+void
+latency_request(struct request *req)
+{
+	struct timespec		 start;
+	enum latency_kind	 kind;
+
+	if (!timespecisset(&req->started))
+		return;
+
+	switch (req->type) {
+	case LDAP_REQ_BIND:
+		kind = LATENCY_BIND;
+		break;
+	case LDAP_REQ_SEARCH:
+		kind = LATENCY_SEARCH;
+		break;
+	case LDAP_REQ_COMPARE:
+		kind = LATENCY_COMPARE;
+		break;
+	case LDAP_REQ_ADD:
+		kind = LATENCY_ADD;
+		break;
+	case LDAP_REQ_MODIFY:
+		kind = LATENCY_MODIFY;
+		break;
+	case LDAP_REQ_DELETE_30:
+		kind = LATENCY_DELETE;
+		break;
+	case LDAP_REQ_EXTENDED:
+		kind = LATENCY_EXTENDED;
+		break;
+	default:
+		return;
+	}
+
+	start = req->started;
+	latency_add(req->ns, kind, latency_lap(&start) / 1000);
+}
+
+/* Appends s to buf, escaped as a filter value if value is set.
+ */
+static void
+latency_append(char *buf, size_t size, const char *s, int value)
+{
+	char		 c[4];
+
+	if (!value) {
+		strlcat(buf, s, size);
+		return;
+	}
+	for (; *s != '\0'; s++) {
+		if (strchr("*()\\", *s) != NULL)
+			snprintf(c, sizeof(c), "\\%02x", (u_char)*s);
+		else {
+			c[0] = *s;
+			c[1] = '\0';
+		}
+		if (strlcat(buf, c, size) >= size)
+			break;
+	}
+}
+
+/* Formats the search filter as a string (RFC 4515), truncated to size.
+ */
+static void
+latency_filter(struct ber_element *filter, char *buf, size_t size)
+{
+	struct ber_element	*elm;
+	char			*attr, *s;
+
+	strlcat(buf, "(", size);
+	switch (filter->be_type) {
+	case LDAP_FILT_AND:
+	case LDAP_FILT_OR:
+	case LDAP_FILT_NOT:
+		strlcat(buf, filter->be_type == LDAP_FILT_AND ? "&" :
+		    filter->be_type == LDAP_FILT_OR ? "|" : "!", size);
+		for (elm = filter->be_sub; elm != NULL; elm = elm->be_next)
+			if (elm->be_encoding != BER_TYPE_EOC)
+				latency_filter(elm, buf, size);
+		break;
+	case LDAP_FILT_EQ:
+	case LDAP_FILT_GE:
+	case LDAP_FILT_LE:
+	case LDAP_FILT_APPR:
+		if (ber_scanf_elements(filter, "{ss", &attr, &s) != 0)
+			break;
+		latency_append(buf, size, attr, 0);
+		latency_append(buf, size, filter->be_type == LDAP_FILT_EQ ?
+		    "=" : filter->be_type == LDAP_FILT_GE ? ">=" :
+		    filter->be_type == LDAP_FILT_LE ? "<=" : "~=", 0);
+		latency_append(buf, size, s, 1);
+		break;
+	case LDAP_FILT_SUBS:
+		if (ber_scanf_elements(filter, "{s{e", &attr, &elm) != 0)
+			break;
+		latency_append(buf, size, attr, 0);
+		latency_append(buf, size, "=", 0);
+		for (; elm != NULL; elm = elm->be_next) {
+			if (ber_get_string(elm, &s) != 0)
+				continue;
+			if (elm->be_type != LDAP_FILT_SUBS_INIT)
+				latency_append(buf, size, "*", 0);
+			latency_append(buf, size, s, 1);
+			if (elm->be_type == LDAP_FILT_SUBS_FIN)
+				break;
+		}
+		if (elm == NULL)
+			latency_append(buf, size, "*", 0);
+		break;
+	case LDAP_FILT_PRES:
+		if (ber_get_string(filter, &attr) != 0)
+			break;
+		latency_append(buf, size, attr, 0);
+		latency_append(buf, size, "=*", 0);
+		break;
+	default:
+		strlcat(buf, "?", size);
+		break;
+	}
+	strlcat(buf, ")", size);
+}
+
+/* Counts the phases of a search whose walk has ended, and logs it if it
+ * was slow. The time not spent in any phase is spent waiting.
+ */
+void
+latency_search(struct search *search, long long result)
+{
+	struct slow_query	 sq;
+	struct timespec		 start;
+	long long		 usec, phase, waited;
+	int			 i;
+
+	if (search->req == NULL || !timespecisset(&search->req->started))
+		return;
+
+	start = search->req->started;
+	usec = latency_lap(&start) / 1000;
+
+	memset(&sq, 0, sizeof(sq));
+	waited = usec;
+	for (i = 0; i < LATENCY_PHASES - 1; i++) {
+		phase = search->phase_nsec[i] / 1000;
+		latency_add(search->ns, LATENCY_PLAN + i, phase);
+		sq.phase_usec[i] = phase;
+		waited -= phase;
+	}
+	if (waited < 0)
+		waited = 0;
+	latency_add(search->ns, LATENCY_WAIT, waited);
+	sq.phase_usec[LATENCY_WAIT - LATENCY_PLAN] = waited;
+
+	if (conf->slow_query == 0 || usec < conf->slow_query * 1000LL)
+		return;
+
+	sq.time = time(NULL);
+	sq.usec = usec > UINT32_MAX ? UINT32_MAX : usec;
+	sq.nscanned = search->nscanned;
+	sq.nmatched = search->nmatched;
+	sq.scope = search->scope;
+	sq.result = result;
+	if (search->basedn != NULL)
+		strlcpy(sq.basedn, search->basedn, sizeof(sq.basedn));
+	if (search->filter != NULL)
+		latency_filter(search->filter, sq.filter, sizeof(sq.filter));
+	if (search->plan == NULL)
+		strlcpy(sq.plan, "base", sizeof(sq.plan));
+	else if (search->plan->indexed)
+		snprintf(sq.plan, sizeof(sq.plan), "%s, %llu estimated",
+		    latency_walks[search->walk], search->plan->estimate);
+	else
+		strlcpy(sq.plan, latency_walks[search->walk],
+		    sizeof(sq.plan));
+
+	log_info("slow search: %lld ms, base %s, scope %lld, filter %s,"
+	    " %s, %u scanned, %u matched", usec / 1000, sq.basedn,
+	    sq.scope, sq.filter, sq.plan, sq.nscanned, sq.nmatched);
+	slowlog_add(&sq);
+}
+
+/* Adds the counts reported by another worker.
+ */
+void
+latency_merge(struct latency_stat *ls)
+{
+	struct namespace	*ns;
+	struct latency		*l = NULL;
+	int			 i;
+
+	if (ls->kind < 0 || ls->kind >= LATENCY_KINDS)
+		return;
+	ls->suffix[sizeof(ls->suffix) - 1] = '\0';
+
+	if (ls->suffix[0] == '\0')
+		l = &latency_all[ls->kind];
+	else {
+		TAILQ_FOREACH(ns, &conf->namespaces, next) {
+			if (strcmp(ns->suffix, ls->suffix) == 0) {
+				l = &ns->latency[ls->kind];
+				break;
+			}
+		}
+	}
+	if (l == NULL)
+		return;
+
+	l->total += ls->latency.total;
+	for (i = 0; i < LATENCY_BUCKETS; i++)
+		l->count[i] += ls->latency.count[i];
+}
+
+/* Sends the histograms that have counts, with the message type.
+ */
+static int
+latency_compose(struct imsgev *iev, int type, struct latency *l,
+    const char *suffix, int reset)
+{
+	struct latency_stat	*ls;
+	int			 kind, rc = 0;
+
+	if ((ls = calloc(1, sizeof(*ls))) == NULL)
+		return -1;
+	strlcpy(ls->suffix, suffix, sizeof(ls->suffix));
+	for (kind = 0; kind < LATENCY_KINDS; kind++) {
+		if (l[kind].total == 0)
+			continue;
+		ls->kind = kind;
+		ls->latency = l[kind];
+		if (imsgev_compose(iev, type, 0, iev->ibuf.pid, -1, ls,
+		    sizeof(*ls)) == -1)
+			rc = -1;
+		if (reset)
+			memset(&l[kind], 0, sizeof(l[kind]));
+	}
+	free(ls);
+	return rc;
+}
+
+/* Reports the counts and slow queries of this worker to the first
+ * worker, and starts over.
+ */
+void
+latency_report(struct imsgev *iev)
+{
+	struct namespace	*ns;
+	unsigned int		 i;
+
+	latency_compose(iev, IMSG_LDAPE_LATENCY, latency_all, "", 1);
+	TAILQ_FOREACH(ns, &conf->namespaces, next) {
+		if (!namespace_has_referrals(ns))
+			latency_compose(iev, IMSG_LDAPE_LATENCY, ns->latency,
+			    ns->suffix, 1);
+	}
+
+	for (i = 0; i < slowlog_count; i++)
+		imsgev_compose(iev, IMSG_LDAPE_SLOWQUERY, 0, 0, -1,
+		    &slowlog[(slowlog_next + SLOWLOG_SIZE - slowlog_count + i) %
+		    SLOWLOG_SIZE], sizeof(struct slow_query));
+	slowlog_count = 0;
+}
+
+/* Answers a control request for the latency histograms.
+ */
+int
+latency_send(struct imsgev *iev)
+{
+	struct namespace	*ns;
+
+	if (latency_compose(iev, IMSG_CTL_LATENCY, latency_all, "", 0) != 0)
+		return -1;
+	TAILQ_FOREACH(ns, &conf->namespaces, next) {
+		if (!namespace_has_referrals(ns) &&
+		    latency_compose(iev, IMSG_CTL_LATENCY, ns->latency,
+		    ns->suffix, 0) != 0)
+			return -1;
+	}
+
+	return imsgev_compose(iev, IMSG_CTL_END, 0, iev->ibuf.pid, -1,
+	    NULL, 0);
+}
+
+/* Keeps a slow query, dropping the oldest one if the log is full.
+ */
+void
+slowlog_add(struct slow_query *sq)
+{
+	sq->basedn[sizeof(sq->basedn) - 1] = '\0';
+	sq->filter[sizeof(sq->filter) - 1] = '\0';
+	sq->plan[sizeof(sq->plan) - 1] = '\0';
+
+	slowlog[slowlog_next] = *sq;
+	slowlog_next = (slowlog_next + 1) % SLOWLOG_SIZE;
+	if (slowlog_count < SLOWLOG_SIZE)
+		slowlog_count++;
+}
+
+/* Answers a control request for the slow query log, oldest first.
+ */
+int
+slowlog_send(struct imsgev *iev)
+{
+	unsigned int	 i;
+
+	for (i = 0; i < slowlog_count; i++) {
+		if (imsgev_compose(iev, IMSG_CTL_SLOWLOG, 0, iev->ibuf.pid,
+		    -1, &slowlog[(slowlog_next + SLOWLOG_SIZE -
+		    slowlog_count + i) % SLOWLOG_SIZE],
+		    sizeof(struct slow_query)) == -1)
+			return -1;
+	}
+
+	return imsgev_compose(iev, IMSG_CTL_END, 0, iev->ibuf.pid, -1,
+	    NULL, 0);
+}
@@ -47,14 +47,19 @@ static void	 ldapd_imsgev(struct imsgev *iev, int code, struct imsg *imsg);
 static void	 ldapd_needfd(struct imsgev *iev);
 static void	 ldapd_auth_request(struct imsgev *iev, struct imsg *imsg);
 static void	 ldapd_open_request(struct imsgev *iev, struct imsg *imsg);
-static void	 ldapd_log_verbose(struct imsg *imsg);
+static void	 ldapd_rename_request(struct imsgev *iev, struct imsg *imsg);
+static void	 ldapd_log_verbose(struct imsgev *iev, struct imsg *imsg);
+static void	 ldapd_worker_stats(struct imsgev *iev, struct imsg *imsg);
+static void	 ldapd_ticket_rekey(int fd, short why, void *data);
 static void	 ldapd_cleanup(char *);
 static pid_t	 start_child(enum ldapd_process, char *, int, int, int,
-		    char *, char *);
+		    char *, char *, int);
 
 struct ldapd_stats	 stats;
-pid_t			 ldape_pid;
+pid_t			 ldape_pids[MAX_WORKERS];
+struct imsgev		*iev_ldape[MAX_WORKERS];
 const char		*datadir = DATADIR;
+static struct event	 ev_rekey;
 
 void
 usage(void)
@@ -62,7 +67,7 @@ usage(void)
 	extern char	*__progname;
 
 	fprintf(stderr, "usage: %s [-dnv] [-D macro=value] "
-	    "[-f file] [-r directory] [-s file]\n", __progname);
+	    "[-f file] [-I file] [-r directory] [-s file]\n", __progname);
 	exit(1);
 }
 
@@ -78,7 +83,7 @@ void
 ldapd_sigchld_handler(int sig, short why, void *data)
 {
 	pid_t		 pid;
-	int		 status;
+	int		 status, i;
 
 	while ((pid = waitpid(WAIT_ANY, &status, WNOHANG)) != 0) {
 		if (pid == -1) {
@@ -98,7 +103,11 @@ ldapd_sigchld_handler(int sig, short why, void *data)
 		else
 			log_debug("child %d terminated abnormally", pid);
 
-		if (pid == ldape_pid) {
+		for (i = 0; i < conf->workers; i++) {
+			if (pid == ldape_pids[i])
+				break;
+		}
+		if (i < conf->workers) {
 			log_info("ldapd: lost ldap server");
 			event_loopexit(NULL);
 			break;
@@ -109,19 +118,22 @@ ldapd_sigchld_handler(int sig, short why, void *data)
 int
 main(int argc, char *argv[])
 {
-	int			 c;
+	int			 c, i;
 	int			 debug = 0, verbose = 0, eflag = 0;
-	int			 configtest = 0;
+	int			 configtest = 0, worker = 0;
 	int			 pipe_parent2ldap[2];
+	int			 ldape_fds[MAX_WORKERS];
+	const char		*errstr;
 	char			*conffile = CONFFILE;
+	char			*importfile = NULL;
 	char			*csockpath = LDAPD_SOCKET;
 	char			*saved_argv0;
-	struct imsgev		*iev_ldape;
 	struct event		 ev_sigint;
 	struct event		 ev_sigterm;
 	struct event		 ev_sigchld;
 	struct event		 ev_sighup;
 	struct stat		 sb;
+	struct listener		*l;
 
 	log_init(1);		/* log to stderr until daemonized */
 
@@ -129,7 +141,7 @@ main(int argc, char *argv[])
 	if (saved_argv0 == NULL)
 		saved_argv0 = "ldapd";
 
-	while ((c = getopt(argc, argv, "dhvD:f:nr:s:E")) != -1) {
+	while ((c = getopt(argc, argv, "dhvD:f:I:nr:s:Ew:")) != -1) {
 
 		switch (c) {
 		case 'd':
@@ -147,6 +159,9 @@ main(int argc, char *argv[])
 		case 'h':
 			usage();
 			/* NOTREACHED */
+		case 'I':
+			importfile = optarg;
+			break;
 		case 'n':
 			configtest = 1;
 			break;
@@ -162,6 +177,12 @@ main(int argc, char *argv[])
 		case 'E':
 			eflag = 1;
 			break;
+		case 'w':
+			worker = strtonum(optarg, 0, MAX_WORKERS - 1, &errstr);
+			if (errstr != NULL)
+				errx(1, "worker number is %s: %s", errstr,
+				    optarg);
+			break;
 		default:
 			usage();
 			/* NOTREACHED */
@@ -193,13 +214,16 @@ main(int argc, char *argv[])
 	}
 
 	if (eflag)
-		ldape(debug, verbose, csockpath);
+		ldape(debug, verbose, csockpath, worker);
 
 	if (stat(datadir, &sb) == -1)
 		err(1, "%s", datadir);
 	if (!S_ISDIR(sb.st_mode))
 		errx(1, "%s is not a directory", datadir);
 
+	if (importfile != NULL)
+		exit(import_ldif(importfile) == 0 ? 0 : 1);
+
 	if (!debug) {
 		if (daemon(1, 0) == -1)
 			err(1, "failed to daemonize");
@@ -208,12 +232,17 @@ main(int argc, char *argv[])
 	log_init(debug);
 	log_info("startup");
 
-	if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC | SOCK_NONBLOCK,
-	    PF_UNSPEC, pipe_parent2ldap) != 0)
-		fatal("socketpair");
-	
-	ldape_pid = start_child(PROC_LDAP_SERVER, saved_argv0,
-	    pipe_parent2ldap[1], debug, verbose, csockpath, conffile);
+	for (i = 0; i < conf->workers; i++) {
+		if (socketpair(AF_UNIX,
+		    SOCK_STREAM | SOCK_CLOEXEC | SOCK_NONBLOCK,
+		    PF_UNSPEC, pipe_parent2ldap) != 0)
+			fatal("socketpair");
+
+		ldape_pids[i] = start_child(PROC_LDAP_SERVER, saved_argv0,
+		    pipe_parent2ldap[1], debug, verbose, csockpath, conffile,
+		    i);
+		ldape_fds[i] = pipe_parent2ldap[0];
+	}
 
 	setproctitle("auth");
 	event_init();
@@ -228,10 +257,22 @@ main(int argc, char *argv[])
 	signal_add(&ev_sighup, NULL);
 	signal(SIGPIPE, SIG_IGN);
 
-	if ((iev_ldape = calloc(1, sizeof(struct imsgev))) == NULL)
-		fatal("calloc");
-	imsgev_init(iev_ldape, pipe_parent2ldap[0], NULL, ldapd_imsgev,
-	    ldapd_needfd);
+	for (i = 0; i < conf->workers; i++) {
+		if ((iev_ldape[i] = calloc(1, sizeof(struct imsgev))) == NULL)
+			fatal("calloc");
+		imsgev_init(iev_ldape[i], ldape_fds[i], NULL, ldapd_imsgev,
+		    ldapd_needfd);
+	}
+
+	if (conf->tls_session_lifetime > 0) {
+		TAILQ_FOREACH(l, &conf->listeners, entry)
+			if (l->flags & F_SSL)
+				break;
+		if (l != NULL) {
+			evtimer_set(&ev_rekey, ldapd_ticket_rekey, NULL);
+			ldapd_ticket_rekey(-1, 0, NULL);
+		}
+	}
 
 	if (pledge("stdio rpath wpath cpath getpw sendfd proc exec",
 	    NULL) == -1)
@@ -276,11 +317,20 @@ ldapd_imsgev(struct imsgev *iev, int code, struct imsg *imsg)
 			ldapd_auth_request(iev, imsg);
 			break;
 		case IMSG_CTL_LOG_VERBOSE:
-			ldapd_log_verbose(imsg);
+			ldapd_log_verbose(iev, imsg);
 			break;
 		case IMSG_LDAPD_OPEN:
 			ldapd_open_request(iev, imsg);
 			break;
+		case IMSG_LDAPD_RENAME:
+			ldapd_rename_request(iev, imsg);
+			break;
+		case IMSG_LDAPE_STATS:
+		case IMSG_LDAPE_NSSTATS:
+		case IMSG_LDAPE_LATENCY:
+		case IMSG_LDAPE_SLOWQUERY:
+			ldapd_worker_stats(iev, imsg);
+			break;
 		default:
 			log_debug("%s: unexpected imsg %d",
 			    __func__, imsg->hdr.type);
@@ -298,6 +348,35 @@ ldapd_imsgev(struct imsgev *iev, int code, struct imsg *imsg)
 	}
 }
 
+/* Sends a new session ticket key to the workers. The workers keep the
+ * last four keys, so a ticket stays valid for the session lifetime.
+ */
+static void
+ldapd_ticket_rekey(int fd, short why, void *data)
+{
+	static uint32_t		 keyrev;
+	struct ldapd_ticket_key	 key;
+	struct timeval		 tv;
+	int			 i;
+
+	if (keyrev == 0)
+		keyrev = arc4random();
+	key.keyrev = keyrev++;
+	arc4random_buf(key.key, sizeof(key.key));
+	for (i = 0; i < conf->workers; i++)
+		imsgev_compose(iev_ldape[i], IMSG_LDAPD_TICKET_KEY, 0, 0, -1,
+		    &key, sizeof(key));
+	explicit_bzero(&key, sizeof(key));
+
+	/* libtls keeps the last four keys, each for the lifetime after it
+	 * was added, so a ticket made just before a new key stays valid for
+	 * three quarters of the lifetime.
+	 */
+	timerclear(&tv);
+	tv.tv_sec = conf->tls_session_lifetime / 4;
+	evtimer_add(&ev_rekey, &tv);
+}
+
 static void
 ldapd_needfd(struct imsgev *iev)
 {
@@ -366,15 +445,61 @@ ldapd_auth_request(struct imsgev *iev, struct imsg *imsg)
 }
 
 static void
-ldapd_log_verbose(struct imsg *imsg)
+ldapd_log_verbose(struct imsgev *iev, struct imsg *imsg)
 {
-	int	 verbose;
+	int	 verbose, i;
 
 	if (imsg->hdr.len != sizeof(verbose) + IMSG_HEADER_SIZE)
 		fatal("invalid size of log verbose request");
 
 	bcopy(imsg->data, &verbose, sizeof(verbose));
 	log_verbose(verbose);
+
+	/* Tell the workers that didn't get the control request. */
+	for (i = 0; i < conf->workers; i++) {
+		if (iev_ldape[i] != iev)
+			imsgev_compose(iev_ldape[i], IMSG_CTL_LOG_VERBOSE, 0,
+			    0, -1, &verbose, sizeof(verbose));
+	}
+}
+
+/* Relays the statistics, database statistics, latencies and slow queries
+ * of a worker to the first worker, which answers control requests.
+ */
+static void
+ldapd_worker_stats(struct imsgev *iev, struct imsg *imsg)
+{
+	size_t	 len;
+	int	 i;
+
+	switch (imsg->hdr.type) {
+	case IMSG_LDAPE_NSSTATS:
+		len = sizeof(struct ns_stat);
+		break;
+	case IMSG_LDAPE_LATENCY:
+		len = sizeof(struct latency_stat);
+		break;
+	case IMSG_LDAPE_SLOWQUERY:
+		len = sizeof(struct slow_query);
+		break;
+	default:
+		len = sizeof(struct ldapd_stats);
+		break;
+	}
+	if (imsg->hdr.len != len + IMSG_HEADER_SIZE)
+		fatal("invalid size of worker stats");
+
+	for (i = 1; i < conf->workers; i++) {
+		if (iev_ldape[i] == iev)
+			break;
+	}
+	if (i == conf->workers) {
+		log_warnx("unexpected worker stats");
+		return;
+	}
+
+	imsgev_compose(iev_ldape[0], imsg->hdr.type, i, 0, -1, imsg->data,
+	    len);
 }
 
 static void
@@ -408,11 +533,47 @@ ldapd_open_request(struct imsgev *iev, struct imsg *imsg)
 	    sizeof(*oreq));
 }
 
+/* Replaces a database with the file written by online compaction.
+ */
+static void
+ldapd_rename_request(struct imsgev *iev, struct imsg *imsg)
+{
+	struct rename_req	*rreq = imsg->data;
+	char			 from[PATH_MAX];
+
+	if (imsg->hdr.len != sizeof(*rreq) + IMSG_HEADER_SIZE)
+		fatal("invalid size of rename request");
+
+	/* make sure path is null-terminated */
+	rreq->path[PATH_MAX] = '\0';
+
+	if (strncmp(rreq->path, datadir, strlen(datadir)) != 0) {
+		log_warnx("refusing to rename file %s", rreq->path);
+		fatal("ldape sent invalid rename request");
+	}
+
+	rreq->error = 0;
+	if ((size_t)snprintf(from, sizeof(from), "%s.compact", rreq->path) >=
+	    sizeof(from))
+		rreq->error = ENAMETOOLONG;
+	else {
+		log_debug("renaming [%s] to [%s]", from, rreq->path);
+		if (rename(from, rreq->path) == -1) {
+			rreq->error = errno;
+			log_warn("%s", from);
+		}
+	}
+
+	imsgev_compose(iev, IMSG_LDAPD_RENAME_RESULT, 0, 0, -1, rreq,
+	    sizeof(*rreq));
+}
+
 static pid_t
 start_child(enum ldapd_process p, char *argv0, int fd, int debug,
-    int verbose, char *csockpath, char *conffile)
+    int verbose, char *csockpath, char *conffile, int worker)
 {
-	char		*argv[9];
+	char		*argv[11];
+	char		 wbuf[16];
 	int		 argc = 0;
 	pid_t		 pid;
 
@@ -435,6 +596,11 @@ start_child(enum ldapd_process p, char *argv0, int fd, int debug,
 		fatalx("Can not start main process");
 	case PROC_LDAP_SERVER:
 		argv[argc++] = "-E";
+		if (worker > 0) {
+			snprintf(wbuf, sizeof(wbuf), "%d", worker);
+			argv[argc++] = "-w";
+			argv[argc++] = wbuf;
+		}
 		break;
 	}
 	if (debug)
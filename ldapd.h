@@ -46,7 +46,15 @@
 #define LDAPS_PORT		 636
 #define LDAPD_SESSION_TIMEOUT	 30
 #define MAX_LISTEN		 64
+#define MAX_WORKERS		 64
+#define MAX_PASSWD_HELPERS	 16
+#define DICT_MAX_SIZE		 2048	/* bytes of compression dictionary */
+#define DICT_SAMPLE		 256	/* entries to train it from */
+#define DICT_MIN_ENTRIES	 64	/* entries before it is trained */
 #define FD_RESERVE		 8 /* 5 overhead, 2 for db, 1 accept */
+#define SEARCH_LOWAT		 16384	/* resume searches below this */
+#define SEARCH_HIWAT		 65536	/* pause searches above this */
+#define TLS_SESSION_LIFETIME	 7200	/* default, seconds */
 
 #define F_STARTTLS		 0x01
 #define F_LDAPS			 0x02
@@ -57,6 +65,8 @@
 #define F_SCERT			 0x01
 
 struct conn;
+struct acl_index;
+struct filter_prog;
 
 struct aci {
 	SIMPLEQ_ENTRY(aci)	 entry;
@@ -86,8 +96,12 @@ struct request {
 	long long		 msgid;
 	struct ber_element	*root;
 	struct ber_element	*op;
+	struct ber_element	*controls;	/* or NULL */
 	struct conn		*conn;
+	struct namespace	*ns;		/* for latency, or NULL */
+	struct timespec		 started;	/* cleared if not timed */
 	int			 replayed;	/* true if replayed request */
+	struct ber_arena	 arena;		/* elements of the request */
 };
 TAILQ_HEAD(request_queue, request);
 
@@ -103,6 +117,8 @@ struct attr_index {
 	TAILQ_ENTRY(attr_index)	 next;
 	char			*attr;
 	enum index_type		 type;
+	int			 ready;		/* 1 = entries indexed */
+	time_t			 checked;	/* if still being built */
 };
 TAILQ_HEAD(attr_index_list, attr_index);
 
@@ -112,6 +128,89 @@ struct referral {
 };
 SLIST_HEAD(referrals, referral);
 
+/* A cached entry, or a DN that doesn't exist if data is NULL.
+ */
+struct cached_entry {
+	RB_ENTRY(cached_entry)	 link;
+	TAILQ_ENTRY(cached_entry) lru;
+	char			*dn;		/* normalized */
+	void			*data;		/* uncompressed stored entry */
+	size_t			 size;
+};
+RB_HEAD(cached_entry_tree, cached_entry);
+RB_PROTOTYPE(cached_entry_tree, cached_entry, link, cached_entry_cmp);
+TAILQ_HEAD(cached_entry_lru, cached_entry);
+
+struct entry_cache_stat {
+	unsigned long long	 entries;
+	unsigned long long	 hits;
+	unsigned long long	 misses;
+	unsigned long long	 evictions;
+	unsigned long long	 flushes;
+};
+
+struct compress_stat {
+	unsigned long long	 stored;	/* entries written */
+	unsigned long long	 raw_bytes;	/* their encoded size */
+	unsigned long long	 stored_bytes;	/* and compressed size */
+	unsigned long long	 inflated;	/* entries decompressed */
+	unsigned long long	 inflate_usec;	/* time spent decompressing */
+	size_t			 dict_size;	/* 0 = no dictionary */
+};
+
+struct entry_cache {
+	struct cached_entry_tree tree;
+	struct cached_entry_lru	 lru;		/* most recently used first */
+	size_t			 max_bytes;	/* 0 = disabled */
+	size_t			 bytes;
+	unsigned int		 revision;	/* of the data db cached */
+	struct entry_cache_stat	 stat;
+};
+
+/* Histogram of latencies in microseconds. Latencies below 8 usec are
+ * counted exactly and larger ones in 8 buckets per power of two, so a
+ * bucket has a precision of 1/8, as in HDR histograms.
+ */
+#define LATENCY_SUB_BITS	 3
+#define LATENCY_BUCKETS		 ((32 - LATENCY_SUB_BITS + 1) << LATENCY_SUB_BITS)
+
+enum latency_kind {
+	LATENCY_BIND,
+	LATENCY_SEARCH,
+	LATENCY_COMPARE,
+	LATENCY_ADD,
+	LATENCY_MODIFY,
+	LATENCY_DELETE,
+	LATENCY_EXTENDED,
+	LATENCY_PLAN,			/* phases of a search */
+	LATENCY_SCAN,			/* index scan */
+	LATENCY_FETCH,			/* data fetch */
+	LATENCY_DECODE,
+	LATENCY_ACL,
+	LATENCY_FILTER,
+	LATENCY_ENCODE,
+	LATENCY_WAIT,			/* queued or output blocked */
+	LATENCY_KINDS
+};
+#define LATENCY_PHASES		 (LATENCY_KINDS - LATENCY_PLAN)
+
+struct latency {
+	unsigned long long	 total;		/* latencies counted */
+	unsigned long long	 count[LATENCY_BUCKETS];
+};
+
+/* Progress of building the indices added to a namespace.
+ */
+struct index_build_stat {
+	unsigned int		 indices;	/* being built, 0 = none */
+	time_t			 started;
+	unsigned long long	 entries;	/* in the namespace at start */
+	unsigned long long	 scanned;	/* entries indexed */
+	unsigned long long	 keys;		/* index keys written */
+	unsigned long long	 rescans;	/* steps made again */
+};
+
+struct index_build;
 struct namespace {
 	TAILQ_ENTRY(namespace)	 next;
 	char			*suffix;
@@ -124,16 +223,53 @@ struct namespace {
 	struct btree		*indx_db;
 	struct btree_txn	*data_txn;
 	struct btree_txn	*indx_txn;
+	int			 data_reopen;	/* 1 = waiting for new data fd */
+	int			 indx_reopen;	/* 1 = waiting for new indx fd */
+	int			 indx_unusable;	/* 1 = indx db in old layout */
+	int			 indx_ids;	/* 1 = all entries have IDs */
+	time_t			 indx_checked;
 	int			 sync;		/* 1 = fsync after commit */
 	struct attr_index_list	 indices;
-	unsigned int		 cache_size;
+	unsigned int		 cache_size;	/* in pages */
 	unsigned int		 index_cache_size;
+	long long		 cache_bytes;	/* overrides cache_size */
+	long long		 index_cache_bytes;
+	struct entry_cache	 entry_cache;
 	struct request_queue	 request_queue;
 	struct event		 ev_queue;
 	unsigned int		 queued_requests;
 	struct acl		 acl;
+	struct acl_index	*acl_index;	/* compiled global and ns acl */
 	int			 relax;		/* relax schema validation */
+	unsigned int		 changelog;	/* changes kept, 0 = no log */
 	int			 compression_level;	/* 0-9, 0 = disabled */
+	int			 compression_dict;	/* 1 = train dictionary */
+	struct btval		 dict;		/* of the data db, if any */
+	unsigned int		 dict_revision;	/* of the data db loaded */
+	int			 dict_valid;
+	unsigned long long	 dict_tried;	/* entries at last training */
+	struct compress_stat	 compress_stat;
+	int			 mmap;		/* 1 = read pages via mmap */
+	unsigned int		 group_commit;	/* batch window in msec, 0 = off */
+	unsigned int		 group_commit_limit;	/* max ops per batch */
+	struct btree_txn	*group_data_txn;	/* open batch, if any */
+	struct btree_txn	*group_indx_txn;
+	struct request_queue	 commit_queue;	/* results held for the batch */
+	unsigned int		 group_ops;
+	struct event		 ev_commit;
+	int			 op_dirty;	/* current op has written */
+	struct btree_compact	*compact;	/* online compaction, if any */
+	int			 compact_phase;
+#define COMPACT_NONE		 0
+#define COMPACT_DATA		 1
+#define COMPACT_INDX		 2
+	char			*compact_path;	/* file being written */
+	struct event		 ev_compact;
+	struct index_build	*index_build;	/* in the first worker */
+	struct index_build_stat	 index_build_stat;
+	struct latency		 latency[LATENCY_KINDS];
+	struct btree_stat	*worker_data_stat; /* of each worker, */
+	struct btree_stat	*worker_indx_stat; /* in the first */
 };
 
 TAILQ_HEAD(namespace_list, namespace);
@@ -142,6 +278,17 @@ struct index
 {
 	TAILQ_ENTRY(index)	 next;
 	char			*prefix;
+	char			*start;		/* first key, or NULL */
+	char			*stop;		/* keys sort before, or NULL */
+	int			 partial;	/* 1 = prefix of the values */
+};
+
+/* The entry IDs found in the indices of a plan, sorted and unique.
+ */
+struct idset {
+	uint32_t		*ids;
+	size_t			 nids;
+	size_t			 maxids;
 };
 
 /* A query plan.
@@ -152,6 +299,7 @@ struct plan
 	TAILQ_HEAD(, plan)	 args;
 	TAILQ_HEAD(, index)	 indices;
 	struct attr_type	*at;
+	const struct match_rule	*ordering;
 	char			*adesc;
 	union {
 		char			*value;
@@ -160,22 +308,65 @@ struct plan
 	int			 op;
 	int			 indexed;
 	int			 undefined;
+	unsigned long long	 estimate;	/* approx. matching entries */
+	struct idset		 idset;		/* loaded indices */
+	struct index		 range;		/* bounds of GE and LE */
 };
 
-/* For OR filters using multiple indices, matches are not unique. Remember
- * all DNs sent to the client to make them unique.
+/* Server side sorting (RFC 2891).
  */
-struct uniqdn {
-	RB_ENTRY(uniqdn)	 link;
-	struct btval		 key;
+#define MAX_SORT_KEYS		 8
+
+enum sort_phase {
+	SORT_INDEX,			/* walking the ordering index */
+	SORT_REST,			/* entries not in the ordering index */
+	SORT_COLLECT,			/* collecting entries to sort */
+	SORT_SEND			/* sending the sorted entries */
+};
+
+struct sort_key {
+	char			*attr;
+	struct attr_type	*at;
+	const struct match_rule	*rule;
+	int			 reverse;
+};
+
+struct sort_entry {
+	struct btval		 dn;
+	char			*values[MAX_SORT_KEYS];	/* smallest */
+};
+
+struct sort {
+	struct namespace	*ns;
+	struct sort_key		 keys[MAX_SORT_KEYS];
+	int			 nkeys;
+	int			 critical;
+	enum sort_phase		 phase;
+	long long		 result;	/* sortResult */
+	struct index		 indx;		/* walked in SORT_INDEX */
+	struct btval		*ikey;		/* current key of indx */
+	struct sort_entry	*entries;
+	size_t			 nentries, maxentries;
+	size_t			 next;		/* next entry to send */
+	uint32_t		 id;		/* of the cookie, or 0 */
+	int			 kept;		/* entries of an earlier page */
+};
+
+/* How a search walks the databases.
+ */
+enum search_walk {
+	WALK_DATA,			/* cursor over the data db */
+	WALK_INDEX,			/* cursor over cindx */
+	WALK_IDSET,			/* the merged plan->idset */
+	WALK_SORTED			/* the entries of sort */
 };
-RB_HEAD(dn_tree, uniqdn);
-RB_PROTOTYPE(dn_tree, uniqdn, link, uniqdn_cmp);
 
 /* An LDAP search request.
  */
 struct search {
 	TAILQ_ENTRY(search)	 next;
+	TAILQ_ENTRY(search)	 runq;
+	int			 queued;	/* 1 if on the run queue */
 	int			 init;		/* 1 if cursor initiated */
 	struct conn		*conn;
 	struct request		*req;
@@ -183,7 +374,7 @@ struct search {
 	struct btree_txn	*data_txn;
 	struct btree_txn	*indx_txn;
 	struct cursor		*cursor;
-	unsigned int		 nscanned, nmatched, ndups;
+	unsigned int		 nscanned, nmatched, ndups, nfiltered;
 	time_t			 started_at;
 	long long		 szlim, tmlim;	/* size and time limits */
 	int			 typesonly;	/* not implemented */
@@ -192,8 +383,38 @@ struct search {
 	char			*basedn;
 	struct ber_element	*filter, *attrlist;
 	struct plan		*plan;
+	struct filter_prog	*prog;		/* compiled plan */
 	struct index		*cindx;		/* current index */
-	struct dn_tree		 uniqdns;
+	size_t			 cid;		/* next id in plan->idset */
+	enum search_walk	 walk;
+	int			 loaded;	/* 1 if indices loaded */
+
+	/* simple paged results (RFC 2696) */
+	int			 paged;
+	long long		 pagesz;
+	unsigned int		 npaged;	/* entries sent in page */
+	char			 resume_mode;	/* walk of resume cookie */
+	struct btval		 resume;	/* position to resume after */
+	struct btval		 cookie;	/* position to continue */
+
+	struct sort		*sort;		/* or NULL */
+
+	int			 acl;		/* read access to all entries:
+						 * 1 = allowed, 0 = denied,
+						 * -1 = checked per entry */
+
+	struct timespec		 lap;		/* end of the last phase */
+	long long		 phase_nsec[LATENCY_PHASES];
+
+	/* persistent search */
+	int			 persist;	/* change types, or 0 */
+	int			 changes_only;
+	int			 return_ecs;
+	int			 persisting;	/* 1 once waiting for changes */
+	int			 notified;	/* 1 if changes may be pending */
+	uint64_t		 change;	/* next change to send */
+	struct change		*ecn;		/* change being sent */
+	TAILQ_ENTRY(search)	 persistq;
 };
 
 struct listener {
@@ -217,12 +438,15 @@ struct conn {
 	int			 fd;
 	struct bufferevent	*bev;
 	struct ber		 ber;
+	size_t			 pdu_len;	/* of the PDU being received */
 	int			 disconnect;
 	struct request		*bind_req;	/* ongoing bind request */
 	char			*binddn;
 	char			*pending_binddn;
 	TAILQ_HEAD(, search)	 searches;
+	struct ber_pool		 pool;		/* chunks for request arenas */
 	struct listener		*listener;	/* where it connected from */
+	struct sort		*sorted;	/* kept for the next page */
 
 	/* SSL support */
 	struct tls		*tls;
@@ -249,9 +473,15 @@ struct ldapd_config
 	SPLAY_HEAD(ssltree, ssl)	*sc_ssl;
 	struct referrals		 referrals;
 	struct acl			 acl;
+	struct acl_index		*acl_index;	/* compiled acl */
 	struct schema			*schema;
 	char				*rootdn;
 	char				*rootpw;
+	int				 workers;	/* ldape processes */
+	int				 password_helpers; /* per ldape */
+	unsigned int			 bind_cache_ttl;	/* seconds */
+	unsigned int			 slow_query;	/* msec, 0 = off */
+	unsigned int			 tls_session_lifetime; /* 0 = off */
 };
 
 struct ldapd_stats
@@ -267,6 +497,14 @@ struct ldapd_stats
 	unsigned int		 searches;	/* active searches */
 };
 
+/* Session ticket keys are made by the parent and shared by the workers,
+ * so a client can resume its session with any of them.
+ */
+struct ldapd_ticket_key {
+	uint32_t		 keyrev;
+	unsigned char		 key[TLS_TICKET_KEY_SIZE];
+};
+
 struct auth_req
 {
 	int			 fd;
@@ -275,6 +513,15 @@ struct auth_req
 	char			 password[128];
 };
 
+/* Sent to the password helpers of the ldape process. */
+struct passwd_req
+{
+	int			 fd;
+	long long		 msgid;
+	char			 hash[128];
+	char			 password[128];
+};
+
 struct auth_res
 {
 	int			 ok;
@@ -287,6 +534,11 @@ struct open_req {
 	unsigned int		 rdonly;
 };
 
+struct rename_req {
+	char			 path[PATH_MAX+1];	/* renamed from path.compact */
+	int			 error;			/* errno of rename */
+};
+
 enum imsg_type {
 	IMSG_NONE,
 	IMSG_CTL_OK,
@@ -295,17 +547,57 @@ enum imsg_type {
 	IMSG_CTL_STATS,
 	IMSG_CTL_NSSTATS,
 	IMSG_CTL_LOG_VERBOSE,
+	IMSG_CTL_COMPACT,
+	IMSG_CTL_LATENCY,
+	IMSG_CTL_SLOWLOG,
 
 	IMSG_LDAPD_AUTH,
 	IMSG_LDAPD_AUTH_RESULT,
 	IMSG_LDAPD_OPEN,
 	IMSG_LDAPD_OPEN_RESULT,
+	IMSG_LDAPD_RENAME,
+	IMSG_LDAPD_RENAME_RESULT,
+	IMSG_LDAPD_TICKET_KEY,
+	IMSG_LDAPE_STATS,
+	IMSG_LDAPE_NSSTATS,
+	IMSG_LDAPE_LATENCY,
+	IMSG_LDAPE_SLOWQUERY,
+	IMSG_PASSWD_CHECK,
+	IMSG_PASSWD_RESULT,
 };
 
 struct ns_stat {
 	char			 suffix[256];
 	struct btree_stat	 data_stat;
 	struct btree_stat	 indx_stat;
+	int			 compact_phase;
+	struct btree_compact_stat compact_stat;
+	struct entry_cache_stat	 entry_cache_stat;
+	struct compress_stat	 compress_stat;
+	struct index_build_stat	 index_build_stat;
+};
+
+/* The latencies of one kind of operation, over all namespaces if the
+ * suffix is empty.
+ */
+struct latency_stat {
+	char			 suffix[256];
+	int			 kind;
+	struct latency		 latency;
+};
+
+/* A search that took longer than the slow-query time.
+ */
+struct slow_query {
+	time_t			 time;		/* when it ended */
+	unsigned int		 usec;
+	unsigned int		 nscanned, nmatched;
+	unsigned int		 phase_usec[LATENCY_PHASES];
+	long long		 scope;
+	long long		 result;
+	char			 basedn[256];
+	char			 filter[512];
+	char			 plan[64];
 };
 
 struct ctl_conn {
@@ -351,14 +643,16 @@ void			 conn_read(struct bufferevent *bev, void *data);
 void			 conn_write(struct bufferevent *bev, void *data);
 void			 conn_err(struct bufferevent *bev, short w, void *data);
 void			 conn_accept(int fd, short why, void *data);
+struct conn		*conn_new(int fd, struct listener *l);
 void			 conn_close(struct conn *conn);
 int			 conn_close_any(void);
 void			 conn_disconnect(struct conn *conn);
 void			 request_dispatch(struct request *req);
 void			 request_free(struct request *req);
+unsigned long		 ldap_application(struct ber_element *elm);
 
 /* ldape.c */
-void			 ldape(int, int, char *);
+void			 ldape(int, int, char *, int);
 int			 ldap_abandon(struct request *req);
 int			 ldap_unbind(struct request *req);
 int			 ldap_compare(struct request *req);
@@ -366,6 +660,10 @@ int			 ldap_extended(struct request *req);
 
 void			 send_ldap_result(struct conn *conn, int msgid,
 				unsigned long type, long long result_code);
+void			 send_ldap_result_controls(struct conn *conn,
+				int msgid, unsigned long type,
+				long long result_code,
+				struct ber_element *controls);
 int			 ldap_respond(struct request *req, int code);
 int			 ldap_refer(struct request *req, const char *basedn,
 			     struct search *search, struct referrals *refs);
@@ -378,6 +676,10 @@ int			 namespace_reopen_data(struct namespace *ns);
 int			 namespace_reopen_indx(struct namespace *ns);
 int			 namespace_set_data_fd(struct namespace *ns, int fd);
 int			 namespace_set_indx_fd(struct namespace *ns, int fd);
+int			 namespace_compact(struct namespace *ns);
+int			 namespace_compact_fd(struct namespace *ns, int fd);
+void			 namespace_compact_renamed(struct namespace *ns,
+				int error);
 struct namespace	*namespace_init(const char *suffix, const char *dir);
 void			 namespace_close(struct namespace *ns);
 void			 namespace_remove(struct namespace *ns);
@@ -395,12 +697,16 @@ int			 namespace_has_referrals(struct namespace *ns);
 struct referrals	*namespace_referrals(const char *basedn);
 int			 namespace_has_index(struct namespace *ns,
 				const char *attr, enum index_type type);
+const struct match_rule *namespace_ordering(struct namespace *ns,
+				char *attr);
 int			 namespace_begin_txn(struct namespace *ns,
 				struct btree_txn **data_txn,
 				struct btree_txn **indx_txn, int rdonly);
 int			 namespace_begin(struct namespace *ns);
 int			 namespace_commit(struct namespace *ns);
 void			 namespace_abort(struct namespace *ns);
+int			 namespace_end(struct namespace *ns,
+				struct request *req, int rc);
 int			 namespace_queue_request(struct namespace *ns,
 				struct request *req);
 void			 namespace_queue_schedule(struct namespace *ns,
@@ -412,12 +718,15 @@ int			 namespace_ber2db(struct namespace *ns,
 				struct ber_element *root, struct btval *val);
 struct ber_element	*namespace_db2ber(struct namespace *ns,
 				struct btval *val);
+int			 namespace_db2raw(struct namespace *ns,
+				struct btval *val, struct btval *raw);
 
 /* attributes.c */
 struct ber_element	*ldap_get_attribute(struct ber_element *root,
 				const char *attr);
 struct ber_element	*ldap_find_attribute(struct ber_element *entry,
 				struct attr_type *at);
+struct attr_type	*ldap_attribute_type(struct ber_element *desc);
 struct ber_element	*ldap_find_value(struct ber_element *elm,
 				const char *value);
 struct ber_element	*ldap_add_attribute(struct ber_element *root,
@@ -440,17 +749,95 @@ void			 control_accept(int, short, void *);
 void			 control_dispatch_imsg(int, short, void *);
 void			 control_cleanup(struct control_sock *);
 int			 control_close_any(struct control_sock *);
+void			 control_worker_stats(int worker,
+			    struct ldapd_stats *st);
+void			 control_worker_nsstats(int worker,
+			    struct ns_stat *nss);
 
 /* filter.c */
-int			 ldap_matches_filter(struct ber_element *root,
-				struct plan *plan);
+struct filter_prog	*filter_compile(struct plan *plan);
+void			 filter_prog_free(struct filter_prog *prog);
+int			 filter_uses_attribute(struct filter_prog *prog,
+				const char *adesc, struct attr_type *at);
+void			 filter_reset(struct filter_prog *prog);
+void			 filter_bind(struct filter_prog *prog, int slot,
+				struct ber_element *elm);
+int			 filter_matches(struct filter_prog *prog);
 
 /* search.c */
 int			 ldap_search(struct request *req);
 void			 conn_search(struct search *search);
+void			 search_schedule(struct search *search);
 void			 search_close(struct search *search);
+void			 search_notify(struct namespace *ns);
 int			 is_child_of(struct btval *key, const char *base);
 
+/* cache.c */
+void			 entry_cache_init(struct entry_cache *cache,
+				size_t max_bytes);
+int			 entry_cache_get(struct entry_cache *cache,
+				const char *dn, struct btval *val);
+void			 entry_cache_put(struct entry_cache *cache,
+				const char *dn, struct btval *val);
+void			 entry_cache_remove(struct entry_cache *cache,
+				const char *dn);
+void			 entry_cache_flush(struct entry_cache *cache);
+
+/* changelog.c */
+#define CHANGELOG_OID		 "1.3.6.1.4.1.30155.4.1"
+
+/* A change read from the change log, pointing into raw.
+ */
+struct change {
+	uint64_t		 seq;
+	unsigned long		 op;		/* LDAP request type */
+	struct btval		 dn;
+	struct btval		 entry;		/* encoded entry, or empty */
+	struct btval		 raw;		/* decoded record */
+};
+
+int			 changelog_next(struct btree_txn *txn,
+				uint64_t *next);
+int			 changelog_get(struct namespace *ns,
+				struct btree_txn *txn, uint64_t seq,
+				struct change *change);
+int			 changelog_append(struct namespace *ns,
+				unsigned long op, char *dn,
+				struct ber_element *entry);
+int			 ldap_changelog(struct request *req,
+				struct ber_element **value);
+
+/* dict.c */
+int			 dict_train(struct btval *samples,
+				unsigned int nsamples, size_t max_size,
+				struct btval *dict);
+
+/* latency.c */
+long long		 latency_lap(struct timespec *lap);
+void			 latency_add(struct namespace *ns,
+				enum latency_kind kind, long long usec);
+void			 latency_request(struct request *req);
+void			 latency_search(struct search *search, long long result);
+void			 latency_merge(struct latency_stat *ls);
+void			 latency_report(struct imsgev *iev);
+int			 latency_send(struct imsgev *iev);
+void			 slowlog_add(struct slow_query *sq);
+int			 slowlog_send(struct imsgev *iev);
+
+/* sort.c */
+struct sort		*sort_new(struct namespace *ns,
+				struct ber_element *keys, int critical);
+int			 sort_plan(struct search *search);
+int			 sort_uses_attribute(struct sort *sort,
+				const char *adesc, struct attr_type *at);
+int			 sort_entry(struct search *search, struct btval *dn,
+				struct ber_element *entry);
+void			 sort_finish(struct sort *sort);
+int			 sort_resume(struct search *search);
+int			 sort_cookie(struct sort *sort, char **cookie);
+void			 sort_keep(struct search *search);
+void			 sort_free(struct sort *sort);
+
 /* modify.c */
 int			 ldap_add(struct request *req);
 int			 ldap_delete(struct request *req);
@@ -462,6 +849,19 @@ int			 ldap_bind(struct request *req);
 void			 ldap_bind_continue(struct conn *conn, int ok);
 int			 authorized(struct conn *conn, struct namespace *ns,
 				int rights, char *dn, int scope);
+int			 authorized_search(struct conn *conn,
+				struct namespace *ns, int rights,
+				char *basedn);
+
+/* passwd.c */
+void			 passwd_init(void);
+int			 passwd_check(struct request *req, const char *binddn,
+				const char *hash, const char *passwd);
+void			 passwd_cancel(struct request *req);
+int			 passwd_cached(const char *binddn, const char *hash,
+				const char *passwd);
+void			 passwd_cache(const char *binddn, const char *hash,
+				const char *passwd);
 
 /* parse.y */
 int			 parse_config(char *filename);
@@ -483,21 +883,60 @@ int			 has_suffix(struct btval *key, const char *suffix);
 int			 has_prefix(struct btval *key, const char *prefix);
 void			 normalize_dn(char *dn);
 int			 ber2db(struct ber_element *root, struct btval *val,
-			    int compression_level);
-struct ber_element	*db2ber(struct btval *val, int compression_level);
+			    int compression_level, struct btval *dict);
+struct ber_element	*db2ber(struct btval *val, int compression_level,
+			    struct btval *dict);
+int			 db2raw(struct btval *val, int compression_level,
+			    struct btval *dict, struct btval *raw);
 int			 accept_reserve(int sockfd, struct sockaddr *addr,
 			    socklen_t *addrlen, int reserve);
 
 /* index.c */
+#define INDEX_GRAM		 3	/* length of substring index keys */
+#define INDEX_GRAM_INIT		 0x01
+#define INDEX_GRAM_FINAL	 0x02
+
+#define ENTRY_ID_SIZE		 4	/* bytes of an entry ID in keys */
+
+typedef int		 (*gram_func)(const char *gram, void *arg);
+int			 index_grams(const char *s, int anchors,
+				gram_func fn, void *arg);
+typedef int		 (*index_func)(struct namespace *ns,
+				struct btval *key, struct btval *val,
+				void *arg);
+int			 index_usable(struct namespace *ns,
+				struct btree_txn *txn);
+int			 index_put_meta(struct btree_txn *txn,
+				uint32_t next_id);
+int			 index_new_id(struct namespace *ns, uint32_t *id);
+int			 index_dn2id(struct namespace *ns,
+				struct btree_txn *txn, struct btval *dn,
+				uint32_t *id);
+int			 index_id2dn(struct namespace *ns,
+				struct btree_txn *txn, uint32_t id,
+				struct btval *dn);
+uint32_t		 index_key_id(struct btval *key);
 int			 index_entry(struct namespace *ns, struct btval *dn,
-				struct ber_element *elm);
+				uint32_t id, struct ber_element *elm);
+int			 index_entry_keys(struct namespace *ns,
+				struct btval *dn, uint32_t id,
+				struct ber_element *elm, index_func fn,
+				void *arg);
 int			 unindex_entry(struct namespace *ns, struct btval *dn,
-				struct ber_element *elm);
-int			 index_to_dn(struct namespace *ns, struct btval *indx,
-				struct btval *dn);
+				uint32_t id, struct ber_element *elm);
+int			 index_built_keys(struct namespace *ns,
+				index_func fn, void *arg);
+int			 index_has_ids(struct namespace *ns);
+void			 index_check_ready(struct namespace *ns,
+				struct attr_index *ai);
+int			 index_build_start(struct namespace *ns);
+void			 index_build_stop(struct namespace *ns);
 
 /* validate.c */
 int	validate_entry(const char *dn, struct ber_element *entry, int relax);
 
+/* import.c */
+int			 import_ldif(const char *path);
+
 #endif /* _LDAPD_H */
 
@@ -36,18 +36,32 @@
 void			 ldape_sig_handler(int fd, short why, void *data);
 static void		 ldape_auth_result(struct imsg *imsg);
 static void		 ldape_open_result(struct imsg *imsg);
+static void		 ldape_rename_result(struct imsg *imsg);
+static void		 ldape_worker_stats(struct imsg *imsg);
+static void		 ldape_worker_nsstats(struct imsg *imsg);
+static void		 ldape_worker_latency(struct imsg *imsg);
+static void		 ldape_worker_slow_query(struct imsg *imsg);
+static void		 ldape_ticket_key(struct imsg *imsg);
+static void		 ldape_log_verbose(struct imsg *imsg);
+static void		 ldape_send_stats(int fd, short why, void *data);
 static void		 ldape_imsgev(struct imsgev *iev, int code,
 			    struct imsg *imsg);
 static void		 ldape_needfd(struct imsgev *iev);
 
-int			 ldap_starttls(struct request *req);
+int			 ldap_starttls(struct request *req,
+			    struct ber_element **value);
 void			 send_ldap_extended_response(struct conn *conn,
 				int msgid, unsigned long type,
 				long long result_code,
-				const char *extended_oid);
+				const char *extended_oid,
+				struct ber_element *value);
+
+#define WORKER_STATS_INTERVAL	 1	/* seconds between stats reports */
 
 struct imsgev		*iev_ldapd;
 struct control_sock	 csock;
+static int		 worker;	/* 0 is the first ldape process */
+static struct event	 ev_stats;
 
 void
 ldape_sig_handler(int sig, short why, void *data)
@@ -68,9 +82,13 @@ ldape_sig_handler(int sig, short why, void *data)
 	event_loopexit(NULL);
 }
 
-void
-send_ldap_extended_response(struct conn *conn, int msgid, unsigned long type,
-    long long result_code, const char *extended_oid)
+/* Sends an LDAP result. The extended response value and the controls,
+ * if any, are consumed.
+ */
+static void
+send_ldap_response(struct conn *conn, int msgid, unsigned long type,
+    long long result_code, const char *extended_oid,
+    struct ber_element *value, struct ber_element *controls)
 {
 	int			 rc;
 	struct ber_element	*root, *elm;
@@ -87,9 +105,19 @@ send_ldap_extended_response(struct conn *conn, int msgid, unsigned long type,
 		goto fail;
 
 	if (extended_oid)
-		if (ber_add_string(elm, extended_oid) == NULL)
+		if ((elm = ber_add_string(elm, extended_oid)) == NULL)
 			goto fail;
 
+	if (value != NULL) {
+		ber_link_elements(elm, value);
+		value = NULL;
+	}
+
+	if (controls != NULL) {
+		ber_link_elements(root->be_sub->be_next, controls);
+		controls = NULL;
+	}
+
 	ldap_debug_elements(root, type, "sending response on fd %d", conn->fd);
 
 	rc = ber_write_elements(&conn->ber, root);
@@ -107,6 +135,19 @@ send_ldap_extended_response(struct conn *conn, int msgid, unsigned long type,
 fail:
 	if (root)
 		ber_free_elements(root);
+	if (value)
+		ber_free_elements(value);
+	if (controls)
+		ber_free_elements(controls);
+}
+
+void
+send_ldap_extended_response(struct conn *conn, int msgid, unsigned long type,
+    long long result_code, const char *extended_oid,
+    struct ber_element *value)
+{
+	send_ldap_response(conn, msgid, type, result_code, extended_oid,
+	    value, NULL);
 }
 
 int
@@ -192,7 +233,16 @@ void
 send_ldap_result(struct conn *conn, int msgid, unsigned long type,
     long long result_code)
 {
-	send_ldap_extended_response(conn, msgid, type, result_code, NULL);
+	send_ldap_extended_response(conn, msgid, type, result_code, NULL,
+	    NULL);
+}
+
+void
+send_ldap_result_controls(struct conn *conn, int msgid, unsigned long type,
+    long long result_code, struct ber_element *controls)
+{
+	send_ldap_response(conn, msgid, type, result_code, NULL, NULL,
+	    controls);
 }
 
 int
@@ -260,6 +310,7 @@ ldap_compare(struct request *req)
 		else
 			return ldap_refer(req, dn, NULL, refs);
 	}
+	req->ns = ns;
 
 	if ((entry = namespace_get(ns, dn)) == NULL)
 		return ldap_respond(req, LDAP_NO_SUCH_OBJECT);
@@ -281,7 +332,7 @@ ldap_compare(struct request *req)
 }
 
 int
-ldap_starttls(struct request *req)
+ldap_starttls(struct request *req, struct ber_element **value)
 {
 	if ((req->conn->listener->flags & F_STARTTLS) == 0) {
 		log_debug("StartTLS not configured for this connection");
@@ -297,12 +348,13 @@ ldap_extended(struct request *req)
 {
 	int			 i, rc = LDAP_PROTOCOL_ERROR;
 	char			*oid = NULL;
-	struct ber_element	*ext_val = NULL;
+	struct ber_element	*ext_val = NULL, *value = NULL;
 	struct {
 		const char	*oid;
-		int (*fn)(struct request *);
+		int (*fn)(struct request *, struct ber_element **);
 	} extended_ops[] = {
 		{ "1.3.6.1.4.1.1466.20037", ldap_starttls },
+		{ CHANGELOG_OID, ldap_changelog },
 		{ NULL }
 	};
 
@@ -314,7 +366,7 @@ ldap_extended(struct request *req)
 
 	for (i = 0; extended_ops[i].oid != NULL; i++) {
 		if (strcmp(oid, extended_ops[i].oid) == 0) {
-			rc = extended_ops[i].fn(req);
+			rc = extended_ops[i].fn(req, &value);
 			break;
 		}
 	}
@@ -324,14 +376,19 @@ ldap_extended(struct request *req)
 
 done:
 	send_ldap_extended_response(req->conn, req->msgid, LDAP_RES_EXTENDED,
-	    rc, oid);
+	    rc, oid, value);
 
 	request_free(req);
 	return 0;
 }
 
+/* Starts an ldape process. With multiple workers, all accept
+ * connections on their own listening sockets. Only the first worker
+ * listens on unix sockets and the control socket, and reports the
+ * statistics of all workers.
+ */
 void
-ldape(int debug, int verbose, char *csockpath)
+ldape(int debug, int verbose, char *csockpath, int w)
 {
 	int			 on = 1;
 	struct namespace	*ns;
@@ -350,8 +407,12 @@ ldape(int debug, int verbose, char *csockpath)
 	log_verbose(verbose);
 
 	TAILQ_INIT(&conn_list);
+	worker = w;
 
-	setproctitle("ldap server");
+	if (worker > 0)
+		setproctitle("ldap server %d", worker);
+	else
+		setproctitle("ldap server");
 	event_init();
 
 	signal_set(&ev_sigint, SIGINT, ldape_sig_handler, NULL);
@@ -372,7 +433,8 @@ ldape(int debug, int verbose, char *csockpath)
 
 	/* Initialize control socket. */
 	memset(&csock, 0, sizeof(csock));
-	csock.cs_name = csockpath;
+	if (worker == 0)
+		csock.cs_name = csockpath;
 	control_init(&csock);
 	control_listen(&csock);
 	TAILQ_INIT(&ctl_conns);
@@ -380,12 +442,21 @@ ldape(int debug, int verbose, char *csockpath)
 	/* Initialize LDAP listeners.
 	 */
 	TAILQ_FOREACH(l, &conf->listeners, entry) {
+		if (l->ss.ss_family == AF_UNIX && worker > 0) {
+			l->fd = -1;
+			continue;
+		}
+
 		l->fd = socket(l->ss.ss_family, SOCK_STREAM | SOCK_NONBLOCK,
 		    0);
 		if (l->fd < 0)
 			fatal("ldape: socket");
 
 		setsockopt(l->fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+		if (l->ss.ss_family != AF_UNIX && conf->workers > 1 &&
+		    setsockopt(l->fd, SOL_SOCKET, SO_REUSEPORT, &on,
+		    sizeof(on)) != 0)
+			fatal("ldape: setsockopt");
 
 		if (l->ss.ss_family == AF_UNIX) {
 			sun = (struct sockaddr_un *)&l->ss;
@@ -430,6 +501,12 @@ ldape(int debug, int verbose, char *csockpath)
 			if (l->ssl == NULL)
 				fatal("ldape: certificate tree corrupted");
 
+			if (conf->tls_session_lifetime > 0 &&
+			    tls_config_set_session_lifetime(l->ssl->config,
+			    conf->tls_session_lifetime) != 0)
+				fatalx("ldape: couldn't set tls session "
+				    "lifetime");
+
 			l->tls = tls_server();
 			if (l->tls == NULL)
 				fatal("ldape: couldn't allocate tls context");
@@ -446,6 +523,13 @@ ldape(int debug, int verbose, char *csockpath)
 			fatal(ns->suffix);
 	}
 
+	/* Indices added to the configuration are built by the first worker. */
+	TAILQ_FOREACH(ns, &conf->namespaces, next) {
+		if (worker == 0 && !namespace_has_referrals(ns) &&
+		    index_build_start(ns) != 0)
+			log_warn("%s: index build not started", ns->suffix);
+	}
+
 	if ((pw = getpwnam(LDAPD_USER)) == NULL)
 		fatal("getpwnam");
 
@@ -461,9 +545,16 @@ ldape(int debug, int verbose, char *csockpath)
 			fatal("cannot drop privileges");
 	}
 
+	passwd_init();
+
 	if (pledge("stdio flock inet unix recvfd", NULL) == -1)
 		fatal("pledge");
 
+	if (worker > 0) {
+		evtimer_set(&ev_stats, ldape_send_stats, NULL);
+		ldape_send_stats(-1, EV_TIMEOUT, NULL);
+	}
+
 	log_debug("ldape: entering event loop");
 	event_dispatch();
 
@@ -490,6 +581,27 @@ ldape_imsgev(struct imsgev *iev, int code, struct imsg *imsg)
 		case IMSG_LDAPD_OPEN_RESULT:
 			ldape_open_result(imsg);
 			break;
+		case IMSG_LDAPD_RENAME_RESULT:
+			ldape_rename_result(imsg);
+			break;
+		case IMSG_LDAPD_TICKET_KEY:
+			ldape_ticket_key(imsg);
+			break;
+		case IMSG_LDAPE_STATS:
+			ldape_worker_stats(imsg);
+			break;
+		case IMSG_LDAPE_NSSTATS:
+			ldape_worker_nsstats(imsg);
+			break;
+		case IMSG_LDAPE_LATENCY:
+			ldape_worker_latency(imsg);
+			break;
+		case IMSG_LDAPE_SLOWQUERY:
+			ldape_worker_slow_query(imsg);
+			break;
+		case IMSG_CTL_LOG_VERBOSE:
+			ldape_log_verbose(imsg);
+			break;
 		default:
 			log_debug("%s: unexpected imsg %d",
 			    __func__, imsg->hdr.type);
@@ -556,6 +668,11 @@ ldape_open_result(struct imsg *imsg)
 	TAILQ_FOREACH(ns, &conf->namespaces, next) {
 		if (namespace_has_referrals(ns))
 			continue;
+		if (ns->compact_path != NULL &&
+		    strcmp(oreq->path, ns->compact_path) == 0) {
+			namespace_compact_fd(ns, imsg->fd);
+			return;
+		}
 		if (strcmp(oreq->path, ns->data_path) == 0) {
 			namespace_set_data_fd(ns, imsg->fd);
 			break;
@@ -573,3 +690,151 @@ ldape_open_result(struct imsg *imsg)
 		namespace_queue_schedule(ns, 0);
 }
 
+static void
+ldape_rename_result(struct imsg *imsg)
+{
+	struct namespace	*ns;
+	struct rename_req	*rreq = imsg->data;
+
+	if (imsg->hdr.len != sizeof(*rreq) + IMSG_HEADER_SIZE)
+		fatal("invalid size of rename result");
+
+	/* make sure path is null-terminated */
+	rreq->path[PATH_MAX] = '\0';
+
+	log_debug("rename(%s) returned %d", rreq->path, rreq->error);
+
+	TAILQ_FOREACH(ns, &conf->namespaces, next) {
+		if (ns->compact == NULL)
+			continue;
+		if (strcmp(rreq->path, ns->data_path) == 0 ||
+		    strcmp(rreq->path, ns->indx_path) == 0) {
+			namespace_compact_renamed(ns, rreq->error);
+			break;
+		}
+	}
+
+	if (ns == NULL)
+		log_warnx("spurious rename result");
+	else
+		namespace_queue_schedule(ns, 0);
+}
+
+/* Reports the statistics of this worker to the first worker, through
+ * the parent.
+ */
+static void
+ldape_send_stats(int fd, short why, void *data)
+{
+	struct namespace	*ns;
+	const struct btree_stat	*st;
+	struct ns_stat		 nss;
+	struct timeval		 tv;
+
+	imsgev_compose(iev_ldapd, IMSG_LDAPE_STATS, 0, 0, -1, &stats,
+	    sizeof(stats));
+
+	/* The database counters of each namespace, summed by the first. */
+	TAILQ_FOREACH(ns, &conf->namespaces, next) {
+		if (namespace_has_referrals(ns))
+			continue;
+		memset(&nss, 0, sizeof(nss));
+		strlcpy(nss.suffix, ns->suffix, sizeof(nss.suffix));
+		if ((st = btree_stat(ns->data_db)) != NULL)
+			bcopy(st, &nss.data_stat, sizeof(nss.data_stat));
+		if ((st = btree_stat(ns->indx_db)) != NULL)
+			bcopy(st, &nss.indx_stat, sizeof(nss.indx_stat));
+		imsgev_compose(iev_ldapd, IMSG_LDAPE_NSSTATS, 0, 0, -1, &nss,
+		    sizeof(nss));
+	}
+	latency_report(iev_ldapd);
+
+	timerclear(&tv);
+	tv.tv_sec = WORKER_STATS_INTERVAL;
+	evtimer_add(&ev_stats, &tv);
+}
+
+static void
+ldape_worker_stats(struct imsg *imsg)
+{
+	struct ldapd_stats	 st;
+
+	if (imsg->hdr.len != sizeof(st) + IMSG_HEADER_SIZE)
+		fatal("invalid size of worker stats");
+
+	bcopy(imsg->data, &st, sizeof(st));
+	control_worker_stats(imsg->hdr.peerid, &st);
+}
+
+static void
+ldape_worker_nsstats(struct imsg *imsg)
+{
+	struct ns_stat		 nss;
+
+	if (imsg->hdr.len != sizeof(nss) + IMSG_HEADER_SIZE)
+		fatal("invalid size of worker namespace stats");
+
+	bcopy(imsg->data, &nss, sizeof(nss));
+	control_worker_nsstats(imsg->hdr.peerid, &nss);
+}
+
+static void
+ldape_worker_latency(struct imsg *imsg)
+{
+	struct latency_stat	 ls;
+
+	if (imsg->hdr.len != sizeof(ls) + IMSG_HEADER_SIZE)
+		fatal("invalid size of worker latency");
+
+	bcopy(imsg->data, &ls, sizeof(ls));
+	latency_merge(&ls);
+}
+
+static void
+ldape_worker_slow_query(struct imsg *imsg)
+{
+	struct slow_query	 sq;
+
+	if (imsg->hdr.len != sizeof(sq) + IMSG_HEADER_SIZE)
+		fatal("invalid size of worker slow query");
+
+	bcopy(imsg->data, &sq, sizeof(sq));
+	slowlog_add(&sq);
+}
+
+/* Adds a session ticket key from the parent to the TLS listeners. The
+ * previous keys are kept to decrypt the tickets issued with them.
+ */
+static void
+ldape_ticket_key(struct imsg *imsg)
+{
+	struct ldapd_ticket_key	 key;
+	struct listener		*l;
+
+	if (imsg->hdr.len != sizeof(key) + IMSG_HEADER_SIZE)
+		fatal("invalid size of ticket key");
+
+	bcopy(imsg->data, &key, sizeof(key));
+	explicit_bzero(imsg->data, sizeof(key));
+	TAILQ_FOREACH(l, &conf->listeners, entry) {
+		if (l->ssl == NULL)
+			continue;
+		if (tls_config_add_ticket_key(l->ssl->config, key.keyrev,
+		    key.key, sizeof(key.key)) != 0)
+			log_warnx("ldape: failed to add ticket key: %s",
+			    tls_config_error(l->ssl->config));
+	}
+	explicit_bzero(&key, sizeof(key));
+}
+
+static void
+ldape_log_verbose(struct imsg *imsg)
+{
+	int	 verbose;
+
+	if (imsg->hdr.len != sizeof(verbose) + IMSG_HEADER_SIZE)
+		fatal("invalid size of log verbose request");
+
+	bcopy(imsg->data, &verbose, sizeof(verbose));
+	log_verbose(verbose);
+}
@@ -0,0 +1,1250 @@
+/*	$OpenBSD$ */
+
+/*
+ * Copyright (c) 2026 agent <agent@local>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/* Load generator for LDAP servers.
+ *
+ * Requests are spread over a number of connections, each with a window
+ * of requests in flight. In closed loop a request is sent as soon as a
+ * window has room, and timed from when it is sent. In open loop the
+ * requests are due at a fixed rate from the start, and each is timed
+ * from when it was due, so the time a request waits for a window to
+ * open behind a stalled server is counted rather than hidden.
+ */
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+
+#include <err.h>
+#include <errno.h>
+#include <event.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <tls.h>
+#include <unistd.h>
+
+#include "aldap.h"
+#include "evbuffer_tls.h"
+
+#define HIST_SUB_BITS	 5		/* 3% resolution */
+#define HIST_BUCKETS	 ((32 - HIST_SUB_BITS + 1) << HIST_SUB_BITS)
+#define MAX_FILTERS	 64
+#define MAX_SUBSTRINGS	 16
+#define DRAIN_SECONDS	 10		/* wait for late responses */
+#define LDAP_VERSION	 3
+
+enum load_op {
+	OP_SEARCH,
+	OP_COMPARE,
+	OP_MODIFY,
+	OP_BIND,
+	OP_COUNT
+};
+
+static char *const	 load_ops[] = {
+	"search", "compare", "modify", "bind", NULL
+};
+
+struct histogram {
+	uint64_t		 count[HIST_BUCKETS];
+	uint64_t		 total;
+	uint64_t		 sum;
+	uint64_t		 max;
+};
+
+struct load_stat {
+	struct histogram	 hist;
+	uint64_t		 errors;
+	uint64_t		 results;
+	uint64_t		 omitted;	/* not sent or answered */
+};
+
+struct load_req {
+	int			 used;
+	int			 msgid;		/* 0 until sent */
+	enum load_op		 op;
+	int64_t			 due;		/* ns since start, -1 if setup */
+};
+
+struct client {
+	unsigned int		 id;
+	int			 fd;
+	struct bufferevent	*bev;
+	struct buffertls	 buftls;
+	struct tls		*tls;
+	struct ber		 ber;
+	size_t			 pdu_len;
+	int			 msgid;
+	unsigned int		 outstanding;
+	int			 binding;	/* a bind waits or is sent */
+	struct load_req		*reqs;
+};
+
+static struct client	*clients;
+static unsigned int	 nclients = 1;
+static unsigned int	 window = 1;
+static unsigned int	 next_client;
+static unsigned int	 rate;			/* per second, 0 if closed */
+static unsigned int	 duration = 10;
+static unsigned int	 range = 10000;
+static unsigned int	 weights[OP_COUNT] = { 100, 0, 0, 0 };
+static unsigned int	 total_weight = 100;
+static char		*filters[MAX_FILTERS];
+static unsigned int	 nfilters;
+static const char	*basedn;
+static const char	*dntmpl;
+static const char	*avatmpl = "description=load %u";
+static const char	*binddn;
+static const char	*bindpw;
+static long long	 scope = LDAP_SCOPE_SUBTREE;
+static int		 verbose;
+
+static struct timespec	 epoch;
+static int		 running, finished, failed;
+static uint64_t		 issued;
+static uint64_t		 unsent, unanswered;
+static int64_t		 last_done;
+static struct load_stat	 stats[OP_COUNT];
+static struct load_stat	 interval;
+static struct event	 ev_due, ev_tick, ev_sigint;
+
+static __dead void	 usage(void);
+static unsigned long	 ldap_application(struct ber_element *);
+static int64_t		 load_now(void);
+static void		 hist_add(struct histogram *, uint64_t);
+static uint64_t		 hist_percentile(const struct histogram *,
+			    unsigned int);
+static int		 expand(const char *, char *, size_t);
+static struct ber_element *filter_parse(char **);
+static struct ber_element *filter_item(char **);
+static int		 load_send(struct client *, struct load_req *);
+static struct client	*load_client(struct load_req **);
+static enum load_op	 load_pick(void);
+static uint64_t		 load_expected(int64_t);
+static void		 load_dispatch(void);
+static unsigned int	 load_outstanding(void);
+static void		 load_stop(void);
+static void		 client_response(struct client *,
+			    struct ber_element *);
+static void		 client_read(struct bufferevent *, void *);
+static void		 client_write(struct bufferevent *, void *);
+static void		 client_error(struct bufferevent *, short, void *);
+static void		 client_connect(struct client *, struct addrinfo *,
+			    const char *, struct tls_config *);
+static void		 load_due(int, short, void *);
+static void		 load_tick(int, short, void *);
+static void		 load_sigint(int, short, void *);
+static void		 load_omit(enum load_op, int64_t);
+static void		 load_omitted(void);
+static void		 load_report(void);
+static void		 parse_mix(char *);
+
+static __dead void
+usage(void)
+{
+	extern char	*__progname;
+
+	fprintf(stderr, "usage: %s [-kTv] [-a attr=value] [-b base] "
+	    "[-C cafile] [-c connections]\n"
+	    "\t[-D binddn] [-d seconds] [-e dn] [-f filter] [-m mix] "
+	    "[-n range]\n"
+	    "\t[-P window] [-p port] [-r rate] [-s scope] [-w secret] host\n",
+	    __progname);
+	exit(1);
+}
+
+static unsigned long
+ldap_application(struct ber_element *elm)
+{
+	return BER_TYPE_OCTETSTRING;
+}
+
+/* Returns the nanoseconds since the start of the run.
+ */
+static int64_t
+load_now(void)
+{
+	struct timespec		 now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (now.tv_sec - epoch.tv_sec) * 1000000000LL +
+	    (now.tv_nsec - epoch.tv_nsec);
+}
+
+/* The buckets grow by a factor of two, each split in 32 linear steps.
+ */
+static unsigned int
+hist_bucket(uint64_t usec)
+{
+	unsigned int	 e;
+
+	if (usec < (1 << HIST_SUB_BITS))
+		return usec;
+	if (usec > UINT32_MAX)
+		usec = UINT32_MAX;
+
+	for (e = HIST_SUB_BITS; usec >> (e + 1) != 0; e++)
+		;
+	return ((e - HIST_SUB_BITS + 1) << HIST_SUB_BITS) +
+	    (usec >> (e - HIST_SUB_BITS)) - (1 << HIST_SUB_BITS);
+}
+
+/* Returns the highest latency counted in bucket b.
+ */
+static uint64_t
+hist_value(unsigned int b)
+{
+	unsigned int	 g, s;
+
+	if (b < (1 << HIST_SUB_BITS))
+		return b;
+	g = b >> HIST_SUB_BITS;
+	s = b & ((1 << HIST_SUB_BITS) - 1);
+	return ((uint64_t)((1 << HIST_SUB_BITS) + s + 1) << (g - 1)) - 1;
+}
+
+static void
+hist_add(struct histogram *h, uint64_t usec)
+{
+	h->count[hist_bucket(usec)]++;
+	h->total++;
+	h->sum += usec;
+	if (usec > h->max)
+		h->max = usec;
+}
+
+static void
+hist_merge(struct histogram *h, const struct histogram *from)
+{
+	unsigned int	 b;
+
+	for (b = 0; b < HIST_BUCKETS; b++)
+		h->count[b] += from->count[b];
+	h->total += from->total;
+	h->sum += from->sum;
+	if (from->max > h->max)
+		h->max = from->max;
+}
+
+/* Returns the latency below which pct thousandths of a percent of the
+ * requests completed.
+ */
+static uint64_t
+hist_percentile(const struct histogram *h, unsigned int pct)
+{
+	uint64_t	 target, seen = 0, v;
+	unsigned int	 b;
+
+	if (h->total == 0)
+		return 0;
+	target = (h->total * pct + 99999) / 100000;
+	if (target == 0)
+		target = 1;
+	for (b = 0; b < HIST_BUCKETS; b++) {
+		seen += h->count[b];
+		if (seen >= target)
+			break;
+	}
+	v = hist_value(b);
+	return v < h->max ? v : h->max;
+}
+
+/* Copies a template to buf, replacing each %u with a random number below
+ * range and %% with a percent sign.
+ */
+static int
+expand(const char *tmpl, char *buf, size_t size)
+{
+	const char	*p;
+	size_t		 len = 0;
+	int		 n;
+
+	for (p = tmpl; *p != '\0'; p++) {
+		if (len + 1 >= size)
+			return -1;
+		if (p[0] == '%' && p[1] == 'u') {
+			n = snprintf(buf + len, size - len, "%u",
+			    arc4random_uniform(range));
+			if (n < 0 || (size_t)n >= size - len)
+				return -1;
+			len += n;
+			p++;
+		} else if (p[0] == '%' && p[1] == '%') {
+			buf[len++] = '%';
+			p++;
+		} else
+			buf[len++] = *p;
+	}
+	buf[len] = '\0';
+	return 0;
+}
+
+static int
+hexval(int c)
+{
+	if (c >= '0' && c <= '9')
+		return c - '0';
+	if (c >= 'a' && c <= 'f')
+		return c - 'a' + 10;
+	if (c >= 'A' && c <= 'F')
+		return c - 'A' + 10;
+	return -1;
+}
+
+/* Parses an RFC 4515 string filter at *cp, which is modified in place,
+ * and leaves *cp after it.
+ */
+static struct ber_element *
+filter_parse(char **cp)
+{
+	struct ber_element	*elm = NULL, *sub, *last;
+	int			 type;
+
+	if (**cp != '(')
+		goto syntax;
+	(*cp)++;
+
+	switch (**cp) {
+	case '&':
+	case '|':
+		type = **cp == '&' ? LDAP_FILT_AND : LDAP_FILT_OR;
+		(*cp)++;
+		if ((elm = ber_add_set(NULL)) == NULL)
+			return NULL;
+		ber_set_header(elm, BER_CLASS_CONTEXT, type);
+		for (last = elm; **cp == '('; last = sub) {
+			if ((sub = filter_parse(cp)) == NULL)
+				goto fail;
+			ber_link_elements(last, sub);
+		}
+		if (last == elm)
+			goto syntax;
+		break;
+	case '!':
+		(*cp)++;
+		if ((sub = filter_parse(cp)) == NULL)
+			return NULL;
+		if ((elm = ber_add_sequence(NULL)) == NULL) {
+			ber_free_elements(sub);
+			return NULL;
+		}
+		ber_set_header(elm, BER_CLASS_CONTEXT, LDAP_FILT_NOT);
+		ber_link_elements(elm, sub);
+		break;
+	default:
+		if ((elm = filter_item(cp)) == NULL)
+			return NULL;
+		break;
+	}
+
+	if (**cp != ')')
+		goto syntax;
+	(*cp)++;
+	return elm;
+
+syntax:
+	errno = EINVAL;
+fail:
+	if (elm != NULL)
+		ber_free_elements(elm);
+	return NULL;
+}
+
+/* Parses a simple, presence or substrings filter without its
+ * parentheses.
+ */
+static struct ber_element *
+filter_item(char **cp)
+{
+	struct ber_element	*elm, *sub;
+	char			*attr, *p, *q;
+	char			*part[MAX_SUBSTRINGS + 1];
+	size_t			 len[MAX_SUBSTRINGS + 1];
+	unsigned int		 i, n = 0, nstars = 0;
+	int			 type, hi, lo;
+
+	attr = *cp;
+	p = attr + strcspn(attr, "=~<>()");
+	if (p == attr)
+		goto syntax;
+	switch (*p) {
+	case '=':
+		type = LDAP_FILT_EQ;
+		*p++ = '\0';
+		break;
+	case '~':
+	case '<':
+	case '>':
+		if (p[1] != '=')
+			goto syntax;
+		type = *p == '~' ? LDAP_FILT_APPR :
+		    *p == '<' ? LDAP_FILT_LE : LDAP_FILT_GE;
+		*p = '\0';
+		p += 2;
+		break;
+	default:
+		goto syntax;
+	}
+
+	/* Split the value at unescaped stars, decoding it in place. */
+	part[0] = q = p;
+	for (; *p != ')'; p++) {
+		if (*p == '\0' || *p == '(')
+			goto syntax;
+		if (*p == '*') {
+			if (type != LDAP_FILT_EQ || nstars == MAX_SUBSTRINGS)
+				goto syntax;
+			len[nstars] = q - part[nstars];
+			part[++nstars] = q;
+			continue;
+		}
+		if (*p == '\\') {
+			if ((hi = hexval(p[1])) == -1 ||
+			    (lo = hexval(p[2])) == -1)
+				goto syntax;
+			*q++ = hi << 4 | lo;
+			p += 2;
+		} else
+			*q++ = *p;
+	}
+	len[nstars] = q - part[nstars];
+	*cp = p;
+
+	if (nstars == 0) {
+		if ((elm = ber_add_sequence(NULL)) == NULL)
+			return NULL;
+		ber_set_header(elm, BER_CLASS_CONTEXT, type);
+		if (ber_add_nstring(ber_add_string(elm, attr), part[0],
+		    len[0]) == NULL)
+			goto fail;
+		return elm;
+	}
+
+	if (nstars == 1 && len[0] == 0 && len[1] == 0) {
+		if ((elm = ber_add_string(NULL, attr)) == NULL)
+			return NULL;
+		ber_set_header(elm, BER_CLASS_CONTEXT, LDAP_FILT_PRES);
+		return elm;
+	}
+
+	if ((elm = ber_add_sequence(NULL)) == NULL)
+		return NULL;
+	ber_set_header(elm, BER_CLASS_CONTEXT, LDAP_FILT_SUBS);
+	if ((sub = ber_add_sequence(ber_add_string(elm, attr))) == NULL)
+		goto fail;
+	for (i = 0; i <= nstars; i++) {
+		if (len[i] == 0)
+			continue;
+		if ((sub = ber_add_nstring(sub, part[i], len[i])) == NULL)
+			goto fail;
+		ber_set_header(sub, BER_CLASS_CONTEXT,
+		    i == 0 ? LDAP_FILT_SUBS_INIT :
+		    i == nstars ? LDAP_FILT_SUBS_FIN : LDAP_FILT_SUBS_ANY);
+		n++;
+	}
+	if (n > 0)
+		return elm;
+	ber_free_elements(elm);
+syntax:
+	errno = EINVAL;
+	return NULL;
+fail:
+	ber_free_elements(elm);
+	return NULL;
+}
+
+/* Encodes the request in slot r and queues it on the connection.
+ */
+static int
+load_send(struct client *c, struct load_req *r)
+{
+	struct ber_element	*root, *elm, *filter;
+	char			 dn[1024], value[2048], *attr, *cp;
+	void			*buf;
+	int			 len;
+
+	r->msgid = ++c->msgid;
+	if ((root = ber_add_sequence(NULL)) == NULL)
+		return -1;
+
+	switch (r->op) {
+	case OP_BIND:
+		if (ber_printf_elements(root, "d{tdsst", r->msgid,
+		    BER_CLASS_APP, (unsigned long)LDAP_REQ_BIND, LDAP_VERSION,
+		    binddn != NULL ? binddn : "", bindpw != NULL ? bindpw : "",
+		    BER_CLASS_CONTEXT, (unsigned long)LDAP_AUTH_SIMPLE) == NULL)
+			goto fail;
+		break;
+	case OP_COMPARE:
+	case OP_MODIFY:
+		if (expand(dntmpl, dn, sizeof(dn)) != 0 ||
+		    expand(avatmpl, value, sizeof(value)) != 0)
+			goto toolong;
+		attr = value;
+		cp = strchr(value, '=');
+		*cp++ = '\0';
+		if (r->op == OP_COMPARE)
+			elm = ber_printf_elements(root, "d{ts{ss", r->msgid,
+			    BER_CLASS_APP, (unsigned long)LDAP_REQ_COMPARE, dn,
+			    attr, cp);
+		else
+			elm = ber_printf_elements(root, "d{ts{{E{s(s",
+			    r->msgid, BER_CLASS_APP,
+			    (unsigned long)LDAP_REQ_MODIFY, dn,
+			    (long long)LDAP_MOD_REPLACE, attr, cp);
+		if (elm == NULL)
+			goto fail;
+		break;
+	case OP_SEARCH:
+		if (expand(basedn, dn, sizeof(dn)) != 0 ||
+		    expand(filters[arc4random_uniform(nfilters)], value,
+		    sizeof(value)) != 0)
+			goto toolong;
+		cp = value;
+		if ((filter = filter_parse(&cp)) == NULL)
+			goto fail;
+		if ((elm = ber_printf_elements(root, "d{tsEEiib", r->msgid,
+		    BER_CLASS_APP, (unsigned long)LDAP_REQ_SEARCH, dn, scope,
+		    (long long)LDAP_DEREF_NEVER, 0LL, 0LL, 0)) == NULL) {
+			ber_free_elements(filter);
+			goto fail;
+		}
+		ber_link_elements(elm, filter);
+		if (ber_add_sequence(filter) == NULL)
+			goto fail;
+		break;
+	default:
+		goto fail;
+	}
+
+	len = ber_write_elements(&c->ber, root);
+	ber_free_elements(root);
+	if (len < 0)
+		return -1;
+	ber_get_writebuf(&c->ber, &buf);
+	return bufferevent_write(c->bev, buf, len);
+
+toolong:
+	errno = ENAMETOOLONG;
+fail:
+	ber_free_elements(root);
+	return -1;
+}
+
+/* Returns the next connection, round robin, with room in its window,
+ * and a free slot in it.
+ */
+static struct client *
+load_client(struct load_req **rp)
+{
+	struct client	*c;
+	unsigned int	 i, j;
+
+	for (i = 0; i < nclients; i++) {
+		c = &clients[next_client];
+		next_client = (next_client + 1) % nclients;
+		if (c->outstanding >= window || c->binding)
+			continue;
+		for (j = 0; j < window; j++)
+			if (!c->reqs[j].used) {
+				*rp = &c->reqs[j];
+				return c;
+			}
+	}
+	return NULL;
+}
+
+static enum load_op
+load_pick(void)
+{
+	unsigned int	 n, op;
+
+	n = arc4random_uniform(total_weight);
+	for (op = 0; op < OP_COUNT - 1; op++) {
+		if (n < weights[op])
+			break;
+		n -= weights[op];
+	}
+	return op;
+}
+
+/* Returns the number of requests due in open loop by ns into the run.
+ */
+static uint64_t
+load_expected(int64_t ns)
+{
+	if (ns < 0)
+		return 0;
+	return (ns / 1000000000LL) * rate +
+	    (ns % 1000000000LL) * rate / 1000000000LL + 1;
+}
+
+/* Sends the requests that are due, as far as the windows allow. In open
+ * loop a request that has to wait for a window keeps its due time.
+ */
+static void
+load_dispatch(void)
+{
+	struct client	*c;
+	struct load_req	*r;
+	struct timeval	 tv;
+	int64_t		 now, due = 0;
+
+	while (running) {
+		now = load_now();
+		if (rate > 0) {
+			due = (issued / rate) * 1000000000LL +
+			    (issued % rate) * 1000000000LL / rate;
+			if (due >= duration * 1000000000LL) {
+				load_stop();
+				return;
+			}
+			if (due > now)
+				break;
+		} else if (now >= duration * 1000000000LL) {
+			load_stop();
+			return;
+		}
+
+		/* A response opens the window again. */
+		if ((c = load_client(&r)) == NULL)
+			return;
+
+		r->used = 1;
+		r->msgid = 0;
+		r->op = load_pick();
+		r->due = rate > 0 ? due : now;
+		issued++;
+		c->outstanding++;
+
+		/* A bind waits until the other requests are answered. */
+		if (r->op == OP_BIND) {
+			c->binding = 1;
+			if (c->outstanding > 1)
+				continue;
+		}
+		if (load_send(c, r) != 0) {
+			warn("%s request", load_ops[r->op]);
+			failed = 1;
+			load_stop();
+			return;
+		}
+	}
+
+	if (running && rate > 0) {
+		due -= now;
+		tv.tv_sec = due / 1000000000LL;
+		tv.tv_usec = (due % 1000000000LL) / 1000;
+		evtimer_add(&ev_due, &tv);
+	}
+}
+
+static unsigned int
+load_outstanding(void)
+{
+	unsigned int	 i, n = 0;
+
+	for (i = 0; i < nclients; i++)
+		n += clients[i].outstanding;
+	return n;
+}
+
+/* Stops sending requests. The run ends when the outstanding ones have
+ * been answered.
+ */
+static void
+load_stop(void)
+{
+	running = 0;
+	evtimer_del(&ev_due);
+	if (load_outstanding() == 0)
+		finished = 1;
+}
+
+static void
+client_response(struct client *c, struct ber_element *root)
+{
+	struct ber_element	*op;
+	struct load_req		*r = NULL;
+	struct load_stat	*st;
+	long long		 msgid, code;
+	unsigned int		 i;
+	uint64_t		 usec;
+
+	if (ber_scanf_elements(root, "{ie", &msgid, &op) != 0)
+		goto invalid;
+	for (i = 0; i < window; i++)
+		if (c->reqs[i].used && c->reqs[i].msgid == msgid &&
+		    msgid != 0) {
+			r = &c->reqs[i];
+			break;
+		}
+	if (r == NULL)
+		goto invalid;
+	st = &stats[r->op];
+
+	switch (op->be_type) {
+	case LDAP_RES_SEARCH_ENTRY:
+		if (r->due >= 0)
+			st->results++;
+		return;
+	case LDAP_RES_SEARCH_REFERENCE:
+		return;
+	}
+
+	if (ber_scanf_elements(op, "{E", &code) != 0)
+		goto invalid;
+	if (r->due < 0) {
+		/* The bind before the run. */
+		if (code != LDAP_SUCCESS) {
+			warnx("connection %u: bind failed with result %lld",
+			    c->id, code);
+			failed = 1;
+		}
+		c->binding = 0;
+		r->used = 0;
+		c->outstanding--;
+		return;
+	}
+
+	last_done = load_now();
+	usec = (last_done - r->due) / 1000;
+	hist_add(&st->hist, usec);
+	hist_add(&interval.hist, usec);
+	if (code != LDAP_SUCCESS && !(r->op == OP_COMPARE &&
+	    (code == LDAP_COMPARE_TRUE || code == LDAP_COMPARE_FALSE))) {
+		st->errors++;
+		interval.errors++;
+		if (verbose > 1)
+			warnx("%s failed with result %lld", load_ops[r->op],
+			    code);
+	}
+
+	if (r->op == OP_BIND)
+		c->binding = 0;
+	r->used = 0;
+	c->outstanding--;
+
+	/* Send a bind waiting for the last other request. */
+	if (c->binding && c->outstanding == 1)
+		for (i = 0; i < window; i++)
+			if (c->reqs[i].used && c->reqs[i].msgid == 0 &&
+			    load_send(c, &c->reqs[i]) != 0) {
+				warn("bind request");
+				failed = 1;
+				load_stop();
+			}
+
+	if (running)
+		load_dispatch();
+	else if (load_outstanding() == 0)
+		finished = 1;
+	return;
+
+invalid:
+	warnx("connection %u: invalid response", c->id);
+	failed = 1;
+	load_stop();
+}
+
+static void
+client_read(struct bufferevent *bev, void *data)
+{
+	struct client		*c = data;
+	struct ber_element	*root;
+	struct evbuffer		*input;
+	size_t			 nused = 0, avail, len;
+	ssize_t			 hlen;
+	unsigned long		 type;
+	int			 class, cstruct;
+	u_char			*p;
+
+	input = EVBUFFER_INPUT(bev);
+	p = EVBUFFER_DATA(input);
+	avail = EVBUFFER_LENGTH(input);
+	while (avail > 0 && !failed) {
+		if (c->pdu_len == 0) {
+			if ((hlen = ber_read_header(p, avail, &class, &type,
+			    &cstruct, &len)) == -1) {
+				if (errno != ECANCELED) {
+					warnx("connection %u: invalid "
+					    "response", c->id);
+					failed = 1;
+					load_stop();
+				}
+				break;
+			}
+			c->pdu_len = hlen + len;
+		}
+		if (c->pdu_len > avail)
+			break;
+
+		ber_set_readbuf(&c->ber, p, c->pdu_len);
+		if ((root = ber_read_elements(&c->ber, NULL)) == NULL) {
+			warnx("connection %u: failed to parse response",
+			    c->id);
+			failed = 1;
+			load_stop();
+			break;
+		}
+		client_response(c, root);
+		ber_free_elements(root);
+
+		p += c->pdu_len;
+		avail -= c->pdu_len;
+		nused += c->pdu_len;
+		c->pdu_len = 0;
+	}
+	evbuffer_drain(input, nused);
+}
+
+static void
+client_write(struct bufferevent *bev, void *data)
+{
+}
+
+static void
+client_error(struct bufferevent *bev, short why, void *data)
+{
+	struct client	*c = data;
+
+	if (why & EVBUFFER_HANDSHAKE)
+		warnx("connection %u: TLS handshake failed: %s", c->id,
+		    tls_error(c->tls));
+	else
+		warnx("connection %u closed by the server", c->id);
+	failed = 1;
+	load_stop();
+	finished = 1;
+}
+
+static void
+client_connect(struct client *c, struct addrinfo *res, const char *host,
+    struct tls_config *tls_config)
+{
+	struct addrinfo	*ai;
+	int		 fd = -1;
+
+	for (ai = res; ai != NULL; ai = ai->ai_next) {
+		if ((fd = socket(ai->ai_family, ai->ai_socktype,
+		    ai->ai_protocol)) == -1)
+			continue;
+		if (connect(fd, ai->ai_addr, ai->ai_addrlen) == 0)
+			break;
+		close(fd);
+		fd = -1;
+	}
+	if (fd == -1)
+		err(1, "connect to %s", host);
+	if (fcntl(fd, F_SETFL, O_NONBLOCK) == -1)
+		err(1, "fcntl");
+
+	c->fd = fd;
+	c->ber.fd = -1;
+	ber_set_application(&c->ber, ldap_application);
+	if ((c->reqs = calloc(window, sizeof(*c->reqs))) == NULL)
+		err(1, "calloc");
+	if ((c->bev = bufferevent_new(fd, client_read, client_write,
+	    client_error, c)) == NULL)
+		err(1, "bufferevent_new");
+	bufferevent_enable(c->bev, EV_READ);
+
+	if (tls_config != NULL) {
+		if ((c->tls = tls_client()) == NULL)
+			errx(1, "tls_client failed");
+		if (tls_configure(c->tls, tls_config) != 0)
+			errx(1, "tls_configure: %s", tls_error(c->tls));
+		if (tls_connect_socket(c->tls, fd, host) != 0)
+			errx(1, "tls_connect_socket: %s", tls_error(c->tls));
+		buffertls_set(&c->buftls, c->bev, c->tls, fd);
+		buffertls_connect(&c->buftls, fd);
+	}
+}
+
+static void
+load_due(int fd, short event, void *data)
+{
+	load_dispatch();
+}
+
+/* Prints the requests answered in the last second with -v, and ends the
+ * run when the late responses have not come in time.
+ */
+static void
+load_tick(int fd, short event, void *data)
+{
+	static unsigned int	 seconds;
+	struct timeval		 tv = { 1, 0 };
+	uint64_t		 expected, backlog = 0;
+	int64_t			 now;
+
+	now = load_now();
+	seconds++;
+	if (rate > 0 && running) {
+		expected = load_expected(now < duration * 1000000000LL ?
+		    now : duration * 1000000000LL - 1);
+		if (expected > issued)
+			backlog = expected - issued;
+	}
+	if (verbose)
+		printf("%4us %10llu ops/s %9llu p50 %9llu p99 %9llu max us"
+		    " %6llu errors %8llu backlog\n",
+		    seconds,
+		    (unsigned long long)interval.hist.total,
+		    (unsigned long long)hist_percentile(&interval.hist, 50000),
+		    (unsigned long long)hist_percentile(&interval.hist, 99000),
+		    (unsigned long long)interval.hist.max,
+		    (unsigned long long)interval.errors,
+		    (unsigned long long)backlog);
+	memset(&interval, 0, sizeof(interval));
+
+	if (running && now >= duration * 1000000000LL)
+		load_dispatch();
+	if (now >= (duration + DRAIN_SECONDS) * 1000000000LL)
+		finished = 1;
+	else
+		evtimer_add(&ev_tick, &tv);
+}
+
+static void
+load_sigint(int sig, short event, void *data)
+{
+	if (!running)
+		finished = 1;
+	load_stop();
+}
+
+static void
+load_omit(enum load_op op, int64_t ns)
+{
+	struct load_stat	*st = &stats[op];
+
+	hist_add(&st->hist, ns / 1000);
+	st->errors++;
+	st->omitted++;
+}
+
+/* Counts the requests that were due but not sent, or not answered, by
+ * the end of the run as errors, with the latency they had reached by
+ * then. Leaving them out would hide a server that stalls at the end.
+ * Requests never sent are given an operation from the mix.
+ */
+static void
+load_omitted(void)
+{
+	struct load_req	*r;
+	int64_t		 end, due;
+	uint64_t	 n, expected;
+	unsigned int	 i, j;
+
+	end = load_now();
+	for (i = 0; i < nclients; i++)
+		for (j = 0; j < window; j++) {
+			r = &clients[i].reqs[j];
+			if (r->used && r->due >= 0) {
+				load_omit(r->op, end - r->due);
+				unanswered++;
+			}
+		}
+
+	if (rate == 0)
+		return;
+	expected = load_expected((end < duration * 1000000000LL ? end :
+	    duration * 1000000000LL) - 1);
+	for (n = issued; n < expected; n++) {
+		due = (n / rate) * 1000000000LL +
+		    (n % rate) * 1000000000LL / rate;
+		load_omit(load_pick(), end - due);
+		unsent++;
+	}
+}
+
+static void
+load_report(void)
+{
+	struct histogram	 all;
+	const struct histogram	*h;
+	uint64_t		 errors = 0, results = 0, omitted = 0;
+	double			 elapsed;
+	unsigned int		 op;
+
+	elapsed = last_done > 0 ? last_done / 1e9 : 1;
+	memset(&all, 0, sizeof(all));
+
+	printf("%-8s %10s %10s %9s %9s %9s %9s %9s %9s %8s %10s\n", "op",
+	    "count", "ops/s", "mean us", "p50 us", "p90 us", "p99 us",
+	    "p99.9 us", "max us", "errors", "results");
+	for (op = 0; op <= OP_COUNT; op++) {
+		if (op == OP_COUNT) {
+			h = &all;
+			if (h->total == 0)
+				break;
+		} else {
+			h = &stats[op].hist;
+			if (h->total == 0)
+				continue;
+			hist_merge(&all, h);
+			errors += stats[op].errors;
+			results += stats[op].results;
+			omitted += stats[op].omitted;
+		}
+		printf("%-8s %10llu %10.0f %9.0f %9llu %9llu %9llu %9llu "
+		    "%9llu %8llu %10llu\n",
+		    op == OP_COUNT ? "total" : load_ops[op],
+		    (unsigned long long)h->total, (h->total - (op == OP_COUNT ?
+		    omitted : stats[op].omitted)) / elapsed,
+		    (double)h->sum / h->total,
+		    (unsigned long long)hist_percentile(h, 50000),
+		    (unsigned long long)hist_percentile(h, 90000),
+		    (unsigned long long)hist_percentile(h, 99000),
+		    (unsigned long long)hist_percentile(h, 99900),
+		    (unsigned long long)h->max,
+		    (unsigned long long)(op == OP_COUNT ? errors :
+		    stats[op].errors),
+		    (unsigned long long)(op == OP_COUNT ? results :
+		    stats[op].results));
+	}
+
+	if (unsent > 0)
+		printf("%llu requests were not sent in time\n",
+		    (unsigned long long)unsent);
+	if (unanswered > 0)
+		printf("%llu requests were not answered\n",
+		    (unsigned long long)unanswered);
+}
+
+static void
+parse_mix(char *spec)
+{
+	char		*name, *value;
+	const char	*errstr;
+	int		 op;
+
+	memset(weights, 0, sizeof(weights));
+	total_weight = 0;
+	while (*spec != '\0') {
+		name = spec;
+		if ((op = getsubopt(&spec, load_ops, &value)) == -1 ||
+		    value == NULL)
+			errx(1, "invalid mix: %s", name);
+		weights[op] = strtonum(value, 0, 1000000, &errstr);
+		if (errstr != NULL)
+			errx(1, "%s weight is %s: %s", load_ops[op], errstr,
+			    value);
+		total_weight += weights[op];
+	}
+	if (total_weight == 0)
+		errx(1, "empty mix");
+}
+
+int
+main(int argc, char *argv[])
+{
+	struct addrinfo		 hints, *res;
+	struct tls_config	*tls_config = NULL;
+	struct ber_element	*elm;
+	struct timeval		 tv = { 1, 0 };
+	const char		*errstr, *port = NULL, *cafile = NULL;
+	char			 buf[2048], *cp;
+	unsigned int		 i;
+	int			 c, usetls = 0, insecure = 0, error;
+
+	while ((c = getopt(argc, argv, "a:b:C:c:D:d:e:f:km:n:P:p:r:s:Tvw:")) !=
+	    -1) {
+		switch (c) {
+		case 'a':
+			if (strchr(optarg, '=') == NULL)
+				errx(1, "-a needs attr=value");
+			avatmpl = optarg;
+			break;
+		case 'b':
+			basedn = optarg;
+			break;
+		case 'C':
+			cafile = optarg;
+			break;
+		case 'c':
+			nclients = strtonum(optarg, 1, 10000, &errstr);
+			if (errstr != NULL)
+				errx(1, "connections is %s: %s", errstr,
+				    optarg);
+			break;
+		case 'D':
+			binddn = optarg;
+			break;
+		case 'd':
+			duration = strtonum(optarg, 1, 86400, &errstr);
+			if (errstr != NULL)
+				errx(1, "duration is %s: %s", errstr, optarg);
+			break;
+		case 'e':
+			dntmpl = optarg;
+			break;
+		case 'f':
+			if (nfilters == MAX_FILTERS)
+				errx(1, "too many filters");
+			filters[nfilters++] = optarg;
+			break;
+		case 'k':
+			insecure = 1;
+			break;
+		case 'm':
+			parse_mix(optarg);
+			break;
+		case 'n':
+			range = strtonum(optarg, 1, UINT32_MAX, &errstr);
+			if (errstr != NULL)
+				errx(1, "range is %s: %s", errstr, optarg);
+			break;
+		case 'P':
+			window = strtonum(optarg, 1, 10000, &errstr);
+			if (errstr != NULL)
+				errx(1, "window is %s: %s", errstr, optarg);
+			break;
+		case 'p':
+			port = optarg;
+			break;
+		case 'r':
+			rate = strtonum(optarg, 0, 10000000, &errstr);
+			if (errstr != NULL)
+				errx(1, "rate is %s: %s", errstr, optarg);
+			break;
+		case 's':
+			if (strcmp(optarg, "base") == 0)
+				scope = LDAP_SCOPE_BASE;
+			else if (strcmp(optarg, "one") == 0)
+				scope = LDAP_SCOPE_ONELEVEL;
+			else if (strcmp(optarg, "sub") == 0)
+				scope = LDAP_SCOPE_SUBTREE;
+			else
+				errx(1, "invalid scope: %s", optarg);
+			break;
+		case 'T':
+			usetls = 1;
+			break;
+		case 'v':
+			verbose++;
+			break;
+		case 'w':
+			bindpw = optarg;
+			break;
+		default:
+			usage();
+		}
+	}
+	argc -= optind;
+	argv += optind;
+	if (argc != 1)
+		usage();
+
+	if (weights[OP_SEARCH] > 0 && basedn == NULL)
+		errx(1, "searches need a base (-b)");
+	if ((weights[OP_COMPARE] > 0 || weights[OP_MODIFY] > 0) &&
+	    dntmpl == NULL)
+		errx(1, "compares and modifies need an entry (-e)");
+	if (nfilters == 0)
+		filters[nfilters++] = "(objectClass=*)";
+
+	/* Check the filters once, before they are sent. */
+	for (i = 0; i < nfilters; i++) {
+		if (expand(filters[i], buf, sizeof(buf)) != 0)
+			errx(1, "filter too long: %s", filters[i]);
+		cp = buf;
+		if ((elm = filter_parse(&cp)) == NULL || *cp != '\0')
+			errx(1, "invalid filter: %s", filters[i]);
+		ber_free_elements(elm);
+	}
+
+	if (usetls) {
+		if (tls_init() != 0)
+			errx(1, "tls_init failed");
+		if ((tls_config = tls_config_new()) == NULL)
+			errx(1, "tls_config_new failed");
+		if (cafile != NULL &&
+		    tls_config_set_ca_file(tls_config, cafile) != 0)
+			errx(1, "%s: %s", cafile,
+			    tls_config_error(tls_config));
+		if (insecure) {
+			tls_config_insecure_noverifycert(tls_config);
+			tls_config_insecure_noverifyname(tls_config);
+		}
+	}
+
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+	if ((error = getaddrinfo(argv[0], port != NULL ? port :
+	    usetls ? "ldaps" : "ldap", &hints, &res)) != 0)
+		errx(1, "%s: %s", argv[0], gai_strerror(error));
+
+	event_init();
+	signal(SIGPIPE, SIG_IGN);
+	signal_set(&ev_sigint, SIGINT, load_sigint, NULL);
+	signal_add(&ev_sigint, NULL);
+	evtimer_set(&ev_due, load_due, NULL);
+	evtimer_set(&ev_tick, load_tick, NULL);
+
+	if ((clients = calloc(nclients, sizeof(*clients))) == NULL)
+		err(1, "calloc");
+	for (i = 0; i < nclients; i++) {
+		clients[i].id = i;
+		client_connect(&clients[i], res, argv[0], tls_config);
+		if (binddn == NULL)
+			continue;
+		clients[i].reqs[0].used = 1;
+		clients[i].reqs[0].op = OP_BIND;
+		clients[i].reqs[0].due = -1;
+		clients[i].outstanding = 1;
+		clients[i].binding = 1;
+		if (load_send(&clients[i], &clients[i].reqs[0]) != 0)
+			err(1, "bind request");
+	}
+	freeaddrinfo(res);
+
+	while (load_outstanding() > 0 && !failed)
+		if (event_loop(EVLOOP_ONCE) == -1)
+			err(1, "event_loop");
+	if (failed)
+		exit(1);
+
+	if (rate > 0)
+		printf("%u connections, window %u, %u requests/s for %us\n",
+		    nclients, window, rate, duration);
+	else
+		printf("%u connections, window %u, closed loop for %us\n",
+		    nclients, window, duration);
+	fflush(stdout);
+
+	clock_gettime(CLOCK_MONOTONIC, &epoch);
+	running = 1;
+	evtimer_add(&ev_tick, &tv);
+	load_dispatch();
+	while (!finished)
+		if (event_loop(EVLOOP_ONCE) == -1)
+			err(1, "event_loop");
+
+	load_omitted();
+	load_report();
+	return failed ? 1 : 0;
+}
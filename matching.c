@@ -20,9 +20,11 @@
 #include <sys/queue.h>
 #include <sys/tree.h>
 
+#include <ctype.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 
 #include "schema.h"
 
@@ -75,10 +77,260 @@ static const char *oid_first_component_syntaxes[] = {
 	NULL
 };
 
+/* Ordering rules compare two values, setting cmp to less than, equal
+ * to or greater than zero. They fail with -1 if a value is invalid for
+ * the syntax.
+ *
+ * Rules with an index_key function can also encode a value so that the
+ * keys sort bytewise in the same order as the values. Case-insensitive
+ * rules order values like the equality index keys, which are lowercased,
+ * and need no keys of their own. Case-sensitive rules can't be indexed.
+ */
+
+#define INTEGER_MAXDIGITS	 99
+#define GENTIME_KEYSIZE		 24
+
+static int
+integer_parse(const char *value, int *neg, const char **digits, size_t *len)
+{
+	*neg = (*value == '-');
+	if (*neg)
+		value++;
+	if (*value == '\0' || value[strspn(value, "0123456789")] != '\0')
+		return -1;
+	while (*value == '0' && value[1] != '\0')
+		value++;
+	*digits = value;
+	*len = strlen(value);
+	if (*len == 1 && *value == '0')
+		*neg = 0;
+	return 0;
+}
+
+static int
+integer_compare(const char *a, const char *b, int *cmp)
+{
+	int		 aneg, bneg;
+	const char	*ad, *bd;
+	size_t		 alen, blen;
+
+	if (integer_parse(a, &aneg, &ad, &alen) != 0 ||
+	    integer_parse(b, &bneg, &bd, &blen) != 0)
+		return -1;
+
+	if (aneg != bneg)
+		*cmp = aneg ? -1 : 1;
+	else {
+		if (alen != blen)
+			*cmp = alen < blen ? -1 : 1;
+		else
+			*cmp = strcmp(ad, bd);
+		if (aneg)
+			*cmp = -*cmp;
+	}
+	return 0;
+}
+
+/* Integers are encoded as 'p' followed by the number of digits and the
+ * digits, or as 'n' followed by the complements for negative numbers.
+ */
+static char *
+integer_index_key(const char *value)
+{
+	int		 neg;
+	const char	*digits;
+	char		*key, *p;
+	size_t		 len, i;
+
+	if (integer_parse(value, &neg, &digits, &len) != 0 ||
+	    len > INTEGER_MAXDIGITS)
+		return NULL;
+	if ((key = malloc(len + 4)) == NULL)
+		return NULL;
+
+	if (neg) {
+		snprintf(key, 4, "n%02zu", INTEGER_MAXDIGITS - len);
+		for (i = 0, p = key + 3; i < len; i++)
+			*p++ = '9' - (digits[i] - '0');
+		*p = '\0';
+	} else
+		snprintf(key, len + 4, "p%02zu%s", len, digits);
+	return key;
+}
+
+static int
+gentime_digits(const char **p, int n, int *v)
+{
+	for (*v = 0; n > 0; n--, (*p)++) {
+		if (!isdigit((unsigned char)**p))
+			return -1;
+		*v = *v * 10 + **p - '0';
+	}
+	return 0;
+}
+
+/* Converts a GeneralizedTime to UTC, formatted as YYYYMMDDHHMMSS followed
+ * by the fraction of the second without trailing zeros.
+ */
+static int
+gentime_normalize(const char *value, char *buf, size_t size)
+{
+	struct tm	 tm;
+	const char	*p = value;
+	time_t		 t;
+	long long	 frac = 0, scale = 1000000000LL, unit = 3600;
+	int		 v, off = 0, sign;
+	size_t		 n;
+
+	memset(&tm, 0, sizeof(tm));
+	if (gentime_digits(&p, 4, &v) != 0)
+		return -1;
+	tm.tm_year = v - 1900;
+	if (gentime_digits(&p, 2, &v) != 0 || v < 1 || v > 12)
+		return -1;
+	tm.tm_mon = v - 1;
+	if (gentime_digits(&p, 2, &tm.tm_mday) != 0 ||
+	    tm.tm_mday < 1 || tm.tm_mday > 31)
+		return -1;
+	if (gentime_digits(&p, 2, &tm.tm_hour) != 0 || tm.tm_hour > 23)
+		return -1;
+	if (isdigit((unsigned char)*p)) {
+		if (gentime_digits(&p, 2, &tm.tm_min) != 0 || tm.tm_min > 59)
+			return -1;
+		unit = 60;
+		if (isdigit((unsigned char)*p)) {
+			if (gentime_digits(&p, 2, &tm.tm_sec) != 0 ||
+			    tm.tm_sec > 60)
+				return -1;
+			unit = 1;
+		}
+	}
+
+	if (*p == '.' || *p == ',') {
+		if (!isdigit((unsigned char)*++p))
+			return -1;
+		for (; isdigit((unsigned char)*p); p++) {
+			if (scale > 1) {
+				scale /= 10;
+				frac += (*p - '0') * scale;
+			}
+		}
+		frac *= unit;
+	}
+
+	if (*p == 'Z')
+		p++;
+	else if (*p == '+' || *p == '-') {
+		sign = (*p++ == '-') ? -1 : 1;
+		if (gentime_digits(&p, 2, &v) != 0 || v > 23)
+			return -1;
+		off = v * 3600;
+		if (isdigit((unsigned char)*p)) {
+			if (gentime_digits(&p, 2, &v) != 0 || v > 59)
+				return -1;
+			off += v * 60;
+		}
+		off *= sign;
+	} else
+		return -1;
+	if (*p != '\0')
+		return -1;
+
+	t = timegm(&tm) + frac / 1000000000LL - off;
+	frac %= 1000000000LL;
+	if (gmtime_r(&t, &tm) == NULL ||
+	    tm.tm_year + 1900 < 0 || tm.tm_year + 1900 > 9999)
+		return -1;
+
+	n = snprintf(buf, size, "%04d%02d%02d%02d%02d%02d",
+	    tm.tm_year + 1900, tm.tm_mon + 1, tm.tm_mday, tm.tm_hour,
+	    tm.tm_min, tm.tm_sec);
+	if (n >= size)
+		return -1;
+	if (frac > 0) {
+		if ((size_t)snprintf(buf + n, size - n, "%09lld", frac) >=
+		    size - n)
+			return -1;
+		n = strlen(buf);
+		while (buf[n - 1] == '0')
+			buf[--n] = '\0';
+	}
+	return 0;
+}
+
+static int
+gentime_compare(const char *a, const char *b, int *cmp)
+{
+	char		 akey[GENTIME_KEYSIZE], bkey[GENTIME_KEYSIZE];
+
+	if (gentime_normalize(a, akey, sizeof(akey)) != 0 ||
+	    gentime_normalize(b, bkey, sizeof(bkey)) != 0)
+		return -1;
+	*cmp = strcmp(akey, bkey);
+	return 0;
+}
+
+static char *
+gentime_index_key(const char *value)
+{
+	char		 key[GENTIME_KEYSIZE];
+
+	if (gentime_normalize(value, key, sizeof(key)) != 0)
+		return NULL;
+	return strdup(key);
+}
+
+/* Numeric strings are compared with spaces removed.
+ */
+static int
+numstr_compare(const char *a, const char *b, int *cmp)
+{
+	for (;;) {
+		while (*a == ' ')
+			a++;
+		while (*b == ' ')
+			b++;
+		if (*a != *b || *a == '\0')
+			break;
+		a++;
+		b++;
+	}
+	*cmp = (unsigned char)*a - (unsigned char)*b;
+	return 0;
+}
+
+static char *
+numstr_index_key(const char *value)
+{
+	char		*key, *p;
+
+	if ((key = strdup(value)) == NULL)
+		return NULL;
+	for (p = key; *value != '\0'; value++)
+		if (*value != ' ')
+			*p++ = *value;
+	*p = '\0';
+	return key;
+}
+
+static int
+case_ignore_compare(const char *a, const char *b, int *cmp)
+{
+	*cmp = strcasecmp(a, b);
+	return 0;
+}
+
+static int
+case_exact_compare(const char *a, const char *b, int *cmp)
+{
+	*cmp = strcmp(a, b);
+	return 0;
+}
+
 struct match_rule match_rules[] = {
 
 	{ "1.3.6.1.1.16.2", "uuidMatch", MATCH_EQUALITY, NULL, "1.3.6.1.1.16.1", NULL },
-	{ "1.3.6.1.1.16.3", "uuidOrderingMatch", MATCH_ORDERING, NULL, "1.3.6.1.1.16.1", NULL },
+	{ "1.3.6.1.1.16.3", "uuidOrderingMatch", MATCH_ORDERING, NULL, "1.3.6.1.1.16.1", NULL, case_ignore_compare, NULL, 1 },
 	{ "1.3.6.1.4.1.1466.109.114.1", "caseExactIA5Match", MATCH_EQUALITY, NULL, "1.3.6.1.4.1.1466.115.121.1.26", ia5string_syntaxes },
 	{ "1.3.6.1.4.1.1466.109.114.2", "caseIgnoreIA5Match", MATCH_EQUALITY, NULL, "1.3.6.1.4.1.1466.115.121.1.26", ia5string_syntaxes },
 	{ "1.3.6.1.4.1.1466.109.114.3", "caseIgnoreIA5SubstringsMatch", MATCH_SUBSTR, NULL, "1.3.6.1.4.1.1466.115.121.1.58", ia5string_syntaxes },
@@ -89,26 +341,26 @@ struct match_rule match_rules[] = {
 	{ "2.5.13.12", "caseIgnoreListSubstringsMatch", MATCH_SUBSTR, NULL, "1.3.6.1.4.1.1466.115.121.1.58", dir_string_sequence_syntaxes },
 	{ "2.5.13.13", "booleanMatch", MATCH_EQUALITY, NULL, "1.3.6.1.4.1.1466.115.121.1.7", NULL },
 	{ "2.5.13.14", "integerMatch", MATCH_EQUALITY, NULL, "1.3.6.1.4.1.1466.115.121.1.27", NULL },
-	{ "2.5.13.15", "integerOrderingMatch", MATCH_ORDERING, NULL, "1.3.6.1.4.1.1466.115.121.1.27", NULL },
+	{ "2.5.13.15", "integerOrderingMatch", MATCH_ORDERING, NULL, "1.3.6.1.4.1.1466.115.121.1.27", NULL, integer_compare, integer_index_key },
 	{ "2.5.13.16", "bitStringMatch", MATCH_EQUALITY,  NULL, "1.3.6.1.4.1.1466.115.121.1.6", NULL },
 	{ "2.5.13.17", "octetStringMatch", MATCH_EQUALITY, NULL, "1.3.6.1.4.1.1466.115.121.1.40", NULL },
-	{ "2.5.13.18", "octetStringOrderingMatch", MATCH_ORDERING, NULL, "1.3.6.1.4.1.1466.115.121.1.40", NULL },
+	{ "2.5.13.18", "octetStringOrderingMatch", MATCH_ORDERING, NULL, "1.3.6.1.4.1.1466.115.121.1.40", NULL, case_exact_compare, NULL },
 	{ "2.5.13.2", "caseIgnoreMatch", MATCH_EQUALITY, NULL, "1.3.6.1.4.1.1466.115.121.1.15", dir_string_syntaxes },
 	{ "2.5.13.20", "telephoneNumberMatch", MATCH_EQUALITY, NULL, "1.3.6.1.4.1.1466.115.121.1.50", NULL },
 	{ "2.5.13.21", "telephoneNumberSubstringsMatch", MATCH_SUBSTR, NULL, "1.3.6.1.4.1.1466.115.121.1.58", telephone_syntaxes },
 	{ "2.5.13.23", "uniqueMemberMatch", MATCH_EQUALITY, NULL, "1.3.6.1.4.1.1466.115.121.1.34", NULL },
 	{ "2.5.13.27", "generalizedTimeMatch", MATCH_EQUALITY, NULL, "1.3.6.1.4.1.1466.115.121.1.24", NULL },
-	{ "2.5.13.28", "generalizedTimeOrderingMatch", MATCH_ORDERING, NULL, "1.3.6.1.4.1.1466.115.121.1.24", NULL },
+	{ "2.5.13.28", "generalizedTimeOrderingMatch", MATCH_ORDERING, NULL, "1.3.6.1.4.1.1466.115.121.1.24", NULL, gentime_compare, gentime_index_key },
 	{ "2.5.13.29", "integerFirstComponentMatch", MATCH_EQUALITY, NULL, "1.3.6.1.4.1.1466.115.121.1.27", int_first_component_syntaxes },
-	{ "2.5.13.3", "caseIgnoreOrderingMatch", MATCH_ORDERING, NULL, "1.3.6.1.4.1.1466.115.121.1.15", dir_string_syntaxes },
+	{ "2.5.13.3", "caseIgnoreOrderingMatch", MATCH_ORDERING, NULL, "1.3.6.1.4.1.1466.115.121.1.15", dir_string_syntaxes, case_ignore_compare, NULL, 1 },
 	{ "2.5.13.30", "objectIdentifierFirstComponentMatch", MATCH_EQUALITY, NULL, "1.3.6.1.4.1.1466.115.121.1.38", oid_first_component_syntaxes },
 	{ "2.5.13.31", "directoryStringFirstComponentMatch", MATCH_EQUALITY, NULL, "1.3.6.1.4.1.1466.115.121.1.15", NULL },
 	{ "2.5.13.4", "caseIgnoreSubstringsMatch", MATCH_SUBSTR, NULL, "1.3.6.1.4.1.1466.115.121.1.58", dir_string_syntaxes },
 	{ "2.5.13.5", "caseExactMatch", MATCH_EQUALITY, NULL, "1.3.6.1.4.1.1466.115.121.1.15", NULL },
-	{ "2.5.13.6", "caseExactOrderingMatch", MATCH_ORDERING, NULL, "1.3.6.1.4.1.1466.115.121.1.15", NULL },
+	{ "2.5.13.6", "caseExactOrderingMatch", MATCH_ORDERING, NULL, "1.3.6.1.4.1.1466.115.121.1.15", NULL, case_exact_compare, NULL },
 	{ "2.5.13.7", "caseExactSubstringsMatch", MATCH_SUBSTR, NULL, "1.3.6.1.4.1.1466.115.121.1.58", dir_string_syntaxes },
 	{ "2.5.13.8", "numericStringMatch", MATCH_EQUALITY, NULL, "1.3.6.1.4.1.1466.115.121.1.36", NULL },
-	{ "2.5.13.9", "numericStringOrderingMatch", MATCH_ORDERING, NULL, "1.3.6.1.4.1.1466.115.121.1.36", NULL },
+	{ "2.5.13.9", "numericStringOrderingMatch", MATCH_ORDERING, NULL, "1.3.6.1.4.1.1466.115.121.1.36", NULL, numstr_compare, numstr_index_key },
 
 #if 0
 	{ "2.5.13.32", "wordMatch", "1.3.6.1.4.1.1466.115.121.1.15", MATCH_EQUALITY, NULL },
@@ -53,6 +53,7 @@ ldap_delete(struct request *req)
 		else
 			return ldap_refer(req, dn, NULL, refs);
 	}
+	req->ns = ns;
 
 	if (!authorized(req->conn, ns, ACI_WRITE, dn, LDAP_SCOPE_BASE))
 		return ldap_respond(req, LDAP_INSUFFICIENT_ACCESS);
@@ -91,14 +92,13 @@ ldap_delete(struct request *req)
 		goto done;
 	}
 
-	if (namespace_del(ns, dn) == 0 && namespace_commit(ns) == 0)
+	if (namespace_del(ns, dn) == 0)
 		rc = LDAP_SUCCESS;
 
 done:
 	btree_cursor_close(cursor);
 	btval_reset(&key);
-	namespace_abort(ns);
-	return ldap_respond(req, rc);
+	return namespace_end(ns, req, rc);
 }
 
 int
@@ -131,6 +131,7 @@ ldap_add(struct request *req)
 		else
 			return ldap_refer(req, dn, NULL, refs);
 	}
+	req->ns = ns;
 
 	if (!authorized(req->conn, ns, ACI_WRITE, dn, LDAP_SCOPE_BASE) != 0)
 		return ldap_respond(req, LDAP_INSUFFICIENT_ACCESS);
@@ -193,15 +194,13 @@ ldap_add(struct request *req)
 
 	if ((rc = validate_entry(dn, attrs, ns->relax)) != LDAP_SUCCESS ||
 	    namespace_add(ns, dn, attrs) != 0) {
-		namespace_abort(ns);
 		if (rc == LDAP_SUCCESS && errno == EEXIST)
 			rc = LDAP_ALREADY_EXISTS;
 		else if (rc == LDAP_SUCCESS)
 			rc = LDAP_OTHER;
-	} else if (namespace_commit(ns) != 0)
-		rc = LDAP_OTHER;
+	}
 
-	return ldap_respond(req, rc);
+	return namespace_end(ns, req, rc);
 
 fail:
 	if (set != NULL)
@@ -241,6 +240,7 @@ ldap_modify(struct request *req)
 		else
 			return ldap_refer(req, dn, NULL, refs);
 	}
+	req->ns = ns;
 
 	if (!authorized(req->conn, ns, ACI_WRITE, dn, LDAP_SCOPE_BASE) != 0)
 		return ldap_respond(req, LDAP_INSUFFICIENT_ACCESS);
@@ -349,7 +349,7 @@ ldap_modify(struct request *req)
 	else
 		ldap_add_attribute(entry, "modifyTimestamp", set);
 
-	if (namespace_update(ns, dn, entry) == 0 && namespace_commit(ns) == 0)
+	if (namespace_update(ns, dn, entry) == 0)
 		rc = LDAP_SUCCESS;
 	else
 		rc = LDAP_OTHER;
@@ -357,7 +357,6 @@ ldap_modify(struct request *req)
 done:
 	if (vals != NULL)
 		ber_free_elements(vals);
-	namespace_abort(ns);
-	return ldap_respond(req, rc);
+	return namespace_end(ns, req, rc);
 }
 
@@ -21,9 +21,12 @@
 
 #include <assert.h>
 #include <errno.h>
+#include <limits.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
+#include <unistd.h>
 #include <zlib.h>
 
 #include "ldapd.h"
@@ -36,10 +39,34 @@ extern const char	*datadir;
  */
 #define MAX_REQUEST_QUEUE	 10000
 
+/* Number of pages copied per event loop iteration during online
+ * compaction, and how long to wait for the write lock to finish it.
+ */
+#define COMPACT_PAGES		 256
+#define COMPACT_RETRY		 100000		/* usec */
+
 static struct btval	*namespace_find(struct namespace *ns, char *dn);
+static int		 namespace_cache_valid(struct namespace *ns);
+static void		 namespace_cache_put(struct namespace *ns, char *dn,
+			    struct btval *val);
 static void		 namespace_queue_replay(int fd, short event, void *arg);
+static void		 namespace_check_stale(struct namespace *ns);
+static void		 namespace_group_end(struct namespace *ns, int commit);
+static void		 namespace_group_timeout(int fd, short event,
+				void *arg);
 static int		 namespace_set_fd(struct namespace *ns,
 			    struct btree **bt, int fd, unsigned int flags);
+static void		 namespace_set_cache_size(struct namespace *ns,
+			    struct btree *bt);
+static int		 namespace_compact_open(struct namespace *ns);
+static void		 namespace_compact_schedule(struct namespace *ns,
+			    unsigned int usec);
+static void		 namespace_compact_step(int fd, short event,
+			    void *arg);
+static void		 namespace_compact_abort(struct namespace *ns);
+static void		 namespace_load_dict(struct namespace *ns,
+			    struct btree_txn *data_txn);
+static void		 namespace_train_dict(struct namespace *ns);
 
 int
 namespace_begin_txn(struct namespace *ns, struct btree_txn **data_txn,
@@ -65,41 +92,107 @@ namespace_begin_txn(struct namespace *ns, struct btree_txn **data_txn,
 		return -1;
 	}
 
+	/* Read-only transactions keep reading a compacted file at its last
+	 * revision, while the new file is being opened.
+	 */
+	if (rdonly)
+		namespace_check_stale(ns);
+	namespace_load_dict(ns, *data_txn);
+
 	return 0;
 }
 
+static void
+namespace_check_stale(struct namespace *ns)
+{
+	if (btree_get_flags(ns->data_db) & BT_STALE)
+		namespace_reopen_data(ns);
+	if (btree_get_flags(ns->indx_db) & BT_STALE)
+		namespace_reopen_indx(ns);
+}
+
 int
 namespace_begin(struct namespace *ns)
 {
-	return namespace_begin_txn(ns, &ns->data_txn, &ns->indx_txn, 0);
+	ns->op_dirty = 0;
+
+	/* Join the batch of a pending group commit. */
+	if (ns->group_data_txn != NULL) {
+		ns->data_txn = ns->group_data_txn;
+		ns->indx_txn = ns->group_indx_txn;
+		return 0;
+	}
+
+	if (namespace_begin_txn(ns, &ns->data_txn, &ns->indx_txn, 0) != 0)
+		return -1;
+
+	/* Changes are indexed again once the first worker has removed an
+	 * index of an earlier version, which it does holding the lock.
+	 */
+	if (ns->indx_unusable)
+		index_check_ready(ns, NULL);
+	namespace_train_dict(ns);
+	return 0;
 }
 
 int
 namespace_commit(struct namespace *ns)
 {
-	if (ns->indx_txn != NULL &&
-	    btree_txn_commit(ns->indx_txn) != BT_SUCCESS) {
-		log_warn("%s(indx): commit failed", ns->suffix);
-		btree_txn_abort(ns->data_txn);
-		ns->indx_txn = ns->data_txn = NULL;
-		return -1;
-	}
-	ns->indx_txn = NULL;
+	unsigned int	 rev;
 
+	/* The entries are committed first, so the change log in the index
+	 * database never holds a change that didn't happen.
+	 */
 	if (ns->data_txn != NULL &&
 	    btree_txn_commit(ns->data_txn) != BT_SUCCESS) {
 		log_warn("%s(data): commit failed", ns->suffix);
-		ns->data_txn = NULL;
+		btree_txn_abort(ns->indx_txn);
+		ns->indx_txn = ns->data_txn = NULL;
+		entry_cache_flush(&ns->entry_cache);
 		return -1;
 	}
 	ns->data_txn = NULL;
 
+	if (ns->indx_txn != NULL &&
+	    btree_txn_commit(ns->indx_txn) != BT_SUCCESS) {
+		log_warn("%s(indx): commit failed after the entries",
+		    ns->suffix);
+		ns->indx_txn = NULL;
+		entry_cache_flush(&ns->entry_cache);
+		return -1;
+	}
+	ns->indx_txn = NULL;
+
+	/* The changed entries were removed from the cache as they were
+	 * written. The rest is still valid if ours was the only commit
+	 * since the cache was last checked.
+	 */
+	if (btree_revision(ns->data_db, &rev) == BT_SUCCESS &&
+	    rev == ns->entry_cache.revision + 1)
+		ns->entry_cache.revision = rev;
+	else
+		entry_cache_flush(&ns->entry_cache);
+
+	/* Persistent searches send the logged changes. */
+	if (ns->changelog != 0)
+		search_notify(ns);
+
 	return 0;
 }
 
 void
 namespace_abort(struct namespace *ns)
 {
+	if (ns->group_data_txn != NULL && ns->data_txn != NULL) {
+		/* An operation that failed before writing anything leaves
+		 * the batch intact, others take the whole batch with them.
+		 */
+		ns->data_txn = ns->indx_txn = NULL;
+		if (ns->op_dirty)
+			namespace_group_end(ns, 0);
+		return;
+	}
+
 	btree_txn_abort(ns->data_txn);
 	ns->data_txn = NULL;
 
@@ -107,16 +200,106 @@ namespace_abort(struct namespace *ns)
 	ns->indx_txn = NULL;
 }
 
+/* Ends the write operation of a request and sends the result. With group
+ * commit, a successful operation is added to the open batch and its result
+ * is held back until the batch is committed.
+ */
+int
+namespace_end(struct namespace *ns, struct request *req, int rc)
+{
+	struct timeval	 tv;
+
+	if (rc != LDAP_SUCCESS) {
+		namespace_abort(ns);
+		return ldap_respond(req, rc);
+	}
+
+	if (ns->group_commit == 0) {
+		if (namespace_commit(ns) != 0)
+			rc = LDAP_OTHER;
+		return ldap_respond(req, rc);
+	}
+
+	ns->group_data_txn = ns->data_txn;
+	ns->group_indx_txn = ns->indx_txn;
+	ns->data_txn = ns->indx_txn = NULL;
+	TAILQ_INSERT_TAIL(&ns->commit_queue, req, next);
+
+	if (++ns->group_ops >= ns->group_commit_limit)
+		namespace_group_end(ns, 1);
+	else if (!evtimer_pending(&ns->ev_commit, NULL)) {
+		tv.tv_sec = ns->group_commit / 1000;
+		tv.tv_usec = (ns->group_commit % 1000) * 1000;
+		evtimer_add(&ns->ev_commit, &tv);
+	}
+
+	return rc;
+}
+
+/* Commits or aborts the open batch and sends the held back results.
+ */
+static void
+namespace_group_end(struct namespace *ns, int commit)
+{
+	struct request		*req;
+	struct ber_arena	*prev;
+	int			 rc = LDAP_SUCCESS;
+
+	if (evtimer_pending(&ns->ev_commit, NULL))
+		evtimer_del(&ns->ev_commit);
+
+	if (ns->group_data_txn == NULL)
+		return;
+
+	ns->data_txn = ns->group_data_txn;
+	ns->indx_txn = ns->group_indx_txn;
+	ns->group_data_txn = ns->group_indx_txn = NULL;
+
+	if (!commit) {
+		log_warnx("%s: aborting batch of %u operations",
+		    ns->suffix, ns->group_ops);
+		namespace_abort(ns);
+		rc = LDAP_OTHER;
+	} else if (namespace_commit(ns) != 0)
+		rc = LDAP_OTHER;
+	else
+		log_debug("%s: committed batch of %u operations",
+		    ns->suffix, ns->group_ops);
+
+	/* Each result is built in the arena of its request, which is gone
+	 * afterwards, even if it is the one being dispatched.
+	 */
+	ns->group_ops = 0;
+	prev = ber_set_arena(NULL);
+	while ((req = TAILQ_FIRST(&ns->commit_queue)) != NULL) {
+		TAILQ_REMOVE(&ns->commit_queue, req, next);
+		if (prev == &req->arena)
+			prev = NULL;
+		ber_set_arena(&req->arena);
+		ldap_respond(req, rc);
+	}
+	ber_set_arena(prev);
+}
+
+static void
+namespace_group_timeout(int fd, short event, void *data)
+{
+	namespace_group_end(data, 1);
+}
+
 int
 namespace_open(struct namespace *ns)
 {
 	unsigned int	 db_flags = 0;
+	int		 rc;
 
 	assert(ns);
 	assert(ns->suffix);
 
 	if (ns->sync == 0)
 		db_flags |= BT_NOSYNC;
+	if (ns->mmap)
+		db_flags |= BT_MMAP;
 
 	if (asprintf(&ns->data_path, "%s/%s_data.db", datadir, ns->suffix) < 0)
 		return -1;
@@ -125,7 +308,7 @@ namespace_open(struct namespace *ns)
 	if (ns->data_db == NULL)
 		return -1;
 
-	btree_set_cache_size(ns->data_db, ns->cache_size);
+	namespace_set_cache_size(ns, ns->data_db);
 
 	if (asprintf(&ns->indx_path, "%s/%s_indx.db", datadir, ns->suffix) < 0)
 		return -1;
@@ -133,10 +316,21 @@ namespace_open(struct namespace *ns)
 	if (ns->indx_db == NULL)
 		return -1;
 
-	btree_set_cache_size(ns->indx_db, ns->index_cache_size);
+	namespace_set_cache_size(ns, ns->indx_db);
+
+	if ((rc = index_usable(ns, NULL)) == -1)
+		return -1;
+	if (rc == 0) {
+		log_warnx("%s: index has no entry IDs and is not used"
+		    " until it is built again", ns->suffix);
+		ns->indx_unusable = 1;
+	} else
+		index_check_ready(ns, NULL);
 
 	/* prepare request queue scheduler */
 	evtimer_set(&ns->ev_queue, namespace_queue_replay, ns);
+	evtimer_set(&ns->ev_commit, namespace_group_timeout, ns);
+	evtimer_set(&ns->ev_compact, namespace_compact_step, ns);
 
 	return 0;
 }
@@ -158,12 +352,16 @@ namespace_reopen(const char *path)
 	    sizeof(req));
 }
 
+/* The stale btree is kept open until the parent has sent us the new file,
+ * so readers aren't blocked in the meantime.
+ */
 int
 namespace_reopen_data(struct namespace *ns)
 {
-	if (ns->data_db != NULL) {
-		btree_close(ns->data_db);
-		ns->data_db = NULL;
+	if (ns->data_db != NULL && !ns->data_reopen) {
+		ns->data_reopen = 1;
+		ns->dict_valid = 0;
+		entry_cache_flush(&ns->entry_cache);
 		return namespace_reopen(ns->data_path);
 	}
 	return 1;
@@ -172,9 +370,8 @@ namespace_reopen_data(struct namespace *ns)
 int
 namespace_reopen_indx(struct namespace *ns)
 {
-	if (ns->indx_db != NULL) {
-		btree_close(ns->indx_db);
-		ns->indx_db = NULL;
+	if (ns->indx_db != NULL && !ns->indx_reopen) {
+		ns->indx_reopen = 1;
 		return namespace_reopen(ns->indx_path);
 	}
 	return 1;
@@ -185,24 +382,240 @@ namespace_set_fd(struct namespace *ns, struct btree **bt, int fd,
     unsigned int flags)
 {
 	log_info("reopening namespace %s (entries)", ns->suffix);
+	namespace_group_end(ns, 1);
 	btree_close(*bt);
 	if (ns->sync == 0)
 		flags |= BT_NOSYNC;
+	if (ns->mmap)
+		flags |= BT_MMAP;
 	*bt = btree_open_fd(fd, flags);
 	if (*bt == NULL)
 		return -1;
+	namespace_set_cache_size(ns, *bt);
+	return 0;
+}
+
+/* The cache size is configured either in pages or in bytes. The page size
+ * is only known once the database is open.
+ */
+static void
+namespace_set_cache_size(struct namespace *ns, struct btree *bt)
+{
+	const struct btree_stat	*st;
+	unsigned int		 pages;
+	long long		 bytes;
+
+	if (bt == ns->data_db) {
+		pages = ns->cache_size;
+		bytes = ns->cache_bytes;
+	} else {
+		pages = ns->index_cache_size;
+		bytes = ns->index_cache_bytes;
+	}
+
+	if (bytes > 0 && (st = btree_stat(bt)) != NULL && st->psize > 0) {
+		if (bytes / st->psize > UINT_MAX)
+			pages = UINT_MAX;
+		else
+			pages = bytes / st->psize;
+		log_debug("%s: cache size %lld bytes is %u pages",
+		    ns->suffix, bytes, pages);
+	}
+
+	btree_set_cache_size(bt, pages);
+}
+
+/* Online compaction copies the database to a new file a few pages at a
+ * time, while the namespace stays available. Only the final switch needs
+ * the write lock. Since ldape can't create or rename files, the parent
+ * opens the new file and renames it over the old one. The entries are
+ * compacted first, then the index.
+ */
+int
+namespace_compact(struct namespace *ns)
+{
+	if (ns->compact_phase != COMPACT_NONE) {
+		errno = EALREADY;
+		return -1;
+	}
+	if (ns->data_db == NULL || ns->indx_db == NULL) {
+		errno = EBUSY;	/* namespace is being reopened */
+		return -1;
+	}
+
+	ns->compact_phase = COMPACT_DATA;
+	return namespace_compact_open(ns);
+}
+
+static int
+namespace_compact_open(struct namespace *ns)
+{
+	const char	*path;
+
+	if (ns->compact_phase == COMPACT_DATA)
+		path = ns->data_path;
+	else
+		path = ns->indx_path;
+
+	free(ns->compact_path);
+	if (asprintf(&ns->compact_path, "%s.compact", path) == -1) {
+		ns->compact_path = NULL;
+		namespace_compact_abort(ns);
+		return -1;
+	}
+
+	log_info("compacting namespace %s (%s)", ns->suffix,
+	    ns->compact_phase == COMPACT_DATA ? "entries" : "index");
+	if (namespace_reopen(ns->compact_path) == -1) {
+		namespace_compact_abort(ns);
+		return -1;
+	}
+	return 0;
+}
+
+/* Called with the file opened by the parent for the compacted database.
+ */
+int
+namespace_compact_fd(struct namespace *ns, int fd)
+{
+	struct btree	*bt;
+
+	if (ns->compact_phase == COMPACT_DATA)
+		bt = ns->data_db;
+	else
+		bt = ns->indx_db;
+
+	if (fd == -1 || bt == NULL) {
+		log_warnx("%s: can't compact, database not open", ns->suffix);
+		goto fail;
+	}
+
+	if (ftruncate(fd, 0) == -1) {
+		log_warn("%s: ftruncate", ns->compact_path);
+		goto fail;
+	}
+
+	if ((ns->compact = btree_compact_begin(bt, fd)) == NULL) {
+		log_warn("%s: failed to start compaction", ns->suffix);
+		namespace_compact_abort(ns);
+		return -1;
+	}
+
+	namespace_compact_schedule(ns, 0);
 	return 0;
+
+fail:
+	if (fd != -1)
+		close(fd);
+	namespace_compact_abort(ns);
+	return -1;
+}
+
+static void
+namespace_compact_schedule(struct namespace *ns, unsigned int usec)
+{
+	struct timeval	 tv;
+
+	tv.tv_sec = 0;
+	tv.tv_usec = usec;
+	evtimer_add(&ns->ev_compact, &tv);
+}
+
+static void
+namespace_compact_step(int fd, short event, void *data)
+{
+	struct namespace	*ns = data;
+	struct rename_req	 rreq;
+	int			 rc;
+
+	if ((rc = btree_compact_step(ns->compact, COMPACT_PAGES)) == 0) {
+		namespace_compact_schedule(ns, 0);
+		return;
+	}
+
+	if (rc == 1) {
+		/* Writers are queued until the file has been renamed. */
+		if (btree_compact_commit(ns->compact) == BT_SUCCESS) {
+			memset(&rreq, 0, sizeof(rreq));
+			strlcpy(rreq.path, ns->compact_phase == COMPACT_DATA ?
+			    ns->data_path : ns->indx_path, sizeof(rreq.path));
+			imsgev_compose(iev_ldapd, IMSG_LDAPD_RENAME, 0, 0, -1,
+			    &rreq, sizeof(rreq));
+			return;
+		}
+		if (errno == EBUSY) {
+			namespace_compact_schedule(ns, COMPACT_RETRY);
+			return;
+		}
+	}
+
+	log_warn("%s: compaction failed", ns->suffix);
+	namespace_compact_abort(ns);
+}
+
+/* Called when the parent has renamed the compacted file. The old file
+ * gets a tombstone, and is reopened as if compacted by another process.
+ */
+void
+namespace_compact_renamed(struct namespace *ns, int error)
+{
+	const struct btree_compact_stat	*st;
+
+	if (ns->compact == NULL)
+		return;
+
+	if (error != 0) {
+		errno = error;
+		log_warn("%s: failed to rename %s", ns->suffix,
+		    ns->compact_path);
+		namespace_compact_abort(ns);
+		return;
+	}
+
+	st = btree_compact_stat(ns->compact);
+	log_info("%s: compacted %llu pages to %llu in %u passes", ns->suffix,
+	    st->file_pages, st->copied, st->passes);
+
+	if (btree_compact_end(ns->compact, 1) != BT_SUCCESS)
+		log_warn("%s: failed to write tombstone", ns->suffix);
+	ns->compact = NULL;
+
+	if (ns->compact_phase == COMPACT_DATA) {
+		namespace_reopen_data(ns);
+		ns->compact_phase = COMPACT_INDX;
+		namespace_compact_open(ns);
+	} else {
+		namespace_reopen_indx(ns);
+		ns->compact_phase = COMPACT_NONE;
+		free(ns->compact_path);
+		ns->compact_path = NULL;
+	}
+}
+
+static void
+namespace_compact_abort(struct namespace *ns)
+{
+	if (evtimer_pending(&ns->ev_compact, NULL))
+		evtimer_del(&ns->ev_compact);
+
+	btree_compact_end(ns->compact, 0);
+	ns->compact = NULL;
+	ns->compact_phase = COMPACT_NONE;
+	free(ns->compact_path);
+	ns->compact_path = NULL;
 }
 
 int
 namespace_set_data_fd(struct namespace *ns, int fd)
 {
+	ns->data_reopen = 0;
 	return namespace_set_fd(ns, &ns->data_db, fd, BT_REVERSEKEY);
 }
 
 int
 namespace_set_indx_fd(struct namespace *ns, int fd)
 {
+	ns->indx_reopen = 0;
 	return namespace_set_fd(ns, &ns->indx_db, fd, 0);
 }
 
@@ -213,6 +626,10 @@ namespace_close(struct namespace *ns)
 	struct search		*search, *next;
 	struct request		*req;
 
+	namespace_group_end(ns, 1);
+	namespace_compact_abort(ns);
+	index_build_stop(ns);
+
 	/* Cancel any queued requests for this namespace.
 	 */
 	if (ns->queued_requests > 0) {
@@ -235,6 +652,8 @@ namespace_close(struct namespace *ns)
 		}
 	}
 
+	entry_cache_flush(&ns->entry_cache);
+	btval_reset(&ns->dict);
 	free(ns->suffix);
 	btree_close(ns->data_db);
 	btree_close(ns->indx_db);
@@ -281,19 +700,82 @@ namespace_find(struct namespace *ns, char *dn)
 		return NULL;
 	}
 
+	if (ns->data_txn == NULL)
+		namespace_check_stale(ns);
+
 	return &val;
 }
 
+/* Returns 1 if the entry cache can be used outside a write operation.
+ * The cache is flushed when another process has committed to the
+ * database since it was last checked.
+ */
+static int
+namespace_cache_valid(struct namespace *ns)
+{
+	unsigned int	 rev;
+
+	if (ns->entry_cache.max_bytes == 0 || ns->data_db == NULL ||
+	    ns->data_txn != NULL)
+		return 0;
+
+	if (btree_revision(ns->data_db, &rev) != BT_SUCCESS) {
+		entry_cache_flush(&ns->entry_cache);
+		return 0;
+	}
+	if (rev != ns->entry_cache.revision) {
+		entry_cache_flush(&ns->entry_cache);
+		ns->entry_cache.revision = rev;
+	}
+	return 1;
+}
+
+/* Entries read while a group commit is pending may be changed by the
+ * batch, so they are only cached once it is committed.
+ */
+static void
+namespace_cache_put(struct namespace *ns, char *dn, struct btval *val)
+{
+	if (ns->group_data_txn == NULL)
+		entry_cache_put(&ns->entry_cache, dn, val);
+}
+
 struct ber_element *
 namespace_get(struct namespace *ns, char *dn)
 {
 	struct ber_element	*elm;
-	struct btval		*val;
+	struct btval		*val, raw;
+	int			 cached, rc;
+
+	if ((cached = namespace_cache_valid(ns)) != 0) {
+		if ((rc = entry_cache_get(&ns->entry_cache, dn, &raw)) == 1)
+			return db2ber(&raw, 0, NULL);
+		if (rc == 0) {
+			log_debug("%s: dn not found (cached)", dn);
+			errno = ENOENT;
+			return NULL;
+		}
+	}
 
-	if ((val = namespace_find(ns, dn)) == NULL)
+	if ((val = namespace_find(ns, dn)) == NULL) {
+		if (cached && errno == ENOENT)
+			namespace_cache_put(ns, dn, NULL);
 		return NULL;
+	}
+
+	if (!cached) {
+		elm = namespace_db2ber(ns, val);
+		btval_reset(val);
+		return elm;
+	}
 
-	elm = namespace_db2ber(ns, val);
+	if (namespace_db2raw(ns, val, &raw) != 0) {
+		btval_reset(val);
+		return NULL;
+	}
+	namespace_cache_put(ns, dn, &raw);
+	elm = db2ber(&raw, 0, NULL);
+	btval_reset(&raw);
 	btval_reset(val);
 	return elm;
 }
@@ -301,25 +783,164 @@ namespace_get(struct namespace *ns, char *dn)
 int
 namespace_exists(struct namespace *ns, char *dn)
 {
-	struct btval		*val;
+	struct btval		*val, raw;
+	int			 cached, rc;
+
+	if ((cached = namespace_cache_valid(ns)) != 0 &&
+	    (rc = entry_cache_get(&ns->entry_cache, dn, &raw)) != -1)
+		return rc;
 
-	if ((val = namespace_find(ns, dn)) == NULL)
+	if ((val = namespace_find(ns, dn)) == NULL) {
+		if (cached && errno == ENOENT)
+			namespace_cache_put(ns, dn, NULL);
 		return 0;
+	}
 	btval_reset(val);
 	return 1;
 }
 
+/* Loads the compression dictionary stored with the data db, unless it
+ * is still the one loaded for the last revision.
+ */
+static void
+namespace_load_dict(struct namespace *ns, struct btree_txn *data_txn)
+{
+	struct btval	 dict;
+	unsigned int	 rev;
+
+	if (ns->compression_level == 0)
+		return;
+
+	/* A stale file keeps the dictionary it was copied with. */
+	if (btree_revision(ns->data_db, &rev) != BT_SUCCESS ||
+	    (ns->dict_valid && rev == ns->dict_revision))
+		return;
+
+	if (btree_txn_get_meta(NULL, data_txn, &dict) != BT_SUCCESS) {
+		if (errno != ENOENT) {
+			log_warn("%s: failed to load dictionary", ns->suffix);
+			return;
+		}
+		memset(&dict, 0, sizeof(dict));
+	}
+
+	btval_reset(&ns->dict);
+	ns->dict = dict;
+	ns->dict_revision = rev;
+	ns->dict_valid = 1;
+	ns->compress_stat.dict_size = dict.size;
+}
+
+/* Trains a compression dictionary from the first entries of the data db,
+ * once there are enough of them.  It is stored with the open write
+ * transaction, and used for the entries written from now on.  Entries
+ * written before stay readable without it.
+ */
+static void
+namespace_train_dict(struct namespace *ns)
+{
+	const struct btree_stat	*st;
+	struct cursor		*cursor;
+	struct btval		 key, val, dict, *samples;
+	unsigned int		 i, n = 0;
+
+	if (!ns->compression_dict || ns->compression_level == 0 ||
+	    ns->dict.data != NULL)
+		return;
+
+	/* Try again as the namespace grows if nothing was worth it. */
+	if ((st = btree_stat(ns->data_db)) == NULL ||
+	    st->entries < DICT_MIN_ENTRIES || st->entries < 2 * ns->dict_tried)
+		return;
+
+	if ((samples = calloc(DICT_SAMPLE, sizeof(*samples))) == NULL)
+		return;
+	if ((cursor = btree_txn_cursor_open(NULL, ns->data_txn)) == NULL) {
+		free(samples);
+		return;
+	}
+	btree_cursor_sequential(cursor);
+
+	memset(&key, 0, sizeof(key));
+	memset(&val, 0, sizeof(val));
+	while (n < DICT_SAMPLE && btree_cursor_get(cursor, &key, &val,
+	    n == 0 ? BT_FIRST : BT_NEXT) == BT_SUCCESS) {
+		if (namespace_db2raw(ns, &val, &samples[n]) == 0)
+			n++;
+		btval_reset(&key);
+		btval_reset(&val);
+	}
+	btree_cursor_close(cursor);
+
+	if (dict_train(samples, n, DICT_MAX_SIZE, &dict) != 0)
+		ns->dict_tried = st->entries;
+	else {
+		if (btree_txn_put_meta(NULL, ns->data_txn, &dict) != BT_SUCCESS) {
+			log_warn("%s: failed to store dictionary", ns->suffix);
+			btval_reset(&dict);
+		} else {
+			log_info("%s: trained %zu byte compression dictionary",
+			    ns->suffix, dict.size);
+			/* reloaded once committed, or if aborted */
+			ns->dict = dict;
+			ns->dict_valid = 0;
+			ns->compress_stat.dict_size = dict.size;
+		}
+	}
+
+	for (i = 0; i < n; i++)
+		btval_reset(&samples[i]);
+	free(samples);
+}
+
 int
 namespace_ber2db(struct namespace *ns, struct ber_element *root,
     struct btval *val)
 {
-	return ber2db(root, val, ns->compression_level);
+	struct compress_stat	*cs = &ns->compress_stat;
+
+	if (ber2db(root, val, ns->compression_level, &ns->dict) != 0)
+		return -1;
+
+	cs->stored++;
+	cs->stored_bytes += val->size;
+	if (ns->compression_level > 0)
+		cs->raw_bytes += *(uint32_t *)val->data;
+	else
+		cs->raw_bytes += val->size;
+	return 0;
+}
+
+int
+namespace_db2raw(struct namespace *ns, struct btval *val, struct btval *raw)
+{
+	struct timespec		 start, end;
+	int			 rc;
+
+	if (ns->compression_level == 0)
+		return db2raw(val, 0, NULL, raw);
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	rc = db2raw(val, ns->compression_level, &ns->dict, raw);
+	clock_gettime(CLOCK_MONOTONIC, &end);
+
+	ns->compress_stat.inflated++;
+	ns->compress_stat.inflate_usec += (end.tv_sec - start.tv_sec) *
+	    1000000LL + (end.tv_nsec - start.tv_nsec) / 1000;
+	return rc;
 }
 
 struct ber_element *
 namespace_db2ber(struct namespace *ns, struct btval *val)
 {
-	return db2ber(val, ns->compression_level);
+	struct btval		 raw;
+	struct ber_element	*elm;
+
+	if (namespace_db2raw(ns, val, &raw) != 0)
+		return NULL;
+	elm = db2ber(&raw, 0, NULL);
+	btval_reset(&raw);
+	return elm;
 }
 
 static int
@@ -327,6 +948,7 @@ namespace_put(struct namespace *ns, char *dn, struct ber_element *root,
     int update)
 {
 	int			 rc;
+	uint32_t		 id;
 	struct btval		 key, val;
 
 	assert(ns != NULL);
@@ -340,8 +962,11 @@ namespace_put(struct namespace *ns, char *dn, struct ber_element *root,
 	if (namespace_ber2db(ns, root, &val) != 0)
 		return BT_FAIL;
 
+	entry_cache_remove(&ns->entry_cache, dn);
 	rc = btree_txn_put(NULL, ns->data_txn, &key, &val,
 	    update ? 0 : BT_NOOVERWRITE);
+	if (rc == BT_SUCCESS || errno != EEXIST)
+		ns->op_dirty = 1;
 	if (rc != BT_SUCCESS) {
 		if (errno == EEXIST)
 			log_debug("%s: already exists", dn);
@@ -350,12 +975,24 @@ namespace_put(struct namespace *ns, char *dn, struct ber_element *root,
 		goto done;
 	}
 
-	/* FIXME: if updating, try harder to just update changed indices.
+	rc = changelog_append(ns, update ? LDAP_REQ_MODIFY : LDAP_REQ_ADD,
+	    dn, root);
+	if (rc != BT_SUCCESS || ns->indx_unusable)
+		goto done;
+
+	/* An entry keeps its ID when it is updated.
+	 * FIXME: if updating, try harder to just update changed indices.
 	 */
-	if (update && (rc = unindex_entry(ns, &key, root)) != BT_SUCCESS)
+	if (update && index_dn2id(ns, ns->indx_txn, &key, &id) == 0) {
+		if ((rc = unindex_entry(ns, &key, id, root)) != BT_SUCCESS)
+			goto done;
+	} else if (update && errno != ENOENT) {
+		rc = BT_FAIL;
+		goto done;
+	} else if ((rc = index_new_id(ns, &id)) != BT_SUCCESS)
 		goto done;
 
-	rc = index_entry(ns, &key, root);
+	rc = index_entry(ns, &key, id, root);
 
 done:
 	btval_reset(&val);
@@ -378,6 +1015,7 @@ int
 namespace_del(struct namespace *ns, char *dn)
 {
 	int			 rc;
+	uint32_t		 id;
 	struct ber_element	*root;
 	struct btval		 key, data;
 
@@ -391,9 +1029,23 @@ namespace_del(struct namespace *ns, char *dn)
 	key.data = dn;
 	key.size = strlen(key.data);
 
+	entry_cache_remove(&ns->entry_cache, dn);
 	rc = btree_txn_del(NULL, ns->data_txn, &key, &data);
-	if (rc == BT_SUCCESS && (root = namespace_db2ber(ns, &data)) != NULL)
-		rc = unindex_entry(ns, &key, root);
+	if (rc == BT_SUCCESS || errno != ENOENT)
+		ns->op_dirty = 1;
+	root = NULL;
+	if (rc == BT_SUCCESS && (ns->changelog != 0 || !ns->indx_unusable))
+		root = namespace_db2ber(ns, &data);
+	if (rc == BT_SUCCESS)
+		rc = changelog_append(ns, LDAP_REQ_DELETE_30, dn, root);
+	if (rc == BT_SUCCESS && !ns->indx_unusable && root != NULL) {
+		if (index_dn2id(ns, ns->indx_txn, &key, &id) == 0)
+			rc = unindex_entry(ns, &key, id, root);
+		else if (errno != ENOENT)
+			rc = BT_FAIL;
+	}
+	if (root != NULL)
+		ber_free_elements(root);
 
 	btval_reset(&data);
 	return rc;
@@ -459,13 +1111,32 @@ namespace_has_index(struct namespace *ns, const char *attr,
 	assert(ns);
 	assert(attr);
 	TAILQ_FOREACH(ai, &ns->indices, next) {
-		if (strcasecmp(attr, ai->attr) == 0 && ai->type == type)
-			return 1;
+		if (strcasecmp(attr, ai->attr) == 0 && ai->type == type) {
+			/* not used until the entries are indexed */
+			index_check_ready(ns, ai);
+			return ai->ready;
+		}
 	}
 
 	return 0;
 }
 
+/* Returns the ordering matching rule of an attribute. Under relaxed
+ * schema checking, attributes without one are ordered case-insensitively.
+ */
+const struct match_rule *
+namespace_ordering(struct namespace *ns, char *attr)
+{
+	struct attr_type	*at;
+
+	at = lookup_attribute(conf->schema, attr);
+	if (at != NULL && at->ordering != NULL)
+		return at->ordering;
+	if (ns->relax)
+		return match_rule_lookup("caseIgnoreOrderingMatch");
+	return NULL;
+}
+
 /* Queues modification requests while the namespace is being reopened.
  */
 int
@@ -491,7 +1162,8 @@ namespace_queue_replay(int fd, short event, void *data)
 	struct namespace	*ns = data;
 	struct request		*req;
 
-	if (ns->data_db == NULL || ns->indx_db == NULL) {
+	if (ns->data_db == NULL || ns->indx_db == NULL ||
+	    ns->data_reopen || ns->indx_reopen) {
 		log_debug("%s: database is being reopened", ns->suffix);
 		return;		/* Database is being reopened. */
 	}
@@ -502,7 +1174,10 @@ namespace_queue_replay(int fd, short event, void *data)
 
 	log_debug("replaying queued request");
 	req->replayed = 1;
+	if (ber_set_arena(&req->arena) != NULL)
+		fatalx("namespace_queue_replay: arena left set");
 	request_dispatch(req);
+	ber_set_arena(NULL);
 	ns->queued_requests--;
 
 	if (!evtimer_pending(&ns->ev_queue, NULL))
@@ -520,7 +1195,8 @@ namespace_queue_schedule(struct namespace *ns, unsigned int usec)
 }
 
 /* Cancel all queued requests from the given connection. Drops matching
- * requests from all namespaces without sending a response.
+ * requests from all namespaces without sending a response. Requests waiting
+ * for a group commit are still committed.
  */
 void
 namespace_cancel_conn(struct conn *conn)
@@ -538,6 +1214,16 @@ namespace_cancel_conn(struct conn *conn)
 				request_free(req);
 			}
 		}
+
+		for (req = TAILQ_FIRST(&ns->commit_queue); req != NULL;
+		    req = next) {
+			next = TAILQ_NEXT(req, next);
+
+			if (req->conn == conn) {
+				TAILQ_REMOVE(&ns->commit_queue, req, next);
+				request_free(req);
+			}
+		}
 	}
 }
 
@@ -553,6 +1239,10 @@ namespace_conn_queue_count(struct conn *conn)
 			if (req->conn == conn)
 				count++;
 		}
+		TAILQ_FOREACH(req, &ns->commit_queue, next) {
+			if (req->conn == conn)
+				count++;
+		}
 	}
 
 	return count;
@@ -37,12 +37,14 @@
 #include <ifaddrs.h>
 #include <limits.h>
 #include <netdb.h>
+#include <openssl/sha.h>
 #include <stdarg.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <syslog.h>
 #include <unistd.h>
+#include <util.h>
 
 #include "ldapd.h"
 #include "log.h"
@@ -112,13 +114,16 @@ static struct namespace *current_ns = NULL;
 %}
 
 %token	ERROR LISTEN ON TLS LDAPS PORT NAMESPACE ROOTDN ROOTPW INDEX
-%token	SECURE RELAX STRICT SCHEMA USE COMPRESSION LEVEL
-%token	INCLUDE CERTIFICATE FSYNC CACHE_SIZE INDEX_CACHE_SIZE
+%token	SECURE RELAX STRICT SCHEMA USE COMPRESSION LEVEL DICTIONARY
+%token	INCLUDE CERTIFICATE FSYNC CACHE_SIZE INDEX_CACHE_SIZE MMAP
+%token	GROUP_COMMIT LIMIT SUBSTRING WORKERS ENTRY_CACHE_SIZE CHANGELOG
+%token	PASSWORD_HELPERS BIND_CACHE_TTL SLOW_QUERY SESSION_LIFETIME
 %token	DENY ALLOW READ WRITE BIND ACCESS TO ROOT REFERRAL
 %token	ANY CHILDREN OF ATTRIBUTE IN SUBTREE BY SELF
 %token	<v.string>	STRING
 %token  <v.number>	NUMBER
-%type	<v.number>	port ssl boolean comp_level
+%type	<v.number>	port ssl boolean comp_level comp_dict bytes group_limit
+%type	<v.number>	index_substr
 %type	<v.number>	aci_type aci_access aci_rights aci_right aci_scope
 %type	<v.string>	aci_target aci_subject certname
 %type	<v.aci>		aci
@@ -220,6 +225,43 @@ conf_main	: LISTEN ON STRING port ssl certname	{
 			normalize_dn(conf->rootdn);
 		}
 		| ROOTPW STRING			{ conf->rootpw = $2; }
+		| WORKERS NUMBER		{
+			if ($2 <= 0 || $2 > MAX_WORKERS) {
+				yyerror("number of workers out of range");
+				YYERROR;
+			}
+			conf->workers = $2;
+		}
+		| PASSWORD_HELPERS NUMBER	{
+			if ($2 < 0 || $2 > MAX_PASSWD_HELPERS) {
+				yyerror("number of password helpers out of "
+				    "range");
+				YYERROR;
+			}
+			conf->password_helpers = $2;
+		}
+		| BIND_CACHE_TTL NUMBER		{
+			if ($2 < 0 || $2 > 3600) {
+				yyerror("bind-cache-ttl out of range");
+				YYERROR;
+			}
+			conf->bind_cache_ttl = $2;
+		}
+		| SLOW_QUERY NUMBER		{
+			if ($2 < 0 || $2 > 3600000) {
+				yyerror("slow-query out of range");
+				YYERROR;
+			}
+			conf->slow_query = $2;
+		}
+		| SESSION_LIFETIME NUMBER	{
+			/* libtls refuses lifetimes below 4 seconds. */
+			if (($2 != 0 && $2 < 4) || $2 > 86400) {
+				yyerror("tls-session-lifetime out of range");
+				YYERROR;
+			}
+			conf->tls_session_lifetime = $2;
+		}
 		;
 
 namespace	: NAMESPACE STRING '{' '\n'		{
@@ -258,7 +300,7 @@ ns_opt		: ROOTDN STRING			{
 			normalize_dn(current_ns->rootdn);
 		}
 		| ROOTPW STRING			{ current_ns->rootpw = $2; }
-		| INDEX STRING			{
+		| INDEX STRING index_substr	{
 			struct attr_index	*ai;
 			if ((ai = calloc(1, sizeof(*ai))) == NULL) {
 				yyerror("calloc");
@@ -268,16 +310,64 @@ ns_opt		: ROOTDN STRING			{
 			ai->attr = $2;
 			ai->type = INDEX_EQUAL;
 			TAILQ_INSERT_TAIL(&current_ns->indices, ai, next);
+			if ($3) {
+				if ((ai = calloc(1, sizeof(*ai))) == NULL) {
+					yyerror("calloc");
+					YYERROR;
+				}
+				if ((ai->attr = strdup($2)) == NULL) {
+					yyerror("strdup");
+					free(ai);
+					YYERROR;
+				}
+				ai->type = INDEX_SUBSTR;
+				TAILQ_INSERT_TAIL(&current_ns->indices, ai,
+				    next);
+			}
 		}
 		| CACHE_SIZE NUMBER		{ current_ns->cache_size = $2; }
+		| CACHE_SIZE bytes		{ current_ns->cache_bytes = $2; }
 		| INDEX_CACHE_SIZE NUMBER	{ current_ns->index_cache_size = $2; }
+		| INDEX_CACHE_SIZE bytes	{
+			current_ns->index_cache_bytes = $2;
+		}
+		| ENTRY_CACHE_SIZE NUMBER	{
+			if ($2 < 0) {
+				yyerror("invalid entry cache size");
+				YYERROR;
+			}
+			current_ns->entry_cache.max_bytes = $2;
+		}
+		| ENTRY_CACHE_SIZE bytes	{
+			current_ns->entry_cache.max_bytes = $2;
+		}
 		| FSYNC boolean			{ current_ns->sync = $2; }
+		| CHANGELOG NUMBER		{
+			if ($2 < 0 || $2 > UINT_MAX) {
+				yyerror("invalid changelog size");
+				YYERROR;
+			}
+			current_ns->changelog = $2;
+		}
+		| GROUP_COMMIT NUMBER group_limit	{
+			if ($2 < 0 || $2 > 1000) {
+				yyerror("group-commit window out of range");
+				YYERROR;
+			}
+			current_ns->group_commit = $2;
+			if ($3 > 0)
+				current_ns->group_commit_limit = $3;
+		}
 		| aci				{
 			SIMPLEQ_INSERT_TAIL(&current_ns->acl, $1, entry);
 		}
 		| RELAX SCHEMA			{ current_ns->relax = 1; }
 		| STRICT SCHEMA			{ current_ns->relax = 0; }
-		| USE COMPRESSION comp_level	{ current_ns->compression_level = $3; }
+		| USE COMPRESSION comp_level comp_dict	{
+			current_ns->compression_level = $3;
+			current_ns->compression_dict = $4;
+		}
+		| USE MMAP			{ current_ns->mmap = 1; }
 		| REFERRAL STRING		{
 			struct referral	*ref;
 			if ((ref = calloc(1, sizeof(*ref))) == NULL) {
@@ -290,10 +380,41 @@ ns_opt		: ROOTDN STRING			{
 		}
 		;
 
+bytes		: STRING			{
+			long long	 size;
+
+			if (scan_scaled($1, &size) == -1 || size <= 0) {
+				yyerror("invalid size '%s'", $1);
+				free($1);
+				YYERROR;
+			}
+			free($1);
+			$$ = size;
+		}
+		;
+
+index_substr	: /* empty */			{ $$ = 0; }
+		| SUBSTRING			{ $$ = 1; }
+		;
+
+group_limit	: /* empty */			{ $$ = 0; }
+		| LIMIT NUMBER			{
+			if ($2 <= 0 || $2 > UINT_MAX) {
+				yyerror("group-commit limit out of range");
+				YYERROR;
+			}
+			$$ = $2;
+		}
+		;
+
 comp_level	: /* empty */			{ $$ = 6; }
 		| LEVEL NUMBER			{ $$ = $2; }
 		;
 
+comp_dict	: /* empty */			{ $$ = 0; }
+		| DICTIONARY			{ $$ = 1; }
+		;
+
 aci		: aci_type aci_access TO aci_scope aci_target aci_subject {
 			if (($$ = mk_aci($1, $2, $4, $5, $6)) == NULL) {
 				free($5);
@@ -424,23 +545,31 @@ lookup(char *s)
 		{ "allow",		ALLOW },
 		{ "any",		ANY },
 		{ "bind",		BIND },
+		{ "bind-cache-ttl",	BIND_CACHE_TTL },
 		{ "by",			BY },
 		{ "cache-size",		CACHE_SIZE },
 		{ "certificate",	CERTIFICATE },
+		{ "changelog",		CHANGELOG },
 		{ "children",		CHILDREN },
 		{ "compression",	COMPRESSION },
 		{ "deny",		DENY },
+		{ "dictionary",		DICTIONARY },
+		{ "entry-cache-size",	ENTRY_CACHE_SIZE },
 		{ "fsync",		FSYNC },
+		{ "group-commit",	GROUP_COMMIT },
 		{ "in",			IN },
 		{ "include",		INCLUDE },
 		{ "index",		INDEX },
 		{ "index-cache-size",	INDEX_CACHE_SIZE },
 		{ "ldaps",		LDAPS },
 		{ "level",		LEVEL },
+		{ "limit",		LIMIT },
 		{ "listen",		LISTEN },
+		{ "mmap",		MMAP },
 		{ "namespace",		NAMESPACE },
 		{ "of",			OF },
 		{ "on",			ON },
+		{ "password-helpers",	PASSWORD_HELPERS },
 		{ "port",		PORT },
 		{ "read",		READ },
 		{ "referral",		REFERRAL },
@@ -451,11 +580,15 @@ lookup(char *s)
 		{ "schema",		SCHEMA },
 		{ "secure",		SECURE },
 		{ "self",		SELF },
+		{ "slow-query",		SLOW_QUERY },
 		{ "strict",		STRICT },
+		{ "substring",		SUBSTRING },
 		{ "subtree",		SUBTREE },
 		{ "tls",		TLS },
+		{ "tls-session-lifetime", SESSION_LIFETIME },
 		{ "to",			TO },
 		{ "use",		USE },
+		{ "workers",		WORKERS },
 		{ "write",		WRITE },
 
 	};
@@ -803,6 +936,9 @@ parse_config(char *filename)
 	SPLAY_INIT(conf->sc_ssl);
 	SIMPLEQ_INIT(&conf->acl);
 	SLIST_INIT(&conf->referrals);
+	conf->workers = 1;
+	conf->password_helpers = 1;
+	conf->tls_session_lifetime = TLS_SESSION_LIFETIME;
 
 	if ((file = pushfile(filename, 1)) == NULL) {
 		free(conf);
@@ -814,6 +950,9 @@ parse_config(char *filename)
 	errors = file->errors;
 	popfile();
 
+	if (errors == 0 && schema_intern(conf->schema) != 0)
+		fatal("schema_intern");
+
 	/* Free macros and check which have not been used. */
 	TAILQ_FOREACH_SAFE(sym, &symhead, entry, next) {
 		log_debug("warning: macro \"%s\" not used", sym->nam);
@@ -1167,6 +1306,7 @@ namespace_new(const char *suffix)
 	ns->sync = 1;
 	ns->cache_size = 1024;
 	ns->index_cache_size = 512;
+	ns->group_commit_limit = 64;
 	if (ns->suffix == NULL) {
 		free(ns->suffix);
 		free(ns);
@@ -1174,6 +1314,8 @@ namespace_new(const char *suffix)
 	}
 	TAILQ_INIT(&ns->indices);
 	TAILQ_INIT(&ns->request_queue);
+	TAILQ_INIT(&ns->commit_queue);
+	entry_cache_init(&ns->entry_cache, 1024 * 1024);
 	SIMPLEQ_INIT(&ns->acl);
 	SLIST_INIT(&ns->referrals);
 
@@ -1192,6 +1334,7 @@ load_certfile(struct ldapd_config *env, const char *name, u_int8_t flags)
 	struct ssl	*s;
 	struct ssl	 key;
 	char		 certfile[PATH_MAX];
+	unsigned char	 sid[SHA256_DIGEST_LENGTH];
 
 	if (strlcpy(key.ssl_name, name, sizeof(key.ssl_name))
 	    >= sizeof(key.ssl_name)) {
@@ -1226,6 +1369,16 @@ load_certfile(struct ldapd_config *env, const char *name, u_int8_t flags)
 		goto err;
 	}
 
+	/* Resumed sessions are only accepted with the same session ID
+	 * context, which must not differ between the workers.
+	 */
+	SHA256((const unsigned char *)s->ssl_name, strlen(s->ssl_name), sid);
+	if (tls_config_set_session_id(s->config, sid, sizeof(sid)) != 0) {
+		log_warn("load_certfile: failed to set tls session id: %s",
+		    tls_config_error(s->config));
+		goto err;
+	}
+
 	if ((name[0] == '/' &&
 	     !bsnprintf(certfile, sizeof(certfile), "%s.crt", name)) ||
 	    !bsnprintf(certfile, sizeof(certfile), "/etc/ldap/certs/%s.crt",
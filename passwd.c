@@ -0,0 +1,492 @@
+/*	$OpenBSD$ */
+
+/*
+ * Copyright (c) 2026 agent <agent@local>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/* Verification of crypt(3) password hashes in helper processes, so a slow
+ * hash doesn't stall the other connections, and a short-lived cache of
+ * successful verifications.
+ */
+
+#include <sys/types.h>
+#include <sys/queue.h>
+#include <sys/socket.h>
+#include <sys/tree.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <openssl/evp.h>
+#include <openssl/hmac.h>
+#include <openssl/sha.h>
+#include <pwd.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "ldapd.h"
+#include "log.h"
+
+#define BIND_CACHE_MAX		 1024
+
+struct passwd_pending {
+	TAILQ_ENTRY(passwd_pending) next;
+	int			 fd;
+	long long		 msgid;
+	struct request		*req;		/* NULL once cancelled */
+	char			*binddn;
+	int			 cache;		/* 1 = cache if verified */
+	u_int8_t		 digest[SHA256_DIGEST_LENGTH];
+};
+TAILQ_HEAD(passwd_pending_list, passwd_pending);
+
+struct passwd_helper {
+	struct imsgev		 iev;
+	pid_t			 pid;
+	struct passwd_pending_list pending;	/* in order of requests */
+	unsigned int		 npending;
+};
+
+struct bind_cached {
+	RB_ENTRY(bind_cached)	 link;
+	TAILQ_ENTRY(bind_cached) next;
+	char			*binddn;
+	u_int8_t		 digest[SHA256_DIGEST_LENGTH];
+	time_t			 expires;
+};
+RB_HEAD(bind_cache_tree, bind_cached);
+
+static void		 passwd_helper_main(int fd);
+static void		 passwd_imsgev(struct imsgev *iev, int code,
+			    struct imsg *imsg);
+static void		 passwd_needfd(struct imsgev *iev);
+static void		 passwd_result(struct passwd_helper *helper,
+			    struct imsg *imsg);
+static int		 passwd_in_progress(struct request *req);
+static int		 passwd_digest(const char *hash, const char *passwd,
+			    u_int8_t *digest);
+static void		 bind_cache_add(const char *binddn, u_int8_t *digest);
+static struct bind_cached *bind_cache_find(const char *binddn);
+static void		 bind_cache_remove(struct bind_cached *bc);
+static int		 bind_cached_cmp(struct bind_cached *a,
+			    struct bind_cached *b);
+
+RB_PROTOTYPE(bind_cache_tree, bind_cached, link, bind_cached_cmp);
+RB_GENERATE(bind_cache_tree, bind_cached, link, bind_cached_cmp);
+
+static struct passwd_helper	 helpers[MAX_PASSWD_HELPERS];
+static int			 nhelpers;
+
+static struct bind_cache_tree	 bind_cache = RB_INITIALIZER(&bind_cache);
+static TAILQ_HEAD(, bind_cached) bind_cache_lru =
+				    TAILQ_HEAD_INITIALIZER(bind_cache_lru);
+static unsigned int		 bind_cache_size;
+static u_int8_t			 bind_cache_key[32];
+
+/* Starts the helper processes. Called after dropping privileges, so the
+ * helpers run chrooted as the ldapd user.
+ */
+void
+passwd_init(void)
+{
+	struct passwd_helper	*helper;
+	int			 fds[2], i;
+
+	arc4random_buf(bind_cache_key, sizeof(bind_cache_key));
+
+	for (i = 0; i < conf->password_helpers; i++) {
+		if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC,
+		    PF_UNSPEC, fds) != 0)
+			fatal("socketpair");
+
+		helper = &helpers[i];
+		switch (helper->pid = fork()) {
+		case -1:
+			fatal("cannot fork");
+		case 0:
+			close(fds[0]);
+			passwd_helper_main(fds[1]);
+			/* NOTREACHED */
+		}
+
+		close(fds[1]);
+		if (fcntl(fds[0], F_SETFL, O_NONBLOCK) == -1)
+			fatal("fcntl");
+		TAILQ_INIT(&helper->pending);
+		imsgev_init(&helper->iev, fds[0], helper, passwd_imsgev,
+		    passwd_needfd);
+		nhelpers++;
+	}
+
+	log_debug("started %d password helpers", nhelpers);
+}
+
+/* The helper keeps only the socket to its server process, and serves one
+ * request at a time.
+ */
+static void
+passwd_helper_main(int fd)
+{
+	struct imsgbuf		 ibuf;
+	struct imsg		 imsg;
+	struct passwd_req	*preq;
+	struct auth_res		 ares;
+	char			*encpw;
+	ssize_t			 n;
+
+	signal(SIGINT, SIG_DFL);
+	signal(SIGTERM, SIG_DFL);
+	signal(SIGHUP, SIG_DFL);
+	signal(SIGCHLD, SIG_DFL);
+
+	if (dup2(fd, PROC_PARENT_SOCK_FILENO) == -1)
+		fatal("cannot setup imsg fd");
+	closefrom(PROC_PARENT_SOCK_FILENO + 1);
+
+	setproctitle("password helper");
+	if (pledge("stdio", NULL) == -1)
+		fatal("pledge");
+
+	imsg_init(&ibuf, PROC_PARENT_SOCK_FILENO);
+	for (;;) {
+		if ((n = imsg_read(&ibuf)) == -1) {
+			if (errno == EAGAIN || errno == EINTR)
+				continue;
+			fatal("imsg_read");
+		}
+		if (n == 0)
+			_exit(0);	/* server process is gone */
+
+		for (;;) {
+			if ((n = imsg_get(&ibuf, &imsg)) == -1)
+				fatal("imsg_get");
+			if (n == 0)
+				break;
+
+			if (imsg.hdr.type != IMSG_PASSWD_CHECK ||
+			    imsg.hdr.len != sizeof(*preq) + IMSG_HEADER_SIZE)
+				fatalx("invalid password request");
+
+			preq = imsg.data;
+			preq->hash[sizeof(preq->hash) - 1] = '\0';
+			preq->password[sizeof(preq->password) - 1] = '\0';
+
+			encpw = crypt(preq->password, preq->hash);
+			ares.ok = encpw != NULL &&
+			    strcmp(encpw, preq->hash) == 0;
+			ares.fd = preq->fd;
+			ares.msgid = preq->msgid;
+			explicit_bzero(preq, sizeof(*preq));
+			imsg_free(&imsg);
+
+			if (imsg_compose(&ibuf, IMSG_PASSWD_RESULT, 0, 0, -1,
+			    &ares, sizeof(ares)) == -1)
+				fatal("imsg_compose");
+		}
+
+		if (imsg_flush(&ibuf) == -1)
+			fatal("imsg_flush");
+	}
+}
+
+/* Sends the crypt(3) hash to the least busy helper. Returns 0 if the
+ * verification is in progress, and -1 if it must be done inline.
+ */
+int
+passwd_check(struct request *req, const char *binddn, const char *hash,
+    const char *passwd)
+{
+	struct passwd_helper	*helper = NULL;
+	struct passwd_pending	*pp;
+	struct passwd_req	 preq;
+	int			 i;
+
+	for (i = 0; i < nhelpers; i++)
+		if (helper == NULL || helpers[i].npending < helper->npending)
+			helper = &helpers[i];
+	if (helper == NULL)
+		return -1;
+
+	memset(&preq, 0, sizeof(preq));
+	if (strlcpy(preq.hash, hash, sizeof(preq.hash)) >= sizeof(preq.hash) ||
+	    strlcpy(preq.password, passwd,
+	    sizeof(preq.password)) >= sizeof(preq.password))
+		goto fail;
+	preq.fd = req->conn->fd;
+	preq.msgid = req->msgid;
+
+	if ((pp = calloc(1, sizeof(*pp))) == NULL)
+		goto fail;
+	if ((pp->binddn = strdup(binddn)) == NULL) {
+		free(pp);
+		goto fail;
+	}
+	pp->fd = preq.fd;
+	pp->msgid = preq.msgid;
+	pp->req = req;
+	pp->cache = conf->bind_cache_ttl > 0 &&
+	    passwd_digest(hash, passwd, pp->digest) == 0;
+
+	if (imsgev_compose(&helper->iev, IMSG_PASSWD_CHECK, 0, 0, -1, &preq,
+	    sizeof(preq)) == -1) {
+		free(pp->binddn);
+		free(pp);
+		goto fail;
+	}
+	explicit_bzero(&preq, sizeof(preq));
+
+	TAILQ_INSERT_TAIL(&helper->pending, pp, next);
+	helper->npending++;
+	req->conn->bind_req = req;
+	return 0;
+
+fail:
+	explicit_bzero(&preq, sizeof(preq));
+	return -1;
+}
+
+/* Forgets the request in the verifications in progress, before it is
+ * freed or answered otherwise. Their results are then ignored.
+ */
+void
+passwd_cancel(struct request *req)
+{
+	struct passwd_pending	*pp;
+	int			 i;
+
+	for (i = 0; i < nhelpers; i++)
+		TAILQ_FOREACH(pp, &helpers[i].pending, next)
+			if (pp->req == req)
+				pp->req = NULL;
+}
+
+/* Returns 1 if a hash of the request is still being verified.
+ */
+static int
+passwd_in_progress(struct request *req)
+{
+	struct passwd_pending	*pp;
+	int			 i;
+
+	for (i = 0; i < nhelpers; i++)
+		TAILQ_FOREACH(pp, &helpers[i].pending, next)
+			if (pp->req == req)
+				return 1;
+	return 0;
+}
+
+static void
+passwd_imsgev(struct imsgev *iev, int code, struct imsg *imsg)
+{
+	switch (code) {
+	case IMSGEV_IMSG:
+		if (imsg->hdr.type == IMSG_PASSWD_RESULT)
+			passwd_result(iev->data, imsg);
+		else
+			log_debug("%s: unexpected imsg %d",
+			    __func__, imsg->hdr.type);
+		break;
+	case IMSGEV_EREAD:
+	case IMSGEV_EWRITE:
+	case IMSGEV_EIMSG:
+		fatal("imsgev read/write error");
+		break;
+	case IMSGEV_DONE:
+		fatalx("lost password helper");
+		break;
+	}
+}
+
+static void
+passwd_needfd(struct imsgev *iev)
+{
+	fatal("should never need an fd for password helpers");
+}
+
+static void
+passwd_result(struct passwd_helper *helper, struct imsg *imsg)
+{
+	struct conn		*conn;
+	struct request		*req;
+	struct auth_res		*ares = imsg->data;
+	struct passwd_pending	*pp;
+
+	if (imsg->hdr.len != sizeof(*ares) + IMSG_HEADER_SIZE)
+		fatal("invalid size of password result");
+
+	/* The helper answers in the order the requests were sent. */
+	if ((pp = TAILQ_FIRST(&helper->pending)) == NULL ||
+	    pp->fd != ares->fd || pp->msgid != ares->msgid)
+		fatalx("password result out of order");
+	TAILQ_REMOVE(&helper->pending, pp, next);
+	helper->npending--;
+
+	log_debug("password check on conn %d/%lld = %d", ares->fd,
+	    ares->msgid, ares->ok);
+
+	if (ares->ok && pp->cache)
+		bind_cache_add(pp->binddn, pp->digest);
+
+	/* The fd and message ID may already be those of a later bind, so
+	 * only the request the hash was sent for is answered. A bind fails
+	 * once none of its hashes matched.
+	 */
+	if ((req = pp->req) == NULL)
+		log_debug("password result for closed request");
+	else if (!ares->ok && passwd_in_progress(req))
+		log_debug("password mismatch, other hashes pending");
+	else {
+		passwd_cancel(req);
+		conn = req->conn;
+		if (conn->bind_req != req)
+			log_warnx("password result for another bind");
+		else
+			ldap_bind_continue(conn, ares->ok &&
+			    conn->pending_binddn != NULL &&
+			    strcmp(conn->pending_binddn, pp->binddn) == 0);
+	}
+
+	explicit_bzero(pp->digest, sizeof(pp->digest));
+	free(pp->binddn);
+	free(pp);
+}
+
+/* Cached verifications are keyed by a keyed digest of both the stored hash
+ * and the password, so a changed password or hash never matches, and the
+ * cache doesn't hold anything cheaper to attack than the hash itself.
+ */
+static int
+passwd_digest(const char *hash, const char *passwd, u_int8_t *digest)
+{
+	HMAC_CTX		*ctx;
+	unsigned int		 len;
+	int			 rc = -1;
+
+	if ((ctx = HMAC_CTX_new()) == NULL)
+		return -1;
+	if (HMAC_Init_ex(ctx, bind_cache_key, sizeof(bind_cache_key),
+	    EVP_sha256(), NULL) &&
+	    HMAC_Update(ctx, hash, strlen(hash) + 1) &&
+	    HMAC_Update(ctx, passwd, strlen(passwd)) &&
+	    HMAC_Final(ctx, digest, &len))
+		rc = 0;
+	HMAC_CTX_free(ctx);
+	return rc;
+}
+
+static int
+bind_cached_cmp(struct bind_cached *a, struct bind_cached *b)
+{
+	return strcmp(a->binddn, b->binddn);
+}
+
+/* Finds binddn in the tree by hand, as RB_FIND would need a non-const
+ * key.
+ */
+static struct bind_cached *
+bind_cache_find(const char *binddn)
+{
+	struct bind_cached	*bc;
+	int			 cmp;
+
+	bc = RB_ROOT(&bind_cache);
+	while (bc != NULL && (cmp = strcmp(binddn, bc->binddn)) != 0)
+		bc = cmp < 0 ? RB_LEFT(bc, link) : RB_RIGHT(bc, link);
+	return bc;
+}
+
+static void
+bind_cache_remove(struct bind_cached *bc)
+{
+	RB_REMOVE(bind_cache_tree, &bind_cache, bc);
+	TAILQ_REMOVE(&bind_cache_lru, bc, next);
+	bind_cache_size--;
+	explicit_bzero(bc->digest, sizeof(bc->digest));
+	free(bc->binddn);
+	free(bc);
+}
+
+/* Returns 1 if the password was verified against the crypt(3) hash for
+ * binddn within the last bind-cache-ttl seconds.
+ */
+int
+passwd_cached(const char *binddn, const char *hash, const char *passwd)
+{
+	struct bind_cached	*bc;
+	u_int8_t		 digest[SHA256_DIGEST_LENGTH];
+	int			 rc;
+
+	if (conf->bind_cache_ttl == 0)
+		return 0;
+
+	if ((bc = bind_cache_find(binddn)) == NULL)
+		return 0;
+	if (bc->expires <= time(NULL)) {
+		bind_cache_remove(bc);
+		return 0;
+	}
+
+	if (passwd_digest(hash, passwd, digest) != 0)
+		return 0;
+	rc = timingsafe_bcmp(digest, bc->digest, sizeof(digest)) == 0;
+	explicit_bzero(digest, sizeof(digest));
+	if (rc)
+		log_debug("%s: password verified from cache", binddn);
+	return rc;
+}
+
+/* Remembers a successful verification, for a password checked inline.
+ */
+void
+passwd_cache(const char *binddn, const char *hash, const char *passwd)
+{
+	u_int8_t		 digest[SHA256_DIGEST_LENGTH];
+
+	if (conf->bind_cache_ttl == 0)
+		return;
+	if (passwd_digest(hash, passwd, digest) == 0)
+		bind_cache_add(binddn, digest);
+	explicit_bzero(digest, sizeof(digest));
+}
+
+static void
+bind_cache_add(const char *binddn, u_int8_t *digest)
+{
+	struct bind_cached	*bc, *old;
+	time_t			 now;
+
+	/* All entries live equally long, so the oldest expire first. */
+	now = time(NULL);
+	while ((old = TAILQ_FIRST(&bind_cache_lru)) != NULL &&
+	    (old->expires <= now || bind_cache_size >= BIND_CACHE_MAX))
+		bind_cache_remove(old);
+
+	if ((bc = calloc(1, sizeof(*bc))) == NULL)
+		return;
+	if ((bc->binddn = strdup(binddn)) == NULL) {
+		free(bc);
+		return;
+	}
+	memcpy(bc->digest, digest, sizeof(bc->digest));
+	bc->expires = now + conf->bind_cache_ttl;
+
+	if ((old = RB_FIND(bind_cache_tree, &bind_cache, bc)) != NULL)
+		bind_cache_remove(old);
+	RB_INSERT(bind_cache_tree, &bind_cache, bc);
+	TAILQ_INSERT_TAIL(&bind_cache_lru, bc, next);
+	bind_cache_size++;
+}
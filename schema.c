@@ -17,8 +17,10 @@
  */
 
 #include <sys/types.h>
+#include <sys/param.h>
 
 #include <ctype.h>
+#include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
 #include <syslog.h>
@@ -61,6 +63,8 @@ RB_GENERATE(symoid_tree, symoid, link, symoid_cmp);
 static struct attr_list	*push_attr(struct attr_list *alist, struct attr_type *a);
 static struct obj_list	*push_obj(struct obj_list *olist, struct object *obj);
 static struct name_list *push_name(struct name_list *nl, char *name);
+static struct oidname	*schema_hash_find(struct schema_hash *h,
+			    const char *name);
 int			 is_oidstr(const char *oidstr);
 
 struct attr_type *
@@ -88,6 +92,12 @@ lookup_attribute_by_oid(struct schema *schema, char *oid)
 struct attr_type *
 lookup_attribute(struct schema *schema, char *oid_or_name)
 {
+	struct oidname		*on;
+
+	if (schema->attr_hash != NULL) {
+		on = schema_hash_find(schema->attr_hash, oid_or_name);
+		return on ? on->on_attr_type : NULL;
+	}
 	if (is_oidstr(oid_or_name))
 		return lookup_attribute_by_oid(schema, oid_or_name);
 	return lookup_attribute_by_name(schema, oid_or_name);
@@ -118,6 +128,12 @@ lookup_object_by_name(struct schema *schema, char *name)
 struct object *
 lookup_object(struct schema *schema, char *oid_or_name)
 {
+	struct oidname		*on;
+
+	if (schema->object_hash != NULL) {
+		on = schema_hash_find(schema->object_hash, oid_or_name);
+		return on ? on->on_object : NULL;
+	}
 	if (is_oidstr(oid_or_name))
 		return lookup_object_by_oid(schema, oid_or_name);
 	return lookup_object_by_name(schema, oid_or_name);
@@ -1100,6 +1116,303 @@ schema_parse(struct schema *schema, const char *filename)
 	return ret;
 }
 
+/*
+ * Once all schema files are parsed, the names and OIDs of attribute types
+ * and object classes are interned in a perfect hash table, built by hash
+ * and displace: the keys are hashed to buckets, and the keys of each
+ * bucket, largest first, are placed with the first seed that hashes them
+ * all to free slots.  A lookup then hashes the case-folded name twice and
+ * compares it with a single entry.
+ */
+#define SCHEMA_HASH_MAXSEED	65536
+
+struct schema_hash {
+	struct oidname		*slots;		/* on_name is NULL if free */
+	unsigned int		 nslots;
+	unsigned int		*seeds;		/* by bucket, 0 if empty */
+	unsigned int		 nbuckets;
+};
+
+struct schema_hash_key {
+	struct oidname		*on;
+	unsigned int		 bucket;
+};
+
+struct schema_hash_bucket {
+	unsigned int		 first;		/* in the sorted keys */
+	unsigned int		 n;
+};
+
+static uint32_t
+schema_hash_name(const char *name, uint32_t seed)
+{
+	uint32_t	 h = 2166136261U ^ seed;
+
+	for (; *name != '\0'; name++) {
+		h ^= tolower((unsigned char)*name);
+		h *= 16777619U;
+	}
+	h ^= h >> 16;
+	h *= 0x85ebca6bU;
+	h ^= h >> 13;
+	h *= 0xc2b2ae35U;
+	h ^= h >> 16;
+	return h;
+}
+
+static struct oidname *
+schema_hash_find(struct schema_hash *h, const char *name)
+{
+	struct oidname	*on;
+	unsigned int	 seed;
+
+	seed = h->seeds[schema_hash_name(name, 0) % h->nbuckets];
+	if (seed == 0)
+		return NULL;
+	on = &h->slots[schema_hash_name(name, seed) % h->nslots];
+	if (on->on_name == NULL || strcasecmp(on->on_name, name) != 0)
+		return NULL;
+	return on;
+}
+
+static int
+schema_hash_key_cmp(const void *a, const void *b)
+{
+	const struct schema_hash_key	*ka = a, *kb = b;
+
+	if (ka->bucket != kb->bucket)
+		return ka->bucket < kb->bucket ? -1 : 1;
+	return 0;
+}
+
+static int
+schema_hash_bucket_cmp(const void *a, const void *b)
+{
+	const struct schema_hash_bucket	*ba = a, *bb = b;
+
+	if (ba->n != bb->n)
+		return ba->n > bb->n ? -1 : 1;
+	return 0;
+}
+
+static void
+schema_hash_free(struct schema_hash *h)
+{
+	if (h == NULL)
+		return;
+	free(h->slots);
+	free(h->seeds);
+	free(h);
+}
+
+/* Builds the table of the nkeys names in keys.  Returns NULL if no seed
+ * places a bucket, and the names are then looked up in the trees.
+ */
+static struct schema_hash *
+schema_hash_build(struct oidname *keys, unsigned int nkeys)
+{
+	struct schema_hash		*h;
+	struct schema_hash_key		*sk = NULL;
+	struct schema_hash_bucket	*b = NULL;
+	u_char				*used = NULL;
+	unsigned int			*slot = NULL;
+	struct schema_hash_key		*key;
+	unsigned int			 i, j, k, nb = 0, seed, s;
+
+	if ((h = calloc(1, sizeof(*h))) == NULL)
+		return NULL;
+	h->nbuckets = nkeys / 4 + 1;
+	h->nslots = nkeys + nkeys / 4 + 1;
+	if ((h->slots = calloc(h->nslots, sizeof(*h->slots))) == NULL ||
+	    (h->seeds = calloc(h->nbuckets, sizeof(*h->seeds))) == NULL ||
+	    (sk = calloc(nkeys + 1, sizeof(*sk))) == NULL ||
+	    (b = calloc(nkeys + 1, sizeof(*b))) == NULL ||
+	    (slot = calloc(nkeys + 1, sizeof(*slot))) == NULL ||
+	    (used = calloc(h->nslots, 1)) == NULL)
+		goto fail;
+
+	for (i = 0; i < nkeys; i++) {
+		sk[i].on = &keys[i];
+		sk[i].bucket = schema_hash_name(keys[i].on_name, 0) %
+		    h->nbuckets;
+	}
+	qsort(sk, nkeys, sizeof(*sk), schema_hash_key_cmp);
+	for (i = 0; i < nkeys; i = j) {
+		for (j = i + 1; j < nkeys && sk[j].bucket == sk[i].bucket; j++)
+			;
+		b[nb].first = i;
+		b[nb++].n = j - i;
+	}
+	qsort(b, nb, sizeof(*b), schema_hash_bucket_cmp);
+
+	for (i = 0; i < nb; i++) {
+		for (seed = 1; seed < SCHEMA_HASH_MAXSEED; seed++) {
+			for (j = 0; j < b[i].n; j++) {
+				key = &sk[b[i].first + j];
+				s = schema_hash_name(key->on->on_name, seed) %
+				    h->nslots;
+				if (used[s])
+					break;
+				for (k = 0; k < j && slot[k] != s; k++)
+					;
+				if (k < j)
+					break;
+				slot[j] = s;
+			}
+			if (j == b[i].n)
+				break;
+		}
+		if (seed == SCHEMA_HASH_MAXSEED) {
+			log_warnx("schema: no perfect hash for %u names",
+			    nkeys);
+			goto fail;
+		}
+
+		h->seeds[sk[b[i].first].bucket] = seed;
+		for (j = 0; j < b[i].n; j++) {
+			used[slot[j]] = 1;
+			h->slots[slot[j]] = *sk[b[i].first + j].on;
+		}
+	}
+
+	free(sk);
+	free(b);
+	free(slot);
+	free(used);
+	return h;
+
+fail:
+	free(sk);
+	free(b);
+	free(slot);
+	free(used);
+	schema_hash_free(h);
+	return NULL;
+}
+
+/* Computes the bitsets of the object class obj, after those of its
+ * superclasses.
+ */
+static int
+schema_expand_object(struct schema *schema, struct object *obj)
+{
+	struct obj_ptr		*optr;
+	struct attr_ptr		*ap;
+	struct object		*sup;
+	size_t			 osz, asz, i;
+
+	if (obj->classes != NULL)
+		return 0;
+
+	osz = howmany(schema->nobjects, NBBY);
+	asz = howmany(schema->nattrs, NBBY);
+	if ((obj->classes = calloc(1, osz + 2 * asz)) == NULL)
+		return -1;
+	obj->required = obj->classes + osz;
+	obj->allowed = obj->required + asz;
+
+	setbit(obj->classes, obj->idx);
+	if (obj->must != NULL) {
+		SLIST_FOREACH(ap, obj->must, next) {
+			setbit(obj->required, ap->attr_type->idx);
+			setbit(obj->allowed, ap->attr_type->idx);
+		}
+	}
+	if (obj->may != NULL) {
+		SLIST_FOREACH(ap, obj->may, next)
+			setbit(obj->allowed, ap->attr_type->idx);
+	}
+
+	if (obj->sup == NULL)
+		return 0;
+	SLIST_FOREACH(optr, obj->sup, next) {
+		sup = optr->object;
+		if (schema_expand_object(schema, sup) != 0)
+			return -1;
+		for (i = 0; i < osz; i++)
+			obj->classes[i] |= sup->classes[i];
+		for (i = 0; i < asz; i++) {
+			obj->required[i] |= sup->required[i];
+			obj->allowed[i] |= sup->allowed[i];
+		}
+	}
+
+	return 0;
+}
+
+/* Numbers the attribute types and object classes, computes the bitsets
+ * of each object class and interns all names and OIDs.  The schema must
+ * not change afterwards.
+ */
+int
+schema_intern(struct schema *schema)
+{
+	struct attr_type	*at;
+	struct object		*obj;
+	struct oidname		*on, *keys;
+	unsigned int		 n;
+
+	n = 0;
+	RB_FOREACH(at, attr_type_tree, &schema->attr_types)
+		n++;
+	if ((schema->attr_index = calloc(n + 1, sizeof(at))) == NULL)
+		return -1;
+	schema->nattrs = 0;
+	RB_FOREACH(at, attr_type_tree, &schema->attr_types) {
+		at->idx = schema->nattrs;
+		schema->attr_index[schema->nattrs++] = at;
+	}
+
+	n = 0;
+	RB_FOREACH(obj, object_tree, &schema->objects)
+		n++;
+	if ((schema->object_index = calloc(n + 1, sizeof(obj))) == NULL)
+		return -1;
+	schema->nobjects = 0;
+	RB_FOREACH(obj, object_tree, &schema->objects) {
+		obj->idx = schema->nobjects;
+		schema->object_index[schema->nobjects++] = obj;
+	}
+	RB_FOREACH(obj, object_tree, &schema->objects) {
+		if (schema_expand_object(schema, obj) != 0)
+			return -1;
+	}
+
+	n = schema->nattrs;
+	RB_FOREACH(on, oidname_tree, &schema->attr_names)
+		n++;
+	if ((keys = calloc(n + 1, sizeof(*keys))) == NULL)
+		return -1;
+	n = 0;
+	RB_FOREACH(on, oidname_tree, &schema->attr_names)
+		keys[n++] = *on;
+	RB_FOREACH(at, attr_type_tree, &schema->attr_types) {
+		keys[n].on_name = at->oid;
+		keys[n++].on_attr_type = at;
+	}
+	schema->attr_hash = schema_hash_build(keys, n);
+	free(keys);
+
+	n = schema->nobjects;
+	RB_FOREACH(on, oidname_tree, &schema->object_names)
+		n++;
+	if ((keys = calloc(n + 1, sizeof(*keys))) == NULL)
+		return -1;
+	n = 0;
+	RB_FOREACH(on, oidname_tree, &schema->object_names)
+		keys[n++] = *on;
+	RB_FOREACH(obj, object_tree, &schema->objects) {
+		keys[n].on_name = obj->oid;
+		keys[n++].on_object = obj;
+	}
+	schema->object_hash = schema_hash_build(keys, n);
+	free(keys);
+
+	log_debug("schema: %u attribute types, %u object classes",
+	    schema->nattrs, schema->nobjects);
+	return 0;
+}
+
 static int
 schema_dump_names(const char *desc, struct name_list *nlist,
     char *buf, size_t size)
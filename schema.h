@@ -58,6 +58,10 @@ struct match_rule
 	int			(*prepare)(char *value, size_t len);
 	const char		*syntax_oid;
 	const char		**alt_syntax_oids;
+	int			(*compare)(const char *a, const char *b,
+					int *cmp);
+	char			*(*index_key)(const char *value);
+	int			 equality_order; /* by equality index keys */
 };
 
 struct attr_type {
@@ -75,6 +79,7 @@ struct attr_type {
 	int			 collective;
 	int			 immutable;	/* no-user-modification */
 	enum usage		 usage;
+	unsigned int		 idx;		/* in schema->attr_index */
 };
 RB_HEAD(attr_type_tree, attr_type);
 RB_PROTOTYPE(attr_type_tree, attr_type, link, attr_oid_cmp);
@@ -108,6 +113,12 @@ struct object {
 	enum object_kind	 kind;
 	struct attr_list	*must;
 	struct attr_list	*may;
+	unsigned int		 idx;		/* in schema->object_index */
+
+	/* Bitsets by index, of this class and all its superclasses. */
+	u_char			*classes;
+	u_char			*required;	/* attribute types */
+	u_char			*allowed;	/* required or optional */
 };
 RB_HEAD(object_tree, object);
 RB_PROTOTYPE(object_tree, object, link, obj_oid_cmp);
@@ -135,6 +146,8 @@ RB_PROTOTYPE(symoid_tree, symoid, link, symoid_cmp);
 
 #define SCHEMA_MAXPUSHBACK	128
 
+struct schema_hash;
+
 struct schema
 {
 	struct attr_type_tree	 attr_types;
@@ -143,6 +156,14 @@ struct schema
 	struct oidname_tree	 object_names;
 	struct symoid_tree	 symbolic_oids;
 
+	/* Set up by schema_intern once all schema files are parsed. */
+	struct attr_type	**attr_index;
+	unsigned int		 nattrs;
+	struct object		**object_index;
+	unsigned int		 nobjects;
+	struct schema_hash	*attr_hash;	/* names and OIDs */
+	struct schema_hash	*object_hash;
+
 	FILE			*fp;
 	const char		*filename;
 	char			 pushback_buffer[SCHEMA_MAXPUSHBACK];
@@ -154,6 +175,7 @@ struct schema
 struct schema		*schema_new(void);
 int			 schema_parse(struct schema *schema,
 			    const char *filename);
+int			 schema_intern(struct schema *schema);
 int			 schema_dump_object(struct object *obj,
 			    char *buf, size_t size);
 int			 schema_dump_attribute(struct attr_type *obj,
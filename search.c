@@ -18,10 +18,13 @@
 
 #include <sys/queue.h>
 #include <sys/types.h>
+#include <sys/time.h>
 #include <sys/tree.h>
 
+#include <ctype.h>
 #include <errno.h>
 #include <event.h>
+#include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
 #include <time.h>
@@ -31,23 +34,290 @@
 
 #define	MAX_SEARCHES	 200
 
+/* Fetching an entry through an index costs about as much as scanning this
+ * many entries in the data db.
+ */
+#define	INDEX_COST	 4
+
+/* The other indices of an AND filter are loaded to skip entries that
+ * can't match if they have up to this many times the keys of the index
+ * used for the search.
+ */
+#define	INTERSECT_RATIO	 8
+
+/* The planner counts up to this many keys of an index, a few leaf pages,
+ * and estimates the size of larger indices from their position in the
+ * index db.
+ */
+#define	PLAN_SAMPLE	 256
+
+/* A search yields to the next one on the run queue after this long, and
+ * the run queue yields to other events.
+ */
+#define	SEARCH_SLICE	 2	/* msec */
+#define	SEARCH_TICK	 20	/* msec */
+
+/* Persistent searches check the change log for commits of other workers
+ * this often.
+ */
+#define	PERSIST_INTERVAL 1	/* sec */
+
+#define	PAGED_RESULTS_OID	"1.2.840.113556.1.4.319"	/* RFC 2696 */
+#define	SORT_REQUEST_OID	"1.2.840.113556.1.4.473"	/* RFC 2891 */
+#define	SORT_RESPONSE_OID	"1.2.840.113556.1.4.474"
+#define	PERSISTENT_SEARCH_OID	"2.16.840.1.113730.3.4.3"
+#define	ENTRY_CHANGE_OID	"2.16.840.1.113730.3.4.7"
+
+/* change types of a persistent search */
+#define	PS_ADD			 1
+#define	PS_DELETE		 2
+#define	PS_MODIFY		 4
+#define	PS_MODDN		 8
+#define	PS_ALL			 15
+
+static TAILQ_HEAD(, search)	 search_runq =
+				    TAILQ_HEAD_INITIALIZER(search_runq);
+static struct event		 search_ev;
+
+/* persistent searches waiting for changes */
+static TAILQ_HEAD(, search)	 search_persistq =
+				    TAILQ_HEAD_INITIALIZER(search_persistq);
+static struct event		 search_persist_ev;
+
 void			 filter_free(struct plan *filter);
 static int		 search_result(const char *dn,
 				size_t dnlen,
 				struct ber_element *attrs,
 				struct search *search);
+static struct ber_element *search_add_control(struct ber_element *prev,
+				const char *oid,
+				struct ber_element *value);
+static int		 search_change_type(unsigned long op);
+static void		 search_lap(struct search *search,
+				enum latency_kind phase);
+
+static int
+idset_cmp(const void *a, const void *b)
+{
+	uint32_t		 ia = *(const uint32_t *)a;
+	uint32_t		 ib = *(const uint32_t *)b;
+
+	return ia < ib ? -1 : ia > ib;
+}
+
+static int
+idset_add(struct idset *set, uint32_t id)
+{
+	uint32_t	*ids;
+	size_t		 n;
+
+	if (set->nids == set->maxids) {
+		n = set->maxids == 0 ? 64 : set->maxids * 2;
+		if ((ids = reallocarray(set->ids, n, sizeof(*ids))) == NULL)
+			return -1;
+		set->ids = ids;
+		set->maxids = n;
+	}
+	set->ids[set->nids++] = id;
+	return 0;
+}
+
+static void
+idset_free(struct idset *set)
+{
+	free(set->ids);
+	memset(set, 0, sizeof(*set));
+}
+
+static int
+idset_contains(struct idset *set, uint32_t id)
+{
+	return bsearch(&id, set->ids, set->nids, sizeof(*set->ids),
+	    idset_cmp) != NULL;
+}
+
+/* Returns the position of the first ID in the set after id.
+ */
+static size_t
+idset_after(struct idset *set, uint32_t id)
+{
+	size_t			 lo = 0, hi = set->nids, mid;
+
+	while (lo < hi) {
+		mid = lo + (hi - lo) / 2;
+		if (set->ids[mid] <= id)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return lo;
+}
+
+/* Returns the key where a walk over the index starts.
+ */
+static char *
+index_first(struct index *indx)
+{
+	return indx->start != NULL ? indx->start : indx->prefix;
+}
+
+/* Returns true (1) if the key belongs to the index.
+ */
+static int
+index_has_key(struct index *indx, struct btval *key)
+{
+	size_t			 len, n;
+	int			 rc;
+
+	if (!has_prefix(key, indx->prefix))
+		return 0;
+	if (indx->stop == NULL)
+		return 1;
+
+	len = strlen(indx->stop);
+	n = key->size < len ? key->size : len;
+	rc = memcmp(key->data, indx->stop, n);
+	return rc < 0 || (rc == 0 && key->size < len);
+}
+
+/* Returns true (1) if a key of the index is of a value matched by it,
+ * rather than of a longer value that starts with the prefix.
+ */
+static int
+index_key_matches(struct index *indx, struct btval *key)
+{
+	if (key->size < ENTRY_ID_SIZE)
+		return 0;
+	return indx->partial ||
+	    key->size == strlen(indx->prefix) + ENTRY_ID_SIZE;
+}
+
+static void
+index_free(struct index *indx)
+{
+	free(indx->prefix);
+	free(indx->start);
+	free(indx->stop);
+	free(indx);
+}
 
+/* Reads the entry IDs of all indices of the plan into its idset. Returns
+ * the number of duplicates, or -1 on failure.
+ */
 static int
-uniqdn_cmp(struct uniqdn *a, struct uniqdn *b)
+plan_load_idset(struct search *search, struct plan *plan)
 {
-	if (a->key.size < b->key.size)
+	struct index		*indx;
+	struct cursor		*cursor;
+	struct btval		 key, val;
+	struct idset		*set = &plan->idset;
+	unsigned int		 op;
+	size_t			 i, n;
+	int			 rc = 0;
+
+	if ((cursor = btree_txn_cursor_open(NULL, search->indx_txn)) == NULL)
 		return -1;
-	if (a->key.size > b->key.size)
-		return +1;
-	return memcmp(a->key.data, b->key.data, a->key.size);
+
+	TAILQ_FOREACH(indx, &plan->indices, next) {
+		memset(&key, 0, sizeof(key));
+		memset(&val, 0, sizeof(val));
+		key.data = index_first(indx);
+		key.size = strlen(key.data);
+		op = BT_CURSOR;
+		while (btree_cursor_get(cursor, &key, &val, op) == BT_SUCCESS) {
+			op = BT_NEXT;
+			btval_reset(&val);
+			if (!index_has_key(indx, &key)) {
+				btval_reset(&key);
+				break;
+			}
+			if (index_key_matches(indx, &key))
+				rc = idset_add(set, index_key_id(&key));
+			btval_reset(&key);
+			if (rc != 0)
+				goto done;
+		}
+	}
+
+	/* Merge the IDs of the indices into one sorted set. */
+	qsort(set->ids, set->nids, sizeof(*set->ids), idset_cmp);
+	for (i = n = 0; i < set->nids; i++) {
+		if (n == 0 || set->ids[n - 1] != set->ids[i])
+			set->ids[n++] = set->ids[i];
+	}
+	rc = set->nids - n;
+	set->nids = n;
+
+	log_debug("loaded %zu ids from %d indices", set->nids, plan->indexed);
+
+done:
+	btree_cursor_close(cursor);
+	return rc;
+}
+
+/* Loads the indices of args that must all match for the plan to match,
+ * other than the one used for the search.
+ */
+static int
+plan_load_args(struct search *search, struct plan *plan)
+{
+	struct plan		*arg;
+
+	if (plan->op != LDAP_FILT_AND && plan->op != LDAP_FILT_SUBS)
+		return 0;
+
+	TAILQ_FOREACH(arg, &plan->args, next) {
+		if (arg->indexed && plan_load_idset(search, arg) == -1)
+			return -1;
+		if (plan_load_args(search, arg) == -1)
+			return -1;
+	}
+
+	return 0;
+}
+
+/* Loads the indices needed before a search can start. Multiple indices
+ * of the plan are merged, giving each entry only once. If the plan is an
+ * AND or a substring filter, the indices of the terms that were not used
+ * for the search are also loaded, to filter out the entries that can't
+ * match before they are read.
+ */
+static int
+search_load_indices(struct search *search)
+{
+	int			 rc;
+
+	if (!search->plan->indexed)
+		return 0;
+
+	if (search->plan->indexed > 1) {
+		if ((rc = plan_load_idset(search, search->plan)) == -1)
+			return -1;
+		search->ndups += rc;
+	}
+
+	return plan_load_args(search, search->plan);
 }
 
-RB_GENERATE(dn_tree, uniqdn, link, uniqdn_cmp);
+/* Returns true if the entry ID is in the loaded indices of all args of
+ * the plan.
+ */
+static int
+plan_intersects(struct plan *plan, uint32_t id)
+{
+	struct plan		*arg;
+
+	if (plan->op != LDAP_FILT_AND && plan->op != LDAP_FILT_SUBS)
+		return 1;
+
+	TAILQ_FOREACH(arg, &plan->args, next) {
+		if (arg->indexed && !idset_contains(&arg->idset, id))
+			return 0;
+		if (!plan_intersects(arg, id))
+			return 0;
+	}
+	return 1;
+}
 
 /* Return true if the attribute is operational.
  */
@@ -93,47 +363,41 @@ should_include_attribute(char *adesc, struct search *search, int explicit)
 	return 0;
 }
 
+/* Sends a search entry with the attribute list attrs, which is consumed.
+ */
 static int
-search_result(const char *dn, size_t dnlen, struct ber_element *attrs,
+search_send_entry(const char *dn, size_t dnlen, struct ber_element *attrs,
     struct search *search)
 {
 	int			 rc;
 	struct conn		*conn = search->conn;
-	struct ber_element	*root, *elm, *filtered_attrs = NULL, *link, *a;
-	struct ber_element	*prev, *next;
-	char			*adesc;
+	struct ber_element	*root, *elm;
 	void			*buf;
 
-	if ((root = ber_add_sequence(NULL)) == NULL)
-		goto fail;
-
-	if ((filtered_attrs = ber_add_sequence(NULL)) == NULL)
+	if ((root = ber_add_sequence(NULL)) == NULL) {
+		ber_free_elements(attrs);
 		goto fail;
-	link = filtered_attrs;
-
-	for (prev = NULL, a = attrs->be_sub; a; a = next) {
-		if (ber_get_string(a->be_sub, &adesc) != 0)
-			goto fail;
-		if (should_include_attribute(adesc, search, 0)) {
-			next = a->be_next;
-			if (prev != NULL)
-				prev->be_next = a->be_next;	/* unlink a */
-			else
-				attrs->be_sub = a->be_next;
-			a->be_next = NULL;			/* break chain*/
-			ber_link_elements(link, a);
-			link = a;
-		} else {
-			prev = a;
-			next = a->be_next;
-		}
 	}
 
 	elm = ber_printf_elements(root, "i{txe", search->req->msgid,
 		BER_CLASS_APP, (unsigned long)LDAP_RES_SEARCH_ENTRY,
-		dn, dnlen, filtered_attrs);
-	if (elm == NULL)
+		dn, dnlen, attrs);
+	if (elm == NULL) {
+		ber_free_elements(attrs);
 		goto fail;
+	}
+
+	/* the change of a persistent search */
+	if (search->ecn != NULL && search->return_ecs) {
+		if ((elm = ber_add_sequence(root->be_sub->be_next)) == NULL)
+			goto fail;
+		ber_set_header(elm, BER_CLASS_CONTEXT, 0);
+		if (search_add_control(elm, ENTRY_CHANGE_OID,
+		    ber_printf_elements(NULL, "{Ei}",
+		    (long long)search_change_type(search->ecn->op),
+		    (long long)search->ecn->seq)) == NULL)
+			goto fail;
+	}
 
 	ldap_debug_elements(root, LDAP_RES_SEARCH_ENTRY,
 	    "sending search entry on fd %d", conn->fd);
@@ -160,18 +424,278 @@ fail:
 	return -1;
 }
 
+static int
+search_result(const char *dn, size_t dnlen, struct ber_element *attrs,
+    struct search *search)
+{
+	struct ber_element	*filtered_attrs, *link, *a;
+	struct ber_element	*prev, *next;
+	char			*adesc;
+
+	if ((filtered_attrs = ber_add_sequence(NULL)) == NULL) {
+		log_warn("search result");
+		return -1;
+	}
+	link = filtered_attrs;
+
+	for (prev = NULL, a = attrs->be_sub; a; a = next) {
+		if (ber_get_string(a->be_sub, &adesc) != 0) {
+			log_warnx("search result: invalid attribute");
+			ber_free_elements(filtered_attrs);
+			return -1;
+		}
+		if (should_include_attribute(adesc, search, 0)) {
+			next = a->be_next;
+			if (prev != NULL)
+				prev->be_next = a->be_next;	/* unlink a */
+			else
+				attrs->be_sub = a->be_next;
+			a->be_next = NULL;			/* break chain*/
+			ber_link_elements(link, a);
+			link = a;
+		} else {
+			prev = a;
+			next = a->be_next;
+		}
+	}
+
+	return search_send_entry(dn, dnlen, filtered_attrs, search);
+}
+
+/* Matches the encoded entry raw against the search filter and sends it.
+ *
+ * The entry is never fully decoded.  Only the attributes tested by the
+ * filter are read into elements; the attributes to return are sent as
+ * byte ranges of the encoding, which already has the shape of a
+ * PartialAttributeList.  Returns 1 if the entry was sent, 0 if it didn't
+ * match and -1 on failure.
+ */
+static int
+search_raw_entry(struct btval *key, struct btval *raw, struct search *search)
+{
+	int			 class, cstruct, slot, rc = -1;
+	unsigned long		 type;
+	ssize_t			 hlen, dlen;
+	size_t			 len, alen, tlv;
+	char			 dbuf[128], *adesc;
+	u_char			*p, *end, *run = NULL, *run_end = NULL;
+	struct attr_type	*at;
+	struct ber_element	*entry = NULL, *attrs = NULL;
+	struct ber_element	*elm, *elink, *alink;
+	struct ber		 ber;
+	struct ber_mark		 mark;
+
+	/* nothing built for the entry outlives it */
+	ber_arena_mark(&search->req->arena, &mark);
+	filter_reset(search->prog);
+
+	if ((hlen = ber_read_header(raw->data, raw->size, &class, &type,
+	    &cstruct, &len)) == -1 || !cstruct || len > raw->size - hlen)
+		goto invalid;
+
+	if ((entry = ber_add_sequence(NULL)) == NULL ||
+	    (attrs = ber_add_sequence(NULL)) == NULL)
+		goto fail;
+	elink = entry;
+	alink = attrs;
+
+	memset(&ber, 0, sizeof(ber));
+	ber.fd = -1;
+
+	p = (u_char *)raw->data + hlen;
+	end = p + len;
+	while (p < end) {
+		/* attribute SEQUENCE { description, SET OF values } */
+		if ((hlen = ber_read_header(p, end - p, &class, &type,
+		    &cstruct, &alen)) == -1 || !cstruct ||
+		    alen > (size_t)(end - p) - hlen)
+			goto invalid;
+		tlv = hlen + alen;
+		if ((dlen = ber_read_header(p + hlen, alen, &class, &type,
+		    &cstruct, &len)) == -1 || cstruct ||
+		    type != BER_TYPE_OCTETSTRING || len > alen - dlen)
+			goto invalid;
+
+		if (len < sizeof(dbuf)) {
+			memcpy(dbuf, p + hlen + dlen, len);
+			dbuf[len] = '\0';
+			adesc = dbuf;
+		} else if ((adesc = strndup((char *)p + hlen + dlen, len)) == NULL)
+			goto fail;
+		at = lookup_attribute(conf->schema, adesc);
+
+		slot = filter_uses_attribute(search->prog, adesc, at);
+		if (slot != -1 || (search->sort != NULL &&
+		    sort_uses_attribute(search->sort, adesc, at))) {
+			ber_set_readbuf(&ber, p, tlv);
+			if ((elm = ber_read_elements(&ber, NULL)) == NULL) {
+				if (adesc != dbuf)
+					free(adesc);
+				goto invalid;
+			}
+			if (elm->be_sub != NULL)
+				elm->be_sub->be_udata = at;
+			ber_link_elements(elink, elm);
+			elink = elm;
+			if (slot != -1)
+				filter_bind(search->prog, slot, elm);
+		}
+
+		/* adjacent attributes are sent as a single range */
+		if (should_include_attribute(adesc, search, 0)) {
+			if (run == NULL || run_end != p) {
+				if (run != NULL && (alink = ber_add_raw(alink,
+				    run, run_end - run)) == NULL) {
+					if (adesc != dbuf)
+						free(adesc);
+					goto fail;
+				}
+				run = p;
+			}
+			run_end = p + tlv;
+		}
+
+		if (adesc != dbuf)
+			free(adesc);
+		p += tlv;
+	}
+	search_lap(search, LATENCY_DECODE);
+
+	/* sorted entries have already matched on this page */
+	if ((search->walk != WALK_SORTED || search->sort->kept) &&
+	    filter_matches(search->prog) != 0) {
+		search_lap(search, LATENCY_FILTER);
+		rc = 0;
+		goto done;
+	}
+	search_lap(search, LATENCY_FILTER);
+
+	if (search->sort != NULL && search->sort->phase != SORT_SEND &&
+	    (rc = sort_entry(search, key, entry)) != 1)
+		goto done;
+
+	if (run != NULL && ber_add_raw(alink, run, run_end - run) == NULL)
+		goto fail;
+
+	/* the ranges must be encoded before the entry is released */
+	rc = search_send_entry(key->data, key->size, attrs, search);
+	search_lap(search, LATENCY_ENCODE);
+	attrs = NULL;
+	if (rc == 0)
+		rc = 1;
+	goto done;
+
+invalid:
+	log_warnx("failed to parse entry [%.*s]",
+	    (int)key->size, (char *)key->data);
+	rc = 0;
+	goto done;
+fail:
+	log_warn("search entry");
+done:
+	if (entry != NULL)
+		ber_free_elements(entry);
+	if (attrs != NULL)
+		ber_free_elements(attrs);
+	ber_arena_rewind(&search->req->arena, &mark);
+	return rc;
+}
+
+/* Matches the stored entry val against the search filter and sends it.
+ */
+static int
+search_entry(struct btval *key, struct btval *val, struct search *search)
+{
+	int			 rc;
+	struct btval		 raw;
+
+	if (namespace_db2raw(search->ns, val, &raw) != 0) {
+		log_warnx("failed to parse entry [%.*s]",
+		    (int)key->size, (char *)key->data);
+		return 0;
+	}
+	search_lap(search, LATENCY_DECODE);
+	rc = search_raw_entry(key, &raw, search);
+	btval_reset(&raw);
+	return rc;
+}
+
+/* Returns the milliseconds elapsed since start.
+ */
+static long long
+search_elapsed(struct timespec *start)
+{
+	struct timespec		 now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (now.tv_sec - start->tv_sec) * 1000LL +
+	    (now.tv_nsec - start->tv_nsec) / 1000000;
+}
+
+/* Counts the time since the end of the last phase in phase.
+ */
+static void
+search_lap(struct search *search, enum latency_kind phase)
+{
+	search->phase_nsec[phase - LATENCY_PLAN] += latency_lap(&search->lap);
+}
+
+/* Runs the queued searches round-robin, each for a slice of time.
+ */
+static void
+search_run(int fd, short event, void *data)
+{
+	struct search		*search;
+	struct timespec		 start;
+	struct timeval		 tv;
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	while ((search = TAILQ_FIRST(&search_runq)) != NULL) {
+		TAILQ_REMOVE(&search_runq, search, runq);
+		search->queued = 0;
+
+		/* Note that the search may be freed by conn_search. */
+		if (ber_set_arena(&search->req->arena) != NULL)
+			fatalx("search_run: arena left set");
+		conn_search(search);
+		ber_set_arena(NULL);
+
+		if (search_elapsed(&start) >= SEARCH_TICK)
+			break;
+	}
+
+	if (!TAILQ_EMPTY(&search_runq) && !evtimer_pending(&search_ev, NULL)) {
+		timerclear(&tv);
+		evtimer_add(&search_ev, &tv);
+	}
+}
+
+/* Queues a search to continue sending entries.
+ */
 void
-search_close(struct search *search)
+search_schedule(struct search *search)
 {
-	struct uniqdn	*dn, *next;
+	struct timeval		 tv;
 
-	for (dn = RB_MIN(dn_tree, &search->uniqdns); dn; dn = next) {
-		next = RB_NEXT(dn_tree, &search->uniqdns, dn);
-		RB_REMOVE(dn_tree, &search->uniqdns, dn);
-		free(dn->key.data);
-		free(dn);
+	if (!search->queued) {
+		TAILQ_INSERT_TAIL(&search_runq, search, runq);
+		search->queued = 1;
 	}
 
+	if (!evtimer_pending(&search_ev, NULL)) {
+		evtimer_set(&search_ev, search_run, NULL);
+		timerclear(&tv);
+		evtimer_add(&search_ev, &tv);
+	}
+}
+
+void
+search_close(struct search *search)
+{
+	if (search->queued)
+		TAILQ_REMOVE(&search_runq, search, runq);
+	if (search->persisting)
+		TAILQ_REMOVE(&search_persistq, search, persistq);
 	btree_cursor_close(search->cursor);
 	btree_txn_abort(search->data_txn);
 	btree_txn_abort(search->indx_txn);
@@ -182,6 +706,11 @@ search_close(struct search *search)
 	}
 	TAILQ_REMOVE(&search->conn->searches, search, next);
 	filter_free(search->plan);
+	filter_prog_free(search->prog);
+	sort_keep(search);
+	sort_free(search->sort);
+	btval_reset(&search->resume);
+	btval_reset(&search->cookie);
 	free(search);
 	--stats.searches;
 }
@@ -202,12 +731,31 @@ is_child_of(struct btval *key, const char *base)
 	return (ksz == bsz && bcmp(p, base, ksz) == 0);
 }
 
+/* Returns true (1) if the client may read the entry key.
+ */
 static int
-check_search_entry(struct btval *key, struct btval *val, struct search *search)
+search_authorized(struct btval *key, struct search *search)
 {
 	int			 rc;
 	char			*dn0;
-	struct ber_element	*elm;
+
+	if (search->acl != -1)
+		return search->acl;
+
+	if ((dn0 = strndup(key->data, key->size)) == NULL) {
+		log_warn("malloc");
+		return 0;
+	}
+	rc = authorized(search->conn, search->ns, ACI_READ, dn0,
+	    LDAP_SCOPE_BASE);
+	free(dn0);
+	return rc;
+}
+
+static int
+check_search_entry(struct btval *key, struct btval *val, struct search *search)
+{
+	int			 rc;
 
 	/* verify entry is a direct subordinate of basedn */
 	if (search->scope == LDAP_SCOPE_ONELEVEL &&
@@ -216,123 +764,585 @@ check_search_entry(struct btval *key, struct btval *val, struct search *search)
 		return 0;
 	}
 
-	if ((dn0 = strndup(key->data, key->size)) == NULL) {
-		log_warn("malloc");
+	rc = search_authorized(key, search);
+	search_lap(search, LATENCY_ACL);
+	if (!rc)				/* LDAP_INSUFFICIENT_ACCESS */
 		return 0;
+
+	if ((rc = search_entry(key, val, search)) != 1)
+		return rc;
+
+	search->nmatched++;
+	search->npaged++;
+	return 0;
+}
+
+/* Returns the cookie mode of the walk: F, I or D for a walk over the data
+ * db, an index or the merged entry IDs of the plan, in lower case for the entries
+ * left out of a sorting index, O for a sorting index and S for entries
+ * sorted in memory.
+ */
+static char
+search_walk_mode(struct search *search)
+{
+	char			 mode;
+	struct sort		*sort = search->sort;
+
+	switch (search->walk) {
+	case WALK_DATA:
+		mode = 'F';
+		break;
+	case WALK_INDEX:
+		if (sort != NULL && sort->phase == SORT_INDEX)
+			return 'O';
+		mode = 'I';
+		break;
+	case WALK_IDSET:
+		mode = 'D';
+		break;
+	default:
+		return 'S';
 	}
 
-	if (!authorized(search->conn, search->ns, ACI_READ, dn0,
-	    LDAP_SCOPE_BASE)) {
-		/* LDAP_INSUFFICIENT_ACCESS */
-		free(dn0);
+	if (sort != NULL && sort->phase == SORT_REST)
+		mode = tolower((unsigned char)mode);
+	return mode;
+}
+
+/* Starts walking the entries of the search, or of the next sort phase.
+ * Sets the key and cursor op of the first lookup. Returns 1 if the walk
+ * resumes at the key of a cookie, 0 if not and -1 on failure.
+ */
+static int
+search_walk_init(struct search *search, struct btval *key, unsigned int *op)
+{
+	int			 resume;
+	uint32_t		 id;
+	const char		*errstr;
+	struct btree_txn	*txn;
+
+	btree_cursor_close(search->cursor);
+	search->cursor = NULL;
+	memset(key, 0, sizeof(*key));
+	*op = BT_NEXT;
+
+	if (search->sort != NULL && search->sort->phase == SORT_INDEX) {
+		search->walk = WALK_INDEX;
+		search->cindx = &search->sort->indx;
+	} else if (search->plan->indexed > 1) {
+		search->walk = WALK_IDSET;
+		search->cid = 0;
+	} else if (search->plan->indexed) {
+		search->walk = WALK_INDEX;
+		search->cindx = TAILQ_FIRST(&search->plan->indices);
+	} else
+		search->walk = WALK_DATA;
+
+	resume = search->resume_mode != 0 &&
+	    search->resume_mode == search_walk_mode(search);
+
+	if (search->walk == WALK_IDSET) {
+		if (resume) {
+			id = strtonum(search->resume.data, 0, UINT32_MAX,
+			    &errstr);
+			if (errstr != NULL)
+				return 0;	/* not a cookie of this walk */
+			search->cid = idset_after(&search->plan->idset, id);
+			btval_reset(&search->resume);
+			search->resume_mode = 0;
+		}
+		log_debug("init scan of %zu merged ids",
+		    search->plan->idset.nids);
 		return 0;
 	}
-	free(dn0);
 
-	if ((elm = namespace_db2ber(search->ns, val)) == NULL) {
-		log_warnx("failed to parse entry [%.*s]",
-		    (int)key->size, (char *)key->data);
-		return 0;
+	txn = search->walk == WALK_INDEX ? search->indx_txn :
+	    search->data_txn;
+	if ((search->cursor = btree_txn_cursor_open(NULL, txn)) == NULL) {
+		log_warn("btree_cursor_open");
+		return -1;
 	}
+	if (search->walk == WALK_DATA)
+		btree_cursor_sequential(search->cursor);
+
+	if (resume)
+		*key = search->resume;
+	else if (search->walk == WALK_INDEX)
+		key->data = index_first(search->cindx);
+	else if (*search->basedn)
+		key->data = search->basedn;
+
+	if (key->data != NULL) {
+		if (!resume)
+			key->size = strlen(key->data);
+		key->free_data = 0;
+		*op = BT_CURSOR;
+	}
+
+	if (search->walk == WALK_INDEX)
+		log_debug("init index scan on [%s]", search->cindx->prefix);
+	else
+		log_debug("init full scan");
+	return resume;
+}
+
+/* Continues with the next phase of a sorted search when a walk ends.
+ * Returns 1 if there are more entries to walk, 0 if not and -1 on
+ * failure.
+ */
+static int
+search_walk_next(struct search *search, struct btval *key, unsigned int *op)
+{
+	struct sort		*sort = search->sort;
 
-	if (ldap_matches_filter(elm, search->plan) != 0) {
-		ber_free_elements(elm);
+	if (sort == NULL)
 		return 0;
+
+	switch (sort->phase) {
+	case SORT_INDEX:
+		/* a cookie left in the index is past its end */
+		if (search->resume_mode == 'O') {
+			btval_reset(&search->resume);
+			search->resume_mode = 0;
+		}
+		sort->phase = SORT_REST;
+		return search_walk_init(search, key, op) == -1 ? -1 : 1;
+	case SORT_COLLECT:
+		sort_finish(sort);
+		btree_cursor_close(search->cursor);
+		search->cursor = NULL;
+		search->walk = WALK_SORTED;
+		if (sort->next > sort->nentries)
+			sort->next = sort->nentries;
+		log_debug("sending %zu sorted entries from %zu",
+		    sort->nentries, sort->next);
+		return 1;
+	default:
+		return 0;
+	}
+}
+
+/* Saves the position of the walk at key for the cookie of the next page.
+ */
+static int
+search_save_cookie(struct search *search, struct btval *key)
+{
+	char			 mode, *p;
+	int			 len;
+
+	mode = search_walk_mode(search);
+	btval_reset(&search->cookie);
+	if (mode == 'S') {
+		if ((len = sort_cookie(search->sort, &p)) == -1)
+			return -1;
+	} else if (search->walk == WALK_IDSET) {
+		if ((len = asprintf(&p, "%c%u", mode,
+		    search->plan->idset.ids[search->cid - 1])) == -1)
+			return -1;
+	} else {
+		len = key->size + 1;
+		if ((p = malloc(len)) == NULL)
+			return -1;
+		p[0] = mode;
+		memcpy(p + 1, key->data, key->size);
 	}
+	search->cookie.data = p;
+	search->cookie.size = len;
+	search->cookie.free_data = 1;
+	return 0;
+}
 
-	rc = search_result(key->data, key->size, elm, search);
-	ber_free_elements(elm);
+/* Appends a control with the encoded value, which is consumed.
+ */
+static struct ber_element *
+search_add_control(struct ber_element *prev, const char *oid,
+    struct ber_element *value)
+{
+	ssize_t			 len;
+	void			*buf;
+	struct ber		 ber;
+	struct ber_element	*elm = NULL;
 
-	if (rc == 0)
-		search->nmatched++;
+	if (value == NULL)
+		return NULL;
 
-	return rc;
+	memset(&ber, 0, sizeof(ber));
+	ber.fd = -1;
+	if ((len = ber_write_elements(&ber, value)) != -1 &&
+	    ber_get_writebuf(&ber, &buf) != -1)
+		elm = ber_printf_elements(prev, "{sx}", oid, buf, (size_t)len);
+	ber_free(&ber);
+	ber_free_elements(value);
+	return elm;
 }
 
+/* Sends the result of the search, with the response controls for paged
+ * results and sorting.
+ */
+static void
+search_send_done(struct search *search, long long reason)
+{
+	struct ber_element	*controls = NULL, *elm;
+
+	latency_search(search, reason);
+
+	if (search->paged || search->sort != NULL) {
+		if ((controls = ber_add_sequence(NULL)) == NULL)
+			goto fail;
+		ber_set_header(controls, BER_CLASS_CONTEXT, 0);
+		elm = controls;
+		if (search->sort != NULL &&
+		    (elm = search_add_control(elm, SORT_RESPONSE_OID,
+		    ber_printf_elements(NULL, "{E}",
+		    search->sort->result))) == NULL)
+			goto fail;
+		if (search->paged &&
+		    search_add_control(elm, PAGED_RESULTS_OID,
+		    ber_printf_elements(NULL, "{ix}", 0,
+		    search->cookie.data == NULL ? "" : search->cookie.data,
+		    search->cookie.size)) == NULL)
+			goto fail;
+	}
+
+	send_ldap_result_controls(search->conn, search->req->msgid,
+	    LDAP_RES_SEARCH_RESULT, reason, controls);
+	return;
+
+fail:
+	log_warn("search_send_done");
+	if (controls != NULL)
+		ber_free_elements(controls);
+	send_ldap_result(search->conn, search->req->msgid,
+	    LDAP_RES_SEARCH_RESULT, LDAP_OTHER);
+}
+
+/* Returns the persistent search change type of the LDAP request type op,
+ * or 0.
+ */
 static int
-mk_dup(struct search *search, struct btval *key)
+search_change_type(unsigned long op)
+{
+	switch (op) {
+	case LDAP_REQ_ADD:
+		return PS_ADD;
+	case LDAP_REQ_DELETE_30:
+		return PS_DELETE;
+	case LDAP_REQ_MODIFY:
+		return PS_MODIFY;
+	case LDAP_REQ_MODRDN:
+		return PS_MODDN;
+	default:
+		return 0;
+	}
+}
+
+/* Wakes all persistent searches, as other workers don't notify them of
+ * their commits.
+ */
+static void
+search_persist_poll(int fd, short event, void *data)
 {
-	struct uniqdn		*udn;
+	struct search		*search;
+	struct timeval		 tv;
+
+	TAILQ_FOREACH(search, &search_persistq, persistq) {
+		search->notified = 1;
+		search_schedule(search);
+	}
+
+	if (!TAILQ_EMPTY(&search_persistq)) {
+		timerclear(&tv);
+		tv.tv_sec = PERSIST_INTERVAL;
+		evtimer_add(&search_persist_ev, &tv);
+	}
+}
 
-	if ((udn = calloc(1, sizeof(*udn))) == NULL)
-		return BT_FAIL;
+/* Ends the initial walk of a persistent search, which then waits for
+ * the changes following those it has seen.
+ */
+static void
+search_persist(struct search *search)
+{
+	struct timeval		 tv;
 
-	if ((udn->key.data = malloc(key->size)) == NULL) {
-		free(udn);
-		return BT_FAIL;
+	btree_cursor_close(search->cursor);
+	search->cursor = NULL;
+	btree_txn_abort(search->data_txn);
+	btree_txn_abort(search->indx_txn);
+	search->data_txn = search->indx_txn = NULL;
+	if (search->plan != NULL)
+		idset_free(&search->plan->idset);
+
+	/* Only the initial walk is timed. */
+	latency_search(search, LDAP_SUCCESS);
+	latency_request(search->req);
+	timespecclear(&search->req->started);
+
+	log_debug("search %d/%lld waits for change %llu", search->conn->fd,
+	    search->req->msgid, (unsigned long long)search->change);
+	search->persisting = 1;
+	TAILQ_INSERT_TAIL(&search_persistq, search, persistq);
+	if (!evtimer_pending(&search_persist_ev, NULL)) {
+		evtimer_set(&search_persist_ev, search_persist_poll, NULL);
+		timerclear(&tv);
+		tv.tv_sec = PERSIST_INTERVAL;
+		evtimer_add(&search_persist_ev, &tv);
 	}
-	bcopy(key->data, udn->key.data, key->size);
-	udn->key.size = key->size;
-	RB_INSERT(dn_tree, &search->uniqdns, udn);
-	return BT_SUCCESS;
+
+	/* Changes may have been committed during the walk. */
+	search->notified = 1;
+	search_schedule(search);
 }
 
-/* check if this entry was already sent */
+/* Sends the entry of a logged change if it matches the persistent
+ * search. Returns -1 on failure.
+ */
 static int
-is_dup(struct search *search, struct btval *key)
+search_change(struct search *search, struct change *change)
+{
+	int			 rc, type;
+	size_t			 len;
+
+	type = search_change_type(change->op);
+	if ((search->persist & type) == 0 || change->entry.size == 0)
+		return 0;
+
+	len = strlen(search->basedn);
+	if (!has_suffix(&change->dn, search->basedn) ||
+	    (change->dn.size > len &&
+	    ((char *)change->dn.data)[change->dn.size - len - 1] != ',') ||
+	    (search->scope == LDAP_SCOPE_BASE && change->dn.size != len) ||
+	    (search->scope == LDAP_SCOPE_ONELEVEL &&
+	    !is_child_of(&change->dn, search->basedn)))
+		return 0;
+
+	if (!search_authorized(&change->dn, search))
+		return 0;
+
+	search->ecn = change;
+	rc = search_raw_entry(&change->dn, &change->entry, search);
+	search->ecn = NULL;
+	if (rc == 1)
+		search->nmatched++;
+	return rc == -1 ? -1 : 0;
+}
+
+/* Sends the logged changes matching a persistent search, until the
+ * output buffer is full or the time slice is used up.
+ */
+static void
+search_changes(struct search *search)
 {
-	struct uniqdn		find;
+	int			 i, rc, full = 0;
+	long long		 reason = LDAP_OTHER;
+	uint64_t		 next;
+	struct btree_txn	*data_txn = NULL, *indx_txn = NULL;
+	struct change		 change;
+	struct timespec		 start;
+
+	/* Also scheduled when the output buffer has drained. */
+	if (!search->notified)
+		return;
+
+	if (namespace_begin_txn(search->ns, &data_txn, &indx_txn, 1) != 0) {
+		if (errno == EBUSY)
+			return;		/* retried after the next commit */
+		goto fail;
+	}
+	if (changelog_next(indx_txn, &next) != 0)
+		goto fail;
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (i = 0; search->change < next; i++) {
+		if (EVBUFFER_LENGTH(EVBUFFER_OUTPUT(search->conn->bev)) >=
+		    SEARCH_HIWAT) {
+			full = 1;
+			break;
+		}
+		if (i % 16 == 15 && search_elapsed(&start) >= SEARCH_SLICE)
+			break;
+
+		if (changelog_get(search->ns, indx_txn, search->change,
+		    &change) != 0) {
+			if (errno == ENOENT) {
+				log_debug("search %d/%lld: change %llu is no"
+				    " longer logged", search->conn->fd,
+				    search->req->msgid,
+				    (unsigned long long)search->change);
+				reason = LDAP_UNWILLING_TO_PERFORM;
+			}
+			goto fail;
+		}
+		search->change++;
+		rc = search_change(search, &change);
+		btval_reset(&change.raw);
+		if (rc != 0)
+			goto fail;
+	}
+	btree_txn_abort(data_txn);
+	btree_txn_abort(indx_txn);
 
-	find.key.data = key->data;
-	find.key.size = key->size;
-	return RB_FIND(dn_tree, &search->uniqdns, &find) != NULL;
+	/* A full buffer resumes the search from conn_write. */
+	bufferevent_enable(search->conn->bev, EV_WRITE);
+	if (search->change >= next)
+		search->notified = 0;
+	else if (!full)
+		search_schedule(search);
+	return;
+
+fail:
+	btree_txn_abort(data_txn);
+	btree_txn_abort(indx_txn);
+	search_send_done(search, reason);
+	search_close(search);
+}
+
+/* Makes the persistent searches of the namespace send its new changes.
+ */
+void
+search_notify(struct namespace *ns)
+{
+	struct search		*search;
+
+	TAILQ_FOREACH(search, &search_persistq, persistq) {
+		if (search->ns == ns) {
+			search->notified = 1;
+			search_schedule(search);
+		}
+	}
 }
 
 void
 conn_search(struct search *search)
 {
-	int			 i, rc = BT_SUCCESS;
-	unsigned int		 reason = LDAP_SUCCESS;
+	int			 i, rc = BT_SUCCESS, full = 0, resume = 0, skip;
+	long long		 reason = LDAP_SUCCESS;
 	unsigned int		 op = BT_NEXT;
+	uint32_t		 id = 0;
 	time_t			 now;
 	struct conn		*conn;
-	struct btree_txn	*txn;
 	struct btval		 key, ikey, val;
+	struct idset		*set;
+	struct sort		*sort;
+	struct timespec		 start;
+
+	if (search->persisting) {
+		search_changes(search);
+		return;
+	}
+	clock_gettime(CLOCK_MONOTONIC, &search->lap);
 
 	conn = search->conn;
+	set = &search->plan->idset;
+	sort = search->sort;
 
 	memset(&key, 0, sizeof(key));
+	memset(&ikey, 0, sizeof(ikey));
 	memset(&val, 0, sizeof(val));
-
-	if (search->plan->indexed)
-		txn = search->indx_txn;
-	else
-		txn = search->data_txn;
+	if (sort != NULL)
+		sort->ikey = &ikey;
+
+	/* The entries sorted for the last page may have been kept. */
+	if (!search->init && search->resume_mode == 'S') {
+		if (sort == NULL || sort->phase != SORT_COLLECT) {
+			log_debug("cookie doesn't match the search plan");
+			reason = LDAP_UNWILLING_TO_PERFORM;
+			goto fail;
+		}
+		if (sort_resume(search) == 1) {
+			search->walk = WALK_SORTED;
+			search->init = 1;
+		}
+	}
 
 	if (!search->init) {
-		search->cursor = btree_txn_cursor_open(NULL, txn);
-		if (search->cursor == NULL) {
-			log_warn("btree_cursor_open");
-			search_close(search);
-			return;
+		if (!search->loaded) {
+			if (search_load_indices(search) != 0) {
+				log_warn("failed to load indices");
+				search_send_done(search, LDAP_OTHER);
+				search_close(search);
+				return;
+			}
+			search->loaded = 1;
+			search_lap(search, LATENCY_SCAN);
 		}
 
-		if (search->plan->indexed) {
-			search->cindx = TAILQ_FIRST(&search->plan->indices);
-			key.data = search->cindx->prefix;
-			log_debug("init index scan on [%s]", key.data);
-		} else {
-			if (*search->basedn)
-				key.data = search->basedn;
-			log_debug("init full scan");
+		/* A cookie continues the walk of the previous page. */
+		if (search->resume_mode != 0 && islower(search->resume_mode)) {
+			if (sort == NULL || sort->phase != SORT_INDEX) {
+				reason = LDAP_UNWILLING_TO_PERFORM;
+				goto fail;
+			}
+			sort->phase = SORT_REST;
 		}
-
-		if (key.data) {
-			key.size = strlen(key.data);
-			op = BT_CURSOR;
+		if ((resume = search_walk_init(search, &key, &op)) == -1) {
+			reason = LDAP_OTHER;
+			goto fail;
+		}
+		if (search->resume_mode != 0 && !resume) {
+			log_debug("cookie doesn't match the search plan");
+			reason = LDAP_UNWILLING_TO_PERFORM;
+			goto fail;
 		}
 
 		search->init = 1;
+		search_lap(search, LATENCY_SCAN);
 	}
 
-	for (i = 0; i < 10 && rc == BT_SUCCESS; i++) {
-		rc = btree_cursor_get(search->cursor, &key, &val, op);
-		op = BT_NEXT;
+	/* Send entries until the output buffer is full or the time slice
+	 * is used up.
+	 */
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (i = 0; rc == BT_SUCCESS; i++) {
+		btval_reset(&ikey);
+		if (EVBUFFER_LENGTH(EVBUFFER_OUTPUT(conn->bev)) >=
+		    SEARCH_HIWAT) {
+			full = 1;
+			break;
+		}
+		if (i % 16 == 15 && search_elapsed(&start) >= SEARCH_SLICE)
+			break;
 
-		if (rc == BT_SUCCESS && search->plan->indexed) {
+		if (search->walk == WALK_IDSET) {
+			/* The IDs of multiple indices are already merged. */
+			if (search->cid < set->nids)
+				id = set->ids[search->cid++];
+			else {
+				rc = BT_FAIL;
+				errno = ENOENT;
+			}
+		} else if (search->walk == WALK_SORTED) {
+			if (sort->next < sort->nentries) {
+				key = sort->entries[sort->next++].dn;
+				key.free_data = 0;
+			} else {
+				rc = BT_FAIL;
+				errno = ENOENT;
+			}
+		} else {
+			rc = btree_cursor_get(search->cursor, &key, &val, op);
+			op = BT_NEXT;
+		}
+		search_lap(search, search->walk == WALK_DATA ? LATENCY_FETCH :
+		    LATENCY_SCAN);
+
+		if (rc == BT_SUCCESS && resume && search->resume_mode != 0) {
+			/* the key of the cookie was sent on the last page */
+			skip = key.size == search->resume.size &&
+			    memcmp(key.data, search->resume.data, key.size) == 0;
+			btval_reset(&search->resume);
+			search->resume_mode = 0;
+			if (skip) {
+				btval_reset(&val);
+				btval_reset(&key);
+				continue;
+			}
+		}
+
+		if (rc == BT_SUCCESS && search->walk == WALK_INDEX) {
 			log_debug("found index %.*s", key.size, key.data);
 
-			if (!has_prefix(&key, search->cindx->prefix)) {
+			if (!index_has_key(search->cindx, &key)) {
 				log_debug("scanned past index prefix [%s]",
 				    search->cindx->prefix);
 				btval_reset(&val);
@@ -342,40 +1352,57 @@ conn_search(struct search *search)
 			}
 		}
 
-		if (rc == BT_FAIL && errno == ENOENT &&
-		    search->plan->indexed > 1) {
-			search->cindx = TAILQ_NEXT(search->cindx, next);
-			if (search->cindx != NULL) {
-				rc = BT_SUCCESS;
-				memset(&key, 0, sizeof(key));
-				key.data = search->cindx->prefix;
-				key.size = strlen(key.data);
-				log_debug("re-init cursor on [%s]", key.data);
-				op = BT_CURSOR;
-				continue;
-			}
-		}
-
 		if (rc != BT_SUCCESS) {
 			if (errno != ENOENT) {
 				log_warnx("btree failure");
 				reason = LDAP_OTHER;
+				break;
+			}
+			if ((rc = search_walk_next(search, &key, &op)) == 1) {
+				rc = BT_SUCCESS;
+				continue;
 			}
+			if (rc == -1)
+				reason = LDAP_OTHER;
+			rc = BT_FAIL;
 			break;
 		}
 
 		search->nscanned++;
 
-		if (search->plan->indexed) {
-			bcopy(&key, &ikey, sizeof(key));
-			memset(&key, 0, sizeof(key));
-			btval_reset(&val);
+		if (search->walk != WALK_DATA) {
+			if (search->walk == WALK_INDEX) {
+				bcopy(&key, &ikey, sizeof(key));
+				memset(&key, 0, sizeof(key));
+				btval_reset(&val);
 
-			rc = index_to_dn(search->ns, &ikey, &key);
-			btval_reset(&ikey);
-			if (rc != 0) {
-				reason = LDAP_OTHER;
-				break;
+				/* a longer value with the same prefix */
+				if (!index_key_matches(search->cindx, &ikey))
+					continue;
+				id = index_key_id(&ikey);
+			}
+
+			if (search->walk != WALK_SORTED) {
+				if (!plan_intersects(search->plan, id)) {
+					log_debug("id %u not in all indices",
+					    id);
+					search->nfiltered++;
+					continue;
+				}
+
+				if (index_id2dn(search->ns, search->indx_txn,
+				    id, &key) != 0) {
+					if (errno == ENOENT) {
+						log_warnx("indexed id %u"
+						    " doesn't exist!", id);
+						continue;
+					}
+					log_warnx("btree failure");
+					reason = LDAP_OTHER;
+					rc = BT_FAIL;
+					break;
+				}
+				search_lap(search, LATENCY_SCAN);
 			}
 
 			log_debug("lookup indexed key [%.*s]",
@@ -389,15 +1416,8 @@ conn_search(struct search *search)
 				continue;
 			}
 
-			if (search->plan->indexed > 1 && is_dup(search, &key)) {
-				log_debug("skipping duplicate dn %.*s",
-				    (int)key.size, (char *)key.data);
-				search->ndups++;
-				btval_reset(&key);
-				continue;
-			}
-
 			rc = btree_txn_get(NULL, search->data_txn, &key, &val);
+			search_lap(search, LATENCY_FETCH);
 			if (rc == BT_FAIL) {
 				if (errno == ENOENT) {
 					log_warnx("indexed key [%.*s]"
@@ -419,22 +1439,37 @@ conn_search(struct search *search)
 		if (!has_suffix(&key, search->basedn)) {
 			btval_reset(&val);
 			btval_reset(&key);
-			if (search->plan->indexed)
+			if (search->walk != WALK_DATA)
+				continue;
+			log_debug("scanned past basedn suffix");
+			if ((rc = search_walk_next(search, &key, &op)) == 1) {
+				rc = BT_SUCCESS;
 				continue;
-			else {
-				log_debug("scanned past basedn suffix");
-				rc = 1;
-				break;
 			}
+			if (rc == -1)
+				reason = LDAP_OTHER;
+			rc = 1;
+			break;
 		}
 
 		rc = check_search_entry(&key, &val, search);
 		btval_reset(&val);
-		if (rc == BT_SUCCESS && search->plan->indexed > 1)
-			rc = mk_dup(search, &key);
-
+		if (rc == BT_SUCCESS && search->paged &&
+		    search->npaged >= search->pagesz) {
+			log_debug("search %d/%lld has sent a page of %lld",
+			    search->conn->fd, search->req->msgid,
+			    search->pagesz);
+			if (search_save_cookie(search,
+			    search->walk == WALK_INDEX ? &ikey : &key) != 0)
+				reason = LDAP_OTHER;
+			rc = BT_FAIL;
+		}
 		btval_reset(&key);
 
+		if (rc == -1 && sort != NULL && sort->phase == SORT_COLLECT &&
+		    sort->result != LDAP_SUCCESS)
+			reason = sort->result;
+
 		/* Check if we have passed the size limit. */
 		if (rc == BT_SUCCESS && search->szlim > 0 &&
 		    search->nmatched >= search->szlim) {
@@ -445,6 +1480,9 @@ conn_search(struct search *search)
 			rc = BT_FAIL;
 		}
 	}
+	btval_reset(&ikey);
+	if (sort != NULL)
+		sort->ikey = NULL;
 
 	/* Check if we have passed the time limit. */
 	now = time(0);
@@ -459,16 +1497,28 @@ conn_search(struct search *search)
 	}
 
 	if (rc == 0) {
+		/* A full buffer resumes the search from conn_write. */
 		bufferevent_enable(search->conn->bev, EV_WRITE);
+		if (!full)
+			search_schedule(search);
 	} else {
-		log_debug("%u scanned, %u matched, %u dups",
-		    search->nscanned, search->nmatched, search->ndups);
-		send_ldap_result(conn, search->req->msgid,
-		    LDAP_RES_SEARCH_RESULT, reason);
+		log_debug("%u scanned, %u matched, %u dups, %u filtered",
+		    search->nscanned, search->nmatched, search->ndups,
+		    search->nfiltered);
+		if (reason == LDAP_SUCCESS && search->persist) {
+			search_persist(search);
+			return;
+		}
+		search_send_done(search, reason);
 		if (errno != ENOENT)
 			log_debug("search failed: %s", strerror(errno));
 		search_close(search);
 	}
+	return;
+
+fail:
+	search_send_done(search, reason);
+	search_close(search);
 }
 
 static void
@@ -500,7 +1550,15 @@ ldap_search_root_dse(struct search *search)
 	elm = ber_add_sequence(elm);
 	key = ber_add_string(elm, "supportedExtension");
 	val = ber_add_set(key);
-	ber_add_string(val, "1.3.6.1.4.1.1466.20037");	/* StartTLS */
+	val = ber_add_string(val, "1.3.6.1.4.1.1466.20037");	/* StartTLS */
+	ber_add_string(val, CHANGELOG_OID);
+
+	elm = ber_add_sequence(elm);
+	key = ber_add_string(elm, "supportedControl");
+	val = ber_add_set(key);
+	val = ber_add_string(val, PAGED_RESULTS_OID);
+	val = ber_add_string(val, SORT_REQUEST_OID);
+	ber_add_string(val, PERSISTENT_SEARCH_OID);
 
 	elm = ber_add_sequence(elm);
 	key = ber_add_string(elm, "supportedFeatures");
@@ -634,6 +1692,9 @@ add_index(struct plan *plan, const char *fmt, ...)
 
 	normalize_dn(indx->prefix);
 
+	/* Unless the prefix ends the value, keys of longer values match. */
+	indx->partial = fmt[strlen(fmt) - 1] != ',';
+
 	TAILQ_INSERT_TAIL(&plan->indices, indx, next);
 	plan->indexed++;
 
@@ -662,15 +1723,361 @@ plan_get_attr(struct plan *plan, struct namespace *ns, char *attr)
 	return 0;
 }
 
+static void
+plan_drop_indices(struct plan *plan)
+{
+	struct index		*indx;
+
+	while ((indx = TAILQ_FIRST(&plan->indices)) != NULL) {
+		TAILQ_REMOVE(&plan->indices, indx, next);
+		index_free(indx);
+	}
+	plan->indexed = 0;
+}
+
+/* Estimates the keys of an index larger than the sample from the
+ * positions of its first key and of the key after its last in the index
+ * db. Returns limit if it can't be estimated.
+ */
+static unsigned long long
+plan_estimate_index(struct index *indx, struct btree_txn *txn,
+    unsigned long long limit)
+{
+	char			*end;
+	size_t			 n;
+	unsigned long long	 count;
+	struct btval		 from, to;
+
+	if (indx->stop != NULL)
+		end = strdup(indx->stop);
+	else if ((end = strdup(indx->prefix)) != NULL) {
+		/* keys of the prefix sort before it with its last byte
+		 * incremented */
+		n = strlen(end);
+		while (n > 0 && (unsigned char)end[n - 1] == 0xFF)
+			end[--n] = '\0';
+		if (n == 0) {
+			free(end);
+			return limit;
+		}
+		end[n - 1]++;
+	}
+	if (end == NULL)
+		return limit;
+
+	memset(&from, 0, sizeof(from));
+	memset(&to, 0, sizeof(to));
+	from.data = index_first(indx);
+	from.size = strlen(from.data);
+	to.data = end;
+	to.size = strlen(end);
+	if (btree_txn_estimate(NULL, txn, &from, &to, &count) != BT_SUCCESS)
+		count = limit;
+	free(end);
+	return count;
+}
+
+/* Counts the index keys of the plan, stopping at limit. Only a sample
+ * of the keys is counted, and the number of keys of a larger index is
+ * estimated. The index is dropped if it has limit keys or more, as a
+ * scan would be cheaper.
+ */
+static void
+plan_count_index(struct plan *plan, struct btree_txn *txn,
+    unsigned long long limit)
+{
+	struct index		*indx;
+	struct cursor		*cursor;
+	struct btval		 key, val;
+	unsigned long long	 n, sample;
+	unsigned int		 op;
+	int			 match = 1;
+
+	if ((indx = TAILQ_FIRST(&plan->indices)) == NULL)
+		return;
+
+	plan->estimate = 0;
+	sample = limit < PLAN_SAMPLE ? limit : PLAN_SAMPLE;
+	if (limit > 0 && (cursor = btree_txn_cursor_open(NULL, txn)) != NULL) {
+		memset(&key, 0, sizeof(key));
+		memset(&val, 0, sizeof(val));
+		key.data = index_first(indx);
+		key.size = strlen(key.data);
+		op = BT_CURSOR;
+		while (plan->estimate < sample &&
+		    btree_cursor_get(cursor, &key, &val, op) == BT_SUCCESS) {
+			op = BT_NEXT;
+			match = index_has_key(indx, &key);
+			btval_reset(&key);
+			btval_reset(&val);
+			if (!match)
+				break;
+			plan->estimate++;
+		}
+		btree_cursor_close(cursor);
+
+		/* the index goes on past the sample */
+		if (match && plan->estimate == sample && sample < limit) {
+			n = plan_estimate_index(indx, txn, limit);
+			if (n > plan->estimate)
+				plan->estimate = n;
+		}
+	} else
+		plan->estimate = limit;
+
+	if (plan->estimate < limit) {
+		log_debug("index [%s] has %llu keys", indx->prefix,
+		    plan->estimate);
+		return;
+	}
+
+	log_debug("index [%s] has %llu or more keys, not used", indx->prefix,
+	    limit);
+	plan_drop_indices(plan);
+}
+
+/* Sets the bounds of the index keys matching a GE or LE filter, using
+ * the ordering keys of the attribute or its equality keys. Keys are
+ * terminated by a comma, which sorts before most characters, so the
+ * upper bound is cut at the first character that sorts before it.
+ */
+static int
+plan_set_range(struct plan *plan, const char *attr, const char *value)
+{
+	struct index		*range = &plan->range;
+	char			*key;
+	size_t			 n;
+	int			 rc;
+
+	if (plan->ordering->index_key != NULL)
+		key = plan->ordering->index_key(value);
+	else if (plan->ordering->equality_order)
+		key = strdup(value);
+	else
+		return 0;
+	if (key == NULL)
+		return 0;	/* not valid for the syntax */
+
+	if (asprintf(&range->prefix, "%s%c", attr,
+	    plan->ordering->index_key != NULL ? '<' : '=') == -1) {
+		range->prefix = NULL;
+		free(key);
+		return -1;
+	}
+	normalize_dn(range->prefix);
+
+	if (plan->op == LDAP_FILT_GE)
+		rc = asprintf(&range->start, "%s%s", range->prefix, key);
+	else {
+		normalize_dn(key);
+		for (n = 0; (unsigned char)key[n] > ','; n++)
+			;
+		rc = asprintf(&range->stop, "%s%.*s\xff", range->prefix,
+		    (int)n, key);
+	}
+	free(key);
+	if (rc == -1)
+		return -1;
+	if (range->start != NULL)
+		normalize_dn(range->start);
+	return 0;
+}
+
+/* Adds an index walking the keys between the bounds of range.
+ */
+static int
+plan_add_range(struct plan *plan, struct index *range)
+{
+	struct index		*indx;
+
+	if ((indx = calloc(1, sizeof(*indx))) == NULL)
+		return -1;
+	if ((indx->prefix = strdup(range->prefix)) == NULL ||
+	    (range->start != NULL &&
+	    (indx->start = strdup(range->start)) == NULL) ||
+	    (range->stop != NULL &&
+	    (indx->stop = strdup(range->stop)) == NULL)) {
+		index_free(indx);
+		return -1;
+	}
+	indx->partial = 1;
+
+	TAILQ_INSERT_TAIL(&plan->indices, indx, next);
+	plan->indexed++;
+	return 0;
+}
+
+/* Combines GE and LE terms on the same attribute in an AND, so that one
+ * walk between both bounds finds the entries matching both.
+ */
+static int
+plan_and_ranges(struct plan *plan, struct btree_txn *txn,
+    unsigned long long limit)
+{
+	struct plan		*ge, *le;
+
+	TAILQ_FOREACH(ge, &plan->args, next) {
+		if (ge->op != LDAP_FILT_GE || ge->range.prefix == NULL ||
+		    ge->range.stop != NULL)
+			continue;
+		TAILQ_FOREACH(le, &plan->args, next) {
+			if (le->op == LDAP_FILT_LE && le->range.prefix != NULL &&
+			    strcmp(ge->range.prefix, le->range.prefix) == 0)
+				break;
+		}
+		if (le == NULL)
+			continue;
+
+		if ((ge->range.stop = strdup(le->range.stop)) == NULL)
+			return -1;
+		plan_drop_indices(ge);
+		plan_drop_indices(le);
+		if (plan_add_range(ge, &ge->range) != 0)
+			return -1;
+		plan_count_index(ge, txn, limit);
+	}
+
+	return 0;
+}
+
+/* Only count the keys of an index that can be used together with the
+ * best index found so far.
+ */
+static unsigned long long
+plan_sublimit(struct plan *best, unsigned long long limit)
+{
+	if (best != NULL && best->estimate * INTERSECT_RATIO < limit)
+		return best->estimate * INTERSECT_RATIO + 1;
+	return limit;
+}
+
+/* Uses the index of best, one of the args that must all match. The
+ * indices of the other args are kept if they are small enough to
+ * intersect with.
+ */
+static void
+plan_use_index(struct plan *plan, struct plan *best)
+{
+	struct index		*indx;
+	struct plan		*arg;
+
+	while ((indx = TAILQ_FIRST(&best->indices))) {
+		TAILQ_REMOVE(&best->indices, indx, next);
+		TAILQ_INSERT_TAIL(&plan->indices, indx, next);
+	}
+	plan->indexed = best->indexed;
+	plan->estimate = best->estimate;
+	best->indexed = 0;
+	log_debug("using index [%s], about %llu entries",
+	    TAILQ_FIRST(&plan->indices)->prefix, plan->estimate);
+
+	TAILQ_FOREACH(arg, &plan->args, next) {
+		if (!arg->indexed)
+			continue;
+		if (arg->estimate > plan->estimate * INTERSECT_RATIO)
+			plan_drop_indices(arg);
+		else
+			log_debug("intersecting with %d indices,"
+			    " about %llu entries", arg->indexed,
+			    arg->estimate);
+	}
+}
+
+struct plan_gram_arg {
+	struct plan		*plan;
+	const char		*attr;
+};
+
+/* Adds an arg to a substring plan for an index on the gram.
+ */
+static int
+plan_add_gram(const char *gram, void *data)
+{
+	struct plan_gram_arg	*ga = data;
+	struct plan		*arg;
+
+	if ((arg = calloc(1, sizeof(*arg))) == NULL)
+		return -1;
+	arg->op = LDAP_FILT_SUBS;
+	TAILQ_INIT(&arg->args);
+	TAILQ_INIT(&arg->indices);
+	TAILQ_INSERT_TAIL(&ga->plan->args, arg, next);
+	return add_index(arg, "%s>%s,", ga->attr, gram);
+}
+
+/* Plans the indices of a substring filter. Each substring can use the
+ * grams in a substring index, and an initial substring can also use an
+ * equality index. Entries must be in all of them.
+ */
+static int
+plan_substring(struct plan *plan, struct namespace *ns,
+    struct btree_txn *txn, const char *attr, unsigned long long limit)
+{
+	int			 class, anchors;
+	unsigned long		 type;
+	char			*s;
+	struct ber_element	*sub;
+	struct plan		*arg, *best = NULL;
+	struct plan_gram_arg	 ga;
+
+	ga.plan = plan;
+	ga.attr = attr;
+	for (sub = plan->assert.substring; sub; sub = sub->be_next) {
+		if (ber_scanf_elements(sub, "ts", &class, &type, &s) != 0 ||
+		    class != BER_CLASS_CONTEXT)
+			continue;
+
+		if (type == LDAP_FILT_SUBS_INIT &&
+		    namespace_has_index(ns, attr, INDEX_EQUAL)) {
+			if ((arg = calloc(1, sizeof(*arg))) == NULL)
+				return -1;
+			arg->op = LDAP_FILT_SUBS;
+			TAILQ_INIT(&arg->args);
+			TAILQ_INIT(&arg->indices);
+			TAILQ_INSERT_TAIL(&plan->args, arg, next);
+			if (add_index(arg, "%s=%s", attr, s) != 0)
+				return -1;
+		}
+
+		if (!namespace_has_index(ns, attr, INDEX_SUBSTR))
+			continue;
+		if (type == LDAP_FILT_SUBS_INIT)
+			anchors = INDEX_GRAM_INIT;
+		else if (type == LDAP_FILT_SUBS_FIN)
+			anchors = INDEX_GRAM_FINAL;
+		else
+			anchors = 0;
+		if (index_grams(s, anchors, plan_add_gram, &ga) != 0)
+			return -1;
+	}
+
+	TAILQ_FOREACH(arg, &plan->args, next) {
+		plan_count_index(arg, txn, plan_sublimit(best, limit));
+		if (arg->indexed &&
+		    (best == NULL || arg->estimate < best->estimate))
+			best = arg;
+	}
+
+	if (best != NULL)
+		plan_use_index(plan, best);
+	return 0;
+}
+
+/* Plans the filter. The plan only uses indices if they are expected to
+ * return fewer than limit entries, otherwise a full scan is cheaper. The
+ * limit is also the most keys counted in each index.
+ */
 static struct plan *
-search_planner(struct namespace *ns, struct ber_element *filter)
+search_planner(struct namespace *ns, struct btree_txn *txn,
+    struct ber_element *filter, unsigned long long limit)
 {
-	int			 class;
+	int			 class, n;
 	unsigned long		 type;
 	char			*s, *attr;
 	struct ber_element	*elm;
 	struct index		*indx;
-	struct plan		*plan, *arg = NULL;
+	struct plan		*plan, *arg = NULL, *best;
+	unsigned long long	 sublimit;
 
 	if (filter->be_class != BER_CLASS_CONTEXT) {
 		log_warnx("invalid class %d in filter", filter->be_class);
@@ -700,6 +2107,30 @@ search_planner(struct namespace *ns, struct ber_element *filter)
 			plan->assert.value = s;
 			if (namespace_has_index(ns, attr, INDEX_EQUAL))
 				add_index(plan, "%s=%s,", attr, s);
+			plan_count_index(plan, txn, limit);
+		}
+		break;
+	case LDAP_FILT_GE:
+	case LDAP_FILT_LE:
+		if (ber_scanf_elements(filter, "{ss", &attr, &s) != 0)
+			goto fail;
+		if (plan_get_attr(plan, ns, attr) == -1)
+			plan->undefined = 1;
+		else if ((plan->ordering = namespace_ordering(ns, attr)) ==
+		    NULL) {
+			log_debug("'%s' doesn't define ordering matching",
+			    attr);
+			plan->undefined = 1;
+		} else {
+			plan->assert.value = s;
+			if (namespace_has_index(ns, attr, INDEX_EQUAL)) {
+				if (plan_set_range(plan, attr, s) != 0)
+					goto fail;
+				if (plan->range.prefix != NULL &&
+				    plan_add_range(plan, &plan->range) != 0)
+					goto fail;
+			}
+			plan_count_index(plan, txn, limit);
 		}
 		break;
 	case LDAP_FILT_SUBS:
@@ -712,12 +2143,8 @@ search_planner(struct namespace *ns, struct ber_element *filter)
 			log_debug("'%s' doesn't define substring matching",
 			    attr);
 			plan->undefined = 1;
-		} else if (class == BER_CLASS_CONTEXT &&
-		    type == LDAP_FILT_SUBS_INIT) {
-			/* Only prefix substrings are usable as index. */
-			if (namespace_has_index(ns, attr, INDEX_EQUAL))
-				add_index(plan, "%s=%s", attr, s);
-		}
+		} else if (plan_substring(plan, ns, txn, attr, limit) != 0)
+			goto fail;
 		break;
 	case LDAP_FILT_PRES:
 		if (ber_scanf_elements(filter, "s", &attr) != 0)
@@ -727,45 +2154,61 @@ search_planner(struct namespace *ns, struct ber_element *filter)
 		else if (strcasecmp(attr, "objectClass") != 0) {
 			if (namespace_has_index(ns, attr, INDEX_PRESENCE))
 				add_index(plan, "%s=", attr);
+			plan_count_index(plan, txn, limit);
 		}
 		break;
 	case LDAP_FILT_AND:
 		if (ber_scanf_elements(filter, "(e", &elm) != 0)
 			goto fail;
+		best = NULL;
 		for (; elm; elm = elm->be_next) {
-			if ((arg = search_planner(ns, elm)) == NULL)
+			sublimit = plan_sublimit(best, limit);
+			if ((arg = search_planner(ns, txn, elm, sublimit)) ==
+			    NULL)
 				goto fail;
 			if (arg->undefined) {
 				plan->undefined = 1;
 				break;
 			}
 			TAILQ_INSERT_TAIL(&plan->args, arg, next);
+			if (arg->indexed &&
+			    (best == NULL || arg->estimate < best->estimate))
+				best = arg;
 		}
 
 		/* The term is undefined if any arg is undefined. */
 		if (plan->undefined)
 			break;
 
-		/* Select an index to use. */
+		if (plan_and_ranges(plan, txn, limit) != 0)
+			goto fail;
+		best = NULL;
 		TAILQ_FOREACH(arg, &plan->args, next) {
-			if (arg->indexed) {
-				while ((indx = TAILQ_FIRST(&arg->indices))) {
-					TAILQ_REMOVE(&arg->indices, indx, next);
-					TAILQ_INSERT_TAIL(&plan->indices, indx,
-					    next);
-				}
-				plan->indexed = arg->indexed;
-				break;
-			}
+			if (arg->indexed &&
+			    (best == NULL || arg->estimate < best->estimate))
+				best = arg;
 		}
+		if (best == NULL)
+			break;
+
+		plan_use_index(plan, best);
 		break;
 	case LDAP_FILT_OR:
 		if (ber_scanf_elements(filter, "(e", &elm) != 0)
 			goto fail;
-		for (; elm; elm = elm->be_next) {
-			if ((arg = search_planner(ns, elm)) == NULL)
+		plan->indexed = 1;
+		for (n = 0; elm; elm = elm->be_next, n++) {
+			/* All args share the limit. */
+			if ((arg = search_planner(ns, txn, elm,
+			    plan->indexed ? limit - plan->estimate : 0)) == NULL)
 				goto fail;
 			TAILQ_INSERT_TAIL(&plan->args, arg, next);
+			if (plan->indexed && !arg->indexed && !arg->undefined) {
+				log_debug("OR: term %d can't use an index,"
+				    " full scan", n);
+				plan->indexed = 0;
+			}
+			plan->estimate += arg->estimate;
 		}
 
 		/* The term is undefined iff all args are undefined. */
@@ -776,30 +2219,32 @@ search_planner(struct namespace *ns, struct ber_element *filter)
 				break;
 			}
 
+		if (!plan->indexed)
+			break;
+
+		/* Undefined args match nothing and need no index. */
+		plan->indexed = 0;
 		TAILQ_FOREACH(arg, &plan->args, next) {
-			if (!arg->indexed) {
-				plan->indexed = 0;
-				break;
-			}
 			while ((indx = TAILQ_FIRST(&arg->indices))) {
 				TAILQ_REMOVE(&arg->indices, indx, next);
 				TAILQ_INSERT_TAIL(&plan->indices, indx,next);
 				plan->indexed++;
 			}
+			arg->indexed = 0;
 		}
+		if (plan->indexed)
+			log_debug("OR: using %d indices, about %llu entries",
+			    plan->indexed, plan->estimate);
 		break;
 	case LDAP_FILT_NOT:
 		if (ber_scanf_elements(filter, "{e", &elm) != 0)
 			goto fail;
-		if ((arg = search_planner(ns, elm)) == NULL)
+		/* A NOT filter can't use an index, don't count it. */
+		if ((arg = search_planner(ns, txn, elm, 0)) == NULL)
 			goto fail;
 		TAILQ_INSERT_TAIL(&plan->args, arg, next);
 
 		plan->undefined = arg->undefined;
-		if (plan->indexed) {
-			log_debug("NOT filter forced unindexed search");
-			plan->indexed = 0;
-		}
 		break;
 
 	default:
@@ -828,17 +2273,154 @@ filter_free(struct plan *filter)
 		}
 		while ((indx = TAILQ_FIRST(&filter->indices)) != NULL) {
 			TAILQ_REMOVE(&filter->indices, indx, next);
-			free(indx->prefix);
-			free(indx);
+			index_free(indx);
 		}
+		free(filter->range.prefix);
+		free(filter->range.start);
+		free(filter->range.stop);
+		idset_free(&filter->idset);
 		free(filter);
 	}
 }
 
+/* Parses the value of a paged results control, realSearchControlValue
+ * SEQUENCE { size INTEGER, cookie OCTET STRING }.
+ */
+static long long
+search_paged_control(struct search *search, struct ber_element *value)
+{
+	char			*cookie, *p;
+	size_t			 len;
+	long long		 size;
+
+	if (value == NULL || search->paged ||
+	    ber_scanf_elements(value, "{ix", &size, (void **)&cookie,
+	    &len) != 0 || size < 0)
+		return LDAP_PROTOCOL_ERROR;
+
+	search->paged = 1;
+	search->pagesz = size;
+	if (len == 0)
+		return LDAP_SUCCESS;
+
+	if (cookie[0] == '\0' || strchr("FIDOfidS", cookie[0]) == NULL) {
+		log_debug("invalid paged results cookie");
+		return LDAP_UNWILLING_TO_PERFORM;
+	}
+	if ((p = malloc(len)) == NULL)
+		return LDAP_OTHER;
+	memcpy(p, cookie + 1, len - 1);
+	p[len - 1] = '\0';
+	search->resume.data = p;
+	search->resume.size = len - 1;
+	search->resume.free_data = 1;
+	search->resume_mode = cookie[0];
+	return LDAP_SUCCESS;
+}
+
+/* Parses the value of a persistent search control, PersistentSearch
+ * SEQUENCE { changeTypes INTEGER, changesOnly BOOLEAN, returnECs BOOLEAN }.
+ * Changes are read from the change log, so the control is ignored for a
+ * namespace without one.
+ */
+static long long
+search_persist_control(struct search *search, struct ber_element *value,
+    int critical)
+{
+	long long		 types;
+	int			 changes_only, return_ecs;
+
+	if (value == NULL || search->persist ||
+	    ber_scanf_elements(value, "{ibb", &types, &changes_only,
+	    &return_ecs) != 0 || types <= 0 || types > PS_ALL)
+		return LDAP_PROTOCOL_ERROR;
+
+	if (search->ns->changelog == 0) {
+		log_debug("%s: no change log for persistent search",
+		    search->ns->suffix);
+		return critical ? LDAP_UNAVAILABLE_CRITICAL_EXTENSION :
+		    LDAP_SUCCESS;
+	}
+
+	search->persist = types;
+	search->changes_only = changes_only;
+	search->return_ecs = return_ecs;
+	return LDAP_SUCCESS;
+}
+
+/* Parses the controls of the search request. Returns the result code
+ * to fail the search with, or LDAP_SUCCESS.
+ */
+static long long
+search_controls(struct search *search)
+{
+	int			 critical;
+	char			*oid;
+	void			*buf;
+	size_t			 len;
+	long long		 code;
+	struct ber		 ber;
+	struct ber_element	*ctrl, *elm, *value;
+
+	if (search->req->controls == NULL)
+		return LDAP_SUCCESS;
+
+	for (ctrl = search->req->controls->be_sub; ctrl != NULL;
+	    ctrl = ctrl->be_next) {
+		if (ber_scanf_elements(ctrl, "{s", &oid) != 0)
+			return LDAP_PROTOCOL_ERROR;
+
+		critical = 0;
+		elm = ctrl->be_sub->be_next;
+		if (elm != NULL && elm->be_encoding == BER_TYPE_BOOLEAN) {
+			if (ber_get_boolean(elm, &critical) != 0)
+				return LDAP_PROTOCOL_ERROR;
+			elm = elm->be_next;
+		}
+
+		value = NULL;
+		if (elm != NULL) {
+			if (ber_get_nstring(elm, &buf, &len) != 0)
+				return LDAP_PROTOCOL_ERROR;
+			memset(&ber, 0, sizeof(ber));
+			ber.fd = -1;
+			ber_set_application(&ber, ldap_application);
+			ber_set_readbuf(&ber, buf, len);
+			if ((value = ber_read_elements(&ber, NULL)) == NULL)
+				return LDAP_PROTOCOL_ERROR;
+		}
+
+		code = LDAP_SUCCESS;
+		if (strcmp(oid, PAGED_RESULTS_OID) == 0)
+			code = search_paged_control(search, value);
+		else if (strcmp(oid, SORT_REQUEST_OID) == 0) {
+			if (search->sort != NULL)
+				code = LDAP_PROTOCOL_ERROR;
+			else if ((search->sort = sort_new(search->ns, value,
+			    critical)) == NULL)
+				code = LDAP_OTHER;
+		} else if (strcmp(oid, PERSISTENT_SEARCH_OID) == 0)
+			code = search_persist_control(search, value, critical);
+		else if (critical) {
+			log_debug("unsupported critical control %s", oid);
+			code = LDAP_UNAVAILABLE_CRITICAL_EXTENSION;
+		}
+
+		if (value != NULL)
+			ber_free_elements(value);
+		if (code != LDAP_SUCCESS)
+			return code;
+	}
+
+	return LDAP_SUCCESS;
+}
+
 int
 ldap_search(struct request *req)
 {
 	long long		 reason = LDAP_OTHER;
+	unsigned long long	 entries = 0;
+	const struct btree_stat	*st;
 	struct referrals	*refs;
 	struct search		*search = NULL;
 
@@ -857,8 +2439,9 @@ ldap_search(struct request *req)
 	search->conn = req->conn;
 	search->init = 0;
 	search->started_at = time(0);
+	search->acl = -1;
+	clock_gettime(CLOCK_MONOTONIC, &search->lap);
 	TAILQ_INSERT_HEAD(&req->conn->searches, search, next);
-	RB_INIT(&search->uniqdns);
 
 	if (ber_scanf_elements(req->op, "{sEEiibeSeS",
 	    &search->basedn,
@@ -924,12 +2507,39 @@ ldap_search(struct request *req)
 		reason = LDAP_NO_SUCH_OBJECT;
 		goto done;
 	}
+	req->ns = search->ns;
 
 	if (!authorized(req->conn, search->ns, ACI_READ,
 	    search->basedn, search->scope)) {
 		reason = LDAP_INSUFFICIENT_ACCESS;
 		goto done;
 	}
+	search->acl = authorized_search(req->conn, search->ns, ACI_READ,
+	    search->basedn);
+
+	if ((reason = search_controls(search)) != LDAP_SUCCESS)
+		goto done;
+	if (search->sort != NULL && search->sort->result != LDAP_SUCCESS) {
+		if (search->sort->critical) {
+			reason = LDAP_UNAVAILABLE_CRITICAL_EXTENSION;
+			goto done;
+		}
+		search->sort->phase = SORT_SEND;	/* send unsorted */
+	}
+	if (search->persist && (search->paged || search->sort != NULL)) {
+		log_debug("persistent search can't be paged or sorted");
+		reason = LDAP_UNWILLING_TO_PERFORM;
+		goto done;
+	}
+	if (search->paged && search->pagesz == 0) {
+		/* abandons the paged search */
+		if (search->resume_mode == 'S') {
+			sort_free(req->conn->sorted);
+			req->conn->sorted = NULL;
+		}
+		reason = LDAP_SUCCESS;
+		goto done;
+	}
 
 	if (namespace_begin_txn(search->ns, &search->data_txn,
 	    &search->indx_txn, 1) != BT_SUCCESS) {
@@ -946,15 +2556,32 @@ ldap_search(struct request *req)
 		goto done;
 	}
 
+	/* Changes up to here are in the snapshot of the walk. */
+	if (search->persist &&
+	    changelog_next(search->indx_txn, &search->change) != 0) {
+		reason = LDAP_OTHER;
+		goto done;
+	}
+
+	if ((st = btree_stat(search->ns->data_db)) != NULL)
+		entries = st->entries;
+
 	if (search->scope == LDAP_SCOPE_BASE) {
 		struct btval		 key, val;
 
+		if (search->sort != NULL)
+			search->sort->phase = SORT_SEND;
 		memset(&key, 0, sizeof(key));
 		memset(&val, 0, sizeof(val));
 		key.data = search->basedn;
 		key.size = strlen(key.data);
 
-		if (btree_txn_get(NULL, search->data_txn, &key, &val) == 0) {
+		search_lap(search, LATENCY_PLAN);
+		if (search->changes_only)
+			reason = LDAP_SUCCESS;
+		else if (btree_txn_get(NULL, search->data_txn, &key,
+		    &val) == 0) {
+			search_lap(search, LATENCY_FETCH);
 			check_search_entry(&key, &val, search);
 			btval_reset(&val);
 			reason = LDAP_SUCCESS;
@@ -962,7 +2589,22 @@ ldap_search(struct request *req)
 			reason = LDAP_NO_SUCH_OBJECT;
 		else
 			reason = LDAP_OTHER;
-		goto done;
+		if (reason != LDAP_SUCCESS || !search->persist)
+			goto done;
+
+		/* The changes of the entry are matched against the filter. */
+		if ((search->plan = search_planner(search->ns,
+		    search->indx_txn, search->filter,
+		    entries / INDEX_COST + 1)) == NULL) {
+			reason = LDAP_PROTOCOL_ERROR;
+			goto done;
+		}
+		if ((search->prog = filter_compile(search->plan)) == NULL) {
+			reason = LDAP_OTHER;
+			goto done;
+		}
+		search_persist(search);
+		return 0;
 	}
 
 	if (!namespace_exists(search->ns, search->basedn)) {
@@ -970,7 +2612,8 @@ ldap_search(struct request *req)
 		goto done;
 	}
 
-	search->plan = search_planner(search->ns, search->filter);
+	search->plan = search_planner(search->ns, search->indx_txn,
+	    search->filter, entries / INDEX_COST + 1);
 	if (search->plan == NULL) {
 		reason = LDAP_PROTOCOL_ERROR;
 		goto done;
@@ -982,7 +2625,8 @@ ldap_search(struct request *req)
 		goto done;
 	}
 
-	if (!search->plan->indexed && search->scope == LDAP_SCOPE_ONELEVEL) {
+	if (!search->plan->indexed && search->scope == LDAP_SCOPE_ONELEVEL &&
+	    index_has_ids(search->ns)) {
 		int	 sz;
 		sz = strlen(search->basedn) - strlen(search->ns->suffix);
 		if (sz > 0 && search->basedn[sz - 1] == ',')
@@ -990,16 +2634,40 @@ ldap_search(struct request *req)
 		add_index(search->plan, "@%.*s,", sz, search->basedn);
 	}
 
+	if (search->sort != NULL && search->sort->result == LDAP_SUCCESS &&
+	    sort_plan(search) != 0) {
+		reason = LDAP_OTHER;
+		goto done;
+	}
+
+	if ((search->prog = filter_compile(search->plan)) == NULL) {
+		reason = LDAP_OTHER;
+		goto done;
+	}
+
 	if (!search->plan->indexed)
 		++stats.unindexed;
+	log_debug("plan: %s scan, about %llu of %llu entries",
+	    search->plan->indexed ? "index" : "full",
+	    search->plan->indexed ? search->plan->estimate : entries, entries);
 
+	search_lap(search, LATENCY_PLAN);
+	if (search->changes_only) {
+		search_persist(search);
+		return 0;
+	}
+
+	search_schedule(search);
 	bufferevent_enable(req->conn->bev, EV_WRITE);
 	return 0;
 
 done:
-	send_ldap_result(req->conn, req->msgid, LDAP_RES_SEARCH_RESULT, reason);
-	if (search)
+	if (search) {
+		search_send_done(search, reason);
 		search_close(search);
+	} else
+		send_ldap_result(req->conn, req->msgid, LDAP_RES_SEARCH_RESULT,
+		    reason);
 	return 0;
 }
 
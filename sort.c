@@ -0,0 +1,494 @@
+/*	$OpenBSD$ */
+
+/*
+ * Copyright (c) 2026 agent <agent@local>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <sys/queue.h>
+#include <sys/types.h>
+
+#include <limits.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "ldapd.h"
+#include "log.h"
+
+/* Entries sorted in memory per search. Larger results are only sorted
+ * when they can be read in the order of an index.
+ */
+#define SORT_MAX_ENTRIES	 100000
+
+static struct sort	*sort_ctx;	/* for sort_cmp */
+static uint32_t		 sort_ids;	/* of cookies of kept entries */
+
+/* Parses the SortKeyList of a sort request control. The sortResult of
+ * a key list that can't be used is set in the returned sort.
+ */
+struct sort *
+sort_new(struct namespace *ns, struct ber_element *keys, int critical)
+{
+	char			*attr, *oid, *reverse;
+	size_t			 len;
+	struct ber_element	*elm, *opt;
+	struct sort		*sort;
+	struct sort_key		*key;
+
+	if ((sort = calloc(1, sizeof(*sort))) == NULL)
+		return NULL;
+	sort->ns = ns;
+	sort->critical = critical;
+	sort->phase = SORT_COLLECT;
+	sort->result = LDAP_SUCCESS;
+
+	if (keys == NULL || keys->be_encoding != BER_TYPE_SEQUENCE) {
+		sort->result = LDAP_PROTOCOL_ERROR;
+		return sort;
+	}
+
+	for (elm = keys->be_sub; elm != NULL; elm = elm->be_next) {
+		if (sort->nkeys == MAX_SORT_KEYS) {
+			sort->result = LDAP_UNWILLING_TO_PERFORM;
+			return sort;
+		}
+		if (ber_scanf_elements(elm, "{s", &attr) != 0) {
+			sort->result = LDAP_PROTOCOL_ERROR;
+			return sort;
+		}
+		opt = elm->be_sub->be_next;
+
+		key = &sort->keys[sort->nkeys++];
+		if ((key->attr = strdup(attr)) == NULL) {
+			sort_free(sort);
+			return NULL;
+		}
+		key->at = lookup_attribute(conf->schema, attr);
+		if (key->at == NULL && !ns->relax) {
+			log_debug("sort on unknown attribute %s", attr);
+			sort->result = LDAP_NO_SUCH_ATTRIBUTE;
+			return sort;
+		}
+
+		for (; opt != NULL; opt = opt->be_next) {
+			if (opt->be_class != BER_CLASS_CONTEXT) {
+				sort->result = LDAP_PROTOCOL_ERROR;
+				return sort;
+			}
+			if (opt->be_type == 0) {
+				if (ber_get_string(opt, &oid) != 0) {
+					sort->result = LDAP_PROTOCOL_ERROR;
+					return sort;
+				}
+				key->rule = match_rule_lookup(oid);
+				if (key->rule == NULL ||
+				    key->rule->compare == NULL) {
+					log_debug("can't sort by rule %s", oid);
+					sort->result =
+					    LDAP_INAPPROPRIATE_MATCHING;
+					return sort;
+				}
+			} else if (opt->be_type == 1) {
+				if (ber_get_nstring(opt, (void **)&reverse,
+				    &len) != 0 || len != 1) {
+					sort->result = LDAP_PROTOCOL_ERROR;
+					return sort;
+				}
+				key->reverse = reverse[0] != 0;
+			} else {
+				sort->result = LDAP_PROTOCOL_ERROR;
+				return sort;
+			}
+		}
+
+		if (key->rule == NULL &&
+		    (key->rule = namespace_ordering(ns, attr)) == NULL) {
+			log_debug("no ordering rule for %s", attr);
+			sort->result = LDAP_INAPPROPRIATE_MATCHING;
+			return sort;
+		}
+	}
+
+	if (sort->nkeys == 0)
+		sort->result = LDAP_PROTOCOL_ERROR;
+	return sort;
+}
+
+/* Decides how the entries of the search are brought in order. A single
+ * ascending key with an ordering index is walked in index order instead
+ * of sorted in memory, unless the plan finds a small enough result.
+ */
+int
+sort_plan(struct search *search)
+{
+	struct sort		*sort = search->sort;
+	struct sort_key		*key = &sort->keys[0];
+	struct plan		*plan = search->plan;
+	char			 op;
+
+	if (sort->nkeys == 1 && !key->reverse &&
+	    key->rule == namespace_ordering(search->ns, key->attr) &&
+	    (key->rule->index_key != NULL || key->rule->equality_order) &&
+	    namespace_has_index(search->ns, key->attr, INDEX_EQUAL) &&
+	    (!plan->indexed || plan->estimate > SORT_MAX_ENTRIES)) {
+		op = key->rule->index_key != NULL ? '<' : '=';
+		if (asprintf(&sort->indx.prefix, "%s%c", key->attr, op) == -1)
+			return -1;
+		normalize_dn(sort->indx.prefix);
+		sort->indx.partial = 1;
+		sort->phase = SORT_INDEX;
+		log_debug("sorting by the %s index", sort->indx.prefix);
+	} else
+		sort->phase = SORT_COLLECT;
+
+	return 0;
+}
+
+/* Returns true (1) if the attribute is a sort key.
+ */
+int
+sort_uses_attribute(struct sort *sort, const char *adesc,
+    struct attr_type *at)
+{
+	int			 i;
+
+	for (i = 0; i < sort->nkeys; i++) {
+		if (sort->keys[i].at != NULL ? sort->keys[i].at == at :
+		    strcasecmp(sort->keys[i].attr, adesc) == 0)
+			return 1;
+	}
+
+	return 0;
+}
+
+static struct ber_element *
+sort_attribute(struct sort_key *key, struct ber_element *entry)
+{
+	if (key->at != NULL)
+		return ldap_find_attribute(entry, key->at);
+	return ldap_get_attribute(entry, key->attr);
+}
+
+static int
+sort_compare_values(const struct match_rule *rule, const char *a,
+    const char *b)
+{
+	int			 cmp;
+
+	if (rule->compare == NULL || rule->compare(a, b, &cmp) != 0)
+		cmp = strcmp(a, b);
+	return cmp;
+}
+
+/* Returns the smallest ordering index key an entry is stored under, up
+ * to its ID, or NULL if none of its values is in the index.
+ */
+static char *
+sort_index_key(struct sort *sort, struct ber_element *entry)
+{
+	char			*s, *enc, *k, *min = NULL;
+	struct sort_key		*key = &sort->keys[0];
+	struct ber_element	*a, *v;
+
+	if ((a = sort_attribute(key, entry)) == NULL || a->be_next == NULL)
+		return NULL;
+
+	for (v = a->be_next->be_sub; v != NULL; v = v->be_next) {
+		if (ber_get_string(v, &s) != 0)
+			continue;
+		if (key->rule->index_key != NULL)
+			enc = key->rule->index_key(s);
+		else
+			enc = strdup(s);
+		if (enc == NULL)
+			continue;
+		if (strchr(enc, ',') != NULL) {
+			free(enc);
+			continue;
+		}
+		if (asprintf(&k, "%s%s,", sort->indx.prefix, enc) == -1) {
+			free(enc);
+			continue;
+		}
+		free(enc);
+		normalize_dn(k);
+		if (min == NULL || strcmp(k, min) < 0) {
+			free(min);
+			min = k;
+		} else
+			free(k);
+	}
+
+	return min;
+}
+
+/* Returns the smallest value of the sort key, or NULL if absent.
+ */
+static int
+sort_smallest(struct sort_key *key, struct ber_element *entry, char **min)
+{
+	char			*s, *m = NULL;
+	struct ber_element	*a, *v;
+
+	*min = NULL;
+	if ((a = sort_attribute(key, entry)) == NULL || a->be_next == NULL)
+		return 0;
+
+	for (v = a->be_next->be_sub; v != NULL; v = v->be_next) {
+		if (ber_get_string(v, &s) != 0)
+			continue;
+		if (m == NULL || sort_compare_values(key->rule, s, m) < 0)
+			m = s;
+	}
+
+	if (m != NULL && (*min = strdup(m)) == NULL)
+		return -1;
+	return 0;
+}
+
+static int
+sort_collect(struct sort *sort, struct btval *dn, struct ber_element *entry)
+{
+	int			 i;
+	size_t			 n;
+	struct sort_entry	*se;
+
+	if (sort->nentries == sort->maxentries) {
+		if (sort->maxentries >= SORT_MAX_ENTRIES) {
+			log_debug("too many entries to sort");
+			sort->result = LDAP_ADMINLIMIT_EXCEEDED;
+			return -1;
+		}
+		n = sort->maxentries == 0 ? 64 : sort->maxentries * 2;
+		if ((se = reallocarray(sort->entries, n, sizeof(*se))) == NULL)
+			return -1;
+		sort->entries = se;
+		sort->maxentries = n;
+	}
+
+	se = &sort->entries[sort->nentries];
+	memset(se, 0, sizeof(*se));
+	if ((se->dn.data = malloc(dn->size)) == NULL)
+		return -1;
+	memcpy(se->dn.data, dn->data, dn->size);
+	se->dn.size = dn->size;
+	se->dn.free_data = 1;
+	sort->nentries++;
+
+	for (i = 0; i < sort->nkeys; i++) {
+		if (sort_smallest(&sort->keys[i], entry, &se->values[i]) != 0)
+			return -1;
+	}
+
+	return 0;
+}
+
+/* Returns 1 if the matching entry is to be sent now, 0 if not and -1
+ * on failure.
+ */
+int
+sort_entry(struct search *search, struct btval *dn, struct ber_element *entry)
+{
+	char			*k;
+	int			 rc;
+	struct sort		*sort = search->sort;
+
+	switch (sort->phase) {
+	case SORT_INDEX:
+		/* an entry is sent at its smallest key */
+		if ((k = sort_index_key(sort, entry)) == NULL)
+			return 0;
+		rc = sort->ikey->size == strlen(k) + ENTRY_ID_SIZE &&
+		    has_prefix(sort->ikey, k);
+		free(k);
+		return rc;
+	case SORT_REST:
+		/* entries without a key sort last */
+		if ((k = sort_index_key(sort, entry)) != NULL) {
+			free(k);
+			return 0;
+		}
+		return 1;
+	case SORT_COLLECT:
+		return sort_collect(sort, dn, entry) == 0 ? 0 : -1;
+	default:
+		return 1;
+	}
+}
+
+static int
+sort_cmp(const void *a, const void *b)
+{
+	int			 i, cmp;
+	size_t			 n;
+	const struct sort_entry	*ea = a, *eb = b;
+	const char		*va, *vb;
+
+	for (i = 0; i < sort_ctx->nkeys; i++) {
+		va = ea->values[i];
+		vb = eb->values[i];
+		if (va == NULL && vb == NULL)
+			continue;
+		/* absent values sort after all other values */
+		if (va == NULL)
+			cmp = 1;
+		else if (vb == NULL)
+			cmp = -1;
+		else
+			cmp = sort_compare_values(sort_ctx->keys[i].rule,
+			    va, vb);
+		if (sort_ctx->keys[i].reverse)
+			cmp = -cmp;
+		if (cmp != 0)
+			return cmp;
+	}
+
+	/* keep equal entries in the same order on every page */
+	n = ea->dn.size < eb->dn.size ? ea->dn.size : eb->dn.size;
+	if ((cmp = memcmp(ea->dn.data, eb->dn.data, n)) != 0)
+		return cmp;
+	return ea->dn.size < eb->dn.size ? -1 : ea->dn.size > eb->dn.size;
+}
+
+/* Sorts the collected entries.
+ */
+void
+sort_finish(struct sort *sort)
+{
+	sort_ctx = sort;
+	qsort(sort->entries, sort->nentries, sizeof(*sort->entries), sort_cmp);
+	sort_ctx = NULL;
+	sort->phase = SORT_SEND;
+}
+
+/* Returns true (1) if two sorts have the same keys.
+ */
+static int
+sort_same_keys(struct sort *a, struct sort *b)
+{
+	int			 i;
+
+	if (a->ns != b->ns || a->nkeys != b->nkeys)
+		return 0;
+	for (i = 0; i < a->nkeys; i++) {
+		if (strcasecmp(a->keys[i].attr, b->keys[i].attr) != 0 ||
+		    a->keys[i].rule != b->keys[i].rule ||
+		    a->keys[i].reverse != b->keys[i].reverse)
+			return 0;
+	}
+
+	return 1;
+}
+
+/* Parses the cookie of a page of sorted entries, "<id>.<next>", and
+ * takes the entries sorted for the previous page if the connection
+ * has kept them. Returns 1 if they were taken, or 0 if the entries
+ * have to be collected and sorted again to be sent from next.
+ */
+int
+sort_resume(struct search *search)
+{
+	char			*p, *dot;
+	const char		*errstr;
+	uint32_t		 id = 0;
+	struct sort		*sort = search->sort;
+	struct sort		*kept = search->conn->sorted;
+
+	p = search->resume.data;
+	if ((dot = strchr(p, '.')) != NULL) {
+		*dot = '\0';
+		id = strtonum(p, 1, UINT32_MAX, &errstr);
+		if (errstr != NULL)
+			id = 0;
+		p = dot + 1;
+	}
+	sort->next = strtonum(p, 0, LLONG_MAX, &errstr);
+	if (errstr != NULL)
+		sort->next = SIZE_MAX;	/* past the end */
+	btval_reset(&search->resume);
+	search->resume_mode = 0;
+
+	if (kept == NULL || id == 0 || kept->id != id ||
+	    !sort_same_keys(sort, kept))
+		return 0;
+
+	/* the entries may have changed since, so they are matched again */
+	sort->entries = kept->entries;
+	sort->nentries = kept->nentries;
+	sort->maxentries = kept->maxentries;
+	sort->id = kept->id;
+	sort->kept = 1;
+	kept->entries = NULL;
+	kept->nentries = kept->maxentries = 0;
+	sort_free(kept);
+	search->conn->sorted = NULL;
+
+	sort->phase = SORT_SEND;
+	if (sort->next > sort->nentries)
+		sort->next = sort->nentries;
+	log_debug("sending %zu kept sorted entries from %zu",
+	    sort->nentries, sort->next);
+	return 1;
+}
+
+/* Formats the cookie of the position in the sorted entries, which are
+ * kept under its id. Returns the length of the cookie or -1.
+ */
+int
+sort_cookie(struct sort *sort, char **cookie)
+{
+	if (sort->id == 0 && (sort->id = ++sort_ids) == 0)
+		sort->id = ++sort_ids;
+	return asprintf(cookie, "S%u.%zu", sort->id, sort->next);
+}
+
+/* Keeps the sorted entries of a search that sent a page on its
+ * connection for the next page, in place of those of an earlier one.
+ */
+void
+sort_keep(struct search *search)
+{
+	struct conn		*conn = search->conn;
+
+	if (search->sort == NULL || search->walk != WALK_SORTED ||
+	    search->cookie.data == NULL)
+		return;
+
+	sort_free(conn->sorted);
+	conn->sorted = search->sort;
+	search->sort = NULL;
+}
+
+void
+sort_free(struct sort *sort)
+{
+	int			 i;
+	size_t			 n;
+
+	if (sort == NULL)
+		return;
+
+	for (i = 0; i < sort->nkeys; i++)
+		free(sort->keys[i].attr);
+	for (n = 0; n < sort->nentries; n++) {
+		btval_reset(&sort->entries[n].dn);
+		for (i = 0; i < sort->nkeys; i++)
+			free(sort->entries[n].values[i]);
+	}
+	free(sort->entries);
+	free(sort->indx.prefix);
+	free(sort);
+}
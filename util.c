@@ -100,15 +100,20 @@ has_prefix(struct btval *key, const char *prefix)
 	return (memcmp(key->data, prefix, pfxlen) == 0);
 }
 
+/* Encodes an entry for storage.  If compression is enabled, the stored
+ * value is the size of the encoding followed by a zlib stream, which is
+ * compressed with the preset dictionary dict if one is given.
+ */
 int
-ber2db(struct ber_element *root, struct btval *val, int compression_level)
+ber2db(struct ber_element *root, struct btval *val, int compression_level,
+    struct btval *dict)
 {
 	int			 rc;
 	ssize_t			 len;
-	uLongf			 destlen;
-	Bytef			*dest;
+	uLong			 bound;
 	void			*buf;
 	struct ber		 ber;
+	z_stream		 zs;
 
 	memset(val, 0, sizeof(*val));
 
@@ -120,28 +125,42 @@ ber2db(struct ber_element *root, struct btval *val, int compression_level)
 		return -1;
 
 	if (compression_level > 0) {
-		val->size = compressBound(len);
-		val->data = malloc(val->size + sizeof(uint32_t));
-		if (val->data == NULL) {
-			log_warn("malloc(%u)", val->size + sizeof(uint32_t));
+		memset(&zs, 0, sizeof(zs));
+		if ((rc = deflateInit(&zs, compression_level)) != Z_OK) {
+			log_warnx("deflateInit returned %d", rc);
 			ber_free(&ber);
 			return -1;
 		}
-		dest = (char *)val->data + sizeof(uint32_t);
-		destlen = val->size - sizeof(uint32_t);
-		if ((rc = compress2(dest, &destlen, buf, len,
-		    compression_level)) != Z_OK) {
-			log_warn("compress returned %d", rc);
+		if (dict != NULL && dict->size > 0 &&
+		    (rc = deflateSetDictionary(&zs, dict->data,
+		    dict->size)) != Z_OK) {
+			log_warnx("deflateSetDictionary returned %d", rc);
+			goto fail;
+		}
+
+		bound = deflateBound(&zs, len);
+		val->data = malloc(bound + sizeof(uint32_t));
+		if (val->data == NULL) {
+			log_warn("malloc(%lu)", bound + sizeof(uint32_t));
+			goto fail;
+		}
+		zs.next_in = buf;
+		zs.avail_in = len;
+		zs.next_out = (Bytef *)val->data + sizeof(uint32_t);
+		zs.avail_out = bound;
+		if ((rc = deflate(&zs, Z_FINISH)) != Z_STREAM_END) {
+			log_warnx("deflate returned %d", rc);
 			free(val->data);
-			ber_free(&ber);
-			return -1;
+			val->data = NULL;
+			goto fail;
 		}
-		log_debug("compressed entry from %u -> %u byte",
-		    len, destlen + sizeof(uint32_t));
+		log_debug("compressed entry from %zd -> %lu byte",
+		    len, zs.total_out + sizeof(uint32_t));
 
 		*(uint32_t *)val->data = len;
-		val->size = destlen + sizeof(uint32_t);
+		val->size = zs.total_out + sizeof(uint32_t);
 		val->free_data = 1;
+		deflateEnd(&zs);
 	} else {
 		val->data = buf;
 		val->size = len;
@@ -152,54 +171,103 @@ ber2db(struct ber_element *root, struct btval *val, int compression_level)
 	ber_free(&ber);
 
 	return 0;
+
+fail:
+	deflateEnd(&zs);
+	ber_free(&ber);
+	return -1;
 }
 
-struct ber_element *
-db2ber(struct btval *val, int compression_level)
+/* Sets raw to the uncompressed BER encoding of an entry stored in val.
+ * Entries compressed with a preset dictionary need dict, others are
+ * read without it.  The caller must release raw with btval_reset.
+ */
+int
+db2raw(struct btval *val, int compression_level, struct btval *dict,
+    struct btval *raw)
 {
+	static z_stream		 zs;
+	static int		 zs_init;
 	int			 rc;
-	uLongf			 len;
+	uLong			 len;
 	void			*buf;
-	Bytef			*src;
-	uLong			 srclen;
-	struct ber_element	*elm;
-	struct ber		 ber;
 
 	assert(val != NULL);
 
-	memset(&ber, 0, sizeof(ber));
-	ber.fd = -1;
+	memset(raw, 0, sizeof(*raw));
 
 	if (compression_level > 0) {
 		if (val->size < sizeof(uint32_t))
-			return NULL;
+			return -1;
+
+		/* The stream state is reused, it is large to set up. */
+		if (!zs_init) {
+			if ((rc = inflateInit(&zs)) != Z_OK) {
+				log_warnx("inflateInit returned %d", rc);
+				return -1;
+			}
+			zs_init = 1;
+		} else if (inflateReset(&zs) != Z_OK)
+			return -1;
 
 		len = *(uint32_t *)val->data;
 		if ((buf = malloc(len)) == NULL) {
-			log_warn("malloc(%u)", len);
-			return NULL;
+			log_warn("malloc(%lu)", len);
+			return -1;
 		}
 
-		src = (char *)val->data + sizeof(uint32_t);
-		srclen = val->size - sizeof(uint32_t);
-		rc = uncompress(buf, &len, src, srclen);
-		if (rc != Z_OK) {
-			log_warnx("dbt_to_ber: uncompress returned %d", rc);
+		zs.next_in = (Bytef *)val->data + sizeof(uint32_t);
+		zs.avail_in = val->size - sizeof(uint32_t);
+		zs.next_out = buf;
+		zs.avail_out = len;
+		rc = inflate(&zs, Z_FINISH);
+		if (rc == Z_NEED_DICT) {
+			if (dict == NULL || dict->size == 0) {
+				log_warnx("db2raw: entry needs a dictionary");
+				free(buf);
+				return -1;
+			}
+			if ((rc = inflateSetDictionary(&zs, dict->data,
+			    dict->size)) == Z_OK)
+				rc = inflate(&zs, Z_FINISH);
+		}
+		if (rc != Z_STREAM_END || zs.total_out != len) {
+			log_warnx("db2raw: inflate returned %d", rc);
 			free(buf);
-			return NULL;
+			return -1;
 		}
 
-		log_debug("uncompressed entry from %u -> %u byte",
+		log_debug("uncompressed entry from %zu -> %lu byte",
 		    val->size, len);
 
-		ber_set_readbuf(&ber, buf, len);
-		elm = ber_read_elements(&ber, NULL);
-		free(buf);
-		return elm;
+		raw->data = buf;
+		raw->size = len;
+		raw->free_data = 1;
 	} else {
-		ber_set_readbuf(&ber, val->data, val->size);
-		return ber_read_elements(&ber, NULL);
+		raw->data = val->data;
+		raw->size = val->size;
 	}
+
+	return 0;
+}
+
+struct ber_element *
+db2ber(struct btval *val, int compression_level, struct btval *dict)
+{
+	struct btval		 raw;
+	struct ber_element	*elm;
+	struct ber		 ber;
+
+	if (db2raw(val, compression_level, dict, &raw) != 0)
+		return NULL;
+
+	memset(&ber, 0, sizeof(ber));
+	ber.fd = -1;
+
+	ber_set_readbuf(&ber, raw.data, raw.size);
+	elm = ber_read_elements(&ber, NULL);
+	btval_reset(&raw);
+	return elm;
 }
 
 int
@@ -17,36 +17,16 @@
  */
 
 #include <sys/types.h>
+#include <sys/param.h>
 #include <sys/queue.h>
 
 #include <stdlib.h>
 #include <string.h>
+#include <strings.h>
 
 #include "ldapd.h"
 #include "log.h"
 
-static int
-validate_required_attributes(struct ber_element *entry, struct object *obj)
-{
-	struct attr_ptr		*ap;
-	struct attr_type	*at;
-
-	if (obj->must == NULL)
-		return LDAP_SUCCESS;
-
-	SLIST_FOREACH(ap, obj->must, next) {
-		at = ap->attr_type;
-
-		if (ldap_find_attribute(entry, at) == NULL) {
-			log_debug("missing required attribute %s",
-			    ATTR_NAME(at));
-			return LDAP_OBJECT_CLASS_VIOLATION;
-		}
-	}
-
-	return LDAP_SUCCESS;
-}
-
 static int
 validate_attribute(struct attr_type *at, struct ber_element *vals)
 {
@@ -188,110 +168,26 @@ fail:
 	return LDAP_NAMING_VIOLATION;
 }
 
-static int
-has_attribute(struct attr_type *at, struct attr_list *alist)
-{
-	struct attr_ptr		*ap;
-
-	if (alist == NULL)
-		return 0;
-
-	SLIST_FOREACH(ap, alist, next) {
-		if (at == ap->attr_type)
-			return 1;
-	}
-	return 0;
-}
-
-/* Validate that the attribute type is allowed by any object class.
- */
-static int
-validate_allowed_attribute(struct attr_type *at, struct obj_list *olist)
-{
-	struct object		*obj;
-	struct obj_ptr		*optr;
-
-	if (olist == NULL)
-		return LDAP_OBJECT_CLASS_VIOLATION;
-
-	SLIST_FOREACH(optr, olist, next) {
-		obj = optr->object;
-
-		if (has_attribute(at, obj->may) ||
-		    has_attribute(at, obj->must))
-			return LDAP_SUCCESS;
-
-		if (validate_allowed_attribute(at, obj->sup) == LDAP_SUCCESS)
-			return LDAP_SUCCESS;
-	}
-
-	return LDAP_OBJECT_CLASS_VIOLATION;
-}
-
-static void
-olist_push(struct obj_list *olist, struct object *obj)
-{
-	struct obj_ptr		*optr, *sup;
-
-	SLIST_FOREACH(optr, olist, next)
-		if (optr->object == obj)
-			return;
-
-	if ((optr = calloc(1, sizeof(*optr))) == NULL)
-		return;
-	optr->object = obj;
-	SLIST_INSERT_HEAD(olist, optr, next);
-
-	/* Expand the list of object classes along the superclass chain.
-	 */
-	if (obj->sup != NULL)
-		SLIST_FOREACH(sup, obj->sup, next)
-			olist_push(olist, sup->object);
-}
-
-static void
-olist_free(struct obj_list *olist)
-{
-	struct obj_ptr		*optr;
-
-	if (olist == NULL)
-		return;
-
-	while ((optr = SLIST_FIRST(olist)) != NULL) {
-		SLIST_REMOVE_HEAD(olist, next);
-		free(optr);
-	}
-
-	free(olist);
-}
-
 /* Check if sup is a superior object class to obj.
  */
 static int
 is_super(struct object *sup, struct object *obj)
 {
-	struct obj_ptr	*optr;
-
-	if (sup == NULL || obj->sup == NULL)
-		return 0;
-
-	SLIST_FOREACH(optr, obj->sup, next)
-		if (optr->object == sup || is_super(sup, optr->object))
-			return 1;
-
-	return 0;
+	return sup != obj && isset(obj->classes, sup->idx);
 }
 
 int
 validate_entry(const char *dn, struct ber_element *entry, int relax)
 {
-	int			 rc, extensible = 0;
+	int			 rc, bit, extensible = 0;
 	char			*s;
 	struct ber_element	*objclass, *a, *vals;
 	struct object		*obj, *structural_obj = NULL;
 	struct attr_type	*at;
-	struct obj_list		*olist = NULL;
-	struct obj_ptr		*optr, *optr2;
+	struct schema		*schema = conf->schema;
+	u_char			*classes = NULL, *covered, *required, *allowed;
+	u_char			*present, bits;
+	size_t			 osz, asz, i;
 
 	if (relax)
 		goto rdn;
@@ -304,9 +200,18 @@ validate_entry(const char *dn, struct ber_element *entry, int relax)
 		return LDAP_OBJECT_CLASS_VIOLATION;
 	}
 
-	if ((olist = calloc(1, sizeof(*olist))) == NULL)
+	/* Bitsets of the object classes of the entry and their superclasses,
+	 * those that a structural or auxiliary class inherits from, and the
+	 * attribute types required, allowed and present.
+	 */
+	osz = howmany(schema->nobjects, NBBY);
+	asz = howmany(schema->nattrs, NBBY);
+	if ((classes = calloc(1, 2 * osz + 3 * asz)) == NULL)
 		return LDAP_OTHER;
-	SLIST_INIT(olist);
+	covered = classes + osz;
+	required = covered + osz;
+	allowed = required + asz;
+	present = allowed + asz;
 
 	/* Check objectClass(es) against schema.
 	 */
@@ -317,7 +222,7 @@ validate_entry(const char *dn, struct ber_element *entry, int relax)
 			goto done;
 		}
 
-		if ((obj = lookup_object(conf->schema, s)) == NULL) {
+		if ((obj = lookup_object(schema, s)) == NULL) {
 			log_debug("objectClass %s not defined in schema", s);
 			rc = LDAP_NAMING_VIOLATION;
 			goto done;
@@ -337,7 +242,15 @@ validate_entry(const char *dn, struct ber_element *entry, int relax)
 				structural_obj = obj;
 		}
 
-		olist_push(olist, obj);
+		for (i = 0; i < osz; i++) {
+			classes[i] |= obj->classes[i];
+			if (obj->kind == KIND_AUXILIARY)
+				covered[i] |= obj->classes[i];
+		}
+		for (i = 0; i < asz; i++) {
+			required[i] |= obj->required[i];
+			allowed[i] |= obj->allowed[i];
+		}
 
                 /* RFC4512, section 4.3:
 		 * "The 'extensibleObject' auxiliary object class allows
@@ -359,26 +272,18 @@ validate_entry(const char *dn, struct ber_element *entry, int relax)
 	 *  unless it belongs to a structural or auxiliary class that
 	 *  inherits from that abstract class."
 	 */
-        SLIST_FOREACH(optr, olist, next) {
-		if (optr->object->kind != KIND_ABSTRACT)
-			continue;
-
-		/* Check the structural object class. */
-		if (is_super(optr->object, structural_obj))
-			continue;
-
-		/* Check all auxiliary object classes. */
-		SLIST_FOREACH(optr2, olist, next) {
-			if (optr2->object->kind != KIND_AUXILIARY)
+	for (i = 0; i < osz; i++) {
+		covered[i] |= structural_obj->classes[i];
+		for (bits = classes[i] & ~covered[i]; bits != 0;
+		    bits &= bits - 1) {
+			bit = ffs(bits) - 1;
+			obj = schema->object_index[i * NBBY + bit];
+			if (obj->kind != KIND_ABSTRACT)
 				continue;
-			if (is_super(optr->object, optr2->object))
-				break;
-		}
 
-		if (optr2 == NULL) {
 			/* No subclassed object class found. */
 			log_debug("abstract class '%s' not subclassed",
-			    OBJ_NAME(optr->object));
+			    OBJ_NAME(obj));
 			rc = LDAP_OBJECT_CLASS_VIOLATION;
 			goto done;
 		}
@@ -386,10 +291,19 @@ validate_entry(const char *dn, struct ber_element *entry, int relax)
 
 	/* Check all required attributes.
 	 */
-	SLIST_FOREACH(optr, olist, next) {
-		rc = validate_required_attributes(entry, optr->object);
-		if (rc != LDAP_SUCCESS)
+	for (a = entry->be_sub; a != NULL; a = a->be_next) {
+		if (a->be_sub != NULL &&
+		    (at = ldap_attribute_type(a->be_sub)) != NULL)
+			setbit(present, at->idx);
+	}
+	for (i = 0; i < asz; i++) {
+		if ((bits = required[i] & ~present[i]) != 0) {
+			at = schema->attr_index[i * NBBY + ffs(bits) - 1];
+			log_debug("missing required attribute %s",
+			    ATTR_NAME(at));
+			rc = LDAP_OBJECT_CLASS_VIOLATION;
 			goto done;
+		}
 	}
 
 	/* Check all attributes against schema.
@@ -399,7 +313,7 @@ validate_entry(const char *dn, struct ber_element *entry, int relax)
 			rc = LDAP_INVALID_SYNTAX;
 			goto done;
 		}
-		if ((at = lookup_attribute(conf->schema, s)) == NULL) {
+		if ((at = ldap_attribute_type(a->be_sub)) == NULL) {
 			log_debug("attribute %s not defined in schema", s);
 			rc = LDAP_NAMING_VIOLATION;
 			goto done;
@@ -407,9 +321,10 @@ validate_entry(const char *dn, struct ber_element *entry, int relax)
 		if ((rc = validate_attribute(at, vals)) != LDAP_SUCCESS)
 			goto done;
 		if (!extensible && at->usage == USAGE_USER_APP &&
-		    (rc = validate_allowed_attribute(at, olist)) != LDAP_SUCCESS) {
+		    !isset(allowed, at->idx)) {
 			log_debug("%s not allowed by any object class",
 			    ATTR_NAME(at));
+			rc = LDAP_OBJECT_CLASS_VIOLATION;
 			goto done;
 		}
 	}
@@ -418,7 +333,6 @@ rdn:
 	rc = validate_dn(dn, entry);
 
 done:
-	olist_free(olist);
+	free(classes);
 	return rc;
 }
-